@@ -0,0 +1,57 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// enough for the biggest key plus the headers a request ever needs
+#define ARENA_SIZE 8192
+// every allocation starts on a multiple of this
+#define ARENA_ALIGN 8
+
+/*
+ * Bump pointer scratch space for one request. Allocating is just moving
+ * used forward, and nothing is freed on its own: the whole arena is reset
+ * once the request has been answered. Owned by a single worker, so no locking.
+ */
+typedef struct arena_t {
+    char *base;
+    size_t size;
+    size_t used;
+} arena_t;
+
+/*
+ * Sets up an arena backed by size bytes from the heap. This is the only
+ * allocation the arena ever makes.
+ *
+ * @param self The arena to initialize
+ * @param size The number of bytes it can hand out between resets
+ * @return true if the backing memory was allocated, false otherwise
+ */
+bool init_arena(arena_t *self, size_t size);
+
+/*
+ * Carves size bytes out of the arena. The memory is not zeroed.
+ *
+ * @param self The arena to allocate from
+ * @param size The number of bytes needed
+ * @return A pointer aligned to ARENA_ALIGN, or NULL (errno ENOMEM) if the
+ *         arena doesn't have that much left
+ */
+void *arena_alloc(arena_t *self, size_t size);
+
+/*
+ * Hands back everything allocated since the last reset, all at once.
+ *
+ * @param self The arena to reset
+ */
+void arena_reset(arena_t *self);
+
+/*
+ * Frees the arena's backing memory.
+ *
+ * @param self The arena to destroy
+ */
+void destroy_arena(arena_t *self);
+
+#endif
@@ -0,0 +1,35 @@
+#ifndef CLOCK_H
+#define CLOCK_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// how often the ticker thread refreshes the cached time, in milliseconds
+#define CLOCK_TICK_MS 1
+
+/*
+ * Returns a coarse, monotonic millisecond timestamp.
+ * If the ticker thread is running this is a single load of the cached value,
+ * otherwise it falls back to CLOCK_MONOTONIC_COARSE (no syscall on linux).
+ *
+ * @return Milliseconds since some unspecified starting point.
+ */
+uint64_t coarse_now_ms(void);
+
+/*
+ * Returns a precise, monotonic nanosecond timestamp, for timing things that
+ * take less than a tick. Reads CLOCK_MONOTONIC (no syscall on linux).
+ *
+ * @return Nanoseconds since some unspecified starting point.
+ */
+uint64_t precise_now_ns(void);
+
+/*
+ * Starts a background thread that refreshes the cached clock every
+ * CLOCK_TICK_MS milliseconds. Calling it more than once is harmless.
+ *
+ * @return true if the ticker is running, false otherwise
+ */
+bool start_clock_ticker(void);
+
+#endif
@@ -0,0 +1,46 @@
+#ifndef CODEL_H
+#define CODEL_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// how long work may sit in a queue before we start worrying about it
+#define CODEL_TARGET_MS 5
+// how long the delay has to stay above target before we start shedding
+#define CODEL_INTERVAL_MS 100
+
+/*
+ * Controlled delay (CoDel) state for one queue. It only looks at how long
+ * each item waited (its sojourn time), so it reacts to a standing queue
+ * rather than to bursts. Owned by a single consumer, so no locking.
+ */
+typedef struct codel_t {
+    uint64_t target;
+    uint64_t interval;
+    uint64_t first_above;   // when the delay will have been above target for a whole interval
+    uint64_t drop_next;     // when the next item gets shed while in the dropping state
+    uint32_t count;         // items shed since we started dropping
+    uint32_t last_count;
+    bool dropping;
+} codel_t;
+
+/*
+ * Sets up a CoDel state. A target of 0 turns shedding off.
+ *
+ * @param self The state to initialize
+ * @param target_ms The acceptable standing queue delay
+ * @param interval_ms How long the delay may stay above target
+ */
+void init_codel(codel_t *self, uint64_t target_ms, uint64_t interval_ms);
+
+/*
+ * Decides whether an item that just came off the queue should be shed.
+ *
+ * @param self The queue's CoDel state
+ * @param enqueued When the item was queued, in coarse_now_ms() time
+ * @param now The current coarse_now_ms() time
+ * @return true if the item should be rejected instead of served
+ */
+bool codel_should_drop(codel_t *self, uint64_t enqueued, uint64_t now);
+
+#endif
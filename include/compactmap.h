@@ -0,0 +1,235 @@
+/*
+ * A drop-in replacement for hashmap.h that keeps each slot down to 24 bytes.
+ * Lengths are 16 bits (cream.h never allows more than 4096), keys and values
+ * are referenced by 32-bit slab offsets instead of pointers, and short keys
+ * live right in the slot so looking them up never leaves the table.
+ *
+ * Because of that, everything the map keeps lives in slab chunks:
+ *  - a key or value already in the slab region is adopted as is
+ *  - anything else is copied into a slab chunk (or into the slot, for short
+ *    keys), and the original goes straight back to the destructor
+ *  - when an entry leaves the map the destructor gets its slab chunks, with a
+ *    NULL key base if the key was stored in the slot
+ * So the destructor has to give chunks back with slab_free().
+ */
+
+#ifndef COMPACTMAP_H
+#define COMPACTMAP_H
+
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+// keys this short are stored in the slot itself
+#define COMPACT_INLINE_KEY 16
+// evict_range() lets go of the lock after looking at this many slots
+#define MAP_EVICT_CHUNK 4096
+
+typedef struct map_key_t {
+    void *key_base;
+    size_t key_len;
+} map_key_t;
+
+typedef struct map_val_t {
+    void *val_base;
+    size_t val_len;
+} map_val_t;
+
+typedef uint32_t (*hash_func_f)(map_key_t);
+typedef void (*destructor_f)(map_key_t, map_val_t);
+
+/*
+ * Called by map_walk() for every live entry. The key and value are only
+ * valid for the length of the call.
+ *
+ * @param age_ms How long ago the entry was written, 0 if the map doesn't keep track
+ * @return false to stop the walk
+ */
+typedef bool (*map_walk_f)(map_key_t key, map_val_t val, uint64_t age_ms, void *arg);
+
+// what delete() hands back. the table itself is made of map_slot_t
+typedef struct map_node_t {
+    map_key_t key;
+    map_val_t val;
+    bool tombstone;
+} map_node_t;
+
+// one entry of a bulk_put() batch
+typedef struct map_entry_t {
+    map_key_t key;
+    map_val_t val;
+    uint32_t hash;      // the map's hash_function(key), worked out by the caller
+    uint64_t age_ms;    // how long ago it was written, see put_aged()
+    bool stored;        // set by bulk_put() once the map has taken the entry
+} map_entry_t;
+
+typedef struct map_slot_t {
+    uint16_t key_len;   // 0 if the slot was never used, top bit set for a tombstone
+    uint16_t val_len;
+    uint32_t val_off;   // slab_offset() of the value
+    union {
+        uint8_t key[COMPACT_INLINE_KEY];    // key_len <= COMPACT_INLINE_KEY
+        struct {
+            uint32_t key_off;   // slab_offset() of the key
+            uint32_t hash;      // full hash, so most mismatches never touch the key
+        } ref;
+    };
+} map_slot_t;
+
+typedef struct hashmap_t {
+    uint32_t capacity;
+    uint32_t size;
+    map_slot_t *slots;
+    hash_func_f hash_function;
+    destructor_f destroy_function;
+    int num_readers;
+    pthread_mutex_t write_lock;
+    pthread_mutex_t fields_lock;
+    bool invalid;
+} hashmap_t;
+
+/*
+ * Create a new hash map.
+ *
+ * @param capacity The number of elements the map can hold.
+ * @param hash_function The function to be used to hash keys.
+ * @param destroy_function The function to be used to destroy elements
+ *                         when the map is destroyed.
+ * @return A pointer to the new hashmap_t instance.
+ */
+hashmap_t *create_map(uint32_t capacity, hash_func_f hash_function, destructor_f destroy_function);
+
+/*
+ * Insert a new key/value pair into the map.
+ * If the key already exists, the old entry is destroyed and replaced.
+ * If the map is full and force is false, nothing is inserted.
+ * If the map is full and force is true, the entry at the index computed by
+ * get_index() is overwritten.
+ *
+ * @param self The hash map to use
+ * @param key The key to insert
+ * @param val The value to insert
+ * @param force Whether or not entries should be overwritten if the map is full.
+ * @return true if the insertion was sucessful, false otherwise (errno ENOMEM
+ *         if the map or the slabs were full).
+ */
+bool put(hashmap_t *self, map_key_t key, map_val_t val, bool force);
+
+/*
+ * Inserts an entry that was written age_ms ago, e.g. one read back from a
+ * snapshot. Otherwise the same as put(). Maps with a TTL count the entry's
+ * lifetime from when it was written, and destroy it right away if it has
+ * already expired. Other maps ignore the age.
+ *
+ * @param self The hash map to use
+ * @param key The key to insert
+ * @param val The value to insert
+ * @param age_ms How long ago the entry was written
+ * @param force Whether or not entries should be overwritten if the map is full.
+ * @return true if the entry was inserted or had expired, false otherwise.
+ */
+bool put_aged(hashmap_t *self, map_key_t key, map_val_t val, uint64_t age_ms, bool force);
+
+/*
+ * Puts a batch of entries, e.g. a block of a snapshot being loaded. Every
+ * entry is put as by put_aged() without force, and later entries win over
+ * earlier ones with the same key.
+ * The batch is put entry by entry, and threads is ignored.
+ *
+ * @param self The hash map to use
+ * @param entries The batch. stored is set on every entry the map took, the
+ *                rest are still the caller's
+ * @param count How many entries there are
+ * @param threads How many threads to put them with
+ * @return true if every entry was stored, false otherwise (errno ENOMEM if
+ *         the map filled up, EINVAL if an entry was empty)
+ */
+bool bulk_put(hashmap_t *self, map_entry_t *entries, size_t count, int threads);
+
+/*
+ * Calls func on every live entry in the map. The map is held as a reader for
+ * the whole walk, so writers wait until it is done.
+ *
+ * @param self The hash map to walk
+ * @param func Called for every entry
+ * @param arg Passed to func
+ * @return true if every entry was visited, false if func stopped the walk or
+ *         the map is invalid
+ */
+bool map_walk(hashmap_t *self, map_walk_f func, void *arg);
+
+/*
+ * Counts the slots holding a tombstone, as a reader. Probes have to step
+ * over them, so a lot of them makes every lookup slower.
+ *
+ * @param self The hash map
+ * @return The number of tombstones, 0 if the map is invalid
+ */
+uint32_t map_tombstones(hashmap_t *self);
+
+/*
+ * Retrieve the value associated with a key.
+ *
+ * @param self The hash map to use
+ * @param key The key to search for
+ * @return The corresponding value, or a map_val_t instance with a null
+ *         pointer and a value length of 0 if the key is not found. The
+ *         value is the map's: a put or delete may retire it as soon as this
+ *         returns, so a caller that uses it afterwards must be inside
+ *         reclaim_enter().
+ */
+map_val_t get(hashmap_t *self, map_key_t key);
+
+/*
+ * Remove the entry associated with a key. The caller owns whatever comes back.
+ *
+ * @param self The hash map to use
+ * @param key The key to remove.
+ * @return The removed entry. Its key base is NULL if the key was stored in the slot.
+ */
+map_node_t delete(hashmap_t *self, map_key_t key);
+
+/*
+ * Clears and destroys all entries in the map.
+ *
+ * @param self The hash map to clear.
+ * @return true if the operation was successful, false otherwise
+ */
+bool clear_map(hashmap_t *self);
+
+/*
+ * Invalidate a hash map and its elements using the destructor function in the
+ * map.
+ *
+ * @param self The hash map to invalidate.
+ * @return true if the operation was successful.
+ */
+bool invalidate_map(hashmap_t *self);
+
+/*
+ * Evicts every entry whose key or value lies in the given address range,
+ * destroying it with the map's destructor. Used to empty out a block of
+ * memory that the allocator wants back. The table is scanned MAP_EVICT_CHUNK
+ * slots at a time, letting go of the lock in between, so entries put in
+ * behind the scan are left for the next call.
+ *
+ * @param self The hash map to evict from
+ * @param lo The first address in the range
+ * @param hi The address just past the range
+ * @return The number of entries evicted
+ */
+int evict_range(hashmap_t *self, const void *lo, const void *hi);
+
+/*
+ * Faults in the whole table up front, so the first requests don't pay for it.
+ * Meant to be called right after create_map(), before the map is in use.
+ *
+ * @param self The hash map to fault in
+ * @param threads How many threads to spread the work over
+ * @return true if the table was faulted in, false otherwise
+ */
+bool prefault_map(hashmap_t *self, int threads);
+
+#endif
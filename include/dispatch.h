@@ -0,0 +1,147 @@
+#ifndef DISPATCH_H
+#define DISPATCH_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include "queue.h"
+
+// how many times an idle worker re-checks the queues before it parks
+#define DISPATCH_SPIN_BUDGET 2000
+// default bound on items waiting across all workers
+#define DISPATCH_MAX_DEPTH 4096
+
+/*
+ * Work is split into lanes by how expensive it is. New connections and reads
+ * go to the workers' local queues, writes and bulk/administrative operations
+ * wait in shared lanes that are served by weight, so a burst of heavy work
+ * can't take every worker away from the read path.
+ */
+#define DISPATCH_LANE_READ 0
+#define DISPATCH_LANE_WRITE 1
+#define DISPATCH_LANE_BULK 2
+#define DISPATCH_LANES 3
+
+// relative share of picks each lane gets when all of them have work
+#define DISPATCH_READ_WEIGHT 16
+#define DISPATCH_WRITE_WEIGHT 4
+#define DISPATCH_BULK_WEIGHT 1
+// how many workers may be busy with bulk work at the same time
+#define DISPATCH_BULK_LIMIT 1
+
+/*
+ * Per-worker idle counters. Only the owning worker writes them, so they are
+ * padded out to a cache line and bumped with relaxed adds.
+ */
+typedef struct dispatch_counters_t {
+    _Alignas(CACHE_LINE) _Atomic unsigned long steals;  // items taken from another worker
+    _Atomic unsigned long spins;   // times work showed up while spinning
+    _Atomic unsigned long parks;   // times the worker went to sleep
+    int credit[DISPATCH_LANES];    // weighted round robin state for picking a lane
+} dispatch_counters_t;
+
+/*
+ * Hands work to a fixed set of workers. Every worker owns a local queue that
+ * the acceptor fills round-robin, and a worker that runs out of local work
+ * steals from the others. A worker with nothing to do spins for
+ * spin_budget rounds and then parks on the eventcount (epoch/sleepers),
+ * which dispatch() only touches when somebody is actually asleep.
+ */
+typedef struct dispatcher_t {
+    queue_t **locals;
+    queue_t *lanes[DISPATCH_LANES];   // shared lanes. the read lane is locals, so lanes[0] is unused
+    int weights[DISPATCH_LANES];
+    int bulk_limit;
+    int num_workers;
+    int *groups;    // the NUMA node each worker runs on, NULL if they aren't grouped
+    unsigned spin_budget;
+    size_t max_depth;
+    dispatch_counters_t *counters;
+    _Atomic unsigned next;
+    _Alignas(CACHE_LINE) _Atomic uint32_t epoch;
+    _Atomic int sleepers;
+    _Alignas(CACHE_LINE) _Atomic int bulk_running;
+} dispatcher_t;
+
+/*
+ * Creates a dispatcher with one local queue per worker.
+ *
+ * @param num_workers The number of workers that will pull from it
+ * @return A pointer to the dispatcher on the heap, or NULL on failure
+ */
+dispatcher_t *create_dispatcher(int num_workers);
+
+/*
+ * Gives an item to the next worker in round-robin order. If that worker's
+ * queue is full the item goes to the next one that has room.
+ *
+ * @param self The dispatcher to use
+ * @param item The item to hand off
+ * @return true if some worker took the item, false if every queue was full
+ *         (errno ENOBUFS) or max_depth items are already waiting (errno EBUSY)
+ */
+bool dispatch(dispatcher_t *self, void *item);
+
+/*
+ * Splits the workers into groups (NUMA nodes). Once grouped, a worker only
+ * steals from workers in its own group, so work routed to a group stays there.
+ *
+ * @param self The dispatcher to use
+ * @param groups The group of every worker, num_workers long. Copied
+ * @return true if the groups were set
+ */
+bool set_dispatch_groups(dispatcher_t *self, const int *groups);
+
+/*
+ * Gives an item that has already been admitted to the next worker in a group.
+ *
+ * @param self The dispatcher to use
+ * @param group The group that should handle it
+ * @param item The item to hand off
+ * @return true if a worker in the group took it, false if their queues were
+ *         full (errno ENOBUFS) or nobody is in that group (errno EINVAL)
+ */
+bool dispatch_group(dispatcher_t *self, int group, void *item);
+
+/*
+ * Queues an item that has already been admitted on one of the shared lanes.
+ * Not subject to max_depth, the work is already in the server.
+ *
+ * @param self The dispatcher to use
+ * @param lane DISPATCH_LANE_WRITE or DISPATCH_LANE_BULK
+ * @param item The item to hand off
+ * @return true if the lane took the item, false if it was full
+ */
+bool dispatch_lane(dispatcher_t *self, int lane, void *item);
+
+/*
+ * Returns the next item for a worker. Lanes are picked by weighted round
+ * robin among the ones with work. For the read lane, the worker takes from its
+ * own queue first and steals from the other workers when its own queue is
+ * empty. Spins for spin_budget rounds and then blocks until there is work.
+ *
+ * @param self The dispatcher to use
+ * @param worker The id of the calling worker, 0 <= worker < num_workers
+ * @param lane Set to the lane the item came from
+ * @return The item, or NULL if the dispatcher was invalidated
+ */
+void *dispatch_next(dispatcher_t *self, int worker, int *lane);
+
+/*
+ * Tells the dispatcher a worker finished an item from the given lane, so the
+ * next bulk item can be handed out.
+ *
+ * @param self The dispatcher to use
+ * @param lane The lane dispatch_next() reported for the item
+ */
+void dispatch_done(dispatcher_t *self, int lane);
+
+/*
+ * Returns how many items are waiting across all workers.
+ *
+ * @param self The dispatcher to use
+ * @return The total number of queued items
+ */
+size_t dispatch_depth(dispatcher_t *self);
+
+#endif
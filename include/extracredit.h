@@ -8,11 +8,27 @@
 
 #include <pthread.h>
 #include <semaphore.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include "const.h"
 
+// TTL is given in seconds, node timestamps are coarse milliseconds
+#define TTL_MS ((uint64_t) TTL * 1000)
+// evict_range() lets go of the lock after looking at this many slots
+#define MAP_EVICT_CHUNK 4096
+
+// with a cold tier, values are spilled until they're back under this share
+// of the hot limit, so a spill isn't started for every put
+#define TIER_LOW_WATER_PERCENT 90
+// how many bytes of values one spill writes while holding the write lock
+#define TIER_BATCH_BYTES ((size_t) 1 << 20)
+// a cold file at least this big is compacted once half of it is dead
+#define TIER_COMPACT_MIN ((uint64_t) 64 << 20)
+// how many more times get() reads a cold value back if it keeps changing under it
+#define TIER_READ_TRIES 3
+
 typedef struct map_key_t {
     void *key_base;
     size_t key_len;
@@ -26,14 +42,54 @@ typedef struct map_val_t {
 typedef uint32_t (*hash_func_f)(map_key_t);
 typedef void (*destructor_f)(map_key_t, map_val_t);
 
+/*
+ * Called by map_walk() for every live entry. The key and value are only
+ * valid for the length of the call.
+ *
+ * @param age_ms How long ago the entry was written, 0 if the map doesn't keep track
+ * @return false to stop the walk
+ */
+typedef bool (*map_walk_f)(map_key_t key, map_val_t val, uint64_t age_ms, void *arg);
+
 typedef struct map_node_t {
     map_key_t key;
     map_val_t val;
     bool tombstone;
+    bool spilled;   // the value is in the cold file at spill_off, val_base is NULL
     uint32_t use;   // counter to keep track of in date
-    time_t start;   // start time for this node
+    uint64_t start; // start time for this node (coarse_now_ms())
+    uint64_t spill_off;
 } map_node_t;
 
+// one entry of a bulk_put() batch
+typedef struct map_entry_t {
+    map_key_t key;
+    map_val_t val;
+    uint32_t hash;      // the map's hash_function(key), worked out by the caller
+    uint64_t age_ms;    // how long ago it was written, see put_aged()
+    bool stored;        // set by bulk_put() once the map has taken the entry
+} map_entry_t;
+
+/*
+ * A cold tier: an append-only file that the least recently used values are
+ * moved to once the entries in memory take up more than hot_limit bytes of
+ * slab chunks. Keys always stay in memory, but count towards the limit. A
+ * get that finds its value spilled reads it back with pread() and keeps it
+ * in memory again. What's in the file doesn't outlive the map.
+ */
+typedef struct tier_t {
+    int fd;
+    char *path;
+    uint64_t hot_limit;
+    _Atomic uint64_t hot_bytes;     // bytes of the chunks of keys and values in memory
+    _Atomic uint64_t dead_bytes;    // bytes of the file no node points at anymore
+    uint64_t file_size;             // under write_lock
+    uint64_t generation;            // bumped by clear_map(), under write_lock
+    atomic_bool spilling;           // the spiller was woken and hasn't finished
+    sem_t wake;                     // posted to wake the spiller
+    pthread_t thread;
+} tier_t;
+
 typedef struct hashmap_t {
     uint32_t capacity;
     uint32_t size;
@@ -45,6 +101,7 @@ typedef struct hashmap_t {
     pthread_mutex_t write_lock;
     pthread_mutex_t fields_lock;
     bool invalid;
+    tier_t *tier;   // NULL unless spill_map() was called
 } hashmap_t;
 
 /* **DO NOT** modify the function prototypes below */
@@ -60,6 +117,22 @@ typedef struct hashmap_t {
  */
 hashmap_t *create_map(uint32_t capacity, hash_func_f hash_function, destructor_f destroy_function);
 
+/*
+ * Gives the map a cold tier, see tier_t. Spilling is done in the background
+ * by a thread of the tier's own, so the map can go over hot_limit for a
+ * little while.
+ * Values read back from the file are put in slab chunks, so the destructor
+ * has to give them back with slab_free().
+ *
+ * @param self The hash map
+ * @param path The cold file. Whatever is in it already is thrown away
+ * @param hot_limit How many bytes of slab the keys and values in memory may
+ *                  take up
+ * @return true if the tier was set up, false otherwise (errno EINVAL if the
+ *         map already has one)
+ */
+bool spill_map(hashmap_t *self, const char *path, uint64_t hot_limit);
+
 /*
  * Insert a new key/value pair into the map.
  * If the key already exists, the corresponding value is overwritten.
@@ -75,13 +148,84 @@ hashmap_t *create_map(uint32_t capacity, hash_func_f hash_function, destructor_f
  */
 bool put(hashmap_t *self, map_key_t key, map_val_t val, bool force);
 
+/*
+ * Inserts an entry that was written age_ms ago, e.g. one read back from a
+ * snapshot. Otherwise the same as put(). Maps with a TTL count the entry's
+ * lifetime from when it was written, and destroy it right away if it has
+ * already expired. Other maps ignore the age.
+ *
+ * @param self The hash map to use
+ * @param key The key to insert
+ * @param val The value to insert
+ * @param age_ms How long ago the entry was written
+ * @param force Whether or not entries should be overwritten if the map is full.
+ * @return true if the entry was inserted or had expired, false otherwise.
+ */
+bool put_aged(hashmap_t *self, map_key_t key, map_val_t val, uint64_t age_ms, bool force);
+
+/*
+ * Puts a batch of entries, e.g. a block of a snapshot being loaded. Every
+ * entry is put as by put_aged() without force, and later entries win over
+ * earlier ones with the same key.
+ * This map's puts stamp, age and evict under the lock one at a time, so the
+ * batch is put entry by entry and threads is ignored.
+ *
+ * @param self The hash map to use
+ * @param entries The batch. stored is set on every entry the map took, the
+ *                rest are still the caller's
+ * @param count How many entries there are
+ * @param threads How many threads to put them with
+ * @return true if every entry was stored, false otherwise (errno ENOMEM if
+ *         the map filled up, EINVAL if an entry was empty)
+ */
+bool bulk_put(hashmap_t *self, map_entry_t *entries, size_t count, int threads);
+
+/*
+ * Calls func on every live entry in the map. The map is held as a reader for
+ * the whole walk, so writers wait until it is done.
+ *
+ * @param self The hash map to walk
+ * @param func Called for every entry
+ * @param arg Passed to func
+ * @return true if every entry was visited, false if func stopped the walk or
+ *         the map is invalid
+ */
+bool map_walk(hashmap_t *self, map_walk_f func, void *arg);
+
+/*
+ * Counts the slots holding a tombstone, as a reader. Probes have to step
+ * over them, so a lot of them makes every lookup slower.
+ *
+ * @param self The hash map
+ * @return The number of tombstones, 0 if the map is invalid
+ */
+uint32_t map_tombstones(hashmap_t *self);
+
+/*
+ * Calls func on the count most recently used live entries, most recent
+ * first. The entries are ranked as a reader, then visited as a reader
+ * again, so writers aren't held off while they're sorted. An entry that was
+ * replaced in between is visited as whatever took its place.
+ *
+ * @param self The hash map
+ * @param count How many entries to visit at most
+ * @param func Called for every entry
+ * @param arg Passed to func
+ * @return true if every entry was visited, false if func stopped the walk,
+ *         the map is invalid, or there was no memory to rank the entries
+ */
+bool map_hottest(hashmap_t *self, uint32_t count, map_walk_f func, void *arg);
+
 /*
  * Retrieve the value associated with a key.
  *
  * @param self The hash map to use
  * @param key The key to search for
  * @return The corresponding value, or a map_val_t instance with a null
- *         pointer and a value length of 0 if the key is not found.
+ *         pointer and a value length of 0 if the key is not found. The
+ *         value is the map's: a put or delete may retire it as soon as this
+ *         returns, so a caller that uses it afterwards must be inside
+ *         reclaim_enter().
  */
 map_val_t get(hashmap_t *self, map_key_t key);
 
@@ -111,4 +255,28 @@ bool clear_map(hashmap_t *self);
  */
 bool invalidate_map(hashmap_t *self);
 
+/*
+ * Evicts every entry whose key or value lies in the given address range,
+ * destroying it with the map's destructor. Used to empty out a block of
+ * memory that the allocator wants back. The table is scanned MAP_EVICT_CHUNK
+ * slots at a time, letting go of the lock in between, so entries put in
+ * behind the scan are left for the next call.
+ *
+ * @param self The hash map to evict from
+ * @param lo The first address in the range
+ * @param hi The address just past the range
+ * @return The number of entries evicted
+ */
+int evict_range(hashmap_t *self, const void *lo, const void *hi);
+
+/*
+ * Faults in the whole table up front, so the first requests don't pay for it.
+ * Meant to be called right after create_map(), before the map is in use.
+ *
+ * @param self The hash map to fault in
+ * @param threads How many threads to spread the work over
+ * @return true if the table was faulted in, false otherwise
+ */
+bool prefault_map(hashmap_t *self, int threads);
+
 #endif
@@ -25,15 +25,55 @@ typedef struct map_val_t {
 typedef uint32_t (*hash_func_f)(map_key_t);
 typedef void (*destructor_f)(map_key_t, map_val_t);
 
+/*
+ * Called by map_walk() for every live entry. The key and value are only
+ * valid for the length of the call.
+ *
+ * @param age_ms How long ago the entry was written, 0 if the map doesn't keep track
+ * @return false to stop the walk
+ */
+typedef bool (*map_walk_f)(map_key_t key, map_val_t val, uint64_t age_ms, void *arg);
+
 typedef struct map_node_t {
     map_key_t key;
     map_val_t val;
     bool tombstone;
 } map_node_t;
 
+// one entry of a bulk_put() batch
+typedef struct map_entry_t {
+    map_key_t key;
+    map_val_t val;
+    uint32_t hash;      // the map's hash_function(key), worked out by the caller
+    uint64_t age_ms;    // how long ago it was written, see put_aged()
+    bool stored;        // set by bulk_put() once the map has taken the entry
+} map_entry_t;
+
+// what a slot holds, as far as probing is concerned
+#define MAP_EMPTY 0     // never used, so a probe can stop here
+#define MAP_LIVE 1
+#define MAP_TOMBSTONE 2
+// bulk_put() gives every thread at least this many entries, fewer aren't
+// worth starting one for
+#define MAP_BULK_PER_THREAD 4096
+// evict_range() lets go of the lock after looking at this many slots
+#define MAP_EVICT_CHUNK 4096
+
+/*
+ * The part of a slot that probing looks at. It is kept in its own array, apart
+ * from the nodes, so one cache line covers 16 slots. The node is only read
+ * once the tag and length say it is probably the key we want.
+ */
+typedef struct map_meta_t {
+    uint8_t state;      // MAP_EMPTY, MAP_LIVE or MAP_TOMBSTONE
+    uint8_t tag;        // top byte of the key's hash
+    uint16_t key_len;   // capped at UINT16_MAX, the node has the real length
+} map_meta_t;
+
 typedef struct hashmap_t {
     uint32_t capacity;
     uint32_t size;
+    map_meta_t *meta;
     map_node_t *nodes;
     hash_func_f hash_function;
     destructor_f destroy_function;
@@ -69,13 +109,72 @@ hashmap_t *create_map(uint32_t capacity, hash_func_f hash_function, destructor_f
  */
 bool put(hashmap_t *self, map_key_t key, map_val_t val, bool force);
 
+/*
+ * Inserts an entry that was written age_ms ago, e.g. one read back from a
+ * snapshot. Otherwise the same as put(). Maps with a TTL count the entry's
+ * lifetime from when it was written, and destroy it right away if it has
+ * already expired. Other maps ignore the age.
+ *
+ * @param self The hash map to use
+ * @param key The key to insert
+ * @param val The value to insert
+ * @param age_ms How long ago the entry was written
+ * @param force Whether or not entries should be overwritten if the map is full.
+ * @return true if the entry was inserted or had expired, false otherwise.
+ */
+bool put_aged(hashmap_t *self, map_key_t key, map_val_t val, uint64_t age_ms, bool force);
+
+/*
+ * Puts a batch of entries, e.g. a block of a snapshot being loaded. Every
+ * entry is put as by put_aged() without force, and later entries win over
+ * earlier ones with the same key.
+ * The batch is split by the region of the table every entry's home slot is
+ * in, and each region is filled by a thread of its own. The write lock is
+ * taken once for the whole batch rather than once per entry, so readers and
+ * writers wait until it's done. An entry whose probe would run out of its
+ * region is put afterwards, by the caller's thread.
+ *
+ * @param self The hash map to use
+ * @param entries The batch. stored is set on every entry the map took, the
+ *                rest are still the caller's
+ * @param count How many entries there are
+ * @param threads How many threads to put them with
+ * @return true if every entry was stored, false otherwise (errno ENOMEM if
+ *         the map filled up, EINVAL if an entry was empty)
+ */
+bool bulk_put(hashmap_t *self, map_entry_t *entries, size_t count, int threads);
+
+/*
+ * Calls func on every live entry in the map. The map is held as a reader for
+ * the whole walk, so writers wait until it is done.
+ *
+ * @param self The hash map to walk
+ * @param func Called for every entry
+ * @param arg Passed to func
+ * @return true if every entry was visited, false if func stopped the walk or
+ *         the map is invalid
+ */
+bool map_walk(hashmap_t *self, map_walk_f func, void *arg);
+
+/*
+ * Counts the slots holding a tombstone, as a reader. Probes have to step
+ * over them, so a lot of them makes every lookup slower.
+ *
+ * @param self The hash map
+ * @return The number of tombstones, 0 if the map is invalid
+ */
+uint32_t map_tombstones(hashmap_t *self);
+
 /*
  * Retrieve the value associated with a key.
  *
  * @param self The hash map to use
  * @param key The key to search for
  * @return The corresponding value, or a map_val_t instance with a null
- *         pointer and a value length of 0 if the key is not found.
+ *         pointer and a value length of 0 if the key is not found. The
+ *         value is the map's: a put or delete may retire it as soon as this
+ *         returns, so a caller that uses it afterwards must be inside
+ *         reclaim_enter().
  */
 map_val_t get(hashmap_t *self, map_key_t key);
 
@@ -105,4 +204,28 @@ bool clear_map(hashmap_t *self);
  */
 bool invalidate_map(hashmap_t *self);
 
+/*
+ * Evicts every entry whose key or value lies in the given address range,
+ * destroying it with the map's destructor. Used to empty out a block of
+ * memory that the allocator wants back. The table is scanned MAP_EVICT_CHUNK
+ * slots at a time, letting go of the lock in between, so entries put in
+ * behind the scan are left for the next call.
+ *
+ * @param self The hash map to evict from
+ * @param lo The first address in the range
+ * @param hi The address just past the range
+ * @return The number of entries evicted
+ */
+int evict_range(hashmap_t *self, const void *lo, const void *hi);
+
+/*
+ * Faults in the whole table up front, so the first requests don't pay for it.
+ * Meant to be called right after create_map(), before the map is in use.
+ *
+ * @param self The hash map to fault in
+ * @param threads How many threads to spread the work over
+ * @return true if the table was faulted in, false otherwise
+ */
+bool prefault_map(hashmap_t *self, int threads);
+
 #endif
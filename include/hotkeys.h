@@ -0,0 +1,77 @@
+#ifndef HOTKEYS_H
+#define HOTKEYS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "store.h"
+
+#define HOTKEYS_MAGIC "CREAMHOT"
+#define HOTKEYS_VERSION 1
+// the share of the map's capacity the server records, in percent
+#define HOTKEYS_PERCENT 10
+// how often the server records them, besides when it is stopped
+#define HOTKEYS_INTERVAL_MS 60000
+// keys a loader thread takes at a time. they're taken in order, so the
+// hottest are back first
+#define HOTKEYS_BATCH 256
+
+/*
+ * A hot keys file is this header, then count keys back to back, hottest
+ * first. Every key is a uint32_t length followed by that many bytes. No
+ * values are kept, so the file stays small, and a restart gets the values
+ * from wherever the caller says (see fetch_f).
+ */
+typedef struct hotkeys_header_t {
+    char magic[8];
+    uint32_t version;
+    uint32_t unused;
+    uint64_t count;
+} hotkeys_header_t;
+
+/*
+ * Gets the value of a key for load_hot_keys(), e.g. from a snapshot (see
+ * fetch_from_snapshot()) or from the origin the cache sits in front of.
+ * Called from several threads at once.
+ *
+ * @param key The key, only valid for the length of the call
+ * @param val Set to the value. It goes into the store as it is, so it has to
+ *            be a slab chunk
+ * @param age_ms Set to how long ago the value was written, 0 if not known
+ * @param arg What was passed to load_hot_keys()
+ * @return true if val was set, false if there is no value for the key (it
+ *         is skipped)
+ */
+typedef bool (*fetch_f)(map_key_t key, map_val_t *val, uint64_t *age_ms, void *arg);
+
+/*
+ * Writes the count most recently used keys in the store to a hot keys file.
+ * The file is written beside path and renamed over it once it is complete
+ * and synced. See store_hottest().
+ *
+ * @param store The store
+ * @param path Where the keys go
+ * @param count How many keys to write at most
+ * @return true if the file was written, false otherwise (errno ENOTSUP if
+ *         the map doesn't know which keys are hot)
+ */
+bool save_hot_keys(store_t *store, const char *path, uint32_t count);
+
+/*
+ * Fetches the value of every key in a hot keys file and puts it in the
+ * store. The keys are shared out between threads in batches, hottest first.
+ * Keys are copied into slab chunks, so the store's destructor has to give
+ * them back with slab_free(). Keys fetch has no value for are skipped.
+ *
+ * @param store The store to load into, normally still empty
+ * @param path The hot keys file
+ * @param fetch Gets the values
+ * @param arg Passed to fetch
+ * @param threads How many threads to load with
+ * @param loaded Set to how many entries were put in the store, may be NULL
+ * @return true if every key was looked up, false otherwise (errno EINVAL if
+ *         the file isn't a hot keys file or is damaged, ENOMEM if the store
+ *         filled up)
+ */
+bool load_hot_keys(store_t *store, const char *path, fetch_f fetch, void *arg, int threads, uint64_t *loaded);
+
+#endif
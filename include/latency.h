@@ -0,0 +1,91 @@
+#ifndef LATENCY_H
+#define LATENCY_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include "stats.h"
+
+/*
+ * The histograms every thread keeps. The first ones are per request, from
+ * when the connection was accepted until its response was written, and are
+ * numbered like the request counters in stats.h (STATS_PUT up to
+ * STATS_BAD_REQUEST). The rest are the stages a request goes through, which
+ * add up to the same time.
+ */
+#define LATENCY_REQUESTS (STATS_BAD_REQUEST + 1)
+#define LATENCY_QUEUE (LATENCY_REQUESTS + 0)    // waiting for a worker, or a core
+#define LATENCY_PARSE (LATENCY_REQUESTS + 1)    // reading the header
+#define LATENCY_READ (LATENCY_REQUESTS + 2)     // reading the key and value
+#define LATENCY_MAP (LATENCY_REQUESTS + 3)      // the map, and the log if there is one
+#define LATENCY_WRITE (LATENCY_REQUESTS + 4)    // writing the response
+#define LATENCY_HISTOGRAMS (LATENCY_REQUESTS + 5)
+
+/*
+ * Buckets are log-linear, as in HDR histograms: values below
+ * 2^LATENCY_SUB_BITS nanoseconds get a bucket each, and every power of two
+ * above that is split into 2^(LATENCY_SUB_BITS - 1) equal buckets. A value
+ * is off by at most 1 / 2^(LATENCY_SUB_BITS - 1) of itself, about 3%, all
+ * the way up.
+ */
+#define LATENCY_SUB_BITS 6
+#define LATENCY_BUCKETS ((64 - LATENCY_SUB_BITS + 2) << (LATENCY_SUB_BITS - 1))
+
+// one histogram, merged from every thread's
+typedef struct latency_hist_t {
+    uint64_t counts[LATENCY_BUCKETS];
+    uint64_t total;
+} latency_hist_t;
+
+/*
+ * Notes when the calling thread started the stage it's in now, e.g. right
+ * after taking a request off a queue.
+ *
+ * @return The time, see precise_now_ns()
+ */
+uint64_t latency_start(void);
+
+/*
+ * Records how long the calling thread's current stage took, since
+ * latency_start() or the last latency_stage(), and starts the next one.
+ *
+ * @param histogram The stage that just finished, e.g. LATENCY_PARSE
+ */
+void latency_stage(int histogram);
+
+/*
+ * Records a time in one of the calling thread's histograms. Like the
+ * counters in stats.h, a thread's histograms are only written by that
+ * thread, are made the first time it records anything, and outlive it.
+ *
+ * @param histogram Which one, e.g. STATS_GET or LATENCY_QUEUE
+ * @param ns How long it took, in nanoseconds
+ */
+void latency_record(int histogram, uint64_t ns);
+
+/*
+ * Adds up one histogram across every thread. Threads keep recording while
+ * this runs.
+ *
+ * @param histogram Which one
+ * @param merged Set to the sum
+ */
+void latency_merge(int histogram, latency_hist_t *merged);
+
+/*
+ * Finds a percentile of a merged histogram.
+ *
+ * @param hist The histogram
+ * @param percentile Between 0 and 100, e.g. 99.9
+ * @return The highest value in the bucket the percentile falls in, in
+ *         nanoseconds, or 0 if nothing was recorded
+ */
+uint64_t latency_percentile(latency_hist_t *hist, double percentile);
+
+/*
+ * @param histogram Which one
+ * @return Its name in a STATS response, e.g. "get" or "queue"
+ */
+const char *latency_name(int histogram);
+
+#endif
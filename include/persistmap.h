@@ -0,0 +1,324 @@
+/*
+ * A drop-in replacement for hashmap.h whose whole state lives in one file
+ * mapping: a header, the slot table, and an arena the keys and values are
+ * copied into. Slots refer to the arena by offsets from the start of the
+ * mapping rather than by pointers, so a restarted process maps the file
+ * again and serves straight away, with no load phase.
+ *
+ * Because of that, the map keeps its own copies of everything:
+ *  - a put copies the key and value into the arena, and the caller's buffers
+ *    go straight back to the destructor
+ *  - the destructor never sees anything of the map's own, so delete() hands
+ *    back NULL bases, and clearing or invalidating destroys nothing
+ *
+ * Crash consistency:
+ *  - the mapping is shared, so everything written is in the page cache the
+ *    moment it's written, and survives the process going down
+ *  - checkpoint_map() msync()s the file, which bounds what a machine going
+ *    down can lose
+ *  - every slot carries a checksum. Opening a file drops slots that don't
+ *    check out and rebuilds the arena's free lists from the slots left, so a
+ *    put or delete that was cut off part way leaves nothing dangling
+ *
+ * create_map() gives the same map on anonymous memory, which doesn't outlive
+ * the process.
+ */
+
+#ifndef PERSISTMAP_H
+#define PERSISTMAP_H
+
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#define PERSIST_MAGIC "CREAMMAP"
+#define PERSIST_VERSION 1
+// the header gets a page to itself, the slots start on the next one
+#define PERSIST_HEADER_BYTES 4096
+// arena room per entry of capacity. the file is sparse, so unused room costs
+// address space but no disk
+#define PERSIST_ARENA_PER_ENTRY 8192
+#define PERSIST_ARENA_MIN ((uint64_t) 64 << 20)
+// arena chunks are powers of two from 16 bytes up to 64 KB
+#define PERSIST_MIN_CHUNK 16
+#define PERSIST_NUM_CLASSES 13
+// freed chunks are stamped for reclaim_passed() this many at a time, see hashmap_t
+#define PERSIST_LIMBO_BATCH 64
+
+typedef struct map_key_t {
+    void *key_base;
+    size_t key_len;
+} map_key_t;
+
+typedef struct map_val_t {
+    void *val_base;
+    size_t val_len;
+} map_val_t;
+
+typedef uint32_t (*hash_func_f)(map_key_t);
+typedef void (*destructor_f)(map_key_t, map_val_t);
+
+/*
+ * Called by map_walk() for every live entry. The key and value are only
+ * valid for the length of the call.
+ *
+ * @param age_ms How long ago the entry was written, 0 if the map doesn't keep track
+ * @return false to stop the walk
+ */
+typedef bool (*map_walk_f)(map_key_t key, map_val_t val, uint64_t age_ms, void *arg);
+
+// what delete() hands back. the table itself is made of map_slot_t
+typedef struct map_node_t {
+    map_key_t key;
+    map_val_t val;
+    bool tombstone;
+} map_node_t;
+
+// one entry of a bulk_put() batch
+typedef struct map_entry_t {
+    map_key_t key;
+    map_val_t val;
+    uint32_t hash;      // the map's hash_function(key), worked out by the caller
+    uint64_t age_ms;    // how long ago it was written, see put_aged()
+    bool stored;        // set by bulk_put() once the map has taken the entry
+} map_entry_t;
+
+// the first page of the file
+typedef struct persist_header_t {
+    char magic[8];          // PERSIST_MAGIC
+    uint32_t version;       // PERSIST_VERSION
+    uint32_t capacity;      // a file is only opened with the capacity it was made with
+    uint64_t arena_offset;  // where the arena starts
+    uint64_t file_size;
+} persist_header_t;
+
+typedef struct map_slot_t {
+    uint16_t key_len;   // 0 if the slot was never used, top bit set for a tombstone
+    uint16_t val_len;
+    uint32_t hash;      // full hash, so most mismatches never touch the key
+    uint64_t key_off;   // offset of the key from the start of the mapping
+    uint64_t val_off;
+    uint32_t check;     // checksum of everything above, so a torn slot is spotted
+    uint32_t unused;
+} map_slot_t;
+
+// a freed chunk waiting out the readers, see hashmap_t
+typedef struct persist_limbo_t {
+    uint64_t chunk;     // its offset, class in the low 4 bits
+    uint64_t stamp;     // from reclaim_stamp(), 0 until it's been stamped
+} persist_limbo_t;
+
+/*
+ * Freed chunks go through a queue (limbo) and aren't handed out again until
+ * reclaim_passed() says every reader that could have got one is done with
+ * it, so a GET copying out a value that was just replaced never sees it
+ * overwritten. retire() can't be used for this, the destructor it calls has
+ * no way back to the map. A clear puts the whole arena it emptied through
+ * the same wait.
+ */
+typedef struct hashmap_t {
+    uint32_t capacity;
+    uint32_t size;
+    map_slot_t *slots;
+    hash_func_f hash_function;
+    destructor_f destroy_function;
+    int num_readers;
+    pthread_mutex_t write_lock;
+    pthread_mutex_t fields_lock;
+    bool invalid;
+    // the mapping, and the file behind it (-1 for anonymous memory)
+    char *base;
+    uint64_t map_size;
+    int fd;
+    // the arena's allocator, rebuilt whenever the file is opened. all of it
+    // is under write_lock
+    uint64_t arena_offset;
+    uint64_t bump;      // everything from here to the end was never handed out
+    uint64_t free_heads[PERSIST_NUM_CLASSES];   // a chunk's first 8 bytes hold the next one's offset, 0 ends
+    persist_limbo_t *limbo;     // oldest first, stamps only ever go up
+    uint32_t limbo_head;        // the ones before this were handed back
+    uint32_t limbo_stamped;     // the ones before this have a stamp
+    uint32_t limbo_len;
+    uint32_t limbo_cap;
+    // the arena below clear_end that clear_map() emptied, waiting for
+    // clear_stamp to pass. once it has, it's handed out from reuse up
+    bool clear_pending;
+    uint64_t clear_stamp;
+    uint64_t clear_end;
+    uint64_t reuse;
+    uint64_t reuse_end;
+    // held by checkpoint_map() while it msync()s without the other locks,
+    // so invalidate_map() can't unmap the file under it
+    pthread_mutex_t sync_lock;
+} hashmap_t;
+
+/*
+ * Create a new hash map.
+ *
+ * @param capacity The number of elements the map can hold.
+ * @param hash_function The function to be used to hash keys.
+ * @param destroy_function The function to be used to destroy elements
+ *                         when the map is destroyed.
+ * @return A pointer to the new hashmap_t instance.
+ */
+hashmap_t *create_map(uint32_t capacity, hash_func_f hash_function, destructor_f destroy_function);
+
+/*
+ * Opens the map kept in a file, or makes a new, empty one there.
+ *
+ * @param path The file, or NULL for anonymous memory (same as create_map())
+ * @param capacity The number of elements the map can hold. Has to match the
+ *                 file's, if it's already there
+ * @param hash_function The function to be used to hash keys. Has to be the
+ *                      one the file was filled with
+ * @param destroy_function Gets the caller's buffers after they're copied
+ * @return The map, or NULL on failure (errno EINVAL if the file isn't one of
+ *         ours or was made with another capacity)
+ */
+hashmap_t *open_map(const char *path, uint32_t capacity, hash_func_f hash_function, destructor_f destroy_function);
+
+/*
+ * Writes everything changed so far out to the file, and waits until it's on
+ * disk. Nobody waits for it: a put that lands while it runs may or may not
+ * make it out, and if it's torn the slot's checksum drops it on the next open.
+ *
+ * @param self The map
+ * @return true once it's on disk (always, for anonymous memory)
+ */
+bool checkpoint_map(hashmap_t *self);
+
+/*
+ * Insert a new key/value pair into the map.
+ * If the key already exists, the old entry is destroyed and replaced.
+ * If the map is full and force is false, nothing is inserted.
+ * If the map is full and force is true, the entry at the index computed by
+ * get_index() is overwritten.
+ *
+ * @param self The hash map to use
+ * @param key The key to insert
+ * @param val The value to insert
+ * @param force Whether or not entries should be overwritten if the map is full.
+ * @return true if the insertion was sucessful, false otherwise (errno ENOMEM
+ *         if the map or its arena were full).
+ */
+bool put(hashmap_t *self, map_key_t key, map_val_t val, bool force);
+
+/*
+ * Inserts an entry that was written age_ms ago, e.g. one read back from a
+ * snapshot. Otherwise the same as put(). Maps with a TTL count the entry's
+ * lifetime from when it was written, and destroy it right away if it has
+ * already expired. Other maps ignore the age.
+ *
+ * @param self The hash map to use
+ * @param key The key to insert
+ * @param val The value to insert
+ * @param age_ms How long ago the entry was written
+ * @param force Whether or not entries should be overwritten if the map is full.
+ * @return true if the entry was inserted or had expired, false otherwise.
+ */
+bool put_aged(hashmap_t *self, map_key_t key, map_val_t val, uint64_t age_ms, bool force);
+
+/*
+ * Puts a batch of entries, e.g. a block of a snapshot being loaded. Every
+ * entry is put as by put_aged() without force, and later entries win over
+ * earlier ones with the same key.
+ * Every put allocates from the one arena, so the batch is put entry by
+ * entry and threads is ignored.
+ *
+ * @param self The hash map to use
+ * @param entries The batch. stored is set on every entry the map took, the
+ *                rest are still the caller's
+ * @param count How many entries there are
+ * @param threads How many threads to put them with
+ * @return true if every entry was stored, false otherwise (errno ENOMEM if
+ *         the map filled up, EINVAL if an entry was empty)
+ */
+bool bulk_put(hashmap_t *self, map_entry_t *entries, size_t count, int threads);
+
+/*
+ * Calls func on every live entry in the map. The map is held as a reader for
+ * the whole walk, so writers wait until it is done.
+ *
+ * @param self The hash map to walk
+ * @param func Called for every entry
+ * @param arg Passed to func
+ * @return true if every entry was visited, false if func stopped the walk or
+ *         the map is invalid
+ */
+bool map_walk(hashmap_t *self, map_walk_f func, void *arg);
+
+/*
+ * Counts the slots holding a tombstone, as a reader. Probes have to step
+ * over them, so a lot of them makes every lookup slower.
+ *
+ * @param self The hash map
+ * @return The number of tombstones, 0 if the map is invalid
+ */
+uint32_t map_tombstones(hashmap_t *self);
+
+/*
+ * Retrieve the value associated with a key.
+ *
+ * @param self The hash map to use
+ * @param key The key to search for
+ * @return The corresponding value, or a map_val_t instance with a null
+ *         pointer and a value length of 0 if the key is not found. The
+ *         value is the map's: a put or delete may retire it as soon as this
+ *         returns, so a caller that uses it afterwards must be inside
+ *         reclaim_enter().
+ */
+map_val_t get(hashmap_t *self, map_key_t key);
+
+/*
+ * Remove the entry associated with a key. Its space in the arena is the
+ * map's, so there's nothing for the caller to free.
+ *
+ * @param self The hash map to use
+ * @param key The key to remove.
+ * @return The removed entry, with its lengths but NULL bases.
+ */
+map_node_t delete(hashmap_t *self, map_key_t key);
+
+/*
+ * Empties the map. The slot table's space is given back to the file system
+ * right away, the arena's once every GET that might still be copying out of
+ * it is done.
+ *
+ * @param self The hash map to clear.
+ * @return true if the operation was successful, false otherwise
+ */
+bool clear_map(hashmap_t *self);
+
+/*
+ * Invalidate a hash map, unmapping it and closing its file. What's in the
+ * file stays there for the next open_map().
+ *
+ * @param self The hash map to invalidate.
+ * @return true if the operation was successful.
+ */
+bool invalidate_map(hashmap_t *self);
+
+/*
+ * Nothing this map keeps lives in the slab, so there's never anything to
+ * evict.
+ *
+ * @param self The hash map to evict from
+ * @param lo The first address in the range
+ * @param hi The address just past the range
+ * @return 0, with errno ENOTSUP
+ */
+int evict_range(hashmap_t *self, const void *lo, const void *hi);
+
+/*
+ * Reads the whole slot table in up front, so the first requests after a
+ * restart don't wait on the disk. Only reads, so no page is dirtied.
+ *
+ * @param self The hash map to fault in
+ * @param threads Ignored, reading the file in is bound by the disk
+ * @return true if the table was faulted in, false otherwise
+ */
+bool prefault_map(hashmap_t *self, int threads);
+
+#endif
@@ -8,20 +8,33 @@
 
 #include <pthread.h>
 #include <semaphore.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdlib.h>
 
+// number of slots in the ring. must be a power of two
+#define QUEUE_CAPACITY 1024
+#define CACHE_LINE 64
 
-typedef struct queue_node_t {
+typedef struct queue_cell_t {
+    _Atomic size_t sequence;
     void *item;
-    struct queue_node_t *next;
-} queue_node_t;
+} queue_cell_t;
 
+/*
+ * Bounded multi-producer/multi-consumer ring. Every cell carries a sequence
+ * number that tells producers and consumers whose turn it is, so the fast
+ * path is a single CAS on enqueue_pos or dequeue_pos. The two positions live
+ * on their own cache lines so producers and consumers don't false share.
+ * items counts published cells and is what dequeue() sleeps on when empty.
+ */
 typedef struct queue_t {
-    queue_node_t *front, *rear;
+    _Alignas(CACHE_LINE) _Atomic size_t enqueue_pos;
+    _Alignas(CACHE_LINE) _Atomic size_t dequeue_pos;
+    _Alignas(CACHE_LINE) queue_cell_t *cells;
+    size_t mask;
     sem_t items;
-    pthread_mutex_t lock;
-    bool invalid;
+    atomic_bool invalid;
 } queue_t;
 
 typedef void (*item_destructor_f)(void *);
@@ -48,7 +61,8 @@ bool invalidate_queue(queue_t *self, item_destructor_f destroy_function);
  *
  * @param self The pointer to the queue
  * @param item The pointer to insert into the queue
- * @return true if the insertion was successful, false otherwise
+ * @return true if the insertion was successful, false otherwise.
+ *         errno is set to ENOBUFS if the ring is full.
  */
 bool enqueue(queue_t *self, void *item);
 
@@ -62,4 +76,22 @@ bool enqueue(queue_t *self, void *item);
  */
 void *dequeue(queue_t *self);
 
+/*
+ * Removes and returns the item at the head of the queue without blocking
+ *
+ * @param self The pointer to the queue
+ *
+ * @return The item at the head of the queue, or NULL if the queue was empty
+ */
+void *try_dequeue(queue_t *self);
+
+/*
+ * Returns how many items are in the queue right now. Only a snapshot,
+ * producers and consumers may move it as soon as it is read.
+ *
+ * @param self The pointer to the queue
+ * @return The number of queued items
+ */
+size_t queue_depth(queue_t *self);
+
 #endif
@@ -0,0 +1,133 @@
+#ifndef RECLAIM_H
+#define RECLAIM_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "utils.h"
+
+// entries a thread collects before handing them to the reclaimer in one job
+#define RETIRE_BATCH 64
+// retired entries allowed to wait for the reclaimer at once. past this,
+// threads wait out the readers and destroy them themselves, see retire_catch_up()
+#define RETIRE_LIMIT 65536
+// how long the reclaimer sleeps while readers are still in the way, in nanoseconds
+#define RECLAIM_TICK_NS 100000
+
+/*
+ * A piece of cleanup work, e.g. destroying every entry of a table that was
+ * swapped out of a map.
+ */
+typedef void (*reclaim_f)(void *arg);
+
+/*
+ * Marks the start of a read section: the calling thread is about to use map
+ * memory past the point where it lets go of the map's lock, e.g. to copy out
+ * a value it got back from get(). Nothing retired, or handed to
+ * reclaim_later(), from here on is destroyed until every thread that was in
+ * a read section at the time has left it. Sections nest, and should be short,
+ * since they hold up all reclamation while they last.
+ */
+void reclaim_enter(void);
+
+/*
+ * Ends the calling thread's read section, see reclaim_enter().
+ */
+void reclaim_exit(void);
+
+/*
+ * Marks the point after which memory the caller has just unlinked from a map
+ * may be destroyed, once reclaim_passed() says so.
+ *
+ * @return The stamp to pass to reclaim_passed()
+ */
+uint64_t reclaim_stamp(void);
+
+/*
+ * Tells whether every read section that could have seen memory unlinked
+ * before a stamp was taken has ended.
+ *
+ * @param stamp From reclaim_stamp()
+ * @return true if the memory can be destroyed
+ */
+bool reclaim_passed(uint64_t stamp);
+
+/*
+ * Waits until every thread that is in a read section right now has left it.
+ * Must not be called holding a map's lock, since a reader may be waiting for
+ * it, nor from inside a read section.
+ */
+void reclaim_synchronize(void);
+
+/*
+ * Hands a job to the background reclaimer, so the caller doesn't pay for it.
+ * The reclaimer is a single thread at idle priority, started on first use,
+ * and starts jobs in the order they were handed over, each once the readers
+ * that were in a read section when it was handed over have left it. If the
+ * thread can't be started, threads going idle run the jobs instead. If there
+ * is no memory to queue the job, it is dropped, since running it right here
+ * could destroy memory a reader still has.
+ *
+ * @param func The job
+ * @param arg What to pass it
+ * @return true if the job was queued, false if it was dropped
+ */
+bool reclaim_later(reclaim_f func, void *arg);
+
+/*
+ * Waits for every job handed over so far to finish.
+ */
+void reclaim_wait(void);
+
+/*
+ * Retires a map entry, so it is destroyed later instead of by a thread that
+ * is holding the map's lock, and not before the readers that might still be
+ * using it are done. Entries go on a list private to the calling thread,
+ * which is handed to the reclaimer once it has RETIRE_BATCH of them. If
+ * there's no memory for the list, the entry is leaked rather than destroyed
+ * under a reader. Either half may be NULL, if both are nothing is done.
+ *
+ * @param destroy The map's destructor
+ * @param key The key to destroy
+ * @param val The value to destroy
+ */
+void retire(destructor_f destroy, map_key_t key, map_val_t val);
+
+/*
+ * Hands whatever the calling thread has retired to the reclaimer, without
+ * waiting for a full batch. Threads call this before they go idle, outside
+ * any lock. If there is no reclaimer, the jobs are run right here, and past
+ * RETIRE_LIMIT it catches up as retire_catch_up() does.
+ */
+void retire_flush(void);
+
+/*
+ * If RETIRE_LIMIT retired entries are waiting, waits out the readers and
+ * runs every job the reclaimer hasn't got to yet, right here, so a thread
+ * that is never idle can't pile them up without bound. Cheap otherwise, so
+ * busy threads call it between requests. Same rules as reclaim_synchronize():
+ * not in a read section, and not holding a lock a reader may wait on.
+ */
+void retire_catch_up(void);
+
+/*
+ * Keeps everything the calling thread retires from now on to itself, however
+ * many there are, until retire_sync().
+ */
+void retire_hold(void);
+
+/*
+ * Waits out the readers, then destroys everything the calling thread has
+ * retired and not handed over, right here, and stops holding. For callers
+ * that need the memory back before they go on, like the slab rebalancer
+ * evicting a page, without waiting behind the rest of the reclaimer's jobs.
+ * Same rules as reclaim_synchronize().
+ */
+void retire_sync(void);
+
+/*
+ * Returns how many retired entries have not been destroyed yet.
+ */
+size_t retired_outstanding(void);
+
+#endif
@@ -0,0 +1,160 @@
+#ifndef SLAB_H
+#define SLAB_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// memory is handed to size classes a page at a time
+#define SLAB_PAGE_SIZE (1 << 20)
+// smallest chunk, and every chunk size is a multiple of it
+#define SLAB_ALIGN 8
+#define SLAB_MIN_SIZE 16
+// the largest thing the protocol lets anyone store (MAX_VALUE_SIZE)
+#define SLAB_MAX_SIZE 4096
+// each class is about this much bigger than the one before it, in percent
+#define SLAB_GROWTH 125
+#define SLAB_MAX_CLASSES 48
+// a thread keeps at most this many free chunks per class before giving some back
+#define SLAB_CACHE_MAX 64
+// chunks move between a thread's cache and the global pool this many at a time
+#define SLAB_BATCH 32
+// address space reserved when nobody called slab_init() first
+#define SLAB_DEFAULT_LIMIT ((size_t) 1 << 30)
+// 32-bit chunk offsets count SLAB_ALIGN units, so they reach this far into the region
+#define SLAB_OFFSET_LIMIT (((size_t) UINT32_MAX + 1) * SLAB_ALIGN)
+// how often the rebalancer looks for a page to move, in milliseconds
+#define SLAB_REBALANCE_MS 1000
+// how many milliseconds the rebalancer waits for a page to drain before giving up on it
+#define SLAB_DRAIN_TRIES 100
+// a page only moves if at most this percent of its chunks are in use
+#define SLAB_MOVE_MAX_LIVE 25
+
+typedef struct slab_class_t {
+    size_t size;            // bytes per chunk
+    unsigned per_page;      // chunks carved out of each page
+    void *free_list;        // free chunks in the global pool, linked through their first word
+    size_t free_count;
+    size_t pages;           // pages owned by this class
+    size_t failures;        // allocations refused because the slabs were full
+    size_t last_failures;   // failures as of the rebalancer's last look
+    size_t moved_in;        // pages the rebalancer gave this class
+    size_t moved_out;       // pages the rebalancer took away from it
+    size_t evicted;         // residents evicted to free up pages that moved out
+    void *drain_list;       // free chunks of the page being moved out, held aside
+    size_t drain_count;
+    pthread_mutex_t lock;
+} slab_class_t;
+
+/*
+ * Evicts everything stored in [lo, hi) so its chunks come back through
+ * slab_free(). Returns how many entries were evicted.
+ */
+typedef int (*slab_evict_f)(const void *lo, const void *hi, void *arg);
+
+/*
+ * Reserves the address space all slab pages are carved from. Pages are only
+ * backed by memory once a class needs them. Must be called before the first
+ * slab_alloc(), otherwise SLAB_DEFAULT_LIMIT is reserved.
+ *
+ * @param limit The most memory the slabs may ever use, in bytes
+ * @return true if the region was reserved, false if it was already set up
+ */
+bool slab_init(size_t limit);
+
+/*
+ * Allocates a chunk of at least size bytes. Comes out of the calling thread's
+ * cache when it can, so it usually takes no lock at all. Sizes over
+ * SLAB_MAX_SIZE fall back to malloc().
+ *
+ * @param size The number of bytes needed
+ * @return A pointer to the chunk, or NULL (errno ENOMEM) if the slabs are full
+ */
+void *slab_alloc(size_t size);
+
+/*
+ * Returns a chunk from slab_alloc() to the calling thread's cache. It does
+ * not have to be the thread that allocated it. NULL is ignored.
+ *
+ * @param ptr The chunk to free
+ */
+void slab_free(void *ptr);
+
+/*
+ * Gives every chunk in the calling thread's cache back to the global pool.
+ */
+void slab_flush_cache(void);
+
+/*
+ * Tells whether a pointer lies inside the slab region.
+ *
+ * @param ptr The pointer to check
+ * @return true if it was carved out of a slab page
+ */
+bool slab_contains(const void *ptr);
+
+/*
+ * Turns a slab pointer into a 32-bit offset, so whoever stores it can keep
+ * half a pointer instead of a whole one.
+ *
+ * @param ptr A pointer inside the slab region, aligned to SLAB_ALIGN
+ * @param offset Where to put the offset
+ * @return true if the pointer can be described by an offset, false (errno
+ *         EINVAL) if it is outside the region or past SLAB_OFFSET_LIMIT
+ */
+bool slab_offset(const void *ptr, uint32_t *offset);
+
+/*
+ * Turns an offset from slab_offset() back into a pointer.
+ *
+ * @param offset The offset
+ * @return The pointer it stands for
+ */
+void *slab_at(uint32_t offset);
+
+/*
+ * Returns the size class a chunk of the given size comes from.
+ *
+ * @param size The number of bytes
+ * @return The chunk size that would be handed out, or 0 if it is too big
+ */
+size_t slab_chunk_size(size_t size);
+
+/*
+ * Moves one page from a cold class to the class that has been refusing
+ * allocations since the last call, if there is one. The page's residents are
+ * evicted through the hook first. A class's last page never moves, and
+ * neither does a page with more than SLAB_MOVE_MAX_LIVE percent in use.
+ *
+ * @param evict The hook that evicts whatever lives in a page
+ * @param arg Passed through to the hook
+ * @return true if a page moved
+ */
+bool slab_rebalance(slab_evict_f evict, void *arg);
+
+/*
+ * Starts a background thread that calls slab_rebalance() every interval_ms.
+ *
+ * @param evict The hook that evicts whatever lives in a page
+ * @param arg Passed through to the hook
+ * @param interval_ms How long to wait between rounds
+ * @return true if the thread is running
+ */
+bool start_slab_rebalancer(slab_evict_f evict, void *arg, unsigned interval_ms);
+
+/*
+ * Copies out a size class's counters.
+ *
+ * @param class The class index, 0 <= class < slab_num_classes()
+ * @param out Where to put the copy. The lock and lists in it are not usable
+ * @return true if the class exists
+ */
+bool slab_class_stats(int class, slab_class_t *out);
+
+/*
+ * @return The number of size classes
+ */
+int slab_num_classes(void);
+
+#endif
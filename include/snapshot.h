@@ -0,0 +1,143 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "store.h"
+
+#define SNAPSHOT_MAGIC "CREAMSNP"
+#define SNAPSHOT_VERSION 1
+// records per block. blocks are what the loader's threads divide up
+#define SNAPSHOT_BLOCK 4096
+// blocks the loader decodes before handing them to the store in one batch
+#define SNAPSHOT_LOAD_BLOCKS 16
+// how much of the file the writer buffers before handing it to the kernel
+#define SNAPSHOT_BUFFER ((size_t) 1 << 20)
+// fds a snapshot child looks at when it can't list the ones it has open
+#define SNAPSHOT_MAX_FDS 65536
+// how often snapshot_wait() looks whether the snapshot is done
+#define SNAPSHOT_POLL_MS 10
+
+/*
+ * A snapshot file is this header, then the records back to back, then an
+ * index with the offset of the first record of every block. Everything is in
+ * the byte order of the machine that wrote it.
+ */
+typedef struct snapshot_header_t {
+    char magic[8];
+    uint32_t version;
+    uint32_t block_records;     // records per block, the last one may have fewer
+    uint64_t count;             // records in the file
+    uint64_t num_blocks;
+    uint64_t index_offset;      // where the index starts, also where the records end
+} snapshot_header_t;
+
+// one entry. key_len bytes of key follow it, then val_len bytes of value
+typedef struct snapshot_record_t {
+    uint32_t key_len;
+    uint32_t val_len;
+    uint64_t age_ms;            // how long ago the entry was written, for the TTL
+} snapshot_record_t;
+
+/*
+ * Writes every entry in the store to a snapshot. The file is written beside
+ * path and only renamed over it once it is complete and synced, so a crash
+ * part way through leaves the previous snapshot alone. Each shard is walked
+ * as a reader, so writes to it wait while it is being written out.
+ *
+ * @param store The store to save
+ * @param path Where the snapshot goes
+ * @return true if the snapshot was written, false otherwise (errno EBUSY if
+ *         another one is being written right now)
+ */
+bool save_snapshot(store_t *store, const char *path);
+
+/*
+ * Writes a snapshot like save_snapshot(), but from a forked child, so the
+ * store is only held still for as long as fork() takes. The child writes
+ * its copy-on-write view of the map while this process keeps serving. A
+ * thread waits for the child and reports on stderr if it failed. The
+ * persistent engine's map is shared with a child rather than copied, so
+ * there a thread writes the snapshot instead, like save_snapshot().
+ *
+ * @param store The store to save
+ * @param path Where the snapshot goes
+ * @return true if the child was started, false otherwise (errno EBUSY if
+ *         another snapshot is being written right now)
+ */
+bool fork_snapshot(store_t *store, const char *path);
+
+/*
+ * @return true while a snapshot is being written, by us or a child
+ */
+bool snapshot_running(void);
+
+/*
+ * Waits until no snapshot is being written, e.g. for one fork_snapshot()
+ * started.
+ *
+ * @return true if the last snapshot to finish was written, false otherwise
+ */
+bool snapshot_wait(void);
+
+/*
+ * Puts every entry of a snapshot into the store. The file is mapped rather
+ * than read. Its blocks are shared out between threads to be decoded, and
+ * every SNAPSHOT_LOAD_BLOCKS of them go into the store in one batch, put by
+ * the same threads (see store_bulk_load()). Keys and values
+ * are copied into slab chunks, so the store's destructor has to give them
+ * back with slab_free(). Entries that have outlived the TTL are dropped by
+ * the map.
+ *
+ * @param store The store to load into, normally still empty
+ * @param path The snapshot to load
+ * @param threads How many threads to load with
+ * @param loaded Set to how many entries were put in the store, may be NULL
+ * @return true if the whole snapshot was loaded, false otherwise (errno
+ *         EINVAL if the file isn't a snapshot or is damaged, ENOMEM if the
+ *         store filled up)
+ */
+bool load_snapshot(store_t *store, const char *path, int threads, uint64_t *loaded);
+
+/*
+ * A snapshot opened to look single keys up in, e.g. to reload only the hot
+ * keys (see load_hot_keys()). Every record is indexed by key when it's
+ * opened, and values are only copied out when they're fetched.
+ */
+typedef struct snapshot_source_t {
+    char *base;
+    size_t size;
+    uint64_t *slots;    // record offsets by key hash, linear probing, 0 for empty
+    uint64_t mask;
+} snapshot_source_t;
+
+/*
+ * Maps a snapshot and indexes its records.
+ *
+ * @param path The snapshot
+ * @return The source, or NULL on failure (errno EINVAL if the file isn't a
+ *         snapshot)
+ */
+snapshot_source_t *open_snapshot_source(const char *path);
+
+/*
+ * A fetch_f that copies a key's value out of a snapshot source into a slab
+ * chunk. Safe to call from several threads at once.
+ *
+ * @param key The key to look up
+ * @param val Set to the copy
+ * @param age_ms Set to how old the value was when the snapshot was written
+ * @param arg The snapshot_source_t
+ * @return true if the key was found, false otherwise (errno ENOENT if it
+ *         isn't in the snapshot, ENOMEM if there was no chunk to copy into)
+ */
+bool fetch_from_snapshot(map_key_t key, map_val_t *val, uint64_t *age_ms, void *arg);
+
+/*
+ * Unmaps a snapshot source and frees it.
+ *
+ * @param source The source, may be NULL
+ */
+void close_snapshot_source(snapshot_source_t *source);
+
+#endif
@@ -0,0 +1,60 @@
+#ifndef SPSC_H
+#define SPSC_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "queue.h"
+
+// number of slots in a ring between two cores. must be a power of two
+#define SPSC_CAPACITY 1024
+
+/*
+ * Bounded single-producer/single-consumer ring. Each side owns one position
+ * and only reads the other's, so a push or pop is a plain store plus a
+ * release, with no CAS and no lock. Each side also keeps the last position it
+ * saw from the other side, and only reloads it (and pulls in that cache line)
+ * when the ring looks full or empty.
+ */
+typedef struct spsc_t {
+    _Alignas(CACHE_LINE) _Atomic size_t head;   // next slot to pop, written by the consumer
+    size_t cached_tail;                         // consumer's copy of tail
+    _Alignas(CACHE_LINE) _Atomic size_t tail;   // next slot to push, written by the producer
+    size_t cached_head;                         // producer's copy of head
+    _Alignas(CACHE_LINE) void **items;
+    size_t mask;
+} spsc_t;
+
+/*
+ * Creates an empty ring with SPSC_CAPACITY slots.
+ *
+ * @return A pointer to the ring on the heap, or NULL on failure
+ */
+spsc_t *create_spsc(void);
+
+/*
+ * Adds an item. Only one thread may ever push to a ring.
+ *
+ * @param self The ring
+ * @param item The item, not NULL
+ * @return true if it was added, false (errno ENOBUFS) if the ring is full
+ */
+bool spsc_push(spsc_t *self, void *item);
+
+/*
+ * Takes the oldest item. Only one thread may ever pop from a ring.
+ *
+ * @param self The ring
+ * @return The item, or NULL if the ring was empty
+ */
+void *spsc_pop(spsc_t *self);
+
+/*
+ * Tells whether the ring has anything in it. Only a snapshot.
+ *
+ * @param self The ring
+ * @return true if there was nothing to pop
+ */
+bool spsc_empty(spsc_t *self);
+
+#endif
@@ -0,0 +1,77 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "queue.h"
+
+// the counters every thread keeps. requests, by request code
+#define STATS_PUT 0
+#define STATS_GET 1
+#define STATS_EVICT 2
+#define STATS_CLEAR 3
+#define STATS_SNAPSHOT 4
+#define STATS_STATS 5
+#define STATS_UNSUPPORTED 6     // request codes we don't know
+#define STATS_BAD_REQUEST 7     // known codes with sizes out of range
+// what GETs found
+#define STATS_HITS 8
+#define STATS_MISSES 9
+// entries thrown out of a map to make room, and ones that outlived the TTL
+#define STATS_EVICTED 10
+#define STATS_EXPIRED 11
+// entries thrown out because the slab moved their page to another size class.
+// the pages themselves are counted per class, see slab_class_stats()
+#define STATS_REBALANCED 12
+// connections
+#define STATS_ACCEPTED 13
+#define STATS_CLOSED 14
+#define STATS_SHED 15           // turned away busy, without reading the request
+#define STATS_COUNTERS 16
+// how much room a STATS response starts out with. it grows as it needs to,
+// since how many lines it has depends on what has been seen so far. it has
+// a name=value line for every
+// counter, added up across threads, then connections (accepted but not yet
+// closed), size, capacity, tombstones and, unless every core runs on its
+// own, queue_depth. then the pages the slab rebalancer moved into and out of
+// every size class that has any, and last the percentiles of every latency
+// histogram with anything in it, see latency.h
+#define STATS_RESPONSE_SIZE 4096
+
+/*
+ * One thread's counters. Only the thread that owns them ever writes them,
+ * with a plain load and store, so counting never writes to a cache line
+ * another thread is writing too. Readers add up every thread's.
+ */
+typedef struct stats_t {
+    _Alignas(CACHE_LINE) _Atomic uint64_t counters[STATS_COUNTERS];
+    struct stats_t *next;   // every thread's, so they can be added up
+} stats_t;
+
+/*
+ * Adds to one of the calling thread's counters. The thread's counters are
+ * made the first time it counts anything, and kept after it exits, so
+ * nothing it counted is lost. If they can't be made, the count is dropped.
+ *
+ * @param counter Which one, e.g. STATS_HITS
+ * @param n How much to add
+ */
+void stats_add(int counter, uint64_t n);
+
+/*
+ * Adds up every thread's counters. Threads keep counting while this runs,
+ * so the totals aren't a snapshot of a single moment.
+ *
+ * @param totals Set to the totals, STATS_COUNTERS of them
+ */
+void stats_sum(uint64_t *totals);
+
+/*
+ * @param counter Which one, e.g. STATS_HITS
+ * @return Its name in a STATS response, e.g. "hits"
+ */
+const char *stats_name(int counter);
+
+#endif
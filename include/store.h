@@ -0,0 +1,211 @@
+#ifndef STORE_H
+#define STORE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "utils.h"
+#include "topology.h"
+
+// the most shards a store can be split into
+#define STORE_MAX_SHARDS TOPOLOGY_MAX_NODES
+// the longest name a shard's file can have
+#define STORE_PATH_MAX 1024
+// how often the server checkpoints a store that lives in files
+#define STORE_CHECKPOINT_MS 1000
+// with a cold tier, the share of the memory limit that values can take up
+// in memory before they start going to disk. the rest is for keys, requests
+// in flight, and what the slab's size classes round up
+#define STORE_HOT_PERCENT 60
+// a live store_bulk_load() holds a shard's lock for this many entries at a
+// time, so requests get in between
+#define STORE_BULK_SLICE 65536
+
+/*
+ * The map, split into independent shards by key hash. Every shard is a map of
+ * its own with its own locks. With a topology, there is one shard per NUMA
+ * node and each one is allocated and faulted in from that node, so its
+ * memory is local to the workers that node runs. That's the shard's table
+ * only: keys and values are slab chunks, and the slab is one pool for every
+ * node (see slab.h), so an entry's value sits on whichever node first
+ * touched its page, usually the one that accepted some earlier PUT.
+ */
+typedef struct store_t {
+    int num_shards;
+    hashmap_t *shards[STORE_MAX_SHARDS];
+    hash_func_f hash_function;
+    destructor_f destroy_function;
+} store_t;
+
+/*
+ * Creates a store.
+ *
+ * @param num_shards How many shards to split into. Ignored with a topology
+ * @param capacity The number of entries the whole store can hold, split evenly
+ * @param hash_function The function to be used to hash keys
+ * @param destroy_function The function to be used to destroy entries
+ * @param topology If not NULL, one shard per node, allocated on that node
+ * @param prefault_threads Threads to fault each shard in with, 0 to leave it
+ *                         lazy. Shards on a topology are always faulted in
+ * @return The store, or NULL on failure
+ */
+store_t *create_store(int num_shards, uint32_t capacity, hash_func_f hash_function,
+                      destructor_f destroy_function, topology_t *topology, int prefault_threads);
+
+/*
+ * Opens a store whose shards live in files, <path>.<shard>-of-<num_shards>,
+ * picking up where each one left off if its file is already there. Only the
+ * persistent engine (-DPERSIST) keeps its map in a file, see persistmap.h.
+ *
+ * @param path Where the shards' files go, or NULL for the same store as
+ *             create_store()
+ * @return The store, or NULL on failure (errno ENOTSUP if the engine can't
+ *         keep its map in a file)
+ */
+store_t *open_store(const char *path, int num_shards, uint32_t capacity, hash_func_f hash_function,
+                    destructor_f destroy_function, topology_t *topology, int prefault_threads);
+
+/*
+ * Picks the shard a key lives in. With a topology, this is also its node.
+ *
+ * @param self The store
+ * @param key The key
+ * @return The shard index
+ */
+int store_shard_of(store_t *self, map_key_t key);
+
+/*
+ * The map operations, on whichever shard the key belongs to. See hashmap.h.
+ */
+bool store_put(store_t *self, map_key_t key, map_val_t val, bool force);
+bool store_put_aged(store_t *self, map_key_t key, map_val_t val, uint64_t age_ms, bool force);
+map_val_t store_get(store_t *self, map_key_t key);
+map_node_t store_delete(store_t *self, map_key_t key);
+
+/*
+ * Deletes a key, and retires the entry it had with the store's destructor
+ * (see retire()), since a GET may still be copying its value out. For callers
+ * that don't want the entry back, like an EVICT request.
+ *
+ * @param self The store
+ * @param key The key
+ * @return true if the key was there
+ */
+bool store_evict(store_t *self, map_key_t key);
+
+/*
+ * Puts a batch of entries, split up by shard, with bulk_put(). Every entry's
+ * hash has to be the store's hash_function(key). Before the store takes
+ * traffic, each shard gets its whole share at once. Live, it gets it a slice
+ * at a time, and requests for the shard wait for at most one slice.
+ *
+ * @param self The store
+ * @param entries The batch. stored is set on every entry a shard took, the
+ *                rest are still the caller's
+ * @param count How many entries there are
+ * @param threads How many threads each shard puts with
+ * @param live Whether the store is already taking requests
+ * @return true if every entry was stored, false otherwise (see bulk_put())
+ */
+bool store_bulk_load(store_t *self, map_entry_t *entries, size_t count, int threads, bool live);
+
+/*
+ * Clears every shard, one at a time.
+ *
+ * @param self The store to clear
+ * @return true if every shard was cleared
+ */
+bool store_clear(store_t *self);
+
+/*
+ * Evicts everything in an address range from every shard. See evict_range().
+ *
+ * @return The number of entries evicted
+ */
+int store_evict_range(store_t *self, const void *lo, const void *hi);
+
+/*
+ * Walks every shard, one at a time. See map_walk().
+ *
+ * @return true if every entry of every shard was visited
+ */
+bool store_walk(store_t *self, map_walk_f func, void *arg);
+
+/*
+ * Visits the most recently used entries of every shard, one shard at a
+ * time. Shards are filled evenly by hash, so each gives an even share of
+ * count. See map_hottest(). Only the extra credit map keeps track of use.
+ *
+ * @param self The store
+ * @param count How many entries to visit across all shards
+ * @param func Called for every entry
+ * @param arg Passed to func
+ * @return true if every entry was visited, false otherwise (errno ENOTSUP
+ *         if the map doesn't know which entries are hot)
+ */
+bool store_hottest(store_t *self, uint32_t count, map_walk_f func, void *arg);
+
+/*
+ * Takes every shard's write lock, so no reader or writer is part way through
+ * a shard until store_thaw(). Meant for fork(): a child only gets the thread
+ * that forked, so any lock held by another thread would stay held in the
+ * child forever, and the shard it guards could be half updated.
+ *
+ * @param self The store to freeze
+ */
+void store_freeze(store_t *self);
+
+/*
+ * Undoes store_freeze().
+ *
+ * @param self The store to thaw
+ */
+void store_thaw(store_t *self);
+
+/*
+ * Gives every shard fresh, unlocked locks. Only for the child of a fork()
+ * made while the store was frozen, where the other threads that may have
+ * been waiting on the locks don't exist.
+ *
+ * @param self The store in the child
+ */
+void store_reset_locks(store_t *self);
+
+/*
+ * Writes every shard out to its file and waits until it's on disk. See
+ * checkpoint_map().
+ *
+ * @param self The store
+ * @return true once it's on disk, or if the store doesn't live in files
+ */
+bool store_checkpoint(store_t *self);
+
+/*
+ * Gives every shard a cold tier of its own, in path.<shard>, with an even
+ * share of hot_limit. See spill_map(). Only the extra credit map has one.
+ *
+ * @param self The store
+ * @param path Where the shards' cold files go
+ * @param hot_limit How many bytes of values the whole store keeps in memory
+ * @return true if every shard has its tier, false otherwise (errno ENOTSUP
+ *         if the map can't spill)
+ */
+bool store_spill(store_t *self, const char *path, uint64_t hot_limit);
+
+/*
+ * @return The number of entries across all shards
+ */
+uint32_t store_size(store_t *self);
+
+/*
+ * @return The number of entries all shards can hold between them
+ */
+uint32_t store_capacity(store_t *self);
+
+/*
+ * Counts every shard's tombstones, one shard at a time. See map_tombstones().
+ *
+ * @return The number of tombstones across all shards
+ */
+uint32_t store_tombstones(store_t *self);
+
+#endif
@@ -0,0 +1,45 @@
+#ifndef TABLE_H
+#define TABLE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// transparent huge page size the tables are laid out for
+#define TABLE_HUGE_PAGE ((size_t) 2 << 20)
+// tables smaller than this just come from calloc, a huge page would be mostly waste
+#define TABLE_MMAP_MIN TABLE_HUGE_PAGE
+
+/*
+ * Allocates zeroed memory for a map's table. Big tables are mapped on their
+ * own, rounded up to whole huge pages, and the kernel is asked to back them
+ * with huge pages so probing doesn't spend its time missing the TLB.
+ *
+ * @param count The number of elements
+ * @param size The size of each element
+ * @return The table, or NULL (errno ENOMEM) on failure
+ */
+void *table_alloc(size_t count, size_t size);
+
+/*
+ * Frees a table from table_alloc().
+ *
+ * @param table The table to free
+ * @param count The count it was allocated with
+ * @param size The size it was allocated with
+ */
+void table_free(void *table, size_t count, size_t size);
+
+/*
+ * Touches every page of a table so it is faulted in now rather than in the
+ * middle of serving requests. The table is split into huge page aligned
+ * pieces that are faulted in by separate threads. The contents are left alone.
+ *
+ * @param table The table to fault in
+ * @param count The count it was allocated with
+ * @param size The size it was allocated with
+ * @param threads How many threads to fault it in with
+ * @return true if every page was touched, false otherwise
+ */
+bool table_prefault(void *table, size_t count, size_t size, int threads);
+
+#endif
@@ -0,0 +1,82 @@
+#ifndef TOPOLOGY_H
+#define TOPOLOGY_H
+
+#include <stdbool.h>
+
+// where the kernel describes NUMA nodes
+#define TOPOLOGY_ROOT "/sys/devices/system/node"
+// the most nodes we bother keeping track of
+#define TOPOLOGY_MAX_NODES 64
+// the most CPUs a node (or the machine) may have, same as glibc's CPU_SETSIZE
+#define TOPOLOGY_MAX_CPUS 1024
+
+/*
+ * Which CPUs belong to which NUMA node, limited to the CPUs this process is
+ * allowed to run on. Nodes without any of those CPUs (memory only nodes, or
+ * nodes we've been fenced off from) are left out, so nodes are numbered
+ * 0..num_nodes-1 and may not match the kernel's numbering.
+ */
+typedef struct topology_t {
+    int num_nodes;
+    int num_cpus[TOPOLOGY_MAX_NODES];
+    int *cpus[TOPOLOGY_MAX_NODES];
+} topology_t;
+
+/*
+ * Parses a kernel cpu list, like "0-3,8,10-11".
+ *
+ * @param list The list to parse
+ * @param cpus Where to put the CPU numbers, in order
+ * @param max How many fit in cpus
+ * @param count Set to how many were found
+ * @return true if the whole list made sense, false (errno EINVAL) otherwise
+ */
+bool parse_cpulist(const char *list, int *cpus, int max, int *count);
+
+/*
+ * Reads the NUMA layout of the machine. If it can't be read, everything we
+ * may run on is treated as a single node.
+ *
+ * @param self The topology to fill in
+ * @param root The sysfs node directory, usually TOPOLOGY_ROOT
+ * @return true if at least one node with usable CPUs was found
+ */
+bool load_topology(topology_t *self, const char *root);
+
+/*
+ * Frees what load_topology() allocated.
+ *
+ * @param self The topology to free
+ */
+void free_topology(topology_t *self);
+
+/*
+ * Picks the nth CPU of a node, wrapping around when there are more workers
+ * than CPUs.
+ *
+ * @param self The topology
+ * @param node The node, 0 <= node < num_nodes
+ * @param n Which of the node's CPUs
+ * @return The CPU number, or -1 (errno EINVAL) for a bad node
+ */
+int topology_cpu(topology_t *self, int node, int n);
+
+/*
+ * Pins the calling thread to every CPU of a node. Threads it creates
+ * afterwards start out pinned the same way.
+ *
+ * @param self The topology
+ * @param node The node to run on
+ * @return true if the thread was pinned
+ */
+bool pin_thread_to_node(topology_t *self, int node);
+
+/*
+ * Pins the calling thread to a single CPU.
+ *
+ * @param cpu The CPU to run on
+ * @return true if the thread was pinned
+ */
+bool pin_thread_to_cpu(int cpu);
+
+#endif
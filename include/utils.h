@@ -9,6 +9,10 @@
 
 #ifdef EC
 #include "extracredit.h"
+#elif defined(COMPACT)
+#include "compactmap.h"
+#elif defined(PERSIST)
+#include "persistmap.h"
 #else
 #include "hashmap.h"
 #endif
@@ -0,0 +1,170 @@
+#ifndef WAL_H
+#define WAL_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "store.h"
+
+// how the log thread syncs what it writes
+#define WAL_SYNC_ALWAYS 0       // a write is answered once it's on disk
+#define WAL_SYNC_INTERVAL 1     // synced every sync_ms, writes don't wait
+#define WAL_SYNC_NEVER 2        // written every sync_ms, the kernel syncs when it likes
+
+// how often an idle log thread in never mode still writes out what it has
+#define WAL_NEVER_FLUSH_MS 100
+// appends wait once this much is waiting to be written
+#define WAL_BUFFER_MAX ((size_t) 64 << 20)
+// a log bigger than this is compacted. if that fails, it's tried again once
+// the log has grown this much more
+#define WAL_COMPACT_BYTES ((uint64_t) 256 << 20)
+
+// what a record does. the same values as the requests
+#define WAL_PUT 0x01
+#define WAL_EVICT 0x04
+#define WAL_CLEAR 0x08
+
+/*
+ * One record in the log. key_len bytes of key follow it, then val_len bytes
+ * of value. The checksum covers everything after it, so a record that was
+ * only partly written when we crashed is recognized and dropped.
+ */
+typedef struct wal_record_t {
+    uint32_t checksum;
+    uint32_t op;
+    uint32_t key_len;
+    uint32_t val_len;
+} wal_record_t;
+
+typedef struct wal_buffer_t {
+    char *data;
+    size_t len;
+    size_t cap;
+} wal_buffer_t;
+
+/*
+ * An append-only log of every change to the store. Appends are copied into a
+ * buffer, and one thread writes the buffer out and syncs it, so everything
+ * appended while it was busy goes out together with a single fdatasync()
+ * (group commit).
+ *
+ * A change is appended and made to the store while its shard's order lock
+ * is held (see wal_lock()), so the log has the changes to a key in the
+ * order the store made them, and a CLEAR in order with everything.
+ *
+ * The log lives in <path>, <path>.old and a snapshot. When <path> grows past
+ * WAL_COMPACT_BYTES it is renamed to <path>.old and a new one is started,
+ * with every order lock held, so everything in <path>.old is already in the
+ * store. Then the whole store is written to the snapshot by a forked child
+ * (see fork_snapshot()) and <path>.old is removed.
+ * Recovery loads the snapshot and replays <path>.old and <path>, in that
+ * order. Any snapshot taken since <path>.old (or <path>, if there is no
+ * .old) was started works, so the snapshot can be shared with SNAPSHOT
+ * requests: replaying changes the snapshot already has is harmless.
+ */
+typedef struct wal_t {
+    char *path;
+    char *old_path;
+    char *snap_path;
+    int fd;
+    int policy;
+    int sync_ms;
+    store_t *store;
+    pthread_mutex_t lock;
+    pthread_cond_t work;        // there is something to write
+    pthread_cond_t done;        // more was written, or synced, or there is room again
+    wal_buffer_t pending;       // appended, waiting for the log thread
+    uint64_t appended;          // bytes appended so far
+    uint64_t synced;            // bytes known to be on disk (or written, without syncing)
+    uint64_t file_size;         // bytes in the live log file
+    uint64_t compact_at;        // compact once file_size is past this
+    pthread_mutex_t order[STORE_MAX_SHARDS];    // see wal_lock()
+    bool writing;               // the log thread is writing to fd without the lock
+    bool compacting;
+    bool failed;                // the log couldn't be written, nothing is durable anymore
+} wal_t;
+
+/*
+ * Parses a sync policy: "always", "never", or a number of milliseconds to
+ * sync every that often.
+ *
+ * @param policy The policy string
+ * @param mode Set to WAL_SYNC_ALWAYS, WAL_SYNC_INTERVAL or WAL_SYNC_NEVER
+ * @param sync_ms Set to the interval
+ * @return true if it made sense, false (errno EINVAL) otherwise
+ */
+bool parse_wal_policy(const char *policy, int *mode, int *sync_ms);
+
+/*
+ * Rebuilds the store from the snapshot and the log's files, see wal_t. A
+ * record that fails its checksum ends a file, since that's where we crashed,
+ * and the live log is cut back to its last good record. Keys and values are
+ * copied into slab chunks, so the store's destructor has to give them back
+ * with slab_free().
+ *
+ * @param store The store to rebuild, normally still empty
+ * @param path The log's path
+ * @param snap_path The log's snapshot
+ * @param applied Set to how many records were replayed, may be NULL
+ * @return true if the store was rebuilt, false otherwise
+ */
+bool recover_wal(store_t *store, const char *path, const char *snap_path, uint64_t *applied);
+
+/*
+ * Opens the log for appending and starts its log thread. Call recover_wal()
+ * first, or what was in the log is lost at the next compaction.
+ *
+ * @param store The store the log is for, compaction snapshots it
+ * @param path The log's path
+ * @param snap_path Where compaction writes the snapshot
+ * @param policy One of the WAL_SYNC_ values
+ * @param sync_ms The interval for WAL_SYNC_INTERVAL
+ * @return The log, or NULL on failure
+ */
+wal_t *open_wal(store_t *store, const char *path, const char *snap_path, int policy, int sync_ms);
+
+/*
+ * Takes a shard's order lock. Hold it while appending a change and making it
+ * to the store, so changes to the shard go into the log in the order the
+ * store made them, and the log isn't rotated in between. Let go of it before
+ * wal_wait(). A change to one key takes its shard's, a CLEAR takes them all.
+ *
+ * @param self The log, or NULL for none, which does nothing
+ * @param shard The shard, see store_shard_of(), or -1 for every shard
+ */
+void wal_lock(wal_t *self, int shard);
+
+/*
+ * Undoes wal_lock().
+ *
+ * @param self The log, or NULL
+ * @param shard What was passed to wal_lock()
+ */
+void wal_unlock(wal_t *self, int shard);
+
+/*
+ * Appends a record. Waits if WAL_BUFFER_MAX bytes are already waiting.
+ *
+ * @param self The log
+ * @param op WAL_PUT, WAL_EVICT or WAL_CLEAR
+ * @param key The key, NULL for WAL_CLEAR
+ * @param key_len Its length
+ * @param val The value, NULL unless WAL_PUT
+ * @param val_len Its length
+ * @return Where the record ends in the log, to pass to wal_wait(), or 0
+ *         (errno EIO) if the log can't be written
+ */
+uint64_t wal_append(wal_t *self, uint32_t op, const void *key, uint32_t key_len, const void *val, uint32_t val_len);
+
+/*
+ * Waits until a record is as durable as the policy makes it. Only
+ * WAL_SYNC_ALWAYS waits, the other policies return right away.
+ *
+ * @param self The log
+ * @param lsn What wal_append() returned
+ * @return true once it is, false (errno EIO) if the log can't be written
+ */
+bool wal_wait(wal_t *self, uint64_t lsn);
+
+#endif
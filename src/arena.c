@@ -0,0 +1,55 @@
+#include "arena.h"
+#include <errno.h>
+#include <stdlib.h>
+
+bool init_arena(arena_t *self, size_t size){
+    if (self == NULL || size == 0){
+        errno = EINVAL;
+        return false;
+    }
+
+    self -> base = malloc(size);
+    if (self -> base == NULL){
+        return false;
+    }
+    self -> size = size;
+    self -> used = 0;
+    return true;
+}
+
+void *arena_alloc(arena_t *self, size_t size){
+    if (self == NULL || size == 0){
+        errno = EINVAL;
+        return NULL;
+    }
+
+    // round up so whatever comes next is aligned too
+    size_t rounded = (size + ARENA_ALIGN - 1) & ~((size_t) ARENA_ALIGN - 1);
+    if (rounded < size || rounded > self -> size - self -> used){
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    void *ptr = self -> base + self -> used;
+    self -> used += rounded;
+    return ptr;
+}
+
+void arena_reset(arena_t *self){
+    if (self == NULL){
+        errno = EINVAL;
+        return;
+    }
+    self -> used = 0;
+}
+
+void destroy_arena(arena_t *self){
+    if (self == NULL){
+        errno = EINVAL;
+        return;
+    }
+    free(self -> base);
+    self -> base = NULL;
+    self -> size = 0;
+    self -> used = 0;
+}
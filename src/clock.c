@@ -0,0 +1,60 @@
+#include "clock.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+
+// the cached time. only the ticker writes it, everyone else just loads it
+static _Atomic uint64_t cachedMs;
+static atomic_bool tickerStarted;
+static atomic_bool tickerRunning;
+
+static uint64_t read_coarse_ms(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void *ticker(void *vargp){
+    struct timespec tick = {.tv_sec = 0, .tv_nsec = CLOCK_TICK_MS * 1000000L};
+
+    while (1){
+        atomic_store_explicit(&cachedMs, read_coarse_ms(), memory_order_relaxed);
+        nanosleep(&tick, NULL);
+    }
+    return NULL;
+}
+
+uint64_t coarse_now_ms(void){
+    // if the ticker is going, the cached value is at most a tick old
+    if (atomic_load_explicit(&tickerRunning, memory_order_acquire) == true){
+        return atomic_load_explicit(&cachedMs, memory_order_relaxed);
+    }
+    return read_coarse_ms();
+}
+
+uint64_t precise_now_ns(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+bool start_clock_ticker(void){
+    // only the first caller gets to start the thread
+    if (atomic_exchange(&tickerStarted, true) == true){
+        return true;
+    }
+
+    // seed the cache before anyone reads it through the fast path
+    atomic_store(&cachedMs, read_coarse_ms());
+
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, ticker, NULL) != 0){
+        atomic_store(&tickerStarted, false);
+        errno = EAGAIN;
+        return false;
+    }
+    pthread_detach(tid);
+    atomic_store(&tickerRunning, true);
+    return true;
+}
@@ -0,0 +1,96 @@
+#include "codel.h"
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Integer square root, so we don't need libm for the control law.
+ */
+static uint32_t isqrt(uint32_t n){
+    uint32_t root = 0;
+    uint32_t bit = 1u << 30;
+
+    while (bit > n){
+        bit >>= 2;
+    }
+    while (bit != 0){
+        if (n >= root + bit){
+            n -= root + bit;
+            root = (root >> 1) + bit;
+        }
+        else{
+            root >>= 1;
+        }
+        bit >>= 2;
+    }
+    return root;
+}
+
+/*
+ * The longer we keep dropping, the closer together the drops get
+ * (interval / sqrt(count)), until the queue drains back under target.
+ */
+static uint64_t control_law(codel_t *self, uint64_t t){
+    uint32_t root = isqrt(self -> count);
+    return t + self -> interval / (root == 0 ? 1 : root);
+}
+
+void init_codel(codel_t *self, uint64_t target_ms, uint64_t interval_ms){
+    memset(self, 0, sizeof(codel_t));
+    self -> target = target_ms;
+    self -> interval = interval_ms;
+}
+
+bool codel_should_drop(codel_t *self, uint64_t enqueued, uint64_t now){
+    // shedding is turned off
+    if (self -> target == 0){
+        return false;
+    }
+
+    uint64_t sojourn = now > enqueued ? now - enqueued : 0;
+    bool okToDrop = false;
+
+    // the queue is draining fine, forget about any earlier trouble
+    if (sojourn < self -> target){
+        self -> first_above = 0;
+    }
+    // first item over target, give it an interval to sort itself out
+    else if (self -> first_above == 0){
+        self -> first_above = now + self -> interval;
+    }
+    // been over target for a whole interval, that's a standing queue
+    else if (now >= self -> first_above){
+        okToDrop = true;
+    }
+
+    if (self -> dropping == true){
+        // back under control, stop shedding
+        if (okToDrop == false){
+            self -> dropping = false;
+            return false;
+        }
+        // still bad, shed one more if it is time
+        if (now >= self -> drop_next){
+            self -> count += 1;
+            self -> drop_next = control_law(self, self -> drop_next);
+            return true;
+        }
+        return false;
+    }
+
+    if (okToDrop == true){
+        // start shedding. if we were dropping recently, pick up near the old
+        // rate instead of starting over, since the overload probably never went away
+        self -> dropping = true;
+        uint32_t delta = self -> count - self -> last_count;
+        if (delta > 1 && now - self -> drop_next < 16 * self -> interval){
+            self -> count = delta;
+        }
+        else{
+            self -> count = 1;
+        }
+        self -> drop_next = control_law(self, now);
+        self -> last_count = self -> count;
+        return true;
+    }
+    return false;
+}
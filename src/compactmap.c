@@ -0,0 +1,561 @@
+#include "utils.h"
+#include "slab.h"
+#include "table.h"
+#include "reclaim.h"
+#include "stats.h"
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+// the top bit of key_len marks a tombstone, the rest is the length
+#define SLOT_TOMBSTONE 0x8000
+#define SLOT_LEN_MASK 0x7fff
+
+_Static_assert(sizeof(map_slot_t) == 24, "map_slot_t should pack into 24 bytes");
+
+static bool slot_live(map_slot_t *slot){
+    return slot -> key_len != 0 && (slot -> key_len & SLOT_TOMBSTONE) == 0;
+}
+
+static bool slot_inline(map_slot_t *slot){
+    return (slot -> key_len & SLOT_LEN_MASK) <= COMPACT_INLINE_KEY;
+}
+
+/*
+ * The key as the destructor should see it. Keys stored in the slot were
+ * already handed back, so their base is NULL.
+ */
+static map_key_t slot_key(map_slot_t *slot){
+    size_t len = slot -> key_len & SLOT_LEN_MASK;
+    if (slot_inline(slot) == true){
+        return MAP_KEY(NULL, len);
+    }
+    return MAP_KEY(slab_at(slot -> ref.key_off), len);
+}
+
+static map_val_t slot_val(map_slot_t *slot){
+    return MAP_VAL(slab_at(slot -> val_off), slot -> val_len);
+}
+
+/*
+ * The key as map_walk() shows it, with inline keys pointing into the slot.
+ */
+static map_key_t walk_key(map_slot_t *slot){
+    if (slot_inline(slot) == true){
+        return MAP_KEY(slot -> key, slot -> key_len & SLOT_LEN_MASK);
+    }
+    return slot_key(slot);
+}
+
+static bool slot_matches(map_slot_t *slot, map_key_t key, uint32_t hash){
+    if (slot_live(slot) == false || slot -> key_len != key.key_len){
+        return false;
+    }
+    if (slot_inline(slot) == true){
+        return memcmp(slot -> key, key.key_base, key.key_len) == 0;
+    }
+    return slot -> ref.hash == hash && memcmp(slab_at(slot -> ref.key_off), key.key_base, key.key_len) == 0;
+}
+
+/*
+ * Looks for a key, starting at its home slot. A slot that was never used ends
+ * the search, since the key would have been put there. Sets *freeSlot to the
+ * first tombstone or empty slot on the way, or -1 if the table is full.
+ *
+ * @return The index of the live slot holding the key, or -1
+ */
+static int probe(hashmap_t *self, map_key_t key, uint32_t hash, int *freeSlot){
+    uint32_t index = hash % self -> capacity;
+    int firstFree = -1;
+
+    for (uint32_t i = 0; i < self -> capacity; i++){
+        map_slot_t *slot = &self -> slots[index];
+        if (slot -> key_len == 0){
+            if (firstFree == -1){
+                firstFree = index;
+            }
+            break;
+        }
+        if (slot_matches(slot, key, hash) == true){
+            if (freeSlot != NULL){
+                *freeSlot = firstFree;
+            }
+            return index;
+        }
+        if (firstFree == -1 && slot_live(slot) == false){
+            firstFree = index;
+        }
+        index = index + 1 == self -> capacity ? 0 : index + 1;
+    }
+
+    if (freeSlot != NULL){
+        *freeSlot = firstFree;
+    }
+    return -1;
+}
+
+/*
+ * Gets the slab offset of something the caller handed in, copying it into a
+ * fresh chunk if it isn't in the slab region already.
+ *
+ * @return true if *offset is set, false (errno ENOMEM) if no chunk was free
+ */
+static bool adopt(void *base, size_t len, uint32_t *offset, bool *copied){
+    if (slab_offset(base, offset) == true){
+        *copied = false;
+        return true;
+    }
+
+    void *chunk = slab_alloc(len);
+    if (chunk == NULL || slab_offset(chunk, offset) == false){
+        slab_free(chunk);
+        errno = ENOMEM;
+        return false;
+    }
+    memcpy(chunk, base, len);
+    *copied = true;
+    return true;
+}
+
+/*
+ * Builds the slot for a new entry without touching the table, so a put that
+ * runs out of memory leaves the map (and the caller's buffers) as they were.
+ *
+ * @param keyCopied Set if the caller's key buffer is no longer needed
+ * @param valCopied Set if the caller's value buffer is no longer needed
+ */
+static bool fill_slot(map_slot_t *slot, map_key_t key, map_val_t val, uint32_t hash, bool *keyCopied, bool *valCopied){
+    memset(slot, 0, sizeof(map_slot_t));
+    slot -> key_len = key.key_len;
+    slot -> val_len = val.val_len;
+
+    if (adopt(val.val_base, val.val_len, &slot -> val_off, valCopied) == false){
+        return false;
+    }
+
+    if (key.key_len <= COMPACT_INLINE_KEY){
+        memcpy(slot -> key, key.key_base, key.key_len);
+        *keyCopied = true;
+        return true;
+    }
+
+    slot -> ref.hash = hash;
+    if (adopt(key.key_base, key.key_len, &slot -> ref.key_off, keyCopied) == false){
+        if (*valCopied == true){
+            slab_free(slab_at(slot -> val_off));
+        }
+        return false;
+    }
+    return true;
+}
+
+/*
+ * Takes the map as a reader. The first reader in holds the write lock for
+ * all of them, so writers wait until the last one is out.
+ */
+static void read_lock(hashmap_t *self){
+    pthread_mutex_lock(&self -> fields_lock);
+    self -> num_readers += 1;
+    if (self -> num_readers == 1){
+        pthread_mutex_lock(&self -> write_lock);
+    }
+    pthread_mutex_unlock(&self -> fields_lock);
+}
+
+/*
+ * Lets go of the map as a reader, see read_lock().
+ */
+static void read_unlock(hashmap_t *self){
+    pthread_mutex_lock(&self -> fields_lock);
+    self -> num_readers -= 1;
+    if (self -> num_readers == 0){
+        pthread_mutex_unlock(&self -> write_lock);
+    }
+    pthread_mutex_unlock(&self -> fields_lock);
+}
+
+hashmap_t *create_map(uint32_t capacity, hash_func_f hash_function, destructor_f destroy_function) {
+    if (hash_function == NULL || destroy_function == NULL || capacity == 0){
+        errno = EINVAL;
+        return NULL;
+    }
+
+    hashmap_t *hashmap = calloc(1, sizeof(hashmap_t));
+    if (hashmap == NULL){
+        errno = EINVAL;
+        return NULL;
+    }
+
+    hashmap -> capacity = capacity;
+    hashmap -> size = 0;
+    hashmap -> hash_function = hash_function;
+    hashmap -> destroy_function = destroy_function;
+    hashmap -> num_readers = 0;
+    hashmap -> invalid = false;
+
+    if (pthread_mutex_init(&hashmap -> write_lock, NULL) != 0){
+        free(hashmap);
+        return NULL;
+    }
+
+    if (pthread_mutex_init(&hashmap -> fields_lock, NULL) != 0){
+        free(hashmap);
+        return NULL;
+    }
+
+    // all zeroes is an empty table. big ones get huge pages, see table_alloc()
+    hashmap -> slots = table_alloc(capacity, sizeof(map_slot_t));
+    if (hashmap -> slots == NULL){
+        free(hashmap);
+        return NULL;
+    }
+    return hashmap;
+}
+
+bool put(hashmap_t *self, map_key_t key, map_val_t val, bool force) {
+    if (self == NULL || key.key_base == NULL || val.val_base == NULL || key.key_len == 0 || val.val_len == 0 ||
+        key.key_len > SLOT_LEN_MASK || val.val_len > UINT16_MAX){
+        errno = EINVAL;
+        return false;
+    }
+
+    pthread_mutex_lock(&self -> write_lock);
+
+    if (self -> invalid == true){
+        errno = EINVAL;
+        pthread_mutex_unlock(&self -> write_lock);
+        return false;
+    }
+
+    uint32_t hash = self -> hash_function(key);
+    int freeSlot;
+    int index = probe(self, key, hash, &freeSlot);
+    bool replacing = true;
+
+    // a new key goes in the first free slot on its probe path
+    if (index == -1 && freeSlot != -1){
+        index = freeSlot;
+        replacing = false;
+    }
+    // nowhere to put it. overwrite the home slot if we're allowed to
+    else if (index == -1){
+        if (force == false){
+            errno = ENOMEM;
+            pthread_mutex_unlock(&self -> write_lock);
+            return false;
+        }
+        index = get_index(self, key);
+        stats_add(STATS_EVICTED, 1);
+    }
+
+    map_slot_t slot;
+    bool keyCopied = false;
+    bool valCopied = false;
+    if (fill_slot(&slot, key, val, hash, &keyCopied, &valCopied) == false){
+        pthread_mutex_unlock(&self -> write_lock);
+        return false;
+    }
+
+    // whatever was there before is gone for good, unless the caller handed us
+    // the same chunks again
+    if (replacing == true){
+        map_key_t oldKey = slot_key(&self -> slots[index]);
+        map_val_t oldVal = slot_val(&self -> slots[index]);
+        retire(self -> destroy_function, oldKey.key_base == slot_key(&slot).key_base ? MAP_KEY(NULL, 0) : oldKey,
+                       oldVal.val_base == slot_val(&slot).val_base ? MAP_VAL(NULL, 0) : oldVal);
+    }
+    else{
+        self -> size += 1;
+    }
+    self -> slots[index] = slot;
+    pthread_mutex_unlock(&self -> write_lock);
+
+    // anything we copied, the caller's buffer isn't needed anymore. nobody
+    // else can see it, so it doesn't need the lock
+    if (keyCopied == true || valCopied == true){
+        self -> destroy_function(keyCopied == true ? key : MAP_KEY(NULL, 0), valCopied == true ? val : MAP_VAL(NULL, 0));
+    }
+    return true;
+}
+
+bool put_aged(hashmap_t *self, map_key_t key, map_val_t val, uint64_t age_ms, bool force) {
+    // nothing here expires, so the age makes no difference
+    return put(self, key, val, force);
+}
+
+bool bulk_put(hashmap_t *self, map_entry_t *entries, size_t count, int threads) {
+    if (self == NULL || (entries == NULL && count > 0) || threads < 1){
+        errno = EINVAL;
+        return false;
+    }
+
+    // one at a time, and keep going past the ones that don't fit
+    int error = 0;
+    for (size_t i = 0; i < count; i++){
+        entries[i].stored = put_aged(self, entries[i].key, entries[i].val, entries[i].age_ms, false);
+        if (entries[i].stored == false){
+            error = errno;
+        }
+    }
+    if (error != 0){
+        errno = error;
+        return false;
+    }
+    return true;
+}
+
+map_val_t get(hashmap_t *self, map_key_t key) {
+    if (self == NULL || key.key_base == NULL ||  key.key_len == 0){
+        errno = EINVAL;
+        return MAP_VAL(NULL, 0);
+    }
+
+    read_lock(self);
+
+    map_val_t val = MAP_VAL(NULL, 0);
+    if (self -> invalid == false){
+        int index = probe(self, key, self -> hash_function(key), NULL);
+        if (index != -1){
+            val = slot_val(&self -> slots[index]);
+        }
+    }
+
+    read_unlock(self);
+
+    if (val.val_base == NULL)
+        errno = EINVAL;
+    return val;
+}
+
+bool map_walk(hashmap_t *self, map_walk_f func, void *arg) {
+    if (self == NULL || func == NULL){
+        errno = EINVAL;
+        return false;
+    }
+
+    // walk as a reader, same as get()
+    read_lock(self);
+
+    bool finished = self -> invalid == false;
+    for (uint32_t i = 0; i < self -> capacity && finished == true; i++){
+        if (slot_live(&self -> slots[i]) == true){
+            finished = func(walk_key(&self -> slots[i]), slot_val(&self -> slots[i]), 0, arg);
+        }
+    }
+
+    read_unlock(self);
+
+    if (finished == false)
+        errno = EINVAL;
+    return finished;
+}
+
+uint32_t map_tombstones(hashmap_t *self) {
+    if (self == NULL){
+        errno = EINVAL;
+        return 0;
+    }
+
+    read_lock(self);
+
+    uint32_t tombstones = 0;
+    for (uint32_t i = 0; self -> invalid == false && i < self -> capacity; i++){
+        if ((self -> slots[i].key_len & SLOT_TOMBSTONE) != 0){
+            tombstones += 1;
+        }
+    }
+
+    read_unlock(self);
+    return tombstones;
+}
+
+map_node_t delete(hashmap_t *self, map_key_t key) {
+    if (self == NULL || key.key_len == 0 || key.key_base == NULL){
+        errno = EINVAL;
+        return MAP_NODE(MAP_KEY(NULL, 0), MAP_VAL(NULL, 0), false);
+    }
+
+    pthread_mutex_lock(&self -> write_lock);
+
+    if (self -> invalid == true){
+        errno = EINVAL;
+        pthread_mutex_unlock(&self -> write_lock);
+        return MAP_NODE(MAP_KEY(NULL, 0), MAP_VAL(NULL, 0), false);
+    }
+
+    int index = probe(self, key, self -> hash_function(key), NULL);
+    if (index == -1){
+        pthread_mutex_unlock(&self -> write_lock);
+        return MAP_NODE(MAP_KEY(NULL, 0), MAP_VAL(NULL, 0), false);
+    }
+
+    map_slot_t *slot = &self -> slots[index];
+    map_node_t returnVal = MAP_NODE(slot_key(slot), slot_val(slot), true);
+    // keep the length, so lookups for keys further along don't stop here
+    slot -> key_len |= SLOT_TOMBSTONE;
+    self -> size -= 1;
+
+    pthread_mutex_unlock(&self -> write_lock);
+    return returnVal;
+}
+
+/*
+ * Destroys every live entry and empties the table. With later, the entries
+ * are retired instead, for readers that may still have them. Caller holds
+ * the write lock.
+ */
+static void destroy_all(hashmap_t *self, bool later){
+    for (uint32_t i = 0; i < self -> capacity; i++){
+        if (slot_live(&self -> slots[i]) == true){
+            if (later == true){
+                retire(self -> destroy_function, slot_key(&self -> slots[i]), slot_val(&self -> slots[i]));
+            }
+            else{
+                self -> destroy_function(slot_key(&self -> slots[i]), slot_val(&self -> slots[i]));
+            }
+        }
+    }
+    // no tombstones left behind, so probes stop early again
+    memset(self -> slots, 0, (size_t) self -> capacity * sizeof(map_slot_t));
+    self -> size = 0;
+}
+
+// a table that was swapped out by clear_map(), waiting for the reclaimer
+typedef struct map_graveyard_t {
+    uint32_t capacity;
+    map_slot_t *slots;
+    destructor_f destroy_function;
+} map_graveyard_t;
+
+/*
+ * Reclaimer job: destroys what was left in a swapped out table, then the table.
+ */
+static void destroy_graveyard(void *arg){
+    map_graveyard_t *graveyard = arg;
+    for (uint32_t i = 0; i < graveyard -> capacity; i++){
+        if (slot_live(&graveyard -> slots[i]) == true){
+            graveyard -> destroy_function(slot_key(&graveyard -> slots[i]), slot_val(&graveyard -> slots[i]));
+        }
+    }
+    table_free(graveyard -> slots, graveyard -> capacity, sizeof(map_slot_t));
+    free(graveyard);
+}
+
+bool clear_map(hashmap_t *self) {
+    if (self == NULL){
+        errno = EINVAL;
+        return false;
+    }
+
+    // the empty table is allocated outside the lock. without one we fall back
+    // to emptying the table in place
+    map_graveyard_t *graveyard = malloc(sizeof(map_graveyard_t));
+    map_slot_t *slots = table_alloc(self -> capacity, sizeof(map_slot_t));
+    if (graveyard == NULL || slots == NULL){
+        free(graveyard);
+        table_free(slots, self -> capacity, sizeof(map_slot_t));
+        graveyard = NULL;
+    }
+
+    pthread_mutex_lock(&self -> write_lock);
+
+    if (self -> invalid == true){
+        errno = EINVAL;
+        pthread_mutex_unlock(&self -> write_lock);
+        if (graveyard != NULL){
+            free(graveyard);
+            table_free(slots, self -> capacity, sizeof(map_slot_t));
+        }
+        return false;
+    }
+
+    if (graveyard == NULL){
+        destroy_all(self, true);
+        pthread_mutex_unlock(&self -> write_lock);
+        return true;
+    }
+
+    // swap, and leave the old entries to the reclaimer
+    graveyard -> capacity = self -> capacity;
+    graveyard -> slots = self -> slots;
+    graveyard -> destroy_function = self -> destroy_function;
+    self -> slots = slots;
+    self -> size = 0;
+
+    pthread_mutex_unlock(&self -> write_lock);
+    reclaim_later(destroy_graveyard, graveyard);
+    return true;
+}
+
+bool invalidate_map(hashmap_t *self) {
+    if (self == NULL){
+        errno = EINVAL;
+        return false;
+    }
+
+    pthread_mutex_lock(&self -> write_lock);
+
+    if (self -> invalid == true){
+        errno = EINVAL;
+        pthread_mutex_unlock(&self -> write_lock);
+        return false;
+    }
+
+    destroy_all(self, false);
+    self -> invalid = true;
+    table_free(self -> slots, self -> capacity, sizeof(map_slot_t));
+
+    pthread_mutex_unlock(&self -> write_lock);
+    return true;
+}
+
+int evict_range(hashmap_t *self, const void *lo, const void *hi) {
+    if (self == NULL || lo == NULL || hi == NULL){
+        errno = EINVAL;
+        return 0;
+    }
+
+    // what we evict is ours to destroy, not the reclaimer's
+    retire_hold();
+
+    // nothing is indexed by address, so look at every live slot. the lock
+    // is let go every MAP_EVICT_CHUNK slots, so puts and gets aren't held
+    // up for a whole pass
+    int evicted = 0;
+    bool valid = true;
+    for (uint32_t first = 0; valid == true && first < self -> capacity; first += MAP_EVICT_CHUNK){
+        pthread_mutex_lock(&self -> write_lock);
+        valid = self -> invalid == false;
+        for (uint32_t i = first; valid == true && i < self -> capacity && i < first + MAP_EVICT_CHUNK; i++){
+            map_slot_t *slot = &self -> slots[i];
+            if (slot_live(slot) == false){
+                continue;
+            }
+            char *key = slot_key(slot).key_base;
+            char *val = slot_val(slot).val_base;
+            if ((key != NULL && key >= (char *) lo && key < (char *) hi) || (val >= (char *) lo && val < (char *) hi)){
+                retire(self -> destroy_function, slot_key(slot), slot_val(slot));
+                slot -> key_len |= SLOT_TOMBSTONE;
+                self -> size -= 1;
+                evicted += 1;
+            }
+        }
+        pthread_mutex_unlock(&self -> write_lock);
+    }
+
+    // the caller wants the memory back, so see it destroyed before returning.
+    // only our own evictions are waited for, not whatever else is queued
+    retire_sync();
+    if (valid == false){
+        errno = EINVAL;
+    }
+    return evicted;
+}
+
+bool prefault_map(hashmap_t *self, int threads) {
+    if (self == NULL || self -> invalid == true){
+        errno = EINVAL;
+        return false;
+    }
+    return table_prefault(self -> slots, self -> capacity, sizeof(map_slot_t), threads);
+}
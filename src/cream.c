@@ -2,86 +2,427 @@
 #include "cream.h"
 #include "utils.h"
 #include "queue.h"
+#include "clock.h"
+#include "dispatch.h"
+#include "codel.h"
+#include "slab.h"
+#include "arena.h"
+#include "store.h"
+#include "topology.h"
+#include "spsc.h"
+#include "reclaim.h"
+#include "snapshot.h"
+#include "wal.h"
+#include "hotkeys.h"
+#include "stats.h"
+#include "latency.h"
+#include <poll.h>
+#include <signal.h>
+#include <sys/eventfd.h>
 
+// in per-core mode, the most connections a core reads requests from at once.
+// past that it stops accepting until some of them are in
+#define CORE_MAX_READING 1024
 
-queue_t *queue;
-hashmap_t *hashmap;
+// an accepted connection waiting for a worker
+typedef struct connection_t {
+    int connfd;
+    uint64_t accepted;  // coarse_now_ms() when it was queued
+    uint64_t arrived;   // precise_now_ns() when it was accepted
+    uint64_t queued;    // precise_now_ns() when it last went into a queue or ring
+    request_header_t header;    // read by the first worker to pick it up
+    bool parsed;    // the header has been read, by a worker that then forwarded it
+    char *key;      // the key, if it was read early to find its shard (slab chunk), or NULL
+    char *val;      // a PUT's value, read early along with its key (slab chunk), or NULL
+    _Atomic int pending;    // for a CLEAR in per-core mode, the cores still clearing
+    size_t got;         // in per-core mode, how much of the request has come in so far
+    uint64_t parsed_at; // precise_now_ns() when all of its header had come in
+} connection_t;
+
+/*
+ * A core in per-core mode. It owns one shard of the store and its own
+ * listener, and is the only thread that ever serves its shard. Requests for
+ * other cores' keys are passed to them through SPSC rings.
+ */
+typedef struct core_t {
+    int listenfd;
+    int eventfd;            // written to wake the core while it waits in poll()
+    atomic_bool sleeping;
+    spsc_t **inbox;         // inbox[i] carries requests forwarded by core i
+    // connections whose requests haven't all come in yet. polled after the
+    // listener and the eventfd, in this order
+    connection_t **reading;
+    int num_reading;
+    struct pollfd *fds;
+} core_t;
+
+// a STATS response being put together
+typedef struct stats_response_t {
+    char *data;
+    size_t len;
+    size_t cap;
+    bool failed;    // it couldn't grow, so it's missing lines
+} stats_response_t;
+
+dispatcher_t *dispatcher;
+store_t *store;
+uint64_t codelTarget = CODEL_TARGET_MS;
+// with -n, the machine's NUMA nodes and the node every worker is pinned to
+bool numaMode = false;
+topology_t topology;
+int *workerNode;
+// with -T, one core_t per worker and nothing shared between them
+bool coreMode = false;
+core_t *cores;
+int numCores;
+// with -S, where SNAPSHOT requests write the map to
+char *snapshotPath = NULL;
+// with -w, the log every change goes to before it is answered
+wal_t *wal = NULL;
+// with -k, where the hottest keys are recorded, and how many of them
+char *hotKeysPath = NULL;
+uint32_t hotKeyCount = 0;
 
 
 void destroy_func(map_key_t key, map_val_t val) {
-    free(key.key_base);
-    free(val.val_base);
+    slab_free(key.key_base);
+    slab_free(val.val_base);
+}
+
+/*
+ * Slab rebalancer hook: throws out every entry living in a page that is
+ * being moved to another size class.
+ */
+int evict_page(const void *lo, const void *hi, void *arg){
+    int evicted = store_evict_range(store, lo, hi);
+    stats_add(STATS_REBALANCED, evicted);
+    return evicted;
 }
 
-void handleClear(int connfd){
-    clear_map(hashmap);
+/*
+ * Writes a store that lives in files out every STORE_CHECKPOINT_MS, so a
+ * crash of the machine (not just of us) loses at most that much.
+ */
+void *checkpointer(void *vargp){
+    while (1){
+        usleep(STORE_CHECKPOINT_MS * 1000);
+        if (store_checkpoint(store) == false){
+            fprintf(stderr, "checkpoint failed: %s\n", strerror(errno));
+        }
+    }
+    return NULL;
+}
 
-    response_header_t *response = calloc(1, sizeof(response_header_t));
-    response -> response_code = OK;
-    response -> value_size = 0;
+/*
+ * Records the hottest keys every HOTKEYS_INTERVAL_MS, and once more when
+ * we're told to stop. SIGINT and SIGTERM are blocked everywhere else, so
+ * this thread is the one that gets them.
+ */
+void *hot_key_recorder(void *vargp){
+    sigset_t stop;
+    sigemptyset(&stop);
+    sigaddset(&stop, SIGINT);
+    sigaddset(&stop, SIGTERM);
+    struct timespec interval = {.tv_sec = HOTKEYS_INTERVAL_MS / 1000, .tv_nsec = (HOTKEYS_INTERVAL_MS % 1000) * 1000000L};
+    while (1){
+        int sig = sigtimedwait(&stop, NULL, &interval);
+        if (sig < 0 && errno == EINTR){
+            continue;
+        }
+        if (save_hot_keys(store, hotKeysPath, hotKeyCount) == false){
+            fprintf(stderr, "%s: %s\n", hotKeysPath, strerror(errno));
+        }
+        if (sig > 0){
+            exit(EXIT_SUCCESS);
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Turns a connection away without reading its request.
+ */
+void handleBusy(int connfd){
+    response_header_t response = {.response_code = SERVER_BUSY, .value_size = 0};
+    write(connfd, &response, sizeof(response));
+    stats_add(STATS_SHED, 1);
+}
+
+/*
+ * Hangs up on a connection and lets go of it.
+ */
+void close_connection(connection_t *conn){
+    Close(conn -> connfd);
+    free(conn);
+    stats_add(STATS_CLOSED, 1);
+}
+
+/*
+ * Logs a change. Call it with the change's order lock held, see wal_lock().
+ *
+ * @return What to pass to wait_logged(), 0 if it couldn't be logged
+ */
+uint64_t log_change(uint32_t op, const void *key, uint32_t key_len, const void *val, uint32_t val_len){
+    if (wal == NULL){
+        return 1;
+    }
+    return wal_append(wal, op, key, key_len, val, val_len);
+}
+
+/*
+ * Waits until a change is as durable as the log's policy makes it. Call it
+ * after letting go of the order lock, the log thread may need it to rotate.
+ *
+ * @return true if it is (or there's no log), false otherwise
+ */
+bool wait_logged(uint64_t lsn){
+    if (lsn == 0){
+        return false;
+    }
+    return wal == NULL || wal_wait(wal, lsn) == true;
+}
+
+/*
+ * Builds a response header in the request's arena.
+ */
+response_header_t *make_response(arena_t *arena, uint32_t code, uint32_t value_size){
+    response_header_t *response = arena_alloc(arena, sizeof(response_header_t));
+    response -> response_code = code;
+    response -> value_size = value_size;
+    return response;
+}
+
+void handleClear(arena_t *arena, int connfd){
+    // every shard at once, so no change lands on either side of the clear
+    // in the log but on the other in the store
+    wal_lock(wal, -1);
+    store_clear(store);
+    uint64_t lsn = log_change(WAL_CLEAR, NULL, 0, NULL, 0);
+    wal_unlock(wal, -1);
+    bool logged = wait_logged(lsn);
+    latency_stage(LATENCY_MAP);
+
+    response_header_t *response = make_response(arena, logged == true ? OK : BAD_REQUEST, 0);
     write(connfd, response, sizeof(response));
-    free(response);
+    latency_stage(LATENCY_WRITE);
 }
 
-void handleEvict(int connfd, int key_size){
-    char *key_ptr = malloc(key_size);
-    read (connfd, key_ptr, key_size);
-    delete(hashmap, MAP_KEY(key_ptr, key_size));
+void handleSnapshot(arena_t *arena, int connfd){
+    // nowhere to put it unless we were started with -S
+    uint32_t code = OK;
+    if (snapshotPath == NULL){
+        code = UNSUPPORTED;
+    }
+    // a child writes it, we only wait for the fork
+    else if (fork_snapshot(store, snapshotPath) == false){
+        code = errno == EBUSY ? SERVER_BUSY : BAD_REQUEST;
+    }
+    latency_stage(LATENCY_MAP);
 
-    response_header_t *response = calloc(1, sizeof(response_header_t));
-    response -> response_code = OK;
-    response -> value_size = 0;
+    response_header_t *response = make_response(arena, code, 0);
     write(connfd, response, sizeof(response));
-    free(response);
+    latency_stage(LATENCY_WRITE);
 }
 
-void handleGet(int connfd, int key_size){
-    char *key_ptr = malloc(key_size);
-    read (connfd, key_ptr, key_size);
-    map_val_t val = get(hashmap, MAP_KEY(key_ptr, key_size));
+/*
+ * Appends a line of a STATS response, making room for it if it has to. If
+ * there's no room to be had, the response is marked failed rather than cut
+ * short.
+ */
+void add_stat(stats_response_t *response, const char *name, uint64_t value){
+    while (response -> failed == false){
+        size_t room = response -> cap - response -> len;
+        int added = response -> data == NULL ? -1 : snprintf(response -> data + response -> len, room, "%s=%lu\n", name, value);
+        if (added >= 0 && (size_t) added < room){
+            response -> len += added;
+            return;
+        }
+        size_t cap = response -> cap == 0 ? STATS_RESPONSE_SIZE : response -> cap * 2;
+        char *data = realloc(response -> data, cap);
+        if (data == NULL){
+            response -> failed = true;
+            return;
+        }
+        response -> data = data;
+        response -> cap = cap;
+    }
+}
+
+void handleStats(arena_t *arena, int connfd){
+    // the counters, added up across threads, then what the store and the
+    // queues look like right now. one name=value per line
+    uint64_t totals[STATS_COUNTERS];
+    stats_sum(totals);
+    // it can outgrow the arena, so it's on the heap
+    stats_response_t buf = {0};
+    for (int i = 0; i < STATS_COUNTERS; i++){
+        add_stat(&buf, stats_name(i), totals[i]);
+    }
+    add_stat(&buf, "connections", totals[STATS_ACCEPTED] - totals[STATS_CLOSED]);
+    add_stat(&buf, "size", store_size(store));
+    add_stat(&buf, "capacity", store_capacity(store));
+    add_stat(&buf, "tombstones", store_tombstones(store));
+    // per-core mode has no queues, only the rings between cores
+    if (dispatcher != NULL){
+        add_stat(&buf, "queue_depth", dispatch_depth(dispatcher));
+    }
+    // where the rebalancer moved pages, by chunk size. classes that never
+    // had a page are left out
+    slab_class_t slabClass;
+    for (int i = 0; i < slab_num_classes() && slab_class_stats(i, &slabClass) == true; i++){
+        if (slabClass.pages == 0 && slabClass.moved_in == 0 && slabClass.moved_out == 0){
+            continue;
+        }
+        char name[64];
+        snprintf(name, sizeof(name), "slab_%zu_moved_in", slabClass.size);
+        add_stat(&buf, name, slabClass.moved_in);
+        snprintf(name, sizeof(name), "slab_%zu_moved_out", slabClass.size);
+        add_stat(&buf, name, slabClass.moved_out);
+    }
+    // then where the time went, for every request code and stage seen so far.
+    // a histogram doesn't fit in the arena
+    latency_hist_t *hist = malloc(sizeof(latency_hist_t));
+    buf.failed = buf.failed == true || hist == NULL;
+    for (int i = 0; buf.failed == false && i < LATENCY_HISTOGRAMS; i++){
+        latency_merge(i, hist);
+        if (hist -> total == 0){
+            continue;
+        }
+        char name[64];
+        snprintf(name, sizeof(name), "%s_p50_ns", latency_name(i));
+        add_stat(&buf, name, latency_percentile(hist, 50));
+        snprintf(name, sizeof(name), "%s_p99_ns", latency_name(i));
+        add_stat(&buf, name, latency_percentile(hist, 99));
+        snprintf(name, sizeof(name), "%s_p999_ns", latency_name(i));
+        add_stat(&buf, name, latency_percentile(hist, 99.9));
+    }
+    free(hist);
+    latency_stage(LATENCY_MAP);
+
+    // half a response would look like a whole one with lines missing
+    if (buf.failed == true){
+        response_header_t *response = make_response(arena, SERVER_BUSY, 0);
+        write(connfd, response, sizeof(response));
+    }
+    else{
+        response_header_t *response = make_response(arena, OK, buf.len);
+        write(connfd, response, sizeof(response));
+        write(connfd, buf.data, buf.len);
+    }
+    free(buf.data);
+    latency_stage(LATENCY_WRITE);
+}
+
+void handleEvict(arena_t *arena, int connfd, int key_size, char *key){
+    // the key only has to live until the map is done looking for it
+    char *key_ptr = key;
+    if (key_ptr == NULL){
+        key_ptr = arena_alloc(arena, key_size);
+        read (connfd, key_ptr, key_size);
+        latency_stage(LATENCY_READ);
+    }
+    int shard = store_shard_of(store, MAP_KEY(key_ptr, key_size));
+    wal_lock(wal, shard);
+    store_evict(store, MAP_KEY(key_ptr, key_size));
+    uint64_t lsn = log_change(WAL_EVICT, key_ptr, key_size, NULL, 0);
+    wal_unlock(wal, shard);
+    bool logged = wait_logged(lsn);
+    latency_stage(LATENCY_MAP);
+
+    response_header_t *response = make_response(arena, logged == true ? OK : BAD_REQUEST, 0);
+    write(connfd, response, sizeof(response));
+    latency_stage(LATENCY_WRITE);
+}
+
+void handleGet(arena_t *arena, int connfd, int key_size, char *key){
+    // the key may have been read already, to find out where to send the request
+    char *key_ptr = key;
+    if (key_ptr == NULL){
+        key_ptr = arena_alloc(arena, key_size);
+        read (connfd, key_ptr, key_size);
+        latency_stage(LATENCY_READ);
+    }
+    // a PUT or EVICT of the same key may retire the value as soon as the
+    // map lets go of it, so copy it out before leaving the read section and
+    // write the copy. the arena has room for the largest value there is
+    reclaim_enter();
+    map_val_t val = store_get(store, MAP_KEY(key_ptr, key_size));
+    if (val.val_len != 0){
+        char *copy = arena_alloc(arena, val.val_len);
+        if (copy != NULL){
+            memcpy(copy, val.val_base, val.val_len);
+        }
+        val = MAP_VAL(copy, copy == NULL ? 0 : val.val_len);
+    }
+    reclaim_exit();
+    stats_add(val.val_len == 0 ? STATS_MISSES : STATS_HITS, 1);
+    latency_stage(LATENCY_MAP);
 
-    response_header_t * response = calloc(1, sizeof(response_header_t));
     if (val.val_len == 0){
-        response -> response_code = BAD_REQUEST;
-        response -> value_size = 0;
+        response_header_t *response = make_response(arena, BAD_REQUEST, 0);
         write(connfd, response, sizeof(response));
     }
 
     else{
-        response -> response_code = OK;
-        response -> value_size = val.val_len;
+        response_header_t *response = make_response(arena, OK, val.val_len);
         write(connfd, response, sizeof(response));
         write(connfd, val.val_base, val.val_len);
     }
-    free(response);
+    latency_stage(LATENCY_WRITE);
 }
 
-void handlePut(int connfd, int key_size, int value_size){
-    // malloc for the key and value
-    char *key_ptr = malloc(key_size);
-    char *val_ptr = malloc(value_size);
+void handlePut(arena_t *arena, int connfd, int key_size, int value_size, char *key, char *val){
+    // the key and value live in slab chunks in the map until destroy_func.
+    // they may have been read already, to find out where to send the request
+    char *key_ptr = key;
+    char *val_ptr = val;
+    int read1 = key_size;
+    int read2 = value_size;
+    bool putted = false;
+    bool logged = false;
 
-    int read1 = read(connfd, key_ptr, key_size);
-    int read2 = read(connfd, val_ptr, value_size);
-    bool putted = put(hashmap, MAP_KEY(key_ptr, key_size), MAP_VAL(val_ptr, value_size), true);
+    if (key_ptr == NULL){
+        key_ptr = slab_alloc(key_size);
+        val_ptr = slab_alloc(value_size);
+        if (key_ptr != NULL && val_ptr != NULL){
+            read1 = read(connfd, key_ptr, key_size);
+            read2 = read(connfd, val_ptr, value_size);
+        }
+        latency_stage(LATENCY_READ);
+    }
 
-    // the next key_size bytes are the key, so read them
-    // send back a response after putting
-    response_header_t *response = calloc(1, sizeof(response_header_t) + 1);
-    if (putted == true){
-        response -> response_code = OK;
-        response -> value_size = 0;
+    // logged before the map takes them, since afterwards they may be evicted
+    // and freed under us. a put that didn't happen is taken back. both under
+    // the shard's order lock, so another change to the key can't get between
+    if (key_ptr != NULL && val_ptr != NULL){
+        int shard = store_shard_of(store, MAP_KEY(key_ptr, key_size));
+        wal_lock(wal, shard);
+        uint64_t lsn = log_change(WAL_PUT, key_ptr, key_size, val_ptr, value_size);
+        if (lsn != 0){
+            putted = store_put(store, MAP_KEY(key_ptr, key_size), MAP_VAL(val_ptr, value_size), true);
+            if (putted == false){
+                log_change(WAL_EVICT, key_ptr, key_size, NULL, 0);
+            }
+        }
+        wal_unlock(wal, shard);
+        // the map has it either way, the client hears whether it's durable
+        logged = putted == true && wait_logged(lsn) == true;
     }
 
-    //else, there was an error while putting
-    else{
-        response -> response_code = BAD_REQUEST;
-        response -> value_size = 0;
+    // the map didn't take them, so they're still ours to give back
+    if (putted == false){
+        slab_free(key_ptr);
+        slab_free(val_ptr);
     }
+    latency_stage(LATENCY_MAP);
+
+    // send back a response after putting. if the map didn't take it,
+    // or it couldn't be logged, there was an error while putting
+    response_header_t *response = make_response(arena, logged == true ? OK : BAD_REQUEST, 0);
 
     // send the header
     int count = write(connfd, response, sizeof(response));
-    free(response);
+    latency_stage(LATENCY_WRITE);
 
     // temp post, please ignore
     if (read1 <= 0 || read2 <= 0 || count <= 0){
@@ -89,20 +430,46 @@ void handlePut(int connfd, int key_size, int value_size){
     }
 }
 
-void handle_request(int connfd){
-    // alocate space for header
-    bool isInvalid = false;
-    request_header_t *header = calloc(1, sizeof(request_header_t));
-    int count = read(connfd, header, sizeof(request_header_t));
+/*
+ * @return The counter a request code is counted in
+ */
+int request_counter(uint8_t request_code){
+    switch (request_code){
+        case PUT:
+            return STATS_PUT;
+        case GET:
+            return STATS_GET;
+        case EVICT:
+            return STATS_EVICT;
+        case CLEAR:
+            return STATS_CLEAR;
+        case SNAPSHOT:
+            return STATS_SNAPSHOT;
+        case STATS:
+            return STATS_STATS;
+        default:
+            return STATS_UNSUPPORTED;
+    }
+}
 
-    if (count < 0){
+/*
+ * Answers one request. Everything the request needs for parsing and for the
+ * response comes out of the worker's arena, which the caller resets afterwards.
+ * key and val are the request's key and value if they were already read off
+ * the socket, or NULL. They're slab chunks, and this takes them over.
+ *
+ * @return The counter the request was counted in, see stats.h
+ */
+int handle_request(arena_t *arena, int connfd, request_header_t *header, char *key, char *val){
+    bool isInvalid = false;
 
-    }
     // if we are putting
     if (header -> request_code == PUT){
         // first check the sizes of the key and val. if its too big, handle put
         if (header -> key_size >= MIN_KEY_SIZE && header -> key_size <= MAX_KEY_SIZE && header -> value_size >= MIN_VALUE_SIZE && header -> value_size <= MAX_VALUE_SIZE){
-            handlePut(connfd, header -> key_size, header -> value_size);
+            handlePut(arena, connfd, header -> key_size, header -> value_size, key, val);
+            key = NULL;
+            val = NULL;
         }
         else{
             isInvalid = true;
@@ -111,7 +478,7 @@ void handle_request(int connfd){
 
     else if (header -> request_code == GET){
         if (header -> key_size >= MIN_KEY_SIZE && header -> key_size <= MAX_KEY_SIZE){
-            handleGet(connfd, header -> key_size);
+            handleGet(arena, connfd, header -> key_size, key);
         }
         else{
             isInvalid = true;
@@ -120,7 +487,7 @@ void handle_request(int connfd){
 
     else if (header -> request_code == EVICT){
         if (header -> key_size >= MIN_KEY_SIZE && header -> key_size <= MAX_KEY_SIZE){
-            handleEvict(connfd, header -> key_size);
+            handleEvict(arena, connfd, header -> key_size, key);
         }
         else{
             isInvalid = true;
@@ -128,62 +495,666 @@ void handle_request(int connfd){
     }
 
     else if (header -> request_code == CLEAR){
-        handleClear(connfd);
+        handleClear(arena, connfd);
+    }
+
+    else if (header -> request_code == SNAPSHOT){
+        handleSnapshot(arena, connfd);
+    }
+
+    else if (header -> request_code == STATS){
+        handleStats(arena, connfd);
     }
 
     // else the header code is something weird, so we don't support it
     else{
-        response_header_t *response = calloc(1, sizeof(response_header_t) + 1);
-        response -> response_code = UNSUPPORTED;
-        response -> value_size = 0;
+        response_header_t *response = make_response(arena, UNSUPPORTED, 0);
+        write(connfd, response, sizeof(response));
+        latency_stage(LATENCY_WRITE);
     }
 
     // if it turns out that we matched a header, but the size wasn't valid, its a bad request
     if (isInvalid == true){
-        response_header_t *response = calloc(1, sizeof(response_header_t) + 1);
-        response -> response_code = BAD_REQUEST;
-        response -> value_size = 0;
+        response_header_t *response = make_response(arena, BAD_REQUEST, 0);
+        write(connfd, response, sizeof(response));
+        latency_stage(LATENCY_WRITE);
     }
+    int counter = isInvalid == true ? STATS_BAD_REQUEST : request_counter(header -> request_code);
+    stats_add(counter, 1);
 
-    // free the allocated header
-    free(header);
+    // only a PUT keeps them
+    slab_free(key);
+    slab_free(val);
+    return counter;
+}
+
+/*
+ * Picks the lane a request waits in. Reads are cheap and latency critical,
+ * CLEAR walks the whole map, and a PUT may have to scan for something to evict.
+ */
+int request_lane(uint8_t request_code){
+    if (request_code == PUT || request_code == EVICT){
+        return DISPATCH_LANE_WRITE;
+    }
+    // STATS counts every shard's tombstones
+    if (request_code == CLEAR || request_code == SNAPSHOT || request_code == STATS){
+        return DISPATCH_LANE_BULK;
+    }
+    // GET, and anything we're about to reject, is cheap
+    return DISPATCH_LANE_READ;
 }
 
 void* thread(void* vargp){
+    // each worker knows its own id so it can pull from its own queue first
+    int worker = (int) (intptr_t) vargp;
+    // and sheds load from its own queue, so the codel state is private too
+    codel_t codel;
+    init_codel(&codel, codelTarget, CODEL_INTERVAL_MS);
+    // scratch space for parsing and answering, reused for every request
+    arena_t arena;
+    if (init_arena(&arena, ARENA_SIZE) == false){
+        return NULL;
+    }
+    // stay on one core of our node, so the shard we serve stays local
+    if (numaMode == true){
+        pin_thread_to_cpu(topology_cpu(&topology, workerNode[worker], worker / topology.num_nodes));
+    }
+
     while(1){
-        void* ptr = dequeue(queue);
-        int connfd = *(int*)ptr; //(*(int*)dequeue(queue));
-        // do work here. Connection gets closed after client sends the word 'exit' or if there is some error
-        handle_request(connfd);
-        Close(connfd);
+        // about to go idle, so don't keep what we retired to ourselves, nor
+        // the free chunks in our slab cache: while we're parked we'd never
+        // notice the rebalancer waiting for them
+        if (dispatch_depth(dispatcher) == 0){
+            retire_flush();
+            slab_flush_cache();
+        }
+        // never idle, so if the reclaimer falls too far behind we pay it off
+        else{
+            retire_catch_up();
+        }
+        int lane;
+        connection_t *conn = dispatch_next(dispatcher, worker, &lane);
+        if (conn == NULL){
+            continue;
+        }
+        // the time it waited is a stage of its own
+        latency_record(LATENCY_QUEUE, latency_start() - conn -> queued);
+
+        // new connections come in on the read lane. we don't know what they
+        // want yet, so read the header and find out which lane they belong in.
+        // a GET forwarded from another node was already read, just answer it
+        if (lane == DISPATCH_LANE_READ && conn -> parsed == false){
+            // if the queue has been standing for too long, fail this one fast
+            // instead of making everyone behind it wait even longer
+            if (codel_should_drop(&codel, conn -> accepted, coarse_now_ms()) == true){
+                handleBusy(conn -> connfd);
+                close_connection(conn);
+                continue;
+            }
+
+            if (read(conn -> connfd, &conn -> header, sizeof(request_header_t)) != sizeof(request_header_t)){
+                close_connection(conn);
+                continue;
+            }
+            latency_stage(LATENCY_PARSE);
+
+            // with a shard per node, a GET is answered on the node that owns its
+            // key, so the lookup never crosses sockets. writes aren't routed:
+            // they wait in the shared write lane so a burst of them can't take
+            // a node's workers from its reads, and where their value ends up
+            // is up to the slab, which isn't split by node either way
+            if (numaMode == true && conn -> header.request_code == GET &&
+                conn -> header.key_size >= MIN_KEY_SIZE && conn -> header.key_size <= MAX_KEY_SIZE){
+                conn -> key = slab_alloc(conn -> header.key_size);
+                if (conn -> key == NULL || read(conn -> connfd, conn -> key, conn -> header.key_size) != conn -> header.key_size){
+                    slab_free(conn -> key);
+                    close_connection(conn);
+                    continue;
+                }
+                conn -> parsed = true;
+                latency_stage(LATENCY_READ);
+                int node = store_shard_of(store, MAP_KEY(conn -> key, conn -> header.key_size));
+                conn -> queued = precise_now_ns();
+                if (node != workerNode[worker] && dispatch_group(dispatcher, node, conn) == true){
+                    continue;
+                }
+            }
+
+            // reads are served right away. anything heavier waits its turn in
+            // its own lane, unless that lane is full
+            int requestLane = request_lane(conn -> header.request_code);
+            conn -> queued = precise_now_ns();
+            if (requestLane != DISPATCH_LANE_READ && dispatch_lane(dispatcher, requestLane, conn) == true){
+                continue;
+            }
+        }
+
+        // do work here. Connection gets closed after the request is answered
+        int counter = handle_request(&arena, conn -> connfd, &conn -> header, conn -> key, conn -> val);
+        latency_record(counter, precise_now_ns() - conn -> arrived);
+        arena_reset(&arena);
+        close_connection(conn);
+        dispatch_done(dispatcher, lane);
+    }
+}
+
+/*
+ * Sets up for whatever follows the header: slab chunks for the key, and the
+ * value for a PUT. Requests with sizes out of range are left alone,
+ * handle_request() turns them away.
+ *
+ * @return false if the connection should be dropped
+ */
+bool start_body(connection_t *conn){
+    request_header_t *header = &conn -> header;
+    if (header -> request_code != GET && header -> request_code != EVICT && header -> request_code != PUT){
+        return true;
+    }
+    if (header -> key_size < MIN_KEY_SIZE || header -> key_size > MAX_KEY_SIZE){
+        return true;
+    }
+    if (header -> request_code == PUT && (header -> value_size < MIN_VALUE_SIZE || header -> value_size > MAX_VALUE_SIZE)){
+        return true;
+    }
+
+    conn -> key = slab_alloc(header -> key_size);
+    if (header -> request_code == PUT){
+        conn -> val = slab_alloc(header -> value_size);
+    }
+    if (conn -> key == NULL || (header -> request_code == PUT && conn -> val == NULL)){
+        slab_free(conn -> key);
+        slab_free(conn -> val);
+        conn -> key = NULL;
+        conn -> val = NULL;
+        return false;
+    }
+    return true;
+}
+
+/*
+ * Reads whatever has come in of a request, and picks up where the last call
+ * left off: the header, then the key and value start_body() made room for.
+ * The socket is non-blocking, so a client that sends slowly doesn't hold up
+ * the core.
+ *
+ * @return 1 once the whole request is in, 0 if more has to come, -1 if the
+ *         connection should be dropped
+ */
+int read_request(connection_t *conn){
+    request_header_t *header = &conn -> header;
+    size_t headerSize = sizeof(request_header_t);
+    while (1){
+        char *dest;
+        size_t want;
+        size_t body = conn -> got - headerSize;
+        if (conn -> got < headerSize){
+            dest = (char *) header + conn -> got;
+            want = headerSize - conn -> got;
+        }
+        else if (conn -> key != NULL && body < header -> key_size){
+            dest = conn -> key + body;
+            want = header -> key_size - body;
+        }
+        else if (conn -> val != NULL && body - header -> key_size < header -> value_size){
+            dest = conn -> val + body - header -> key_size;
+            want = header -> value_size - (body - header -> key_size);
+        }
+        else{
+            return 1;
+        }
+
+        ssize_t got = read(conn -> connfd, dest, want);
+        if (got < 0 && errno == EINTR){
+            continue;
+        }
+        if (got < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)){
+            return 0;
+        }
+        if (got <= 0){
+            return -1;
+        }
+        conn -> got += got;
+
+        // the header's in, so now we know what follows it. other connections
+        // were read in between, so the stages are timed per connection
+        if (conn -> got == headerSize){
+            conn -> parsed_at = precise_now_ns();
+            latency_record(LATENCY_PARSE, conn -> parsed_at - conn -> arrived);
+            if (start_body(conn) == false){
+                return -1;
+            }
+        }
     }
 }
 
+/*
+ * Drops a connection whose request hadn't all come in.
+ */
+void drop_reading(connection_t *conn){
+    slab_free(conn -> key);
+    slab_free(conn -> val);
+    close_connection(conn);
+}
+
+/*
+ * Opens one of the per-core listeners. They all bind the same port, and the
+ * kernel spreads incoming connections across them. Non-blocking, so a core
+ * can go back to its inbox when there is nobody to accept.
+ */
+int open_core_listenfd(char *port){
+    struct addrinfo hints, *listp, *p;
+    int listenfd = -1, optval = 1;
+
+    memset(&hints, 0, sizeof(struct addrinfo));
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE | AI_NUMERICSERV | AI_ADDRCONFIG;
+    Getaddrinfo(NULL, port, &hints, &listp);
+
+    for (p = listp; p; p = p -> ai_next){
+        listenfd = socket(p -> ai_family, p -> ai_socktype | SOCK_NONBLOCK, p -> ai_protocol);
+        if (listenfd < 0){
+            continue;
+        }
+        Setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, (const void *) &optval, sizeof(int));
+        Setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT, (const void *) &optval, sizeof(int));
+        if (bind(listenfd, p -> ai_addr, p -> ai_addrlen) == 0){
+            break;
+        }
+        Close(listenfd);
+    }
+
+    Freeaddrinfo(listp);
+    if (!p || listen(listenfd, LISTENQ) < 0){
+        return -1;
+    }
+    return listenfd;
+}
+
+/*
+ * Wakes a core if it is asleep in poll().
+ */
+void wake_core(core_t *core){
+    // pairs with the fence in core_thread(). either we see it asleep, or it
+    // sees what we just pushed when it checks its inbox one last time
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&core -> sleeping, memory_order_relaxed) == true){
+        uint64_t one = 1;
+        write(core -> eventfd, &one, sizeof(one));
+    }
+}
+
+/*
+ * Runs a request against this core's shard and answers it. Without a log, a
+ * CLEAR is sent to every core, and the last one to clear its shard answers it.
+ * With one, the core that got it clears every shard, see handleClear().
+ */
+void serve(int self, connection_t *conn, arena_t *arena){
+    int counter = STATS_CLEAR;
+    if (conn -> header.request_code == CLEAR && wal == NULL){
+        clear_map(store -> shards[self]);
+        latency_stage(LATENCY_MAP);
+        if (atomic_fetch_sub(&conn -> pending, 1) != 1){
+            return;
+        }
+        response_header_t *response = make_response(arena, OK, 0);
+        write(conn -> connfd, response, sizeof(response));
+        latency_stage(LATENCY_WRITE);
+        stats_add(STATS_CLEAR, 1);
+    }
+    else{
+        counter = handle_request(arena, conn -> connfd, &conn -> header, conn -> key, conn -> val);
+    }
+    latency_record(counter, precise_now_ns() - conn -> arrived);
+    arena_reset(arena);
+    close_connection(conn);
+}
+
+/*
+ * Serves everything other cores have forwarded to us.
+ *
+ * @return How many requests were served
+ */
+int serve_inbox(int self, arena_t *arena){
+    int served = 0;
+    for (int i = 0; i < numCores; i++){
+        if (i == self){
+            continue;
+        }
+        connection_t *conn;
+        while ((conn = spsc_pop(cores[self].inbox[i])) != NULL){
+            latency_record(LATENCY_QUEUE, latency_start() - conn -> queued);
+            serve(self, conn, arena);
+            served += 1;
+        }
+    }
+    return served;
+}
+
+/*
+ * Passes a request to the core that owns it. If that core's ring is full, we
+ * keep serving our own inbox while we wait, so two cores that are both
+ * forwarding to each other can't wait on each other forever.
+ */
+void forward(int self, int owner, connection_t *conn, arena_t *arena){
+    conn -> queued = precise_now_ns();
+    while (spsc_push(cores[owner].inbox[self], conn) == false){
+        serve_inbox(self, arena);
+        sched_yield();
+    }
+    wake_core(&cores[owner]);
+}
+
+/*
+ * Sends a request that has all come in to the core whose shard the key is
+ * in, or serves it here.
+ */
+void route(int self, connection_t *conn, arena_t *arena){
+    if (conn -> key != NULL){
+        latency_record(LATENCY_READ, precise_now_ns() - conn -> parsed_at);
+    }
+    latency_start();
+    // the response is written in one go, as in the other modes. the socket's
+    // buffer almost always takes it straight away
+    fcntl(conn -> connfd, F_SETFL, fcntl(conn -> connfd, F_GETFL) & ~O_NONBLOCK);
+
+    // every core clears its own shard. with a log, the clear has to go in
+    // between the same changes in the log as in the store, so it's done in
+    // one go, with every shard's order lock held
+    if (conn -> header.request_code == CLEAR && wal == NULL){
+        atomic_init(&conn -> pending, numCores);
+        for (int i = 0; i < numCores; i++){
+            if (i != self){
+                forward(self, i, conn, arena);
+            }
+        }
+        serve(self, conn, arena);
+        return;
+    }
+
+    // requests without a (valid) key get turned away right here
+    int owner = self;
+    if (conn -> key != NULL){
+        owner = store_shard_of(store, MAP_KEY(conn -> key, conn -> header.key_size));
+    }
+    if (owner == self){
+        serve(self, conn, arena);
+    }
+    else{
+        forward(self, owner, conn, arena);
+    }
+}
+
+/*
+ * Accepts a connection and reads what it has sent so far. If that isn't the
+ * whole request, the core keeps reading it between other work.
+ *
+ * @return false if there was nobody waiting to be accepted
+ */
+bool accept_one(int self, arena_t *arena){
+    core_t *core = &cores[self];
+    int connfd = accept(core -> listenfd, NULL, NULL);
+    if (connfd < 0){
+        return false;
+    }
+    // it doesn't take after the listener
+    fcntl(connfd, F_SETFL, fcntl(connfd, F_GETFL) | O_NONBLOCK);
+
+    connection_t *conn = Malloc(sizeof(connection_t));
+    conn -> connfd = connfd;
+    conn -> arrived = latency_start();
+    conn -> parsed = true;
+    conn -> key = NULL;
+    conn -> val = NULL;
+    conn -> got = 0;
+    stats_add(STATS_ACCEPTED, 1);
+
+    int read = read_request(conn);
+    if (read < 0){
+        drop_reading(conn);
+    }
+    else if (read == 0){
+        core -> reading[core -> num_reading++] = conn;
+    }
+    else{
+        route(self, conn, arena);
+    }
+    return true;
+}
+
+/*
+ * Waits up to timeout milliseconds (as in poll()) for a new connection, more
+ * of a request we're reading, or a wakeup, then gets on with what came.
+ *
+ * @return How many connections were accepted or had their request come in
+ */
+int poll_connections(int self, arena_t *arena, int timeout){
+    core_t *core = &cores[self];
+    int numReading = core -> num_reading;
+    // stop accepting while we're reading as many as we keep track of
+    core -> fds[0].fd = numReading < CORE_MAX_READING ? core -> listenfd : -1;
+    for (int i = 0; i < numReading; i++){
+        core -> fds[2 + i] = (struct pollfd) {.fd = core -> reading[i] -> connfd, .events = POLLIN};
+    }
+    if (poll(core -> fds, 2 + numReading, timeout) <= 0){
+        return 0;
+    }
+    if (core -> fds[1].revents & POLLIN){
+        uint64_t count;
+        read(core -> eventfd, &count, sizeof(count));
+    }
+
+    // backwards, so the last one moving into a finished one's place was
+    // already looked at
+    int done = 0;
+    for (int i = numReading - 1; i >= 0; i--){
+        if (core -> fds[2 + i].revents == 0){
+            continue;
+        }
+        connection_t *conn = core -> reading[i];
+        int read = read_request(conn);
+        if (read == 0){
+            continue;
+        }
+        core -> reading[i] = core -> reading[--core -> num_reading];
+        if (read < 0){
+            drop_reading(conn);
+            continue;
+        }
+        route(self, conn, arena);
+        done += 1;
+    }
+
+    // everyone who's waiting, as long as there's room for them
+    while ((core -> fds[0].revents & POLLIN) && core -> num_reading < CORE_MAX_READING && accept_one(self, arena) == true){
+        done += 1;
+    }
+    return done;
+}
+
+/*
+ * A core in per-core mode. It serves what other cores forwarded, accepts new
+ * connections, and sleeps in poll() when there is neither.
+ */
+void *core_thread(void *vargp){
+    int self = (int) (intptr_t) vargp;
+    core_t *core = &cores[self];
+    pin_thread_to_cpu(topology_cpu(&topology, workerNode[self], self / topology.num_nodes));
+
+    arena_t arena;
+    if (init_arena(&arena, ARENA_SIZE) == false){
+        return NULL;
+    }
+
+    while (1){
+        int work = serve_inbox(self, &arena);
+        work += poll_connections(self, &arena, 0);
+        if (work > 0){
+            retire_catch_up();
+            continue;
+        }
+
+        // nothing to do. say we're going to sleep, then look one last time
+        atomic_store(&core -> sleeping, true);
+        atomic_thread_fence(memory_order_seq_cst);
+        bool empty = true;
+        for (int i = 0; i < numCores && empty == true; i++){
+            empty = i == self || spsc_empty(core -> inbox[i]);
+        }
+        if (empty == true){
+            retire_flush();
+            slab_flush_cache();
+            poll_connections(self, &arena, -1);
+        }
+        atomic_store(&core -> sleeping, false);
+    }
+}
+
+/*
+ * Sets up a core_t for every worker: a listener, a wakeup eventfd and a ring
+ * from every other core.
+ */
+void create_cores(int num_cores, char *port){
+    numCores = num_cores;
+    cores = Calloc(num_cores, sizeof(core_t));
+    for (int i = 0; i < num_cores; i++){
+        cores[i].listenfd = open_core_listenfd(port);
+        cores[i].eventfd = eventfd(0, EFD_NONBLOCK);
+        cores[i].inbox = Calloc(num_cores, sizeof(spsc_t *));
+        cores[i].reading = Calloc(CORE_MAX_READING, sizeof(connection_t *));
+        cores[i].fds = Calloc(CORE_MAX_READING + 2, sizeof(struct pollfd));
+        if (cores[i].listenfd < 0 || cores[i].eventfd < 0){
+            exit(EXIT_FAILURE);
+        }
+        cores[i].fds[0] = (struct pollfd) {.fd = cores[i].listenfd, .events = POLLIN};
+        cores[i].fds[1] = (struct pollfd) {.fd = cores[i].eventfd, .events = POLLIN};
+        atomic_init(&cores[i].sleeping, false);
+        for (int from = 0; from < num_cores; from++){
+            if (from != i && (cores[i].inbox[from] = create_spsc()) == NULL){
+                exit(EXIT_FAILURE);
+            }
+        }
+    }
+}
+
+void usage(void){
+    printf("%s\n", "./cream [-h] [-s SPINS] [-q DEPTH] [-t TARGET_MS] [-m MEGABYTES] [-p THREADS] [-n] [-T] [-S FILE [-R]] [-w FILE [-y POLICY]] [-P FILE] [-c FILE] [-k FILE] NUM_WORKERS PORT_NUMBER MAX_ENTRIES\n"
+                   "-h                 Displays this help menu and returns EXIT_SUCCESS.\n"
+                   "-s SPINS           How many times an idle worker polls for work before it sleeps.\n"
+                   "-q DEPTH           How many connections may wait for a worker before new ones are turned away.\n"
+                   "-t TARGET_MS       Queueing delay above which connections are shed (0 turns shedding off).\n"
+                   "-m MEGABYTES       The most memory keys and values may take up.\n"
+                   "-p THREADS         Fault in the whole map with this many threads before listening.\n"
+                   "-n                 Give every NUMA node its own shard of the map and pin workers to its cores.\n"
+                   "-T                 Run one thread per core, each with its own listener and its own shard of the map.\n"
+                   "-S FILE            Where a SNAPSHOT request writes the map to, from a forked child.\n"
+                   "-R                 Load the map from the -S file before listening.\n"
+                   "-w FILE            Log every change to FILE before answering it, and rebuild the map from it on startup.\n"
+                   "-y POLICY          When the log is synced: always (the default), never, or every POLICY milliseconds.\n"
+                   "-P FILE            Keep the map in files named after FILE, and pick up from them on startup (make persist only).\n"
+                   "-c FILE            Move the coldest values to files named after FILE once they pass 60% of -m (make ec only).\n"
+                   "-k FILE            Record the hottest keys to FILE every minute and on exit, and reload them from the -S file on startup (make ec only).\n"
+                   "NUM_WORKERS        The number of worker threads used to service requests.\n"
+                   "PORT_NUMBER        Port number to listen on for incoming connections.\n"
+                   "MAX_ENTRIES        The maximum number of entries that can be stored in `cream`'s underlying data store.\n");
+}
+
 int main(int argc, char *argv[]) {
-    // first thing is to check if arg2 is -h
+    // first thing is to check if there are any args at all
     if (argc < 2){
         // error
         exit(EXIT_FAILURE);
     }
     signal(SIGPIPE, SIG_IGN);
-    // if we have at least 2 args, check if first arg is -h
-    if (strcmp(argv[1], "-h") == 0){
-        printf("%s\n", "./cream [-h] NUM_WORKERS PORT_NUMBER MAX_ENTRIES\n"
-                       "-h                 Displays this help menu and returns EXIT_SUCCESS.\n"
-                       "NUM_WORKERS        The number of worker threads used to service requests.\n"
-                       "PORT_NUMBER        Port number to listen on for incoming connections.\n"
-                       "MAX_ENTRIES        The maximum number of entries that can be stored in `cream`'s underlying data store.\n");
 
-        exit(EXIT_SUCCESS);
+    // the optional flags come before the positional args
+    int opt;
+    long spinBudget = DISPATCH_SPIN_BUDGET;
+    long maxDepth = DISPATCH_MAX_DEPTH;
+    size_t memoryLimit = SLAB_DEFAULT_LIMIT;
+    long prefaultThreads = 0;
+    bool restore = false;
+    char *walPath = NULL;
+    int walPolicy = WAL_SYNC_ALWAYS;
+    int walSyncMs = 0;
+    char *mapPath = NULL;
+    char *coldPath = NULL;
+    while ((opt = getopt(argc, argv, "hs:q:t:m:p:nTS:Rw:y:P:c:k:")) != -1){
+        switch (opt){
+            case 'h':
+                usage();
+                exit(EXIT_SUCCESS);
+            case 's':
+                spinBudget = atol(optarg);
+                if (spinBudget < 0){
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'q':
+                maxDepth = atol(optarg);
+                if (maxDepth < 1){
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 't':
+                if (atol(optarg) < 0){
+                    exit(EXIT_FAILURE);
+                }
+                codelTarget = atol(optarg);
+                break;
+            case 'm':
+                if (atol(optarg) < 1){
+                    exit(EXIT_FAILURE);
+                }
+                memoryLimit = (size_t) atol(optarg) << 20;
+                break;
+            case 'p':
+                prefaultThreads = atol(optarg);
+                if (prefaultThreads < 1){
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'n':
+                numaMode = true;
+                break;
+            case 'T':
+                coreMode = true;
+                break;
+            case 'S':
+                snapshotPath = optarg;
+                break;
+            case 'R':
+                restore = true;
+                break;
+            case 'w':
+                walPath = optarg;
+                break;
+            case 'y':
+                if (parse_wal_policy(optarg, &walPolicy, &walSyncMs) == false){
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'P':
+                mapPath = optarg;
+                break;
+            case 'c':
+                coldPath = optarg;
+                break;
+            case 'k':
+                hotKeysPath = optarg;
+                break;
+            default:
+                exit(EXIT_FAILURE);
+        }
     }
 
-    // so the first arg wasn't -h. there should be exactly 4 args total then (prog name, num workers, port num, max entries)
-    if (argc != 4){
+    // after the flags, there should be exactly 3 args left (num workers, port num, max entries)
+    if (argc - optind != 3 || (restore == true && snapshotPath == NULL)){
         exit(EXIT_FAILURE);
     }
 
-    int NUM_WORKERS = atoi(argv[1]);
-    int MAX_ENTRIES = atoi(argv[3]);
+    int NUM_WORKERS = atoi(argv[optind]);
+    char *PORT_NUMBER = argv[optind + 1];
+    int MAX_ENTRIES = atoi(argv[optind + 2]);
 
 
     // using the 3 values above, validate them.
@@ -197,19 +1168,151 @@ int main(int argc, char *argv[]) {
     struct sockaddr_storage clientaddr;
     pthread_t tid;
 
+    // with -k, stopping is left to the recorder, so it can write the keys
+    // first. every thread started from here on has the signals blocked
+    if (hotKeysPath != NULL){
+        sigset_t stop;
+        sigemptyset(&stop);
+        sigaddset(&stop, SIGINT);
+        sigaddset(&stop, SIGTERM);
+        pthread_sigmask(SIG_BLOCK, &stop, NULL);
+        hotKeyCount = (uint64_t) MAX_ENTRIES * HOTKEYS_PERCENT / 100;
+    }
+
+    // reserve the memory keys and values get carved out of
+    if (slab_init(memoryLimit) == false){
+        exit(EXIT_FAILURE);
+    }
+    // start the cached clock so the map never has to ask the kernel for the time
+    start_clock_ticker();
+    // workers are spread over the nodes round robin, so every node gets some
+    if (numaMode == true || coreMode == true){
+        if (load_topology(&topology, TOPOLOGY_ROOT) == false){
+            exit(EXIT_FAILURE);
+        }
+        workerNode = Malloc(NUM_WORKERS * sizeof(int));
+        for (i = 0; i < NUM_WORKERS; i++){
+            workerNode[i] = i % topology.num_nodes;
+        }
+    }
+    // the map is ready (and faulted in, if asked) before anyone can connect.
+    // in NUMA mode every node builds its own shard
+    // in per-core mode every core gets a shard
+    // with -P the shards are files, and whatever they held is back right away
+    if (coreMode == true){
+        store = open_store(mapPath, NUM_WORKERS, MAX_ENTRIES, jenkins_one_at_a_time_hash, destroy_func, NULL, prefaultThreads);
+    }
+    else{
+        store = open_store(mapPath, 1, MAX_ENTRIES, jenkins_one_at_a_time_hash, destroy_func,
+                           numaMode == true ? &topology : NULL, prefaultThreads);
+    }
+    if (store == NULL){
+        if (mapPath != NULL){
+            fprintf(stderr, "%s: %s\n", mapPath, strerror(errno));
+        }
+        exit(EXIT_FAILURE);
+    }
+    if (mapPath != NULL){
+        Pthread_create(&tid, NULL, checkpointer, NULL);
+    }
+    // a map that can't tell which keys are hot can't record them
+    if (hotKeysPath != NULL && store_hottest(store, 0, NULL, NULL) == false && errno == ENOTSUP){
+        fprintf(stderr, "%s: %s\n", hotKeysPath, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    // the cold tier is there before anything is loaded, so a big load spills too
+    if (coldPath != NULL && store_spill(store, coldPath, (uint64_t) memoryLimit * STORE_HOT_PERCENT / 100) == false){
+        fprintf(stderr, "%s: %s\n", coldPath, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    // warm up from the last snapshot, so we don't open with a miss storm. a
+    // snapshot that is missing or damaged just means starting (partly) empty
+    // with a log, its snapshot is -S's (or one next to the log), and
+    // recovering from the log replaces -R
+    if (walPath != NULL){
+        char *walSnapshot = snapshotPath;
+        if (walSnapshot == NULL){
+            walSnapshot = Malloc(strlen(walPath) + sizeof(".snap"));
+            sprintf(walSnapshot, "%s.snap", walPath);
+            snapshotPath = walSnapshot;
+        }
+        uint64_t applied;
+        if (recover_wal(store, walPath, walSnapshot, &applied) == false){
+            fprintf(stderr, "%s: %s, replayed %lu records\n", walPath, strerror(errno), applied);
+            exit(EXIT_FAILURE);
+        }
+        wal = open_wal(store, walPath, walSnapshot, walPolicy, walSyncMs);
+        if (wal == NULL){
+            exit(EXIT_FAILURE);
+        }
+    }
+    else if (restore == true){
+        uint64_t loaded;
+        if (load_snapshot(store, snapshotPath, NUM_WORKERS, &loaded) == false){
+            fprintf(stderr, "%s: %s, loaded %lu entries\n", snapshotPath, strerror(errno), loaded);
+        }
+    }
+    // without a full restore, the keys that were hot last time are fetched
+    // from the snapshot, so the hit ratio comes back without loading all of it
+    else if (hotKeysPath != NULL && snapshotPath != NULL && access(hotKeysPath, F_OK) == 0){
+        snapshot_source_t *source = open_snapshot_source(snapshotPath);
+        uint64_t loaded = 0;
+        if (source == NULL || load_hot_keys(store, hotKeysPath, fetch_from_snapshot, source, NUM_WORKERS, &loaded) == false){
+            fprintf(stderr, "%s: %s, loaded %lu entries\n", hotKeysPath, strerror(errno), loaded);
+        }
+        close_snapshot_source(source);
+    }
+    if (hotKeysPath != NULL){
+        Pthread_create(&tid, NULL, hot_key_recorder, NULL);
+    }
+    // per-core mode has no shared queues, every core listens and serves on its own
+    if (coreMode == true){
+        create_cores(NUM_WORKERS, PORT_NUMBER);
+        start_slab_rebalancer(evict_page, NULL, SLAB_REBALANCE_MS);
+        for (i = 1; i < NUM_WORKERS; i++){
+            Pthread_create(&tid, NULL, core_thread, (void *) (intptr_t) i);
+        }
+        core_thread((void *) (intptr_t) 0);
+        exit(EXIT_FAILURE);
+    }
+
     // create the listener
-    listenfd = Open_listenfd(argv[2]);
-    // create the queue
-    queue = create_queue();
-    hashmap = create_map(MAX_ENTRIES, jenkins_one_at_a_time_hash, destroy_func);
+    listenfd = Open_listenfd(PORT_NUMBER);
+    // create the per-worker queues
+    dispatcher = create_dispatcher(NUM_WORKERS);
+    if (dispatcher == NULL){
+        fprintf(stderr, "dispatcher: %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    dispatcher -> spin_budget = spinBudget;
+    dispatcher -> max_depth = maxDepth;
+    if (numaMode == true){
+        set_dispatch_groups(dispatcher, workerNode);
+    }
+    // move slab pages to whichever size class is running short
+    start_slab_rebalancer(evict_page, NULL, SLAB_REBALANCE_MS);
 
     for (i = 0; i < NUM_WORKERS; i++){
-        Pthread_create(&tid, NULL, thread, NULL);
+        Pthread_create(&tid, NULL, thread, (void *) (intptr_t) i);
     }
     while(1){
         clientlen = sizeof(struct sockaddr_storage);
         connfd = Accept(listenfd, (SA *)&clientaddr, &clientlen);
-        enqueue(queue, &connfd);
+        // every connection gets its own copy of the fd, the next accept would overwrite a shared one
+        connection_t *conn = Malloc(sizeof(connection_t));
+        conn -> connfd = connfd;
+        conn -> accepted = coarse_now_ms();
+        conn -> arrived = precise_now_ns();
+        conn -> queued = conn -> arrived;
+        conn -> parsed = false;
+        conn -> key = NULL;
+        conn -> val = NULL;
+        stats_add(STATS_ACCEPTED, 1);
+        // over the bound (or out of slots), tell the client we're busy right away
+        if (dispatch(dispatcher, conn) == false){
+            handleBusy(connfd);
+            close_connection(conn);
+        }
     }
     exit(0);
 }
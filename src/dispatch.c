@@ -0,0 +1,410 @@
+#include "dispatch.h"
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/*
+ * Tells the core we are in a spin loop so it can back off the pipeline
+ * (and let a sibling hyperthread run).
+ */
+static inline void cpu_relax(void){
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    __asm__ __volatile__("yield");
+#endif
+}
+
+static void futex_wait(_Atomic uint32_t *addr, uint32_t expected){
+    syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, expected, NULL, NULL, 0);
+}
+
+static void futex_wake(_Atomic uint32_t *addr, int count){
+    syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0);
+}
+
+/*
+ * Frees a queue nobody has used yet, along with its ring.
+ */
+static void free_queue(queue_t *queue){
+    if (queue == NULL){
+        return;
+    }
+    sem_destroy(&queue -> items);
+    free(queue -> cells);
+    free(queue);
+}
+
+/*
+ * Undoes a create_dispatcher() that failed part way. No worker has seen the
+ * dispatcher yet, so its queues are all empty.
+ */
+static void free_dispatcher(dispatcher_t *dispatcher, int num_workers){
+    int saved = errno;
+    for (int i = 0; i < num_workers; i++){
+        free_queue(dispatcher -> locals[i]);
+    }
+    for (int lane = DISPATCH_LANE_WRITE; lane < DISPATCH_LANES; lane++){
+        free_queue(dispatcher -> lanes[lane]);
+    }
+    free(dispatcher -> locals);
+    free(dispatcher -> counters);
+    free(dispatcher);
+    errno = saved;
+}
+
+dispatcher_t *create_dispatcher(int num_workers) {
+    if (num_workers < 1){
+        errno = EINVAL;
+        return NULL;
+    }
+
+    // the eventcount sits on its own cache line, so calloc's alignment isn't enough
+    dispatcher_t *dispatcher = aligned_alloc(CACHE_LINE, sizeof(dispatcher_t));
+    if (dispatcher == NULL){
+        return NULL;
+    }
+    memset(dispatcher, 0, sizeof(dispatcher_t));
+
+    dispatcher -> locals = calloc(num_workers, sizeof(queue_t *));
+    dispatcher -> counters = aligned_alloc(CACHE_LINE, num_workers * sizeof(dispatch_counters_t));
+    if (dispatcher -> locals == NULL || dispatcher -> counters == NULL){
+        free(dispatcher -> locals);
+        free(dispatcher -> counters);
+        free(dispatcher);
+        return NULL;
+    }
+    memset(dispatcher -> counters, 0, num_workers * sizeof(dispatch_counters_t));
+
+    // every worker gets a queue of its own
+    for (int i = 0; i < num_workers; i++){
+        dispatcher -> locals[i] = create_queue();
+        if (dispatcher -> locals[i] == NULL){
+            free_dispatcher(dispatcher, num_workers);
+            return NULL;
+        }
+    }
+    // and the heavier lanes are shared by everyone
+    for (int lane = DISPATCH_LANE_WRITE; lane < DISPATCH_LANES; lane++){
+        dispatcher -> lanes[lane] = create_queue();
+        if (dispatcher -> lanes[lane] == NULL){
+            free_dispatcher(dispatcher, num_workers);
+            return NULL;
+        }
+    }
+    dispatcher -> weights[DISPATCH_LANE_READ] = DISPATCH_READ_WEIGHT;
+    dispatcher -> weights[DISPATCH_LANE_WRITE] = DISPATCH_WRITE_WEIGHT;
+    dispatcher -> weights[DISPATCH_LANE_BULK] = DISPATCH_BULK_WEIGHT;
+    dispatcher -> bulk_limit = DISPATCH_BULK_LIMIT;
+    atomic_init(&dispatcher -> bulk_running, 0);
+    dispatcher -> num_workers = num_workers;
+    dispatcher -> spin_budget = DISPATCH_SPIN_BUDGET;
+    dispatcher -> max_depth = DISPATCH_MAX_DEPTH;
+    atomic_init(&dispatcher -> next, 0);
+    atomic_init(&dispatcher -> epoch, 0);
+    atomic_init(&dispatcher -> sleepers, 0);
+
+    return dispatcher;
+}
+
+/*
+ * Wakes a parked worker, if there are any. Once workers are grouped, not every
+ * worker can take every item, so they all get woken and sort it out.
+ */
+static void wake_sleeper(dispatcher_t *self){
+    // pairs with the sleeper's increment in dispatch_next(). either we
+    // see it asleep here, or it sees our item when it re-checks
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&self -> sleepers, memory_order_relaxed) > 0){
+        atomic_fetch_add(&self -> epoch, 1);
+        futex_wake(&self -> epoch, self -> groups == NULL ? 1 : INT_MAX);
+    }
+}
+
+/*
+ * Whether one worker may take work out of another's queue.
+ */
+static bool same_group(dispatcher_t *self, int worker, int other){
+    return self -> groups == NULL || self -> groups[worker] == self -> groups[other];
+}
+
+bool dispatch(dispatcher_t *self, void *item) {
+    if (self == NULL || item == NULL){
+        errno = EINVAL;
+        return false;
+    }
+
+    // admission control. past the bound, the caller should turn the work away
+    // now rather than make it wait behind everything else
+    if (dispatch_depth(self) >= self -> max_depth){
+        errno = EBUSY;
+        return false;
+    }
+
+    // only the acceptor moves the cursor, so relaxed is plenty
+    unsigned start = atomic_fetch_add_explicit(&self -> next, 1, memory_order_relaxed);
+
+    // try the worker whose turn it is, then everyone after it
+    for (int i = 0; i < self -> num_workers; i++){
+        int target = (start + i) % self -> num_workers;
+        if (enqueue(self -> locals[target], item) == true){
+            wake_sleeper(self);
+            return true;
+        }
+    }
+
+    // every queue was full
+    errno = ENOBUFS;
+    return false;
+}
+
+bool set_dispatch_groups(dispatcher_t *self, const int *groups) {
+    if (self == NULL || groups == NULL){
+        errno = EINVAL;
+        return false;
+    }
+
+    int *copy = malloc(self -> num_workers * sizeof(int));
+    if (copy == NULL){
+        return false;
+    }
+    memcpy(copy, groups, self -> num_workers * sizeof(int));
+    self -> groups = copy;
+    return true;
+}
+
+bool dispatch_group(dispatcher_t *self, int group, void *item) {
+    if (self == NULL || item == NULL || self -> groups == NULL){
+        errno = EINVAL;
+        return false;
+    }
+
+    unsigned start = atomic_fetch_add_explicit(&self -> next, 1, memory_order_relaxed);
+    bool found = false;
+
+    // the group's workers, starting from wherever the cursor is
+    for (int i = 0; i < self -> num_workers; i++){
+        int target = (start + i) % self -> num_workers;
+        if (self -> groups[target] != group){
+            continue;
+        }
+        found = true;
+        if (enqueue(self -> locals[target], item) == true){
+            wake_sleeper(self);
+            return true;
+        }
+    }
+
+    errno = found == true ? ENOBUFS : EINVAL;
+    return false;
+}
+
+bool dispatch_lane(dispatcher_t *self, int lane, void *item) {
+    if (self == NULL || item == NULL || lane <= DISPATCH_LANE_READ || lane >= DISPATCH_LANES){
+        errno = EINVAL;
+        return false;
+    }
+
+    if (enqueue(self -> lanes[lane], item) == false){
+        return false;
+    }
+    wake_sleeper(self);
+    return true;
+}
+
+/*
+ * Takes one item from the read lane, preferring the worker's own queue and
+ * stealing otherwise.
+ */
+static void *take_read(dispatcher_t *self, int worker){
+    // our own work first, it was handed to us and nobody else is touching it
+    void *item = try_dequeue(self -> locals[worker]);
+    if (item != NULL){
+        return item;
+    }
+
+    // nothing local, see if someone else (on our node) is backed up
+    for (int i = 1; i < self -> num_workers; i++){
+        int victim = (worker + i) % self -> num_workers;
+        if (same_group(self, worker, victim) == false){
+            continue;
+        }
+        item = try_dequeue(self -> locals[victim]);
+        if (item != NULL){
+            atomic_fetch_add_explicit(&self -> counters[worker].steals, 1, memory_order_relaxed);
+            return item;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Takes one item from the bulk lane, if fewer than bulk_limit workers are
+ * already busy with bulk work.
+ */
+static void *take_bulk(dispatcher_t *self){
+    int running = atomic_load(&self -> bulk_running);
+    do {
+        if (running >= self -> bulk_limit){
+            return NULL;
+        }
+    } while (atomic_compare_exchange_weak(&self -> bulk_running, &running, running + 1) == false);
+
+    void *item = try_dequeue(self -> lanes[DISPATCH_LANE_BULK]);
+    // nothing there after all, give the slot back
+    if (item == NULL){
+        atomic_fetch_sub(&self -> bulk_running, 1);
+    }
+    return item;
+}
+
+static void *take_lane(dispatcher_t *self, int worker, int lane){
+    if (lane == DISPATCH_LANE_READ){
+        return take_read(self, worker);
+    }
+    if (lane == DISPATCH_LANE_BULK){
+        return take_bulk(self);
+    }
+    return try_dequeue(self -> lanes[lane]);
+}
+
+static bool lane_has_work(dispatcher_t *self, int worker, int lane){
+    if (lane == DISPATCH_LANE_READ){
+        for (int i = 0; i < self -> num_workers; i++){
+            if (same_group(self, worker, i) == true && queue_depth(self -> locals[i]) > 0){
+                return true;
+            }
+        }
+        return false;
+    }
+    if (lane == DISPATCH_LANE_BULK && atomic_load(&self -> bulk_running) >= self -> bulk_limit){
+        return false;
+    }
+    return queue_depth(self -> lanes[lane]) > 0;
+}
+
+/*
+ * Takes one item from whichever lane is due. The lanes that have work are
+ * picked by smooth weighted round robin, so with every lane busy a worker
+ * takes weights[lane] items from each lane per round, interleaved.
+ */
+static void *find_work(dispatcher_t *self, int worker, int *lane){
+    int *credit = self -> counters[worker].credit;
+    int pick = -1;
+    int total = 0;
+
+    for (int i = 0; i < DISPATCH_LANES; i++){
+        if (lane_has_work(self, worker, i) == true){
+            credit[i] += self -> weights[i];
+            total += self -> weights[i];
+            if (pick == -1 || credit[i] > credit[pick]){
+                pick = i;
+            }
+        }
+    }
+
+    if (pick != -1){
+        credit[pick] -= total;
+        void *item = take_lane(self, worker, pick);
+        if (item != NULL){
+            *lane = pick;
+            return item;
+        }
+    }
+
+    // someone beat us to it. take anything that's left, cheapest lane first
+    for (int i = 0; i < DISPATCH_LANES; i++){
+        if (i == pick){
+            continue;
+        }
+        void *item = take_lane(self, worker, i);
+        if (item != NULL){
+            *lane = i;
+            return item;
+        }
+    }
+    return NULL;
+}
+
+void *dispatch_next(dispatcher_t *self, int worker, int *lane) {
+    if (self == NULL || worker < 0 || worker >= self -> num_workers || lane == NULL){
+        errno = EINVAL;
+        return NULL;
+    }
+
+    dispatch_counters_t *counters = &self -> counters[worker];
+
+    while (1){
+        void *item = find_work(self, worker, lane);
+        if (item != NULL){
+            return item;
+        }
+
+        // nothing anywhere. work usually shows up again within a few
+        // microseconds, so spin on it for a while before paying for a sleep
+        for (unsigned spin = 0; spin < self -> spin_budget; spin++){
+            cpu_relax();
+            item = find_work(self, worker, lane);
+            if (item != NULL){
+                atomic_fetch_add_explicit(&counters -> spins, 1, memory_order_relaxed);
+                return item;
+            }
+        }
+
+        // announce that we are going to sleep, then look one last time.
+        // anything dispatched after this point will see us and bump the epoch
+        atomic_fetch_add(&self -> sleepers, 1);
+        uint32_t epoch = atomic_load(&self -> epoch);
+        item = find_work(self, worker, lane);
+        if (item != NULL){
+            atomic_fetch_sub(&self -> sleepers, 1);
+            return item;
+        }
+        if (atomic_load(&self -> locals[worker] -> invalid) == true){
+            atomic_fetch_sub(&self -> sleepers, 1);
+            errno = EINVAL;
+            return NULL;
+        }
+
+        atomic_fetch_add_explicit(&counters -> parks, 1, memory_order_relaxed);
+        // returns right away if the epoch already moved on
+        futex_wait(&self -> epoch, epoch);
+        atomic_fetch_sub(&self -> sleepers, 1);
+    }
+}
+
+void dispatch_done(dispatcher_t *self, int lane) {
+    if (self == NULL){
+        errno = EINVAL;
+        return;
+    }
+
+    if (lane == DISPATCH_LANE_BULK){
+        atomic_fetch_sub(&self -> bulk_running, 1);
+        // a bulk item may have been left waiting on the limit, not on an empty lane
+        if (queue_depth(self -> lanes[DISPATCH_LANE_BULK]) > 0){
+            wake_sleeper(self);
+        }
+    }
+}
+
+size_t dispatch_depth(dispatcher_t *self) {
+    if (self == NULL){
+        errno = EINVAL;
+        return 0;
+    }
+
+    // only reads, so asking doesn't add any traffic to the workers' cache lines
+    size_t depth = 0;
+    for (int i = 0; i < self -> num_workers; i++){
+        depth += queue_depth(self -> locals[i]);
+    }
+    for (int lane = DISPATCH_LANE_WRITE; lane < DISPATCH_LANES; lane++){
+        depth += queue_depth(self -> lanes[lane]);
+    }
+    return depth;
+}
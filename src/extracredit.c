@@ -1,14 +1,45 @@
 #include "utils.h"
+#include "clock.h"
+#include "table.h"
+#include "reclaim.h"
+#include "stats.h"
+#include "slab.h"
 #include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <string.h>
 
-#include <time.h>
 #include <unistd.h>
 //#include "extracredit.h"
 
 
 #define MAP_NODE2(key_arg, val_arg, tombstone_arg, use_arg) (map_node_t) {.key = key_arg, .val = val_arg, .tombstone = tombstone_arg, .use = use_arg}
+
+/*
+ * Takes the map as a reader. The first reader in holds the write lock for
+ * all of them, so writers wait until the last one is out.
+ */
+static void read_lock(hashmap_t *self){
+    pthread_mutex_lock(&self -> fields_lock);
+    self -> num_readers += 1;
+    if (self -> num_readers == 1){
+        pthread_mutex_lock(&self -> write_lock);
+    }
+    pthread_mutex_unlock(&self -> fields_lock);
+}
+
+/*
+ * Lets go of the map as a reader, see read_lock().
+ */
+static void read_unlock(hashmap_t *self){
+    pthread_mutex_lock(&self -> fields_lock);
+    self -> num_readers -= 1;
+    if (self -> num_readers == 0){
+        pthread_mutex_unlock(&self -> write_lock);
+    }
+    pthread_mutex_unlock(&self -> fields_lock);
+}
+
 hashmap_t *create_map(uint32_t capacity, hash_func_f hash_function, destructor_f destroy_function) {
     // if either of the args is null, return null
     if (hash_function == NULL || destroy_function == NULL || capacity < 0){
@@ -42,10 +73,11 @@ hashmap_t *create_map(uint32_t capacity, hash_func_f hash_function, destructor_f
     }
 
     // after setting those fields, theres 1 field left. the node base address.
-    // we need to calloc for the number of nodes and store the starting address into the hashmap
-    map_node_t *baseNode = calloc(capacity, sizeof(map_node_t));
+    // we need to allocate the nodes and store the starting address into the hashmap.
+    // big tables get huge pages, see table_alloc()
+    map_node_t *baseNode = table_alloc(capacity, sizeof(map_node_t));
 
-    // after calloc-ing for the space, check for errors
+    // after allocating the space, check for errors
     if (baseNode == NULL){
         free(hashmap);
         return NULL;
@@ -56,7 +88,395 @@ hashmap_t *create_map(uint32_t capacity, hash_func_f hash_function, destructor_f
     return hashmap;
 }
 
-bool put(hashmap_t *self, map_key_t key, map_val_t val, bool force) {
+// a value the spiller may move to the cold file, or an entry being ranked
+// by map_hottest()
+typedef struct spill_candidate_t {
+    uint32_t index;
+    uint32_t use;
+    void *val_base;     // what the node held when we looked, NULL once it's skipped
+    uint64_t offset;    // where it went in the batch, or in the compacted file
+    uint64_t spill_off;
+    size_t val_len;
+} spill_candidate_t;
+
+/*
+ * How much memory a key or value of len bytes really takes: the slab chunk
+ * it sits in, or just len for the malloc() fallback.
+ */
+static uint64_t chunk_bytes(size_t len){
+    size_t chunk = slab_chunk_size(len);
+    return chunk != 0 ? chunk : len;
+}
+
+/*
+ * Keeps the tier's counts right for a node whose entry is leaving the map.
+ * Call it before the node is overwritten.
+ */
+static void entry_gone(hashmap_t *self, map_node_t *node){
+    if (self -> tier == NULL){
+        return;
+    }
+    atomic_fetch_sub(&self -> tier -> hot_bytes, chunk_bytes(node -> key.key_len));
+    if (node -> spilled == true){
+        atomic_fetch_add(&self -> tier -> dead_bytes, node -> val.val_len);
+        node -> spilled = false;
+    }
+    else{
+        atomic_fetch_sub(&self -> tier -> hot_bytes, chunk_bytes(node -> val.val_len));
+    }
+}
+
+/*
+ * Counts an entry that was just put in a node.
+ */
+static void entry_added(hashmap_t *self, map_node_t *node){
+    node -> spilled = false;
+    if (self -> tier != NULL){
+        atomic_fetch_add(&self -> tier -> hot_bytes, chunk_bytes(node -> key.key_len) + chunk_bytes(node -> val.val_len));
+    }
+}
+
+static bool pread_all(int fd, char *buffer, size_t len, uint64_t offset){
+    while (len > 0){
+        ssize_t got = pread(fd, buffer, len, offset);
+        if (got < 0 && errno == EINTR){
+            continue;
+        }
+        if (got <= 0){
+            return false;
+        }
+        buffer += got;
+        len -= got;
+        offset += got;
+    }
+    return true;
+}
+
+static bool pwrite_all(int fd, const char *buffer, size_t len, uint64_t offset){
+    while (len > 0){
+        ssize_t put = pwrite(fd, buffer, len, offset);
+        if (put < 0 && errno == EINTR){
+            continue;
+        }
+        if (put <= 0){
+            return false;
+        }
+        buffer += put;
+        len -= put;
+        offset += put;
+    }
+    return true;
+}
+
+static int compare_use(const void *a, const void *b){
+    const spill_candidate_t *left = a;
+    const spill_candidate_t *right = b;
+    return left -> use < right -> use ? -1 : left -> use > right -> use;
+}
+
+static int compare_spill_off(const void *a, const void *b){
+    const spill_candidate_t *left = a;
+    const spill_candidate_t *right = b;
+    return left -> spill_off < right -> spill_off ? -1 : left -> spill_off > right -> spill_off;
+}
+
+/*
+ * Rewrites the cold file with only what nodes still point at. The copying
+ * is done without the lock: nothing is ever written over in the file, and
+ * only the spiller (which is us) appends to it. clear_map() may empty it
+ * under us, in which case the generation tells us to give up.
+ */
+static void compact_tier(hashmap_t *self){
+    tier_t *tier = self -> tier;
+    char *tmpPath = malloc(strlen(tier -> path) + sizeof(".tmp"));
+    char *buffer = malloc(TIER_BATCH_BYTES);
+    spill_candidate_t *spilled = malloc((size_t) self -> capacity * sizeof(spill_candidate_t));
+    int fd = -1;
+    if (tmpPath == NULL || buffer == NULL || spilled == NULL){
+        goto done;
+    }
+    sprintf(tmpPath, "%s.tmp", tier -> path);
+
+    read_lock(self);
+
+    uint64_t generation = tier -> generation;
+    size_t count = 0;
+    for (uint32_t i = 0; self -> invalid == false && i < self -> capacity; i++){
+        map_node_t *node = &self -> nodes[i];
+        if (node -> tombstone == false && node -> key.key_len != 0 && node -> spilled == true && node -> val.val_len <= TIER_BATCH_BYTES){
+            spilled[count++] = (spill_candidate_t) {.index = i, .spill_off = node -> spill_off, .val_len = node -> val.val_len};
+        }
+    }
+
+    read_unlock(self);
+
+    // read the old file front to back, writing the new one a batch at a time
+    qsort(spilled, count, sizeof(spill_candidate_t), compare_spill_off);
+    fd = open(tmpPath, O_RDWR | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0){
+        goto done;
+    }
+    uint64_t size = 0;
+    size_t used = 0;
+    for (size_t i = 0; i < count; i++){
+        if (used + spilled[i].val_len > TIER_BATCH_BYTES){
+            if (pwrite_all(fd, buffer, used, size - used) == false){
+                goto done;
+            }
+            used = 0;
+        }
+        if (pread_all(tier -> fd, buffer + used, spilled[i].val_len, spilled[i].spill_off) == false){
+            goto done;
+        }
+        spilled[i].offset = size;
+        used += spilled[i].val_len;
+        size += spilled[i].val_len;
+    }
+    if (pwrite_all(fd, buffer, used, size - used) == false){
+        goto done;
+    }
+
+    pthread_mutex_lock(&self -> write_lock);
+    if (self -> invalid == true || generation != tier -> generation || rename(tmpPath, tier -> path) != 0){
+        pthread_mutex_unlock(&self -> write_lock);
+        goto done;
+    }
+    // whatever was promoted or dropped since we looked is dead in the new file too
+    uint64_t dead = 0;
+    for (size_t i = 0; i < count; i++){
+        map_node_t *node = &self -> nodes[spilled[i].index];
+        if (node -> spilled == true && node -> spill_off == spilled[i].spill_off){
+            node -> spill_off = spilled[i].offset;
+        }
+        else{
+            dead += spilled[i].val_len;
+        }
+    }
+    close(tier -> fd);
+    tier -> fd = fd;
+    tier -> file_size = size;
+    atomic_store(&tier -> dead_bytes, dead);
+    fd = -1;
+    pthread_mutex_unlock(&self -> write_lock);
+
+done:
+    if (fd >= 0){
+        close(fd);
+        unlink(tmpPath);
+    }
+    free(spilled);
+    free(buffer);
+    free(tmpPath);
+}
+
+/*
+ * Moves the least recently used values to the cold file until the ones in
+ * memory are back under the low water mark. The coldest are picked as a
+ * reader, then moved a batch at a time as the writer, skipping any that
+ * changed in between.
+ */
+static void spill_cold(hashmap_t *self){
+    tier_t *tier = self -> tier;
+    uint64_t lowWater = tier -> hot_limit / 100 * TIER_LOW_WATER_PERCENT;
+    char *buffer = malloc(TIER_BATCH_BYTES);
+    spill_candidate_t *candidates = malloc((size_t) self -> capacity * sizeof(spill_candidate_t));
+    if (buffer == NULL || candidates == NULL){
+        goto done;
+    }
+
+    read_lock(self);
+
+    uint64_t generation = tier -> generation;
+    size_t count = 0;
+    for (uint32_t i = 0; self -> invalid == false && i < self -> capacity; i++){
+        map_node_t *node = &self -> nodes[i];
+        // values too big for a batch stay in memory
+        if (node -> tombstone == false && node -> key.key_len != 0 && node -> spilled == false && node -> val.val_len <= TIER_BATCH_BYTES){
+            candidates[count++] = (spill_candidate_t) {.index = i, .use = node -> use, .val_base = node -> val.val_base};
+        }
+    }
+
+    read_unlock(self);
+
+    qsort(candidates, count, sizeof(spill_candidate_t), compare_use);
+    size_t next = 0;
+    while (next < count && atomic_load(&tier -> hot_bytes) > lowWater){
+        pthread_mutex_lock(&self -> write_lock);
+        if (self -> invalid == true || generation != tier -> generation){
+            pthread_mutex_unlock(&self -> write_lock);
+            break;
+        }
+
+        size_t first = next;
+        size_t used = 0;
+        uint64_t freeing = 0;
+        uint64_t hot = atomic_load(&tier -> hot_bytes);
+        for (; next < count && hot - freeing > lowWater; next++){
+            map_node_t *node = &self -> nodes[candidates[next].index];
+            if (node -> val.val_base != candidates[next].val_base || node -> tombstone == true || node -> key.key_len == 0 || node -> spilled == true){
+                candidates[next].val_base = NULL;
+                continue;
+            }
+            if (used + node -> val.val_len > TIER_BATCH_BYTES){
+                break;
+            }
+            memcpy(buffer + used, node -> val.val_base, node -> val.val_len);
+            candidates[next].offset = used;
+            candidates[next].val_len = node -> val.val_len;
+            used += node -> val.val_len;
+            freeing += chunk_bytes(node -> val.val_len);
+        }
+
+        bool written = pwrite_all(tier -> fd, buffer, used, tier -> file_size);
+        for (size_t i = first; written == true && i < next; i++){
+            if (candidates[i].val_base == NULL){
+                continue;
+            }
+            map_node_t *node = &self -> nodes[candidates[i].index];
+            atomic_fetch_sub(&tier -> hot_bytes, chunk_bytes(node -> val.val_len));
+            node -> val.val_base = NULL;
+            node -> spilled = true;
+            node -> spill_off = tier -> file_size + candidates[i].offset;
+        }
+        if (written == true){
+            tier -> file_size += used;
+        }
+        pthread_mutex_unlock(&self -> write_lock);
+        if (written == false){
+            fprintf(stderr, "%s: %s, values stay in memory\n", tier -> path, strerror(errno));
+            break;
+        }
+        // freeing them is the point, so it isn't left to the reclaimer. a
+        // GET may still be copying one out, so wait for it first
+        retire_hold();
+        for (size_t i = first; i < next; i++){
+            if (candidates[i].val_base != NULL){
+                retire(self -> destroy_function, MAP_KEY(NULL, 0), MAP_VAL(candidates[i].val_base, candidates[i].val_len));
+            }
+        }
+        retire_sync();
+    }
+
+    if (tier -> file_size >= TIER_COMPACT_MIN && atomic_load(&tier -> dead_bytes) * 2 > tier -> file_size){
+        compact_tier(self);
+    }
+
+done:
+    free(buffer);
+    free(candidates);
+}
+
+/*
+ * The tier's own thread. It isn't a reclaimer job: the reclaimer only runs
+ * when nothing else wants the CPU, and a spill is what makes room for puts.
+ */
+static void *spiller(void *arg){
+    hashmap_t *self = arg;
+    while (true){
+        sem_wait(&self -> tier -> wake);
+        spill_cold(self);
+        // what was spilled is only room for puts once it's back in the pool
+        slab_flush_cache();
+        atomic_store(&self -> tier -> spilling, false);
+    }
+    return NULL;
+}
+
+/*
+ * Wakes the spiller if the values in memory are over the limit and it isn't
+ * already at it.
+ */
+static void maybe_spill(hashmap_t *self){
+    if (self == NULL || self -> tier == NULL || atomic_load(&self -> tier -> hot_bytes) <= self -> tier -> hot_limit ||
+        atomic_exchange(&self -> tier -> spilling, true) == true){
+        return;
+    }
+    sem_post(&self -> tier -> wake);
+}
+
+/*
+ * Reads a spilled value back into a fresh buffer: a slab chunk if one is
+ * free, else the heap. slab_free() takes either.
+ *
+ * @return The buffer, or NULL if the file couldn't be read
+ */
+static void *read_spilled(hashmap_t *self, map_node_t *node){
+    void *buffer = slab_alloc(node -> val.val_len);
+    if (buffer == NULL){
+        buffer = malloc(node -> val.val_len);
+    }
+    if (buffer != NULL && pread_all(self -> tier -> fd, buffer, node -> val.val_len, node -> spill_off) == false){
+        slab_free(buffer);
+        buffer = NULL;
+    }
+    return buffer;
+}
+
+bool spill_map(hashmap_t *self, const char *path, uint64_t hot_limit){
+    if (self == NULL || path == NULL || hot_limit == 0){
+        errno = EINVAL;
+        return false;
+    }
+    tier_t *tier = calloc(1, sizeof(tier_t));
+    char *tierPath = malloc(strlen(path) + 1);
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+    if (tier == NULL || tierPath == NULL || fd < 0){
+        free(tier);
+        free(tierPath);
+        if (fd >= 0){
+            close(fd);
+        }
+        return false;
+    }
+    strcpy(tierPath, path);
+    tier -> fd = fd;
+    tier -> path = tierPath;
+    tier -> hot_limit = hot_limit;
+    atomic_init(&tier -> dead_bytes, 0);
+    atomic_init(&tier -> spilling, false);
+    sem_init(&tier -> wake, 0, 0);
+
+    pthread_mutex_lock(&self -> write_lock);
+    if (self -> invalid == true || self -> tier != NULL){
+        pthread_mutex_unlock(&self -> write_lock);
+        close(fd);
+        unlink(path);
+        free(tierPath);
+        free(tier);
+        errno = EINVAL;
+        return false;
+    }
+    // everything already in the map is in memory
+    uint64_t hot = 0;
+    for (int i = 0; i < self -> capacity; i++){
+        if (self -> nodes[i].tombstone == false && self -> nodes[i].key.key_len != 0){
+            hot += chunk_bytes(self -> nodes[i].key.key_len) + chunk_bytes(self -> nodes[i].val.val_len);
+        }
+    }
+    atomic_init(&tier -> hot_bytes, hot);
+    self -> tier = tier;
+    if (pthread_create(&tier -> thread, NULL, spiller, self) != 0){
+        self -> tier = NULL;
+        pthread_mutex_unlock(&self -> write_lock);
+        close(fd);
+        unlink(path);
+        sem_destroy(&tier -> wake);
+        free(tierPath);
+        free(tier);
+        return false;
+    }
+    pthread_detach(tier -> thread);
+    pthread_mutex_unlock(&self -> write_lock);
+
+    maybe_spill(self);
+    return true;
+}
+
+/*
+ * put() and put_aged(). Every node this writes is stamped as written age_ms
+ * ago.
+ */
+static bool put_at(hashmap_t *self, map_key_t key, map_val_t val, uint64_t age_ms, bool force) {
     if (self == NULL || key.key_base == NULL || val.val_base == NULL || key.key_len == 0 || val.val_len == 0){
         errno = EINVAL;
         return false;
@@ -78,11 +498,16 @@ bool put(hashmap_t *self, map_key_t key, map_val_t val, bool force) {
     // is reading, and no one else is writing. do stuff
     // we want to put the key, val at some index x, so get the index
     int index = get_index(self, key);
+    // read the clock once, every stamp in this put uses it
+    uint64_t now = coarse_now_ms();
+    // when the entry was written. older than now if it came from a snapshot
+    uint64_t start = age_ms < now ? now - age_ms : 0;
 
     // if the key doesn't exist or it existed in the past (tombstone), then just put the new key and val and return
     if (self -> nodes[index].key.key_len == 0 || self -> nodes[index].tombstone == true){
         self -> nodes[index].key = key; // put key
         self -> nodes[index].val = val; // put val
+        entry_added(self, &self -> nodes[index]);
         self -> size += 1;  // increment size by 1
 
         // NEW: update the amount of stuff (used for last-used time)
@@ -92,7 +517,7 @@ bool put(hashmap_t *self, map_key_t key, map_val_t val, bool force) {
 
         self -> nodes[index].tombstone = false;
         // set the time for the start
-        time (&(self -> nodes[index].start));
+        self -> nodes[index].start = start;
 
         // unlock after putting key and val
         pthread_mutex_unlock(&self -> write_lock);
@@ -105,8 +530,14 @@ bool put(hashmap_t *self, map_key_t key, map_val_t val, bool force) {
         if (self -> nodes[index].key.key_len == key.key_len){
             // if the memory at index key == arg key, then its the same key. update the val and return
             if (memcmp(self -> nodes[index].key.key_base, key.key_base, key.key_len) == 0){
+                // the node keeps its key, so the new copy of it and the old val
+                // are done with, unless the caller handed us the same buffers again
+                retire(self -> destroy_function, self -> nodes[index].key.key_base == key.key_base ? MAP_KEY(NULL, 0) : key,
+                       self -> nodes[index].val.val_base == val.val_base ? MAP_VAL(NULL, 0) : self -> nodes[index].val);
+                entry_gone(self, &self -> nodes[index]);
 
                 self -> nodes[index].val = val;
+                entry_added(self, &self -> nodes[index]);
                 self -> nodes[index].tombstone = false;
                 // NEW: update the amount of stuff (used for last-used time)
                 self -> counter += 1;
@@ -114,7 +545,7 @@ bool put(hashmap_t *self, map_key_t key, map_val_t val, bool force) {
                 self -> nodes[index].use = self -> counter;
 
                 // set the time for the start
-                time (&(self -> nodes[index].start));
+                self -> nodes[index].start = start;
 
                 pthread_mutex_unlock(&self -> write_lock);
                 return true;
@@ -133,6 +564,7 @@ bool put(hashmap_t *self, map_key_t key, map_val_t val, bool force) {
             if (self -> nodes[currIndex].key.key_len == 0 || self -> nodes[currIndex].tombstone == true){
                 self -> nodes[currIndex].key = key;
                 self -> nodes[currIndex].val = val;
+                entry_added(self, &self -> nodes[currIndex]);
                 self -> nodes[currIndex].tombstone = false;
                 self -> size += 1;
 
@@ -142,7 +574,7 @@ bool put(hashmap_t *self, map_key_t key, map_val_t val, bool force) {
                 self -> nodes[currIndex].use = self -> counter;
 
                 // set the time for the start
-                time (&(self -> nodes[currIndex].start));
+                self -> nodes[currIndex].start = start;
 
                 // unlock and return
                 pthread_mutex_unlock(&self -> write_lock);
@@ -157,23 +589,23 @@ bool put(hashmap_t *self, map_key_t key, map_val_t val, bool force) {
     if (force == true){
         // find if a node has passed its alloted time (ttl)
         bool didPass = false;
-        time_t end;
-        time (&end);
-        int diff = 0;
 
         int oldIndex = index;
         oldIndex += 1;
         int currIndex = 0;
 
-        if (difftime(end, self -> nodes[index].start) >= TTL){
+        if (now - self -> nodes[index].start >= TTL_MS){
             // if current node is usable, then use it.
             didPass = true;
             // set free this node and set.
-            self -> destroy_function(self -> nodes[index].key, self -> nodes[index].val);
+            retire(self -> destroy_function, self -> nodes[index].key, self -> nodes[index].val);
+            stats_add(STATS_EXPIRED, 1);
+            entry_gone(self, &self -> nodes[index]);
 
             // just simply put it at the required index.
             self -> nodes[index].key = key;
             self -> nodes[index].val = val;
+            entry_added(self, &self -> nodes[index]);
 
             self -> counter += 1;
             // NEW: update this nodes last -used time
@@ -181,7 +613,7 @@ bool put(hashmap_t *self, map_key_t key, map_val_t val, bool force) {
 
             self -> nodes[index].val = val;
             // reset the time
-            time(&(self -> nodes[index].start));
+            self -> nodes[index].start = start;
         }
 
         else{
@@ -190,16 +622,17 @@ bool put(hashmap_t *self, map_key_t key, map_val_t val, bool force) {
                 currIndex = oldIndex % self -> capacity;
                 if (self -> nodes[currIndex].key.key_len != 0){
                     // check if this current - occupied is done
-                    diff = difftime(end, self -> nodes[currIndex].start);
-
-                    if (diff >= TTL){
+                    if (now - self -> nodes[currIndex].start >= TTL_MS){
                         didPass = true;
                         // set free this node and set.
-                        self -> destroy_function(self -> nodes[currIndex].key, self -> nodes[currIndex].val);
+                        retire(self -> destroy_function, self -> nodes[currIndex].key, self -> nodes[currIndex].val);
+                        stats_add(STATS_EXPIRED, 1);
+                        entry_gone(self, &self -> nodes[currIndex]);
 
                         // just simply put it at the required index.
                         self -> nodes[currIndex].key = key;
                         self -> nodes[currIndex].val = val;
+                        entry_added(self, &self -> nodes[currIndex]);
 
                         self -> counter += 1;
                         // NEW: update this nodes last -used time
@@ -207,7 +640,7 @@ bool put(hashmap_t *self, map_key_t key, map_val_t val, bool force) {
 
                         self -> nodes[currIndex].val = val;
                         // reset the time
-                        time(&(self -> nodes[currIndex].start));
+                        self -> nodes[currIndex].start = start;
                     }
                 }
                 oldIndex += 1;
@@ -227,17 +660,20 @@ bool put(hashmap_t *self, map_key_t key, map_val_t val, bool force) {
             }
             // curruse has the last used index. destroy it and put
             // destory the old node
-            self -> destroy_function(self -> nodes[index].key, self -> nodes[index].val);
+            retire(self -> destroy_function, self -> nodes[index].key, self -> nodes[index].val);
+            stats_add(STATS_EVICTED, 1);
+            entry_gone(self, &self -> nodes[index]);
 
             // just simply put it at the required index.
             self -> nodes[index].key = key;
             self -> nodes[index].val = val;
+            entry_added(self, &self -> nodes[index]);
 
             self -> counter += 1;
             // NEW: update this nodes last -used time
             self -> nodes[index].use = self -> counter;
 
-            time(&(self -> nodes[index].start));
+            self -> nodes[index].start = start;
         }
         pthread_mutex_unlock(&self -> write_lock);
         return true;
@@ -249,42 +685,78 @@ bool put(hashmap_t *self, map_key_t key, map_val_t val, bool force) {
     return false;
 }
 
-map_val_t get(hashmap_t *self, map_key_t key) {
+bool put(hashmap_t *self, map_key_t key, map_val_t val, bool force) {
+    bool putted = put_at(self, key, val, 0, force);
+    maybe_spill(self);
+    return putted;
+}
+
+bool put_aged(hashmap_t *self, map_key_t key, map_val_t val, uint64_t age_ms, bool force) {
+    if (self == NULL || key.key_base == NULL || val.val_base == NULL || key.key_len == 0 || val.val_len == 0){
+        errno = EINVAL;
+        return false;
+    }
+    // it would be gone already, don't bother putting it in
+    if (age_ms >= TTL_MS){
+        self -> destroy_function(key, val);
+        return true;
+    }
+    bool putted = put_at(self, key, val, age_ms, force);
+    maybe_spill(self);
+    return putted;
+}
+
+bool bulk_put(hashmap_t *self, map_entry_t *entries, size_t count, int threads) {
+    if (self == NULL || (entries == NULL && count > 0) || threads < 1){
+        errno = EINVAL;
+        return false;
+    }
+
+    // one at a time, and keep going past the ones that don't fit
+    int error = 0;
+    for (size_t i = 0; i < count; i++){
+        entries[i].stored = put_aged(self, entries[i].key, entries[i].val, entries[i].age_ms, false);
+        if (entries[i].stored == false){
+            error = errno;
+        }
+    }
+    if (error != 0){
+        errno = error;
+        return false;
+    }
+    return true;
+}
+
+/*
+ * get(), which looks again, up to tries more times, if a cold value it read
+ * back changed before it could be put back in memory.
+ */
+static map_val_t get_tries(hashmap_t *self, map_key_t key, int tries) {
     if (self == NULL || key.key_base == NULL ||  key.key_len == 0){
         errno = EINVAL;
         return MAP_VAL(NULL, 0);
     }
 
     // if none of them are null, we are reading. first grab the mutex to increase num readers
-    pthread_mutex_lock(&self -> fields_lock);
-    self -> num_readers += 1;
-    if (self -> num_readers == 1){
-        pthread_mutex_lock(&self -> write_lock);
-    }
-    pthread_mutex_unlock(&self -> fields_lock);
+    read_lock(self);
 
     // now we have complete control over reading
     // use the key to calculate the index for which we have to read
     int index = get_index(self, key);
     int oldIndex = index + 1;
     int currIndex = 0;
+    int found = -1;
     void* returnAddy = NULL;
     int len = 0;
+    uint64_t now = coarse_now_ms();
 
     if (self -> invalid == false){
 
         if (self -> nodes[index].key.key_len == key.key_len){
             if (memcmp(self -> nodes[index].key.key_base, key.key_base, key.key_len) == 0  &&  self -> nodes[index].tombstone == false){
                 // if they're the same key, store the variable
-
-                time_t end;
-                time (&end);
-                int diff = 0;
-                diff = difftime(end, self -> nodes[index].start);
-
-                if (diff < TTL){
-                    returnAddy = self -> nodes[index].val.val_base;
-                    len = self -> nodes[index].val.val_len;
+                if (now - self -> nodes[index].start < TTL_MS){
+                    found = index;
 
                     // was just accessed, so its access time increases as well
                     // NEW: update the amount of stuff (used for last-used time)
@@ -295,7 +767,9 @@ map_val_t get(hashmap_t *self, map_key_t key) {
 
                 else{
                     // ttl happened, so free this node and continue like nothing happened
-                    self -> destroy_function(self -> nodes[index].key, self -> nodes[index].val);
+                    retire(self -> destroy_function, self -> nodes[index].key, self -> nodes[index].val);
+                    stats_add(STATS_EXPIRED, 1);
+                    entry_gone(self, &self -> nodes[index]);
                     // NEW: update this nodes last -used time
                     self -> nodes[index].use = 0;
                     self -> nodes[index].tombstone = true;
@@ -307,15 +781,8 @@ map_val_t get(hashmap_t *self, map_key_t key) {
             currIndex = oldIndex % self -> capacity;
             if (self -> nodes[currIndex].key.key_len == key.key_len){
                 if (memcmp(self -> nodes[currIndex].key.key_base, key.key_base, key.key_len) == 0 && self -> nodes[currIndex].tombstone == false){
-                    time_t end;
-                    time (&end);
-                    int diff = 0;
-                    diff = difftime(end, self -> nodes[currIndex].start);
-
-                    if (diff < TTL){
-
-                        returnAddy = self -> nodes[currIndex].val.val_base;
-                        len = self -> nodes[currIndex].val.val_len;
+                    if (now - self -> nodes[currIndex].start < TTL_MS){
+                        found = currIndex;
 
                         // NEW: update the amount of stuff (used for last-used time)
                         self -> counter += 1;
@@ -324,7 +791,9 @@ map_val_t get(hashmap_t *self, map_key_t key) {
                     }
 
                     else{
-                        self -> destroy_function(self -> nodes[currIndex].key, self -> nodes[currIndex].val);
+                        retire(self -> destroy_function, self -> nodes[currIndex].key, self -> nodes[currIndex].val);
+                        stats_add(STATS_EXPIRED, 1);
+                        entry_gone(self, &self -> nodes[currIndex]);
                         self -> nodes[currIndex].use = 0;
                         self -> nodes[currIndex].tombstone = true;
                     }
@@ -334,19 +803,167 @@ map_val_t get(hashmap_t *self, map_key_t key) {
         }
     }
 
+    // a value in the cold file is read back while we're still a reader, so
+    // the file can't be emptied or compacted under us
+    uint64_t generation = 0;
+    uint64_t spillOff = 0;
+    bool spilled = false;
+    if (found >= 0){
+        len = self -> nodes[found].val.val_len;
+        if (self -> nodes[found].spilled == true){
+            spilled = true;
+            generation = self -> tier -> generation;
+            spillOff = self -> nodes[found].spill_off;
+            returnAddy = read_spilled(self, &self -> nodes[found]);
+        }
+        else{
+            returnAddy = self -> nodes[found].val.val_base;
+        }
+    }
+
     // at this point, the value is either null, 0 or it was set in one of the loops. unlock the stuff and return
     // after all is read, we decrease num readers
-    pthread_mutex_lock(&self -> fields_lock);
-    self -> num_readers -= 1;
-    if (self -> num_readers == 0)
+    read_unlock(self);
+
+    // it was used, so it goes back in memory. if it moved or changed while we
+    // read it, the copy is stale and nobody else has seen it, so it's freed
+    // and we look again
+    if (spilled == true && returnAddy != NULL){
+        pthread_mutex_lock(&self -> write_lock);
+        map_node_t *node = &self -> nodes[found];
+        bool promoted = self -> invalid == false && generation == self -> tier -> generation && node -> spilled == true &&
+                        node -> spill_off == spillOff;
+        if (promoted == true){
+            entry_gone(self, node);
+            node -> val.val_base = returnAddy;
+            entry_added(self, node);
+        }
         pthread_mutex_unlock(&self -> write_lock);
-    pthread_mutex_unlock(&self -> fields_lock);
+        if (promoted == false){
+            slab_free(returnAddy);
+            if (tries > 0){
+                return get_tries(self, key, tries - 1);
+            }
+            returnAddy = NULL;
+            len = 0;
+        }
+        maybe_spill(self);
+    }
 
     if (returnAddy == NULL)
         errno = EINVAL;
     return MAP_VAL(returnAddy, len);
 }
 
+map_val_t get(hashmap_t *self, map_key_t key) {
+    return get_tries(self, key, TIER_READ_TRIES);
+}
+
+/*
+ * Calls func on one live node. Cold values are read into a copy that lasts
+ * for the call. The caller is a reader.
+ */
+static bool walk_node(hashmap_t *self, map_node_t *node, uint64_t now, map_walk_f func, void *arg){
+    if (node -> spilled == false){
+        return func(node -> key, node -> val, now - node -> start, arg);
+    }
+    char *copy = malloc(node -> val.val_len);
+    bool finished = copy != NULL && pread_all(self -> tier -> fd, copy, node -> val.val_len, node -> spill_off) == true &&
+                    func(node -> key, MAP_VAL(copy, node -> val.val_len), now - node -> start, arg);
+    free(copy);
+    return finished;
+}
+
+bool map_walk(hashmap_t *self, map_walk_f func, void *arg) {
+    if (self == NULL || func == NULL){
+        errno = EINVAL;
+        return false;
+    }
+
+    // walk as a reader, same as get()
+    read_lock(self);
+
+    bool finished = self -> invalid == false;
+    uint64_t now = coarse_now_ms();
+    for (int i = 0; i < self -> capacity && finished == true; i++){
+        if (self -> nodes[i].tombstone == false && self -> nodes[i].key.key_len != 0 && now - self -> nodes[i].start < TTL_MS){
+            finished = walk_node(self, &self -> nodes[i], now, func, arg);
+        }
+    }
+
+    read_unlock(self);
+
+    if (finished == false)
+        errno = EINVAL;
+    return finished;
+}
+
+uint32_t map_tombstones(hashmap_t *self) {
+    if (self == NULL){
+        errno = EINVAL;
+        return 0;
+    }
+
+    read_lock(self);
+
+    uint32_t tombstones = 0;
+    for (uint32_t i = 0; self -> invalid == false && i < self -> capacity; i++){
+        if (self -> nodes[i].tombstone == true){
+            tombstones += 1;
+        }
+    }
+
+    read_unlock(self);
+    return tombstones;
+}
+
+bool map_hottest(hashmap_t *self, uint32_t count, map_walk_f func, void *arg) {
+    if (self == NULL || func == NULL){
+        errno = EINVAL;
+        return false;
+    }
+    spill_candidate_t *ranked = malloc((size_t) self -> capacity * sizeof(spill_candidate_t));
+    if (ranked == NULL){
+        return false;
+    }
+
+    // note every live node's last use, as a reader
+    read_lock(self);
+
+    bool finished = self -> invalid == false;
+    size_t live = 0;
+    uint64_t now = coarse_now_ms();
+    for (uint32_t i = 0; finished == true && i < self -> capacity; i++){
+        map_node_t *node = &self -> nodes[i];
+        if (node -> tombstone == false && node -> key.key_len != 0 && now - node -> start < TTL_MS){
+            ranked[live++] = (spill_candidate_t) {.index = i, .use = node -> use};
+        }
+    }
+
+    read_unlock(self);
+
+    // the most recently used sort last
+    qsort(ranked, live, sizeof(spill_candidate_t), compare_use);
+
+    read_lock(self);
+
+    finished = finished == true && self -> invalid == false;
+    now = coarse_now_ms();
+    for (size_t i = live; finished == true && i > 0 && live - i < count; i--){
+        map_node_t *node = &self -> nodes[ranked[i - 1].index];
+        if (node -> tombstone == false && node -> key.key_len != 0 && now - node -> start < TTL_MS){
+            finished = walk_node(self, node, now, func, arg);
+        }
+    }
+
+    read_unlock(self);
+
+    free(ranked);
+    if (finished == false)
+        errno = EINVAL;
+    return finished;
+}
+
 map_node_t delete(hashmap_t *self, map_key_t key) {
     if (self == NULL || key.key_len == 0 || key.key_base == NULL){
         errno = EINVAL;
@@ -375,6 +992,7 @@ map_node_t delete(hashmap_t *self, map_key_t key) {
                 self -> nodes[index].tombstone = true;
                 self -> nodes[index].use = 0;
                 self -> size -= 1;
+                entry_gone(self, &self -> nodes[index]);
                 map_node_t returnVal = self -> nodes[index];
                 // unlock
                 pthread_mutex_unlock(&self -> write_lock);
@@ -389,6 +1007,7 @@ map_node_t delete(hashmap_t *self, map_key_t key) {
                     self -> nodes[currIndex].tombstone = true;
                     self -> nodes[currIndex].use = 0;
                     self -> size -= 1;
+                    entry_gone(self, &self -> nodes[currIndex]);
                     map_node_t returnVal = self -> nodes[currIndex];
                     // unlock
                     pthread_mutex_unlock(&self -> write_lock);
@@ -409,6 +1028,27 @@ map_node_t delete(hashmap_t *self, map_key_t key) {
     return node;
 }
 
+// a table that was swapped out by clear_map(), waiting for the reclaimer
+typedef struct map_graveyard_t {
+    uint32_t capacity;
+    map_node_t *nodes;
+    destructor_f destroy_function;
+} map_graveyard_t;
+
+/*
+ * Reclaimer job: destroys what was left in a swapped out table, then the table.
+ */
+static void destroy_graveyard(void *arg){
+    map_graveyard_t *graveyard = arg;
+    for (int i = 0; i < graveyard -> capacity; i++){
+        if (graveyard -> nodes[i].tombstone == false && graveyard -> nodes[i].key.key_len != 0){
+            graveyard -> destroy_function(graveyard -> nodes[i].key, graveyard -> nodes[i].val);
+        }
+    }
+    table_free(graveyard -> nodes, graveyard -> capacity, sizeof(map_node_t));
+    free(graveyard);
+}
+
 bool clear_map(hashmap_t *self) {
 	// check the param
     if (self == NULL){
@@ -416,6 +1056,16 @@ bool clear_map(hashmap_t *self) {
         return false;
     }
 
+    // get an empty table ready before taking the lock. if we can't, we empty
+    // the one we have instead
+    map_graveyard_t *graveyard = malloc(sizeof(map_graveyard_t));
+    map_node_t *nodes = table_alloc(self -> capacity, sizeof(map_node_t));
+    if (graveyard == NULL || nodes == NULL){
+        free(graveyard);
+        table_free(nodes, self -> capacity, sizeof(map_node_t));
+        graveyard = NULL;
+    }
+
     // grab the mutex
     pthread_mutex_lock(&self -> write_lock);
 
@@ -423,13 +1073,43 @@ bool clear_map(hashmap_t *self) {
     if (self -> invalid == true){
         errno = EINVAL;
         pthread_mutex_unlock(&self -> write_lock);
+        if (graveyard != NULL){
+            free(graveyard);
+            table_free(nodes, self -> capacity, sizeof(map_node_t));
+        }
         return false;
     }
 
-    // if not invalid, go through each node and destroy it if its tombstone status is false
+    // the cold file goes with the entries. the generation tells a spill or a
+    // read that started before this not to trust what it saw
+    if (self -> tier != NULL){
+        self -> tier -> generation += 1;
+        if (ftruncate(self -> tier -> fd, 0) != 0){
+            fprintf(stderr, "%s: %s\n", self -> tier -> path, strerror(errno));
+        }
+        self -> tier -> file_size = 0;
+        atomic_store(&self -> tier -> hot_bytes, 0);
+        atomic_store(&self -> tier -> dead_bytes, 0);
+    }
+
+    // swap in the empty table and let the reclaimer destroy the old entries,
+    // so a clear costs the same no matter how full the map is
+    if (graveyard != NULL){
+        graveyard -> capacity = self -> capacity;
+        graveyard -> nodes = self -> nodes;
+        graveyard -> destroy_function = self -> destroy_function;
+        self -> nodes = nodes;
+        self -> size = 0;
+        pthread_mutex_unlock(&self -> write_lock);
+        reclaim_later(destroy_graveyard, graveyard);
+        return true;
+    }
+
+    // if not invalid, go through each node and retire it if its tombstone status is false.
+    // a reader may still have it
     for (int i = 0; i < self -> capacity; i++){
         if (self -> nodes[i].tombstone == false && self -> nodes[i].key.key_len != 0){
-            self -> destroy_function(self -> nodes[i].key, self -> nodes[i].val);
+            retire(self -> destroy_function, self -> nodes[i].key, self -> nodes[i].val);
             self -> nodes[i].tombstone = true;
             self -> nodes[i].use = 0;
         }
@@ -445,3 +1125,55 @@ bool clear_map(hashmap_t *self) {
 bool invalidate_map(hashmap_t *self) {
     return false;
 }
+
+int evict_range(hashmap_t *self, const void *lo, const void *hi) {
+    if (self == NULL || lo == NULL || hi == NULL){
+        errno = EINVAL;
+        return 0;
+    }
+
+    // what we evict is ours to destroy, not the reclaimer's
+    retire_hold();
+
+    // nothing is indexed by address, so look at every live node. the lock
+    // is let go every MAP_EVICT_CHUNK nodes, so puts and gets aren't held
+    // up for a whole pass
+    int evicted = 0;
+    bool valid = true;
+    for (int first = 0; valid == true && first < self -> capacity; first += MAP_EVICT_CHUNK){
+        pthread_mutex_lock(&self -> write_lock);
+        valid = self -> invalid == false;
+        for (int i = first; valid == true && i < self -> capacity && i < first + MAP_EVICT_CHUNK; i++){
+            if (self -> nodes[i].tombstone == true || self -> nodes[i].key.key_len == 0){
+                continue;
+            }
+            char *key = self -> nodes[i].key.key_base;
+            char *val = self -> nodes[i].val.val_base;
+            if ((key >= (char *) lo && key < (char *) hi) || (val >= (char *) lo && val < (char *) hi)){
+                retire(self -> destroy_function, self -> nodes[i].key, self -> nodes[i].val);
+                entry_gone(self, &self -> nodes[i]);
+                self -> nodes[i].tombstone = true;
+                self -> nodes[i].use = 0;
+                self -> size -= 1;
+                evicted += 1;
+            }
+        }
+        pthread_mutex_unlock(&self -> write_lock);
+    }
+
+    // the caller wants the memory back, so see it destroyed before returning.
+    // only our own evictions are waited for, not whatever else is queued
+    retire_sync();
+    if (valid == false){
+        errno = EINVAL;
+    }
+    return evicted;
+}
+
+bool prefault_map(hashmap_t *self, int threads) {
+    if (self == NULL || self -> invalid == true){
+        errno = EINVAL;
+        return false;
+    }
+    return table_prefault(self -> nodes, self -> capacity, sizeof(map_node_t), threads);
+}
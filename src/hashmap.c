@@ -1,8 +1,36 @@
 #include "utils.h"
+#include "table.h"
+#include "reclaim.h"
+#include "stats.h"
 #include <errno.h>
 #include <stdio.h>
 #include <string.h>
 
+/*
+ * Takes the map as a reader. The first reader in holds the write lock for
+ * all of them, so writers wait until the last one is out.
+ */
+static void read_lock(hashmap_t *self){
+    pthread_mutex_lock(&self -> fields_lock);
+    self -> num_readers += 1;
+    if (self -> num_readers == 1){
+        pthread_mutex_lock(&self -> write_lock);
+    }
+    pthread_mutex_unlock(&self -> fields_lock);
+}
+
+/*
+ * Lets go of the map as a reader, see read_lock().
+ */
+static void read_unlock(hashmap_t *self){
+    pthread_mutex_lock(&self -> fields_lock);
+    self -> num_readers -= 1;
+    if (self -> num_readers == 0){
+        pthread_mutex_unlock(&self -> write_lock);
+    }
+    pthread_mutex_unlock(&self -> fields_lock);
+}
+
 hashmap_t *create_map(uint32_t capacity, hash_func_f hash_function, destructor_f destroy_function) {
     // if either of the args is null, return null
     if (hash_function == NULL || destroy_function == NULL || capacity < 0){
@@ -35,11 +63,17 @@ hashmap_t *create_map(uint32_t capacity, hash_func_f hash_function, destructor_f
     }
 
     // after setting those fields, theres 1 field left. the node base address.
-    // we need to calloc for the number of nodes and store the starting address into the hashmap
-    map_node_t *baseNode = calloc(capacity, sizeof(map_node_t));
+    // we need to allocate the nodes and store the starting address into the hashmap.
+    // big tables get huge pages, see table_alloc()
+    map_node_t *baseNode = table_alloc(capacity, sizeof(map_node_t));
+
+    // and the metadata probes walk. all zeroes is MAP_EMPTY
+    map_meta_t *baseMeta = table_alloc(capacity, sizeof(map_meta_t));
 
-    // after calloc-ing for the space, check for errors
-    if (baseNode == NULL){
+    // after allocating the space, check for errors
+    if (baseNode == NULL || baseMeta == NULL){
+        table_free(baseNode, capacity, sizeof(map_node_t));
+        table_free(baseMeta, capacity, sizeof(map_meta_t));
         free(hashmap);
         return NULL;
     }
@@ -62,10 +96,130 @@ hashmap_t *create_map(uint32_t capacity, hash_func_f hash_function, destructor_f
     // if there are no errors, store it
     // this is the base address of the nodes :eyes:
     hashmap -> nodes = baseNode;
+    hashmap -> meta = baseMeta;
     // return it.
     return hashmap;
 }
 
+static uint8_t hash_tag(uint32_t hash){
+    return hash >> 24;
+}
+
+static uint16_t meta_len(size_t key_len){
+    return key_len > UINT16_MAX ? UINT16_MAX : key_len;
+}
+
+/*
+ * Looks for a key, starting at its home slot. Only the metadata is read until
+ * the tag and length match, and a slot that was never used ends the search,
+ * since the key would have been put there. Sets *freeSlot to the first
+ * tombstone or empty slot on the way, or -1 if there was none.
+ *
+ * @return The index of the live slot holding the key, or -1
+ */
+static int probe(hashmap_t *self, map_key_t key, uint32_t hash, int *freeSlot){
+    uint32_t index = hash % self -> capacity;
+    uint8_t tag = hash_tag(hash);
+    uint16_t len = meta_len(key.key_len);
+    int firstFree = -1;
+
+    for (uint32_t i = 0; i < self -> capacity; i++){
+        map_meta_t meta = self -> meta[index];
+        if (meta.state == MAP_EMPTY){
+            if (firstFree == -1){
+                firstFree = index;
+            }
+            break;
+        }
+        if (meta.state == MAP_LIVE && meta.tag == tag && meta.key_len == len){
+            // probably it. now it's worth touching the node
+            map_node_t *node = &self -> nodes[index];
+            if (node -> key.key_len == key.key_len && memcmp(node -> key.key_base, key.key_base, key.key_len) == 0){
+                if (freeSlot != NULL){
+                    *freeSlot = firstFree;
+                }
+                return index;
+            }
+        }
+        if (firstFree == -1 && meta.state == MAP_TOMBSTONE){
+            firstFree = index;
+        }
+        index = index + 1 == self -> capacity ? 0 : index + 1;
+    }
+
+    if (freeSlot != NULL){
+        *freeSlot = firstFree;
+    }
+    return -1;
+}
+
+/*
+ * Marks a live slot dead. Its key length stays in the metadata, so probes for
+ * keys further along don't stop here.
+ */
+static void bury(hashmap_t *self, int index){
+    self -> meta[index].state = MAP_TOMBSTONE;
+    self -> nodes[index].tombstone = true;
+}
+
+/*
+ * Puts an entry into a slot: the new key's, or the one it already has.
+ */
+static void fill(hashmap_t *self, int index, map_key_t key, map_val_t val, uint32_t hash){
+    self -> nodes[index] = MAP_NODE(key, val, false);
+    self -> meta[index] = (map_meta_t) {.state = MAP_LIVE, .tag = hash_tag(hash), .key_len = meta_len(key.key_len)};
+}
+
+/*
+ * Swaps a new entry in for the one a key already has, and gets rid of the
+ * old one. If the caller handed us the same buffers again, they're still in
+ * use.
+ */
+static void replace(hashmap_t *self, int index, map_key_t key, map_val_t val){
+    map_node_t *node = &self -> nodes[index];
+    retire(self -> destroy_function, node -> key.key_base == key.key_base ? MAP_KEY(NULL, 0) : node -> key,
+                   node -> val.val_base == val.val_base ? MAP_VAL(NULL, 0) : node -> val);
+    node -> key = key;
+    node -> val = val;
+}
+
+/*
+ * put(), for a caller that holds the write lock and has hashed the key.
+ */
+static bool put_locked(hashmap_t *self, map_key_t key, map_val_t val, uint32_t hash, bool force){
+    // look for the key first, so it never ends up in the map twice
+    int freeSlot;
+    int index = probe(self, key, hash, &freeSlot);
+
+    // the key is already here, swap in the new entry
+    if (index != -1){
+        replace(self, index, key, val);
+        return true;
+    }
+
+    // a new key goes in the first empty or dead slot on its probe path
+    if (freeSlot != -1){
+        index = freeSlot;
+        self -> size += 1;
+    }
+    // so we looped all the way around, and there were no open slots or dead slots.
+    // this means that we need to check the force parameter
+    else if (force == true){
+        // destroy the old node and simply put it at the required index
+        index = hash % self -> capacity;
+        retire(self -> destroy_function, self -> nodes[index].key, self -> nodes[index].val);
+        stats_add(STATS_EVICTED, 1);
+    }
+    // if we are not forcing, and the map is full, set errno to enomem
+    else{
+        errno = ENOMEM;
+        return false;
+    }
+
+    fill(self, index, key, val, hash);
+    return true;
+}
+
 bool put(hashmap_t *self, map_key_t key, map_val_t val, bool force) {
     if (self == NULL || key.key_base == NULL || val.val_base == NULL || key.key_len == 0 || val.val_len == 0){
         errno = EINVAL;
@@ -84,77 +238,190 @@ bool put(hashmap_t *self, map_key_t key, map_val_t val, bool force) {
         return false;
     }
 
-    // after we grab this lock, we know that no one else
-    // is reading, and no one else is writing. do stuff
-    // we want to put the key, val at some index x, so get the index
-    int index = get_index(self, key);
-
-    // if the key doesn't exist or it existed in the past (tombstone), then just put the new key and val and return
-    if (self -> nodes[index].key.key_len == 0 || self -> nodes[index].tombstone == true){
-        self -> nodes[index].key = key; // put key
-        self -> nodes[index].val = val; // put val
-        self -> size += 1;  // increment size by 1
-        self -> nodes[index].tombstone = false;
-
-        // unlock after putting key and val
-        pthread_mutex_unlock(&self -> write_lock);
-        return true;
-    }
+    bool putted = put_locked(self, key, val, self -> hash_function(key), force);
+    pthread_mutex_unlock(&self -> write_lock);
+    return putted;
+}
 
-    // else if its not empty and its not a tombstone, we check for replacement
-    if (self -> nodes[index].key.key_len != 0){
-        // check if the keys are the same. if they are, update the val
-        if (self -> nodes[index].key.key_len == key.key_len){
-            // if the memory at index key == arg key, then its the same key. update the val and return
-            if (memcmp(self -> nodes[index].key.key_base, key.key_base, key.key_len) == 0){
+bool put_aged(hashmap_t *self, map_key_t key, map_val_t val, uint64_t age_ms, bool force) {
+    // nothing here expires, so the age makes no difference
+    return put(self, key, val, force);
+}
 
-                self -> nodes[index].val = val;
-                self -> nodes[index].tombstone = false;
-                pthread_mutex_unlock(&self -> write_lock);
-                return true;
+// one thread's share of a bulk_put(): the entries whose home slot is in
+// [lo, hi), which are the only slots it touches
+typedef struct bulk_region_t {
+    hashmap_t *map;
+    map_entry_t *entries;
+    uint32_t *order;        // the region's entries, in batch order
+    size_t count;
+    uint32_t lo;
+    uint32_t hi;
+    uint32_t added;         // new keys
+    size_t deferred;        // entries left for the caller, moved to the front of order
+} bulk_region_t;
+
+/*
+ * probe(), kept inside [lo, hi).
+ *
+ * @return false if the probe ran out of the region before it could tell
+ */
+static bool probe_region(hashmap_t *self, map_key_t key, uint32_t hash, uint32_t hi, int *found, int *freeSlot){
+    uint8_t tag = hash_tag(hash);
+    uint16_t len = meta_len(key.key_len);
+    *freeSlot = -1;
+    for (uint32_t index = hash % self -> capacity; index < hi; index++){
+        map_meta_t meta = self -> meta[index];
+        if (meta.state == MAP_EMPTY){
+            *found = -1;
+            if (*freeSlot == -1){
+                *freeSlot = index;
             }
+            return true;
         }
-
-        // else if the key lengths aren't the same, then probe until same key or tombstone is found
-        int oldIndex = index;
-        oldIndex += 1;
-        int currIndex = 0;
-
-        // as long as we have not looped all the way around, keep incrementing and checking index % capacity
-        while ((oldIndex % self -> capacity) != index){
-            currIndex = oldIndex % self -> capacity;
-            if (self -> nodes[currIndex].key.key_len == 0 || self -> nodes[currIndex].tombstone == true){
-                self -> nodes[currIndex].key = key;
-                self -> nodes[currIndex].val = val;
-                self -> size += 1;
-                self -> nodes[currIndex].tombstone = false;
-
-                // unlock and return
-                pthread_mutex_unlock(&self -> write_lock);
+        if (meta.state == MAP_LIVE && meta.tag == tag && meta.key_len == len){
+            map_node_t *node = &self -> nodes[index];
+            if (node -> key.key_len == key.key_len && memcmp(node -> key.key_base, key.key_base, key.key_len) == 0){
+                *found = index;
                 return true;
             }
+        }
+        if (*freeSlot == -1 && meta.state == MAP_TOMBSTONE){
+            *freeSlot = index;
+        }
+    }
+    return false;
+}
 
-            oldIndex += 1;
+static void *fill_region(void *vargp){
+    bulk_region_t *region = vargp;
+    hashmap_t *self = region -> map;
+    for (size_t i = 0; i < region -> count; i++){
+        map_entry_t *entry = &region -> entries[region -> order[i]];
+        int found, freeSlot;
+        if (probe_region(self, entry -> key, entry -> hash, region -> hi, &found, &freeSlot) == false){
+            region -> order[region -> deferred++] = region -> order[i];
+        }
+        else if (found != -1){
+            replace(self, found, entry -> key, entry -> val);
+            entry -> stored = true;
+        }
+        else{
+            fill(self, freeSlot, entry -> key, entry -> val, entry -> hash);
+            region -> added += 1;
+            entry -> stored = true;
         }
     }
-    // so we looped all the way around, and there were no open slots or dead slots.
-    // this means that we need to check the force parameter
-    if (force == true){
-        // destory the old node
-        self -> destroy_function(self -> nodes[index].key, self -> nodes[index].val);
+    // what this thread replaced goes to the reclaimer before it goes away
+    retire_flush();
+    return NULL;
+}
+
+bool bulk_put(hashmap_t *self, map_entry_t *entries, size_t count, int threads) {
+    if (self == NULL || (entries == NULL && count > 0) || threads < 1){
+        errno = EINVAL;
+        return false;
+    }
+
+    // one region per thread, and every thread gets enough to be worth it
+    uint32_t regions = threads;
+    if (regions > count / MAP_BULK_PER_THREAD){
+        regions = count / MAP_BULK_PER_THREAD > 0 ? count / MAP_BULK_PER_THREAD : 1;
+    }
+    if (regions > self -> capacity){
+        regions = self -> capacity;
+    }
+    uint32_t *order = malloc(count * sizeof(uint32_t) + 1);
+    bulk_region_t *region = calloc(regions, sizeof(bulk_region_t));
+    pthread_t *tids = calloc(regions, sizeof(pthread_t));
+    bool *started = calloc(regions, sizeof(bool));
+    if (order == NULL || region == NULL || tids == NULL || started == NULL){
+        free(order);
+        free(region);
+        free(tids);
+        free(started);
+        errno = ENOMEM;
+        return false;
+    }
 
-        // just simply put it at the required index.
-        self -> nodes[index].key = key;
-        self -> nodes[index].val = val;
+    // region r owns the slots from ceil(r * capacity / regions) up to the next
+    // one's, so an entry's region is worked out from its home slot alone.
+    // counting sort the entries by region, keeping batch order in each
+    int error = 0;
+    for (uint32_t r = 0; r < regions; r++){
+        region[r] = (bulk_region_t) {.map = self, .entries = entries, .lo = ((uint64_t) self -> capacity * r + regions - 1) / regions};
+    }
+    for (uint32_t r = 0; r < regions; r++){
+        region[r].hi = r + 1 < regions ? region[r + 1].lo : self -> capacity;
+    }
+    for (size_t i = 0; i < count; i++){
+        entries[i].stored = false;
+        if (entries[i].key.key_base == NULL || entries[i].val.val_base == NULL || entries[i].key.key_len == 0 || entries[i].val.val_len == 0){
+            error = EINVAL;
+            continue;
+        }
+        region[(uint64_t) (entries[i].hash % self -> capacity) * regions / self -> capacity].count += 1;
+    }
+    size_t next = 0;
+    for (uint32_t r = 0; r < regions; r++){
+        region[r].order = order + next;
+        next += region[r].count;
+        region[r].count = 0;
+    }
+    for (size_t i = 0; i < count; i++){
+        if (entries[i].key.key_base != NULL && entries[i].val.val_base != NULL && entries[i].key.key_len != 0 && entries[i].val.val_len != 0){
+            bulk_region_t *home = &region[(uint64_t) (entries[i].hash % self -> capacity) * regions / self -> capacity];
+            home -> order[home -> count++] = i;
+        }
+    }
 
+    // the lock is taken once, and every region is filled at the same time
+    pthread_mutex_lock(&self -> write_lock);
+    if (self -> invalid == true){
         pthread_mutex_unlock(&self -> write_lock);
-        return true;
+        free(order);
+        free(region);
+        free(tids);
+        free(started);
+        errno = EINVAL;
+        return false;
+    }
+    for (uint32_t r = 1; r < regions; r++){
+        started[r] = pthread_create(&tids[r], NULL, fill_region, &region[r]) == 0;
+    }
+    // we take the first region, and any a thread couldn't be started for
+    fill_region(&region[0]);
+    for (uint32_t r = 1; r < regions; r++){
+        if (started[r] == true){
+            pthread_join(tids[r], NULL);
+        }
+        else{
+            fill_region(&region[r]);
+        }
     }
 
-    // if we are not forcing, and the map is full, set errno to enomem
-    errno = ENOMEM;
+    // the ones that ran out of their region go in one at a time, in order
+    for (uint32_t r = 0; r < regions; r++){
+        self -> size += region[r].added;
+        for (size_t i = 0; i < region[r].deferred; i++){
+            map_entry_t *entry = &entries[region[r].order[i]];
+            entry -> stored = put_locked(self, entry -> key, entry -> val, entry -> hash, false);
+            if (entry -> stored == false){
+                error = ENOMEM;
+            }
+        }
+    }
     pthread_mutex_unlock(&self -> write_lock);
-    return false;
+
+    free(order);
+    free(region);
+    free(tids);
+    free(started);
+    if (error != 0){
+        errno = error;
+        return false;
+    }
+    return true;
 }
 
 map_val_t get(hashmap_t *self, map_key_t key) {
@@ -164,54 +431,65 @@ map_val_t get(hashmap_t *self, map_key_t key) {
     }
 
     // if none of them are null, we are reading. first grab the mutex to increase num readers
-    pthread_mutex_lock(&self -> fields_lock);
-    self -> num_readers += 1;
-    if (self -> num_readers == 1){
-        pthread_mutex_lock(&self -> write_lock);
-    }
-    pthread_mutex_unlock(&self -> fields_lock);
+    read_lock(self);
 
     // now we have complete control over reading
-    // use the key to calculate the index for which we have to read
-    int index = get_index(self, key);
-    int oldIndex = index + 1;
-    int currIndex = 0;
-    void* returnAddy = NULL;
-    int len = 0;
-
+    map_val_t val = MAP_VAL(NULL, 0);
     if (self -> invalid == false){
-
-        if (self -> nodes[index].key.key_len == key.key_len){
-            if (memcmp(self -> nodes[index].key.key_base, key.key_base, key.key_len) == 0  &&  self -> nodes[index].tombstone == false){
-                // if they're the same key, store the variable
-                returnAddy = self -> nodes[index].val.val_base;
-                len = self -> nodes[index].val.val_len;
-            }
+        int index = probe(self, key, self -> hash_function(key), NULL);
+        if (index != -1){
+            val = self -> nodes[index].val;
         }
+    }
 
-        while ((oldIndex % (self -> capacity)) != index){
-            currIndex = oldIndex % self -> capacity;
-            if (self -> nodes[currIndex].key.key_len == key.key_len){
-                if (memcmp(self -> nodes[currIndex].key.key_base, key.key_base, key.key_len) == 0 && self -> nodes[currIndex].tombstone == false){
-                    returnAddy = self -> nodes[currIndex].val.val_base;
-                    len = self -> nodes[currIndex].val.val_len;
-                }
-            }
-            oldIndex += 1;
+    // after all is read, we decrease num readers
+    read_unlock(self);
+
+    if (val.val_base == NULL)
+        errno = EINVAL;
+    return val;
+}
+
+bool map_walk(hashmap_t *self, map_walk_f func, void *arg) {
+    if (self == NULL || func == NULL){
+        errno = EINVAL;
+        return false;
+    }
+
+    // walk as a reader, same as get()
+    read_lock(self);
+
+    bool finished = self -> invalid == false;
+    for (uint32_t i = 0; i < self -> capacity && finished == true; i++){
+        if (self -> meta[i].state == MAP_LIVE){
+            finished = func(self -> nodes[i].key, self -> nodes[i].val, 0, arg);
         }
     }
 
-    // at this point, the value is either null, 0 or it was set in one of the loops. unlock the stuff and return
-    // after all is read, we decrease num readers
-    pthread_mutex_lock(&self -> fields_lock);
-    self -> num_readers -= 1;
-    if (self -> num_readers == 0)
-        pthread_mutex_unlock(&self -> write_lock);
-    pthread_mutex_unlock(&self -> fields_lock);
+    read_unlock(self);
+
+    if (finished == false)
+        errno = EINVAL;
+    return finished;
+}
 
-    if (returnAddy == NULL)
+uint32_t map_tombstones(hashmap_t *self) {
+    if (self == NULL){
         errno = EINVAL;
-    return MAP_VAL(returnAddy, len);
+        return 0;
+    }
+
+    read_lock(self);
+
+    uint32_t tombstones = 0;
+    for (uint32_t i = 0; self -> invalid == false && i < self -> capacity; i++){
+        if (self -> meta[i].state == MAP_TOMBSTONE){
+            tombstones += 1;
+        }
+    }
+
+    read_unlock(self);
+    return tombstones;
 }
 
 map_node_t delete(hashmap_t *self, map_key_t key) {
@@ -230,43 +508,65 @@ map_node_t delete(hashmap_t *self, map_key_t key) {
         return MAP_NODE(MAP_KEY(NULL, 0), MAP_VAL(NULL, 0), false);
     }
 
-    int index = get_index(self, key);
-    int oldIndex = index + 1;
-    int currIndex = 0;
+    int index = probe(self, key, self -> hash_function(key), NULL);
 
-    if (self -> invalid == false){
+    // if here, then not found
+    if (index == -1){
+        pthread_mutex_unlock(&self -> write_lock);
+        return MAP_NODE(MAP_KEY(NULL, 0), MAP_VAL(NULL, 0), false);
+    }
 
-        if (self -> nodes[index].key.key_len == key.key_len){
-            if (memcmp(self -> nodes[index].key.key_base, key.key_base, key.key_len) == 0  &&  self -> nodes[index].tombstone == false){
-                // if they're the same key, store the variable
-                self -> nodes[index].tombstone = true;
-                self -> size -= 1;
-                map_node_t returnVal = self -> nodes[index];
-                // unlock
-                pthread_mutex_unlock(&self -> write_lock);
-                return returnVal;
-            }
-        }
+    bury(self, index);
+    self -> size -= 1;
+    map_node_t returnVal = self -> nodes[index];
 
-        while ((oldIndex % (self -> capacity)) != index){
-            currIndex = oldIndex % self -> capacity;
-            if (self -> nodes[currIndex].key.key_len == key.key_len){
-                if (memcmp(self -> nodes[currIndex].key.key_base, key.key_base, key.key_len) == 0 && self -> nodes[currIndex].tombstone == false){
-                    self -> nodes[currIndex].tombstone = true;
-                    self -> size -= 1;
-                    map_node_t returnVal = self -> nodes[currIndex];
-                    // unlock
-                    pthread_mutex_unlock(&self -> write_lock);
-                    return returnVal;
-                }
+    pthread_mutex_unlock(&self -> write_lock);
+    return returnVal;
+}
+
+/*
+ * Destroys every live entry and empties the table. With later, the entries
+ * are retired instead, for readers that may still have them. Caller holds
+ * the write lock.
+ */
+static void destroy_all(hashmap_t *self, bool later){
+    for (uint32_t i = 0; i < self -> capacity; i++){
+        if (self -> meta[i].state == MAP_LIVE){
+            if (later == true){
+                retire(self -> destroy_function, self -> nodes[i].key, self -> nodes[i].val);
+            }
+            else{
+                self -> destroy_function(self -> nodes[i].key, self -> nodes[i].val);
             }
-            oldIndex += 1;
+            self -> nodes[i].tombstone = true;
         }
     }
+    // no tombstones left behind, so probes stop early again
+    memset(self -> meta, 0, (size_t) self -> capacity * sizeof(map_meta_t));
+    self -> size = 0;
+}
 
-    // if here, then not found
-    pthread_mutex_unlock(&self -> write_lock);
-    return MAP_NODE(MAP_KEY(NULL, 0), MAP_VAL(NULL, 0), false);
+// a table that was swapped out by clear_map(), waiting for the reclaimer
+typedef struct map_graveyard_t {
+    uint32_t capacity;
+    map_meta_t *meta;
+    map_node_t *nodes;
+    destructor_f destroy_function;
+} map_graveyard_t;
+
+/*
+ * Reclaimer job: destroys what was left in a swapped out table, then the table.
+ */
+static void destroy_graveyard(void *arg){
+    map_graveyard_t *graveyard = arg;
+    for (uint32_t i = 0; i < graveyard -> capacity; i++){
+        if (graveyard -> meta[i].state == MAP_LIVE){
+            graveyard -> destroy_function(graveyard -> nodes[i].key, graveyard -> nodes[i].val);
+        }
+    }
+    table_free(graveyard -> nodes, graveyard -> capacity, sizeof(map_node_t));
+    table_free(graveyard -> meta, graveyard -> capacity, sizeof(map_meta_t));
+    free(graveyard);
 }
 
 bool clear_map(hashmap_t *self) {
@@ -276,6 +576,18 @@ bool clear_map(hashmap_t *self) {
         return false;
     }
 
+    // get an empty table ready before taking the lock. if we can't, fall back
+    // to emptying the one we have
+    map_graveyard_t *graveyard = malloc(sizeof(map_graveyard_t));
+    map_node_t *nodes = table_alloc(self -> capacity, sizeof(map_node_t));
+    map_meta_t *meta = table_alloc(self -> capacity, sizeof(map_meta_t));
+    if (graveyard == NULL || nodes == NULL || meta == NULL){
+        free(graveyard);
+        table_free(nodes, self -> capacity, sizeof(map_node_t));
+        table_free(meta, self -> capacity, sizeof(map_meta_t));
+        graveyard = NULL;
+    }
+
     // grab the mutex
     pthread_mutex_lock(&self -> write_lock);
 
@@ -283,21 +595,32 @@ bool clear_map(hashmap_t *self) {
     if (self -> invalid == true){
         errno = EINVAL;
         pthread_mutex_unlock(&self -> write_lock);
+        if (graveyard != NULL){
+            free(graveyard);
+            table_free(nodes, self -> capacity, sizeof(map_node_t));
+            table_free(meta, self -> capacity, sizeof(map_meta_t));
+        }
         return false;
     }
 
-    // if not invalid, go through each node and destroy it if its tombstone status is false
-    for (int i = 0; i < self -> capacity; i++){
-        if (self -> nodes[i].tombstone == false && self -> nodes[i].key.key_len != 0){
-            self -> destroy_function(self -> nodes[i].key, self -> nodes[i].val);
-            self -> nodes[i].tombstone = true;
-        }
+    if (graveyard == NULL){
+        destroy_all(self, true);
+        pthread_mutex_unlock(&self -> write_lock);
+        return true;
     }
 
-    // set size to 0
+    // swap in the empty table. the old entries are destroyed in the
+    // background, so clearing takes as long as the swap whatever the size
+    graveyard -> capacity = self -> capacity;
+    graveyard -> meta = self -> meta;
+    graveyard -> nodes = self -> nodes;
+    graveyard -> destroy_function = self -> destroy_function;
+    self -> meta = meta;
+    self -> nodes = nodes;
     self -> size = 0;
 
     pthread_mutex_unlock(&self -> write_lock);
+    reclaim_later(destroy_graveyard, graveyard);
 	return true;
 }
 
@@ -318,21 +641,65 @@ bool invalidate_map(hashmap_t *self) {
         return false;
     }
 
-    // clear the map
-    // if not invalid, go through each node and destroy it if its tombstone status is false
-    for (int i = 0; i < self -> capacity; i++){
-        if (self -> nodes[i].tombstone == false && self -> nodes[i].key.key_len != 0){
-            self -> destroy_function(self -> nodes[i].key, self -> nodes[i].val);
-            self -> nodes[i].tombstone = true;
-        }
-    }
-    self -> size = 0;
-    // invalidate it
+    // clear the map, then invalidate it
+    destroy_all(self, false);
     self -> invalid = true;
-    // free the node pointer
-    free (self-> nodes);
+    // free the node and metadata arrays
+    table_free(self -> nodes, self -> capacity, sizeof(map_node_t));
+    table_free(self -> meta, self -> capacity, sizeof(map_meta_t));
 
     // unlock and return
     pthread_mutex_unlock(&self -> write_lock);
     return true;
 }
+
+int evict_range(hashmap_t *self, const void *lo, const void *hi) {
+    if (self == NULL || lo == NULL || hi == NULL){
+        errno = EINVAL;
+        return 0;
+    }
+
+    // what we evict is ours to destroy, not the reclaimer's
+    retire_hold();
+
+    // nothing is indexed by address, so look at every live node. the lock
+    // is let go every MAP_EVICT_CHUNK nodes, so puts and gets aren't held
+    // up for a whole pass
+    int evicted = 0;
+    bool valid = true;
+    for (int first = 0; valid == true && first < self -> capacity; first += MAP_EVICT_CHUNK){
+        pthread_mutex_lock(&self -> write_lock);
+        valid = self -> invalid == false;
+        for (int i = first; valid == true && i < self -> capacity && i < first + MAP_EVICT_CHUNK; i++){
+            if (self -> meta[i].state != MAP_LIVE){
+                continue;
+            }
+            char *key = self -> nodes[i].key.key_base;
+            char *val = self -> nodes[i].val.val_base;
+            if ((key >= (char *) lo && key < (char *) hi) || (val >= (char *) lo && val < (char *) hi)){
+                retire(self -> destroy_function, self -> nodes[i].key, self -> nodes[i].val);
+                bury(self, i);
+                self -> size -= 1;
+                evicted += 1;
+            }
+        }
+        pthread_mutex_unlock(&self -> write_lock);
+    }
+
+    // the caller wants the memory back, so see it destroyed before returning.
+    // only our own evictions are waited for, not whatever else is queued
+    retire_sync();
+    if (valid == false){
+        errno = EINVAL;
+    }
+    return evicted;
+}
+
+bool prefault_map(hashmap_t *self, int threads) {
+    if (self == NULL || self -> invalid == true){
+        errno = EINVAL;
+        return false;
+    }
+    return table_prefault(self -> meta, self -> capacity, sizeof(map_meta_t), threads) &&
+           table_prefault(self -> nodes, self -> capacity, sizeof(map_node_t), threads);
+}
@@ -0,0 +1,252 @@
+#include "hotkeys.h"
+#include "slab.h"
+#include "reclaim.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// where save_hot_keys() is in the file it's writing
+typedef struct hotkeys_writer_t {
+    FILE *file;
+    uint64_t count;
+} hotkeys_writer_t;
+
+// what the loader threads share
+typedef struct hotkeys_loader_t {
+    store_t *store;
+    const char *base;
+    const uint64_t *keys;   // offset of every key's length in the file
+    uint64_t count;
+    fetch_f fetch;
+    void *arg;
+    atomic_uint_fast64_t next_key;
+    atomic_uint_fast64_t loaded;
+    atomic_int error;
+} hotkeys_loader_t;
+
+static bool write_key(map_key_t key, map_val_t val, uint64_t age_ms, void *arg){
+    hotkeys_writer_t *writer = arg;
+    uint32_t keyLen = key.key_len;
+    if (fwrite(&keyLen, sizeof(keyLen), 1, writer -> file) != 1 || fwrite(key.key_base, 1, keyLen, writer -> file) != keyLen){
+        return false;
+    }
+    writer -> count += 1;
+    return true;
+}
+
+bool save_hot_keys(store_t *store, const char *path, uint32_t count){
+    if (store == NULL || path == NULL){
+        errno = EINVAL;
+        return false;
+    }
+
+    errno = 0;
+    char *tmpPath = malloc(strlen(path) + sizeof(".tmp"));
+    hotkeys_writer_t writer = {0};
+    hotkeys_header_t header = {.version = HOTKEYS_VERSION};
+    memcpy(header.magic, HOTKEYS_MAGIC, sizeof(header.magic));
+    bool saved = false;
+
+    if (tmpPath == NULL){
+        goto done;
+    }
+    sprintf(tmpPath, "%s.tmp", path);
+    writer.file = fopen(tmpPath, "w");
+    if (writer.file == NULL){
+        goto done;
+    }
+
+    // the header is written for real once we know how many keys there are
+    if (fwrite(&header, sizeof(header), 1, writer.file) != 1 || store_hottest(store, count, write_key, &writer) == false){
+        goto done;
+    }
+    header.count = writer.count;
+    if (fseek(writer.file, 0, SEEK_SET) != 0 || fwrite(&header, sizeof(header), 1, writer.file) != 1 ||
+        fflush(writer.file) != 0 || fsync(fileno(writer.file)) != 0){
+        goto done;
+    }
+    saved = true;
+
+done:
+    if (writer.file != NULL){
+        int error = errno;
+        saved = fclose(writer.file) == 0 && saved;
+        // swap it in, or get rid of what we wrote
+        if (saved == true){
+            saved = rename(tmpPath, path) == 0;
+        }
+        if (saved == false){
+            unlink(tmpPath);
+            errno = error;
+        }
+    }
+    if (saved == false && errno == 0){
+        errno = EIO;
+    }
+    free(tmpPath);
+    return saved;
+}
+
+/*
+ * Fetches and puts one key.
+ *
+ * @return false if the store is full
+ */
+static bool load_key(hotkeys_loader_t *loader, uint64_t i){
+    uint32_t keyLen;
+    memcpy(&keyLen, loader -> base + loader -> keys[i], sizeof(keyLen));
+    map_key_t fileKey = MAP_KEY((void *) (loader -> base + loader -> keys[i] + sizeof(keyLen)), keyLen);
+
+    map_val_t val = MAP_VAL(NULL, 0);
+    uint64_t age = 0;
+    if (loader -> fetch(fileKey, &val, &age, loader -> arg) == false || val.val_base == NULL){
+        return true;
+    }
+    char *key = slab_alloc(keyLen);
+    if (key == NULL){
+        slab_free(val.val_base);
+        errno = ENOMEM;
+        return false;
+    }
+    memcpy(key, fileKey.key_base, keyLen);
+
+    if (store_put_aged(loader -> store, MAP_KEY(key, keyLen), val, age, false) == false){
+        slab_free(key);
+        slab_free(val.val_base);
+        errno = ENOMEM;
+        return false;
+    }
+    atomic_fetch_add_explicit(&loader -> loaded, 1, memory_order_relaxed);
+    return true;
+}
+
+static void *load_keys(void *vargp){
+    hotkeys_loader_t *loader = vargp;
+
+    uint64_t first;
+    while (atomic_load_explicit(&loader -> error, memory_order_relaxed) == 0 &&
+           (first = atomic_fetch_add(&loader -> next_key, HOTKEYS_BATCH)) < loader -> count){
+        for (uint64_t i = first; i < first + HOTKEYS_BATCH && i < loader -> count; i++){
+            if (load_key(loader, i) == false){
+                atomic_store(&loader -> error, errno);
+                break;
+            }
+        }
+    }
+
+    // this thread is about to go away, don't strand anything in its caches
+    retire_flush();
+    slab_flush_cache();
+    return NULL;
+}
+
+bool load_hot_keys(store_t *store, const char *path, fetch_f fetch, void *arg, int threads, uint64_t *loaded){
+    if (loaded != NULL){
+        *loaded = 0;
+    }
+    if (store == NULL || path == NULL || fetch == NULL || threads < 1){
+        errno = EINVAL;
+        return false;
+    }
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0){
+        return false;
+    }
+    struct stat info;
+    if (fstat(fd, &info) != 0 || info.st_size < sizeof(hotkeys_header_t)){
+        close(fd);
+        errno = EINVAL;
+        return false;
+    }
+    size_t size = info.st_size;
+    char *base = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED){
+        return false;
+    }
+
+    hotkeys_header_t header;
+    memcpy(&header, base, sizeof(header));
+    if (memcmp(header.magic, HOTKEYS_MAGIC, sizeof(header.magic)) != 0 || header.version != HOTKEYS_VERSION ||
+        header.count > (size - sizeof(header)) / (sizeof(uint32_t) + 1)){
+        munmap(base, size);
+        errno = EINVAL;
+        return false;
+    }
+
+    // keys have different lengths, so find them all before sharing them out
+    uint64_t *keys = malloc(header.count * sizeof(uint64_t) + 1);
+    if (keys == NULL){
+        munmap(base, size);
+        return false;
+    }
+    uint64_t pos = sizeof(header);
+    for (uint64_t i = 0; i < header.count; i++){
+        uint32_t keyLen;
+        if (size - pos < sizeof(keyLen)){
+            break;
+        }
+        memcpy(&keyLen, base + pos, sizeof(keyLen));
+        if (keyLen == 0 || size - pos - sizeof(keyLen) < keyLen){
+            break;
+        }
+        keys[i] = pos;
+        pos += sizeof(keyLen) + keyLen;
+    }
+    if (pos != size){
+        free(keys);
+        munmap(base, size);
+        errno = EINVAL;
+        return false;
+    }
+
+    hotkeys_loader_t loader = {
+        .store = store,
+        .base = base,
+        .keys = keys,
+        .count = header.count,
+        .fetch = fetch,
+        .arg = arg,
+    };
+    atomic_init(&loader.next_key, 0);
+    atomic_init(&loader.loaded, 0);
+    atomic_init(&loader.error, 0);
+
+    uint64_t batches = (header.count + HOTKEYS_BATCH - 1) / HOTKEYS_BATCH;
+    if (threads > batches){
+        threads = batches > 0 ? batches : 1;
+    }
+    pthread_t *tids = calloc(threads, sizeof(pthread_t));
+    bool *started = calloc(threads, sizeof(bool));
+    for (int i = 1; tids != NULL && started != NULL && i < threads; i++){
+        started[i] = pthread_create(&tids[i], NULL, load_keys, &loader) == 0;
+    }
+    // we pitch in too, and finish the job alone if no thread could be started
+    load_keys(&loader);
+    for (int i = 1; tids != NULL && started != NULL && i < threads; i++){
+        if (started[i] == true){
+            pthread_join(tids[i], NULL);
+        }
+    }
+    free(tids);
+    free(started);
+    free(keys);
+    munmap(base, size);
+
+    if (loaded != NULL){
+        *loaded = atomic_load(&loader.loaded);
+    }
+    if (atomic_load(&loader.error) != 0){
+        errno = atomic_load(&loader.error);
+        return false;
+    }
+    return true;
+}
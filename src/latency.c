@@ -0,0 +1,129 @@
+#include "latency.h"
+#include "clock.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+// values per bucket doubles every this many buckets
+#define HALF (1 << (LATENCY_SUB_BITS - 1))
+
+// one thread's histograms
+typedef struct latency_t {
+    _Atomic uint64_t counts[LATENCY_HISTOGRAMS][LATENCY_BUCKETS];
+    struct latency_t *next;
+} latency_t;
+
+static const char *stageNames[] = {
+    [LATENCY_QUEUE - LATENCY_REQUESTS] = "queue",
+    [LATENCY_PARSE - LATENCY_REQUESTS] = "parse",
+    [LATENCY_READ - LATENCY_REQUESTS] = "read",
+    [LATENCY_MAP - LATENCY_REQUESTS] = "map",
+    [LATENCY_WRITE - LATENCY_REQUESTS] = "write",
+};
+
+// every thread's histograms, pushed onto the same way as the counters
+static _Atomic(latency_t *) allLatency = NULL;
+static pthread_mutex_t registerLock = PTHREAD_MUTEX_INITIALIZER;
+static __thread latency_t *myLatency = NULL;
+// when the calling thread's current stage started
+static __thread uint64_t stageStart = 0;
+
+static latency_t *register_latency(void){
+    // most buckets are never touched, so most of this is never faulted in
+    latency_t *latency = calloc(1, sizeof(latency_t));
+    if (latency == NULL){
+        return NULL;
+    }
+    pthread_mutex_lock(&registerLock);
+    latency -> next = atomic_load_explicit(&allLatency, memory_order_relaxed);
+    atomic_store_explicit(&allLatency, latency, memory_order_release);
+    pthread_mutex_unlock(&registerLock);
+    myLatency = latency;
+    return latency;
+}
+
+/*
+ * The bucket a value goes in. Below 2 * HALF, the value itself. Above, the
+ * top LATENCY_SUB_BITS bits of the value pick it, and how far the value had
+ * to be shifted to get them says which power of two it's in.
+ */
+static int bucket_of(uint64_t ns){
+    if (ns < 2 * HALF){
+        return ns;
+    }
+    int shift = 63 - __builtin_clzll(ns) - (LATENCY_SUB_BITS - 1);
+    return shift * HALF + (ns >> shift);
+}
+
+/*
+ * @return The highest value that goes in a bucket
+ */
+static uint64_t bucket_top(int bucket){
+    if (bucket < 2 * HALF){
+        return bucket;
+    }
+    int shift = bucket / HALF - 1;
+    uint64_t top = bucket - shift * HALF;
+    return ((top + 1) << shift) - 1;
+}
+
+uint64_t latency_start(void){
+    stageStart = precise_now_ns();
+    return stageStart;
+}
+
+void latency_stage(int histogram){
+    uint64_t now = precise_now_ns();
+    latency_record(histogram, now - stageStart);
+    stageStart = now;
+}
+
+void latency_record(int histogram, uint64_t ns){
+    latency_t *latency = myLatency;
+    if (latency == NULL && (latency = register_latency()) == NULL){
+        return;
+    }
+    // we're the only writer, so there's no need for a locked add
+    _Atomic uint64_t *count = &latency -> counts[histogram][bucket_of(ns)];
+    atomic_store_explicit(count, atomic_load_explicit(count, memory_order_relaxed) + 1, memory_order_relaxed);
+}
+
+void latency_merge(int histogram, latency_hist_t *merged){
+    memset(merged, 0, sizeof(latency_hist_t));
+    for (latency_t *latency = atomic_load_explicit(&allLatency, memory_order_acquire); latency != NULL; latency = latency -> next){
+        for (int i = 0; i < LATENCY_BUCKETS; i++){
+            uint64_t count = atomic_load_explicit(&latency -> counts[histogram][i], memory_order_relaxed);
+            merged -> counts[i] += count;
+            merged -> total += count;
+        }
+    }
+}
+
+uint64_t latency_percentile(latency_hist_t *hist, double percentile){
+    if (hist -> total == 0){
+        return 0;
+    }
+    // the rank of the value we want, counting from 1
+    uint64_t rank = (uint64_t) (percentile / 100 * hist -> total + 0.5);
+    if (rank < 1){
+        rank = 1;
+    }
+    uint64_t seen = 0;
+    for (int i = 0; i < LATENCY_BUCKETS; i++){
+        seen += hist -> counts[i];
+        if (seen >= rank){
+            return bucket_top(i);
+        }
+    }
+    return bucket_top(LATENCY_BUCKETS - 1);
+}
+
+const char *latency_name(int histogram){
+    if (histogram < 0 || histogram >= LATENCY_HISTOGRAMS){
+        return NULL;
+    }
+    if (histogram < LATENCY_REQUESTS){
+        return stats_name(histogram);
+    }
+    return stageNames[histogram - LATENCY_REQUESTS];
+}
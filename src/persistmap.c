@@ -0,0 +1,860 @@
+#define _GNU_SOURCE
+#include "utils.h"
+#include "stats.h"
+#include "reclaim.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// the top bit of key_len marks a tombstone, the rest is the length
+#define SLOT_TOMBSTONE 0x8000
+#define SLOT_LEN_MASK 0x7fff
+// limbo keeps a chunk's class in the offset's low bits, chunks are 16 byte aligned
+#define LIMBO_CLASS_MASK ((uint64_t) PERSIST_MIN_CHUNK - 1)
+
+_Static_assert(sizeof(map_slot_t) == 32, "map_slot_t should pack into 32 bytes");
+_Static_assert(sizeof(persist_header_t) <= PERSIST_HEADER_BYTES, "persist_header_t should fit its page");
+
+// a chunk some live slot uses, while a file's allocator is rebuilt
+typedef struct chunk_ref_t {
+    uint64_t off;
+    uint64_t size;
+    uint32_t slot;
+} chunk_ref_t;
+
+static int chunk_class(size_t len){
+    int class = 0;
+    while (((size_t) PERSIST_MIN_CHUNK << class) < len){
+        class += 1;
+    }
+    return class;
+}
+
+static uint64_t class_size(int class){
+    return (uint64_t) PERSIST_MIN_CHUNK << class;
+}
+
+/*
+ * FNV-1a over the slot, up to its checksum.
+ */
+static uint32_t slot_check(const map_slot_t *slot){
+    const uint8_t *bytes = (const uint8_t *) slot;
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < offsetof(map_slot_t, check); i++){
+        hash = (hash ^ bytes[i]) * 16777619u;
+    }
+    return hash;
+}
+
+static bool slot_live(map_slot_t *slot){
+    return slot -> key_len != 0 && (slot -> key_len & SLOT_TOMBSTONE) == 0;
+}
+
+static void slot_bury(map_slot_t *slot){
+    // keep the length, so lookups for keys further along don't stop here
+    slot -> key_len |= SLOT_TOMBSTONE;
+    slot -> check = slot_check(slot);
+}
+
+static bool slot_matches(hashmap_t *self, map_slot_t *slot, map_key_t key, uint32_t hash){
+    return slot_live(slot) == true && slot -> key_len == key.key_len && slot -> hash == hash &&
+           memcmp(self -> base + slot -> key_off, key.key_base, key.key_len) == 0;
+}
+
+/*
+ * Whether something lies in the map's own mapping.
+ */
+static bool owned(hashmap_t *self, const void *ptr){
+    return (const char *) ptr >= self -> base && (const char *) ptr < self -> base + self -> map_size;
+}
+
+/*
+ * Looks for a key, starting at its home slot. A slot that was never used ends
+ * the search, since the key would have been put there. Sets *freeSlot to the
+ * first tombstone or empty slot on the way, or -1 if the table is full.
+ *
+ * @return The index of the live slot holding the key, or -1
+ */
+static int probe(hashmap_t *self, map_key_t key, uint32_t hash, int *freeSlot){
+    uint32_t index = hash % self -> capacity;
+    int firstFree = -1;
+
+    for (uint32_t i = 0; i < self -> capacity; i++){
+        map_slot_t *slot = &self -> slots[index];
+        if (slot -> key_len == 0){
+            if (firstFree == -1){
+                firstFree = index;
+            }
+            break;
+        }
+        if (slot_matches(self, slot, key, hash) == true){
+            if (freeSlot != NULL){
+                *freeSlot = firstFree;
+            }
+            return index;
+        }
+        if (firstFree == -1 && slot_live(slot) == false){
+            firstFree = index;
+        }
+        index = index + 1 == self -> capacity ? 0 : index + 1;
+    }
+
+    if (freeSlot != NULL){
+        *freeSlot = firstFree;
+    }
+    return -1;
+}
+
+/*
+ * Puts a chunk on its free list, to be handed out again right away.
+ */
+static void release_chunk(hashmap_t *self, uint64_t off, int class){
+    *(uint64_t *) (self -> base + off) = self -> free_heads[class];
+    self -> free_heads[class] = off;
+}
+
+/*
+ * Makes room at the end of limbo, by sliding what's still waiting to the
+ * front if at least half of it was handed back, else by growing it.
+ */
+static bool grow_limbo(hashmap_t *self){
+    if (self -> limbo_head > 0 && self -> limbo_head >= self -> limbo_len / 2){
+        uint32_t waiting = self -> limbo_len - self -> limbo_head;
+        memmove(self -> limbo, self -> limbo + self -> limbo_head, waiting * sizeof(persist_limbo_t));
+        self -> limbo_stamped -= self -> limbo_head;
+        self -> limbo_len = waiting;
+        self -> limbo_head = 0;
+        return true;
+    }
+    uint32_t cap = self -> limbo_cap == 0 ? PERSIST_LIMBO_BATCH * 4 : self -> limbo_cap * 2;
+    persist_limbo_t *limbo = realloc(self -> limbo, cap * sizeof(persist_limbo_t));
+    if (limbo == NULL){
+        return false;
+    }
+    self -> limbo = limbo;
+    self -> limbo_cap = cap;
+    return true;
+}
+
+/*
+ * Frees a chunk someone may still be reading. It waits in limbo until they're
+ * done, see drain_limbo(). If limbo can't grow, the chunk is lost until the
+ * file is opened again, which beats handing it out under a reader.
+ */
+static void free_chunk(hashmap_t *self, uint64_t off, int class){
+    if (self -> limbo_len == self -> limbo_cap && grow_limbo(self) == false){
+        return;
+    }
+    self -> limbo[self -> limbo_len++] = (persist_limbo_t) {.chunk = off | class, .stamp = 0};
+}
+
+/*
+ * Gives a range of the file's pages back, which reads back as zeroes.
+ */
+static bool drop_pages(hashmap_t *self, uint64_t off, uint64_t length){
+    if (self -> fd >= 0){
+        return fallocate(self -> fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, off, length) == 0;
+    }
+    return madvise(self -> base + off, length, MADV_DONTNEED) == 0;
+}
+
+/*
+ * Stamps the chunks freed since the last stamp, once there are
+ * PERSIST_LIMBO_BATCH of them (or any at all, with everything), then hands
+ * back every chunk whose readers are done with it, and the arena a clear
+ * emptied once its readers are. A stamp per batch keeps puts from all
+ * bumping the global epoch.
+ */
+static void drain_limbo(hashmap_t *self, bool everything){
+    uint32_t unstamped = self -> limbo_len - self -> limbo_stamped;
+    if (unstamped > 0 && (everything == true || unstamped >= PERSIST_LIMBO_BATCH)){
+        uint64_t stamp = reclaim_stamp();
+        for (uint32_t i = self -> limbo_stamped; i < self -> limbo_len; i++){
+            self -> limbo[i].stamp = stamp;
+        }
+        self -> limbo_stamped = self -> limbo_len;
+    }
+
+    // stamps go up along limbo, so stop at the first one that hasn't passed
+    while (self -> limbo_head < self -> limbo_stamped){
+        uint64_t stamp = self -> limbo[self -> limbo_head].stamp;
+        if (reclaim_passed(stamp) == false){
+            break;
+        }
+        while (self -> limbo_head < self -> limbo_stamped && self -> limbo[self -> limbo_head].stamp == stamp){
+            uint64_t chunk = self -> limbo[self -> limbo_head++].chunk;
+            release_chunk(self, chunk & ~LIMBO_CLASS_MASK, chunk & LIMBO_CLASS_MASK);
+        }
+    }
+    if (self -> limbo_head == self -> limbo_len){
+        self -> limbo_head = 0;
+        self -> limbo_stamped = 0;
+        self -> limbo_len = 0;
+    }
+
+    if (self -> clear_pending == true && reclaim_passed(self -> clear_stamp) == true){
+        drop_pages(self, self -> arena_offset, self -> clear_end - self -> arena_offset);
+        self -> reuse = self -> arena_offset;
+        self -> reuse_end = self -> clear_end;
+        self -> clear_pending = false;
+    }
+}
+
+/*
+ * Hands out a chunk: one of the class that was freed, else a piece of a
+ * bigger free chunk, else fresh arena. Free space goes first, so the file
+ * doesn't grow while it has holes.
+ *
+ * @return Its offset, or 0 if the arena is full
+ */
+static uint64_t alloc_chunk(hashmap_t *self, int class){
+    uint64_t off = self -> free_heads[class];
+    if (off != 0){
+        self -> free_heads[class] = *(uint64_t *) (self -> base + off);
+        return off;
+    }
+
+    // split the smallest bigger chunk, keeping the halves we don't need
+    for (int bigger = class + 1; bigger < PERSIST_NUM_CLASSES; bigger++){
+        off = self -> free_heads[bigger];
+        if (off == 0){
+            continue;
+        }
+        self -> free_heads[bigger] = *(uint64_t *) (self -> base + off);
+        for (int half = bigger - 1; half >= class; half--){
+            release_chunk(self, off + class_size(half), half);
+        }
+        return off;
+    }
+
+    // then what a clear gave back, so the file doesn't grow past it either
+    if (self -> reuse + class_size(class) <= self -> reuse_end){
+        off = self -> reuse;
+        self -> reuse += class_size(class);
+        return off;
+    }
+
+    if (self -> bump + class_size(class) <= self -> map_size){
+        off = self -> bump;
+        self -> bump += class_size(class);
+        return off;
+    }
+    return 0;
+}
+
+/*
+ * alloc_chunk(), and if the arena is full, one more try after stamping
+ * everything in limbo, in case its readers are already gone. A chunk is
+ * never handed out early: we hold the write lock, so we can't wait for
+ * readers, and being full for a moment beats a GET seeing its value change.
+ */
+static uint64_t alloc_chunk_or_limbo(hashmap_t *self, int class){
+    uint64_t off = alloc_chunk(self, class);
+    if (off != 0 || (self -> limbo_len == 0 && self -> clear_pending == false)){
+        return off;
+    }
+    drain_limbo(self, true);
+    return alloc_chunk(self, class);
+}
+
+/*
+ * Forgets everything the allocator knew, limbo included: the whole arena is
+ * fresh again. Only for a file nobody has read from yet.
+ */
+static void reset_allocator(hashmap_t *self){
+    self -> bump = self -> arena_offset;
+    memset(self -> free_heads, 0, sizeof(self -> free_heads));
+    self -> limbo_head = 0;
+    self -> limbo_stamped = 0;
+    self -> limbo_len = 0;
+    self -> clear_pending = false;
+    self -> reuse = 0;
+    self -> reuse_end = 0;
+}
+
+/*
+ * Puts the space between two used chunks on the free lists, in the biggest
+ * pieces that fit.
+ */
+static void carve_gap(hashmap_t *self, uint64_t lo, uint64_t hi){
+    while (hi - lo >= PERSIST_MIN_CHUNK){
+        int class = PERSIST_NUM_CLASSES - 1;
+        while (class_size(class) > hi - lo){
+            class -= 1;
+        }
+        release_chunk(self, lo, class);
+        lo += class_size(class);
+    }
+}
+
+static int compare_chunks(const void *a, const void *b){
+    const chunk_ref_t *left = a;
+    const chunk_ref_t *right = b;
+    return left -> off < right -> off ? -1 : left -> off > right -> off;
+}
+
+static bool chunk_in_arena(hashmap_t *self, uint64_t off, size_t len){
+    return off >= self -> arena_offset && off % PERSIST_MIN_CHUNK == 0 && off <= self -> map_size &&
+           class_size(chunk_class(len)) <= self -> map_size - off;
+}
+
+/*
+ * Checks every slot of a file that was just opened, and rebuilds the
+ * allocator from the chunks the live ones use. Slots that don't check out,
+ * or point outside the arena, or share a chunk with another slot, are turned
+ * into tombstones: whatever they were doing was cut off by a crash.
+ *
+ * @return false (errno ENOMEM) if there was no memory to sort the chunks in
+ */
+static bool rebuild(hashmap_t *self){
+    uint64_t live = 0;
+    for (uint32_t i = 0; i < self -> capacity; i++){
+        map_slot_t *slot = &self -> slots[i];
+        if (slot -> key_len == 0){
+            continue;
+        }
+        if (slot -> check != slot_check(slot)){
+            slot_bury(slot);
+        }
+        else if (slot_live(slot) == true && (slot -> val_len == 0 || chunk_in_arena(self, slot -> key_off, slot -> key_len) == false ||
+                                             chunk_in_arena(self, slot -> val_off, slot -> val_len) == false)){
+            slot_bury(slot);
+        }
+        live += slot_live(slot) == true;
+    }
+
+    chunk_ref_t *chunks = malloc((live > 0 ? live : 1) * 2 * sizeof(chunk_ref_t));
+    if (chunks == NULL){
+        errno = ENOMEM;
+        return false;
+    }
+    uint64_t count = 0;
+    for (uint32_t i = 0; i < self -> capacity; i++){
+        map_slot_t *slot = &self -> slots[i];
+        if (slot_live(slot) == true){
+            chunks[count++] = (chunk_ref_t) {.off = slot -> key_off, .size = class_size(chunk_class(slot -> key_len)), .slot = i};
+            chunks[count++] = (chunk_ref_t) {.off = slot -> val_off, .size = class_size(chunk_class(slot -> val_len)), .slot = i};
+        }
+    }
+    qsort(chunks, count, sizeof(chunk_ref_t), compare_chunks);
+
+    // everything between the chunks in use is free. a slot that overlaps the
+    // one before it goes, though its other chunk may stay used until a clear
+    reset_allocator(self);
+    uint64_t end = self -> arena_offset;
+    for (uint64_t i = 0; i < count; i++){
+        map_slot_t *slot = &self -> slots[chunks[i].slot];
+        if (slot_live(slot) == false){
+            continue;
+        }
+        if (chunks[i].off < end){
+            slot_bury(slot);
+            continue;
+        }
+        carve_gap(self, end, chunks[i].off);
+        end = chunks[i].off + chunks[i].size;
+    }
+    self -> bump = end;
+    free(chunks);
+
+    self -> size = 0;
+    for (uint32_t i = 0; i < self -> capacity; i++){
+        self -> size += slot_live(&self -> slots[i]) == true;
+    }
+    return true;
+}
+
+/*
+ * Maps a file that is already there, after checking it's one of ours and
+ * the size we expect.
+ */
+static bool map_existing(hashmap_t *self, uint64_t file_size){
+    persist_header_t header;
+    if (file_size < sizeof(header) || pread(self -> fd, &header, sizeof(header), 0) != sizeof(header) ||
+        memcmp(header.magic, PERSIST_MAGIC, sizeof(header.magic)) != 0 || header.version != PERSIST_VERSION ||
+        header.capacity != self -> capacity || header.file_size != file_size ||
+        header.arena_offset < PERSIST_HEADER_BYTES + (uint64_t) self -> capacity * sizeof(map_slot_t) ||
+        header.arena_offset > file_size){
+        errno = EINVAL;
+        return false;
+    }
+    self -> map_size = header.file_size;
+    self -> arena_offset = header.arena_offset;
+    self -> base = mmap(NULL, self -> map_size, PROT_READ | PROT_WRITE, MAP_SHARED, self -> fd, 0);
+    if (self -> base == MAP_FAILED){
+        self -> base = NULL;
+        return false;
+    }
+    self -> slots = (map_slot_t *) (self -> base + PERSIST_HEADER_BYTES);
+    if (rebuild(self) == false){
+        munmap(self -> base, self -> map_size);
+        self -> base = NULL;
+        return false;
+    }
+    return true;
+}
+
+/*
+ * Maps fresh memory, or a fresh file grown to size, and writes the header.
+ */
+static bool map_fresh(hashmap_t *self){
+    uint64_t slotBytes = (uint64_t) self -> capacity * sizeof(map_slot_t);
+    uint64_t arenaBytes = (uint64_t) self -> capacity * PERSIST_ARENA_PER_ENTRY;
+    if (arenaBytes < PERSIST_ARENA_MIN){
+        arenaBytes = PERSIST_ARENA_MIN;
+    }
+    self -> arena_offset = (PERSIST_HEADER_BYTES + slotBytes + PERSIST_HEADER_BYTES - 1) / PERSIST_HEADER_BYTES * PERSIST_HEADER_BYTES;
+    self -> map_size = self -> arena_offset + arenaBytes;
+
+    if (self -> fd < 0){
+        self -> base = mmap(NULL, self -> map_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    }
+    // sparse, so only what gets written takes up disk
+    else if (ftruncate(self -> fd, self -> map_size) == 0){
+        self -> base = mmap(NULL, self -> map_size, PROT_READ | PROT_WRITE, MAP_SHARED, self -> fd, 0);
+    }
+    else{
+        return false;
+    }
+    if (self -> base == MAP_FAILED){
+        self -> base = NULL;
+        return false;
+    }
+
+    persist_header_t *header = (persist_header_t *) self -> base;
+    memcpy(header -> magic, PERSIST_MAGIC, sizeof(header -> magic));
+    header -> version = PERSIST_VERSION;
+    header -> capacity = self -> capacity;
+    header -> arena_offset = self -> arena_offset;
+    header -> file_size = self -> map_size;
+    if (self -> fd >= 0 && msync(self -> base, PERSIST_HEADER_BYTES, MS_SYNC) != 0){
+        munmap(self -> base, self -> map_size);
+        self -> base = NULL;
+        return false;
+    }
+    self -> slots = (map_slot_t *) (self -> base + PERSIST_HEADER_BYTES);
+    reset_allocator(self);
+    return true;
+}
+
+/*
+ * Takes the map as a reader. The first reader in holds the write lock for
+ * all of them, so writers wait until the last one is out.
+ */
+static void read_lock(hashmap_t *self){
+    pthread_mutex_lock(&self -> fields_lock);
+    self -> num_readers += 1;
+    if (self -> num_readers == 1){
+        pthread_mutex_lock(&self -> write_lock);
+    }
+    pthread_mutex_unlock(&self -> fields_lock);
+}
+
+/*
+ * Lets go of the map as a reader, see read_lock().
+ */
+static void read_unlock(hashmap_t *self){
+    pthread_mutex_lock(&self -> fields_lock);
+    self -> num_readers -= 1;
+    if (self -> num_readers == 0){
+        pthread_mutex_unlock(&self -> write_lock);
+    }
+    pthread_mutex_unlock(&self -> fields_lock);
+}
+
+hashmap_t *open_map(const char *path, uint32_t capacity, hash_func_f hash_function, destructor_f destroy_function) {
+    if (hash_function == NULL || destroy_function == NULL || capacity == 0){
+        errno = EINVAL;
+        return NULL;
+    }
+
+    hashmap_t *hashmap = calloc(1, sizeof(hashmap_t));
+    if (hashmap == NULL){
+        errno = EINVAL;
+        return NULL;
+    }
+
+    hashmap -> capacity = capacity;
+    hashmap -> size = 0;
+    hashmap -> hash_function = hash_function;
+    hashmap -> destroy_function = destroy_function;
+    hashmap -> num_readers = 0;
+    hashmap -> invalid = false;
+    hashmap -> fd = -1;
+
+    if (pthread_mutex_init(&hashmap -> write_lock, NULL) != 0){
+        free(hashmap);
+        return NULL;
+    }
+
+    if (pthread_mutex_init(&hashmap -> fields_lock, NULL) != 0){
+        free(hashmap);
+        return NULL;
+    }
+
+    if (pthread_mutex_init(&hashmap -> sync_lock, NULL) != 0){
+        free(hashmap);
+        return NULL;
+    }
+
+    bool mapped;
+    if (path == NULL){
+        mapped = map_fresh(hashmap);
+    }
+    else{
+        struct stat info;
+        hashmap -> fd = open(path, O_RDWR | O_CREAT, 0644);
+        mapped = hashmap -> fd >= 0 && fstat(hashmap -> fd, &info) == 0 &&
+                 (info.st_size == 0 ? map_fresh(hashmap) : map_existing(hashmap, info.st_size));
+    }
+    if (mapped == false){
+        int error = errno;
+        if (hashmap -> fd >= 0){
+            close(hashmap -> fd);
+        }
+        free(hashmap);
+        errno = error;
+        return NULL;
+    }
+    return hashmap;
+}
+
+hashmap_t *create_map(uint32_t capacity, hash_func_f hash_function, destructor_f destroy_function) {
+    return open_map(NULL, capacity, hash_function, destroy_function);
+}
+
+bool checkpoint_map(hashmap_t *self) {
+    if (self == NULL){
+        errno = EINVAL;
+        return false;
+    }
+
+    // the disk can take a while, so it's written without the map's locks:
+    // nobody waits on it. a slot caught half written fails its checksum on
+    // the next open. sync_lock keeps the mapping there until we're done
+    pthread_mutex_lock(&self -> sync_lock);
+    read_lock(self);
+    bool valid = self -> invalid == false;
+    read_unlock(self);
+
+    bool synced = false;
+    if (valid == false){
+        errno = EINVAL;
+    }
+    else{
+        synced = self -> fd < 0 || msync(self -> base, self -> map_size, MS_SYNC) == 0;
+    }
+
+    pthread_mutex_unlock(&self -> sync_lock);
+    return synced;
+}
+
+bool put(hashmap_t *self, map_key_t key, map_val_t val, bool force) {
+    if (self == NULL || key.key_base == NULL || val.val_base == NULL || key.key_len == 0 || val.val_len == 0 ||
+        key.key_len > SLOT_LEN_MASK || val.val_len > UINT16_MAX){
+        errno = EINVAL;
+        return false;
+    }
+
+    pthread_mutex_lock(&self -> write_lock);
+
+    if (self -> invalid == true){
+        errno = EINVAL;
+        pthread_mutex_unlock(&self -> write_lock);
+        return false;
+    }
+
+    uint32_t hash = self -> hash_function(key);
+    int freeSlot;
+    int index = probe(self, key, hash, &freeSlot);
+    bool replacing = true;
+    // take back whatever the readers are done with
+    drain_limbo(self, false);
+
+    // a new key goes in the first free slot on its probe path
+    if (index == -1 && freeSlot != -1){
+        index = freeSlot;
+        replacing = false;
+    }
+    // nowhere to put it. overwrite the home slot if we're allowed to
+    else if (index == -1){
+        if (force == false){
+            errno = ENOMEM;
+            pthread_mutex_unlock(&self -> write_lock);
+            return false;
+        }
+        index = get_index(self, key);
+        stats_add(STATS_EVICTED, 1);
+    }
+
+    int keyClass = chunk_class(key.key_len);
+    int valClass = chunk_class(val.val_len);
+    uint64_t keyOff = alloc_chunk_or_limbo(self, keyClass);
+    uint64_t valOff = keyOff != 0 ? alloc_chunk_or_limbo(self, valClass) : 0;
+    if (valOff == 0){
+        // nobody saw it, so it can go straight back
+        if (keyOff != 0){
+            release_chunk(self, keyOff, keyClass);
+        }
+        errno = ENOMEM;
+        pthread_mutex_unlock(&self -> write_lock);
+        return false;
+    }
+
+    // the data goes in before the slot that points at it, so a slot that
+    // checks out never points at something half copied
+    memcpy(self -> base + keyOff, key.key_base, key.key_len);
+    memcpy(self -> base + valOff, val.val_base, val.val_len);
+    map_slot_t slot = {
+        .key_len = key.key_len,
+        .val_len = val.val_len,
+        .hash = hash,
+        .key_off = keyOff,
+        .val_off = valOff,
+    };
+    slot.check = slot_check(&slot);
+
+    if (replacing == true){
+        map_slot_t *old = &self -> slots[index];
+        free_chunk(self, old -> key_off, chunk_class(old -> key_len & SLOT_LEN_MASK));
+        free_chunk(self, old -> val_off, chunk_class(old -> val_len));
+    }
+    else{
+        self -> size += 1;
+    }
+    self -> slots[index] = slot;
+    pthread_mutex_unlock(&self -> write_lock);
+
+    // we have our own copies, the caller's buffers aren't needed anymore
+    self -> destroy_function(owned(self, key.key_base) == false ? key : MAP_KEY(NULL, 0),
+                             owned(self, val.val_base) == false ? val : MAP_VAL(NULL, 0));
+    return true;
+}
+
+bool put_aged(hashmap_t *self, map_key_t key, map_val_t val, uint64_t age_ms, bool force) {
+    // nothing here expires, so the age makes no difference
+    return put(self, key, val, force);
+}
+
+bool bulk_put(hashmap_t *self, map_entry_t *entries, size_t count, int threads) {
+    if (self == NULL || (entries == NULL && count > 0) || threads < 1){
+        errno = EINVAL;
+        return false;
+    }
+
+    // one at a time, and keep going past the ones that don't fit
+    int error = 0;
+    for (size_t i = 0; i < count; i++){
+        entries[i].stored = put_aged(self, entries[i].key, entries[i].val, entries[i].age_ms, false);
+        if (entries[i].stored == false){
+            error = errno;
+        }
+    }
+    if (error != 0){
+        errno = error;
+        return false;
+    }
+    return true;
+}
+
+map_val_t get(hashmap_t *self, map_key_t key) {
+    if (self == NULL || key.key_base == NULL ||  key.key_len == 0){
+        errno = EINVAL;
+        return MAP_VAL(NULL, 0);
+    }
+
+    read_lock(self);
+
+    map_val_t val = MAP_VAL(NULL, 0);
+    if (self -> invalid == false){
+        int index = probe(self, key, self -> hash_function(key), NULL);
+        if (index != -1){
+            val = MAP_VAL(self -> base + self -> slots[index].val_off, self -> slots[index].val_len);
+        }
+    }
+
+    read_unlock(self);
+
+    if (val.val_base == NULL)
+        errno = EINVAL;
+    return val;
+}
+
+bool map_walk(hashmap_t *self, map_walk_f func, void *arg) {
+    if (self == NULL || func == NULL){
+        errno = EINVAL;
+        return false;
+    }
+
+    // walk as a reader, same as get()
+    read_lock(self);
+
+    bool finished = self -> invalid == false;
+    for (uint32_t i = 0; i < self -> capacity && finished == true; i++){
+        map_slot_t *slot = &self -> slots[i];
+        if (slot_live(slot) == true){
+            finished = func(MAP_KEY(self -> base + slot -> key_off, slot -> key_len),
+                            MAP_VAL(self -> base + slot -> val_off, slot -> val_len), 0, arg);
+        }
+    }
+
+    read_unlock(self);
+
+    if (finished == false)
+        errno = EINVAL;
+    return finished;
+}
+
+uint32_t map_tombstones(hashmap_t *self) {
+    if (self == NULL){
+        errno = EINVAL;
+        return 0;
+    }
+
+    read_lock(self);
+
+    uint32_t tombstones = 0;
+    for (uint32_t i = 0; self -> invalid == false && i < self -> capacity; i++){
+        if ((self -> slots[i].key_len & SLOT_TOMBSTONE) != 0){
+            tombstones += 1;
+        }
+    }
+
+    read_unlock(self);
+    return tombstones;
+}
+
+map_node_t delete(hashmap_t *self, map_key_t key) {
+    if (self == NULL || key.key_len == 0 || key.key_base == NULL){
+        errno = EINVAL;
+        return MAP_NODE(MAP_KEY(NULL, 0), MAP_VAL(NULL, 0), false);
+    }
+
+    pthread_mutex_lock(&self -> write_lock);
+
+    if (self -> invalid == true){
+        errno = EINVAL;
+        pthread_mutex_unlock(&self -> write_lock);
+        return MAP_NODE(MAP_KEY(NULL, 0), MAP_VAL(NULL, 0), false);
+    }
+
+    int index = probe(self, key, self -> hash_function(key), NULL);
+    if (index == -1){
+        pthread_mutex_unlock(&self -> write_lock);
+        return MAP_NODE(MAP_KEY(NULL, 0), MAP_VAL(NULL, 0), false);
+    }
+
+    map_slot_t *slot = &self -> slots[index];
+    map_node_t returnVal = MAP_NODE(MAP_KEY(NULL, slot -> key_len), MAP_VAL(NULL, slot -> val_len), true);
+    free_chunk(self, slot -> key_off, chunk_class(slot -> key_len));
+    free_chunk(self, slot -> val_off, chunk_class(slot -> val_len));
+    slot_bury(slot);
+    self -> size -= 1;
+
+    pthread_mutex_unlock(&self -> write_lock);
+    return returnVal;
+}
+
+bool clear_map(hashmap_t *self) {
+    if (self == NULL){
+        errno = EINVAL;
+        return false;
+    }
+
+    pthread_mutex_lock(&self -> write_lock);
+
+    if (self -> invalid == true){
+        errno = EINVAL;
+        pthread_mutex_unlock(&self -> write_lock);
+        return false;
+    }
+
+    // dropping the pages zeroes the table without touching it, and gives the
+    // file's blocks back
+    if (drop_pages(self, PERSIST_HEADER_BYTES, self -> arena_offset - PERSIST_HEADER_BYTES) == false){
+        memset(self -> slots, 0, (size_t) self -> capacity * sizeof(map_slot_t));
+    }
+    // a GET may still be copying out of the arena, so everything handed out
+    // so far waits out the readers in one piece, see drain_limbo(). until
+    // then, puts carry on from the bump
+    memset(self -> free_heads, 0, sizeof(self -> free_heads));
+    self -> limbo_head = 0;
+    self -> limbo_stamped = 0;
+    self -> limbo_len = 0;
+    self -> reuse = 0;
+    self -> reuse_end = 0;
+    self -> clear_pending = true;
+    self -> clear_stamp = reclaim_stamp();
+    self -> clear_end = self -> bump;
+    self -> size = 0;
+
+    pthread_mutex_unlock(&self -> write_lock);
+    return true;
+}
+
+bool invalidate_map(hashmap_t *self) {
+    if (self == NULL){
+        errno = EINVAL;
+        return false;
+    }
+
+    // a checkpoint may still be writing the mapping out
+    pthread_mutex_lock(&self -> sync_lock);
+    pthread_mutex_lock(&self -> write_lock);
+
+    if (self -> invalid == true){
+        errno = EINVAL;
+        pthread_mutex_unlock(&self -> write_lock);
+        pthread_mutex_unlock(&self -> sync_lock);
+        return false;
+    }
+
+    // the file keeps everything, there's nothing of the caller's to destroy
+    munmap(self -> base, self -> map_size);
+    if (self -> fd >= 0){
+        close(self -> fd);
+    }
+    self -> base = NULL;
+    self -> slots = NULL;
+    self -> fd = -1;
+    self -> invalid = true;
+    free(self -> limbo);
+    self -> limbo = NULL;
+    self -> limbo_cap = 0;
+
+    pthread_mutex_unlock(&self -> write_lock);
+    pthread_mutex_unlock(&self -> sync_lock);
+    return true;
+}
+
+int evict_range(hashmap_t *self, const void *lo, const void *hi) {
+    if (self == NULL || lo == NULL || hi == NULL){
+        errno = EINVAL;
+        return 0;
+    }
+    // keys and values are copied into the file, none of them are slab chunks
+    errno = ENOTSUP;
+    return 0;
+}
+
+bool prefault_map(hashmap_t *self, int threads) {
+    if (self == NULL || self -> invalid == true){
+        errno = EINVAL;
+        return false;
+    }
+
+    // read every page, a write would dirty it and the next checkpoint would
+    // write the whole table back out
+    size_t bytes = (size_t) self -> capacity * sizeof(map_slot_t);
+    size_t page = sysconf(_SC_PAGESIZE);
+    madvise(self -> slots, bytes, MADV_WILLNEED);
+    for (size_t off = 0; off < bytes; off += page){
+        (void) *(volatile char *) ((char *) self -> slots + off);
+    }
+    return true;
+}
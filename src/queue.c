@@ -1,28 +1,138 @@
 #include "queue.h"
 #include <stdio.h>
+#include <stdint.h>
+#include <string.h>
 #include <errno.h>
+#include <sched.h>
+
+
+/*
+ * Claims the cell at enqueue_pos and publishes item into it.
+ * Returns false if the ring is full.
+ */
+static bool ring_push(queue_t *self, void *item){
+    size_t pos = atomic_load_explicit(&self -> enqueue_pos, memory_order_relaxed);
+    queue_cell_t *cell;
+
+    while (1){
+        cell = &self -> cells[pos & self -> mask];
+        size_t seq = atomic_load_explicit(&cell -> sequence, memory_order_acquire);
+        intptr_t diff = (intptr_t) seq - (intptr_t) pos;
+
+        // the cell is free for this lap, try to claim it
+        if (diff == 0){
+            if (atomic_compare_exchange_weak_explicit(&self -> enqueue_pos, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed)){
+                break;
+            }
+        }
+        // the consumer from the previous lap hasn't emptied it, so we're full
+        else if (diff < 0){
+            return false;
+        }
+        // someone else claimed it, catch up
+        else{
+            pos = atomic_load_explicit(&self -> enqueue_pos, memory_order_relaxed);
+        }
+    }
+
+    // fill the cell, then hand it to the consumers
+    cell -> item = item;
+    atomic_store_explicit(&cell -> sequence, pos + 1, memory_order_release);
+    return true;
+}
+
+/*
+ * Claims the cell at dequeue_pos and takes its item.
+ * Returns NULL if no published cell is available.
+ */
+static void *ring_pop(queue_t *self){
+    size_t pos = atomic_load_explicit(&self -> dequeue_pos, memory_order_relaxed);
+    queue_cell_t *cell;
+
+    while (1){
+        cell = &self -> cells[pos & self -> mask];
+        size_t seq = atomic_load_explicit(&cell -> sequence, memory_order_acquire);
+        intptr_t diff = (intptr_t) seq - (intptr_t) (pos + 1);
+
+        // the cell has been published for this lap, try to claim it
+        if (diff == 0){
+            if (atomic_compare_exchange_weak_explicit(&self -> dequeue_pos, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed)){
+                break;
+            }
+        }
+        // nothing published here yet
+        else if (diff < 0){
+            return NULL;
+        }
+        else{
+            pos = atomic_load_explicit(&self -> dequeue_pos, memory_order_relaxed);
+        }
+    }
+
+    // take the item, then give the cell back to the producers for the next lap
+    void *item = cell -> item;
+    atomic_store_explicit(&cell -> sequence, pos + self -> mask + 1, memory_order_release);
+    return item;
+}
+
+/*
+ * Pops the item the caller already took a count for.
+ */
+static void *claim_item(queue_t *self){
+    // after grabbing the count, check if the queue is still valid
+    if (atomic_load(&self -> invalid) == true){
+        errno = EINVAL;
+        return NULL;
+    }
 
+    // the count promises us an item, but the producer that claimed the cell at
+    // the head may not have published it yet. it is mid-store, so just wait it out
+    void *item;
+    while ((item = ring_pop(self)) == NULL){
+        if (atomic_load(&self -> invalid) == true){
+            errno = EINVAL;
+            return NULL;
+        }
+        sched_yield();
+    }
+    return item;
+}
 
 queue_t *create_queue(void) {
-    queue_t* queue = calloc(1, sizeof(queue_t));
+    // the positions are cache line aligned, so calloc's alignment isn't enough
+    queue_t* queue = aligned_alloc(CACHE_LINE, sizeof(queue_t));
 
     if (queue == NULL){
         errno = EINVAL;
         return NULL;
     }
+    memset(queue, 0, sizeof(queue_t));
 
-    // if its not null, meaning we were able to allocate, then set fields
-    queue -> front = NULL;
-    queue -> rear = NULL;
-    if (sem_init(&queue -> items, 0, 0) == -1){
+    queue -> cells = calloc(QUEUE_CAPACITY, sizeof(queue_cell_t));
+    if (queue -> cells == NULL){
+        free(queue);
+        errno = ENOMEM;
         return NULL;
     }
 
-    if (pthread_mutex_init(&queue -> lock, NULL) == -1){
+    // if its not null, meaning we were able to allocate, then set fields
+    // each cell starts out owned by the producer of lap 0
+    queue -> mask = QUEUE_CAPACITY - 1;
+    for (size_t i = 0; i < QUEUE_CAPACITY; i++){
+        atomic_init(&queue -> cells[i].sequence, i);
+    }
+    atomic_init(&queue -> enqueue_pos, 0);
+    atomic_init(&queue -> dequeue_pos, 0);
+
+    if (sem_init(&queue -> items, 0, 0) == -1){
+        free(queue -> cells);
+        free(queue);
         return NULL;
     }
 
-    queue -> invalid = false;
+    atomic_init(&queue -> invalid, false);
 
     // return the queue
     return queue;
@@ -37,30 +147,20 @@ bool invalidate_queue(queue_t *self, item_destructor_f destroy_function) {
     }
 
     // else, the arguments are valid, so lets invalidate this queue properly
-    // grab the mutex
-    pthread_mutex_lock(&self -> lock);
-
-    // if its already invalid, return false
-    if (self -> invalid == true){
+    // if its already invalid, return false. only one caller gets past this
+    if (atomic_exchange(&self -> invalid, true) == true){
         errno = EINVAL;
-        pthread_mutex_unlock(&self -> lock);
         return false;
     }
 
-    // call destroy function on the item of the front
-    queue_node_t *node = self -> front;
-
-    while (node != NULL){
-        queue_node_t *nextNode = node -> next;
-        destroy_function(node -> item);
-        free(node);
-
-        node = nextNode;
+    // call destroy function on everything still in the ring
+    void *item;
+    while ((item = ring_pop(self)) != NULL){
+        // keep the item count in step with the ring
+        sem_trywait(&self -> items);
+        destroy_function(item);
     }
 
-    self -> invalid = true;
-
-    pthread_mutex_unlock(&self -> lock);
     return true;
 }
 
@@ -73,84 +173,61 @@ bool enqueue(queue_t *self, void *item) {
         return false;
     }
 
-    // args are valid, grab the mutex
-    pthread_mutex_lock(&self -> lock);
-
     // check if the queue is invalid
-    if (self -> invalid == true){
+    if (atomic_load_explicit(&self -> invalid, memory_order_relaxed) == true){
         errno = EINVAL;
-        pthread_mutex_unlock(&self -> lock);
         return false;
     }
 
-    // if its still valid, then add a new queue_node_t to it
-    // calloc for space
-    queue_node_t *node = calloc(1, sizeof(queue_node_t));
-
-    // if calloc returned a NULL pointer, then set to false and exit
-    if (node == NULL){
-        errno = EINVAL;
-        pthread_mutex_unlock(&self -> lock);
+    // the ring is bounded, so the caller decides what to do when it is full
+    if (ring_push(self, item) == false){
+        errno = ENOBUFS;
         return false;
     }
 
-    // else, calloc did give space. set the item field to our current item
-    node -> item = item;
-    node -> next = NULL;
-
-    // and now, add the item to the queue
-    // if the front is null, put it directly at the front. else, go to the end
-    if (self -> front == NULL){
-        self -> front = node;
-        self -> rear = node;
-    }
-
-    else{
-        // set the next of the rear to this item
-        self -> rear -> next = node;
-        // set the queue rear to this item
-        self -> rear = node;
-    }
-
-    // increment our item count by 1
+    // increment our item count by 1, waking a sleeping consumer if there is one
     sem_post(&self -> items);
-
-    // unlock and return
-    pthread_mutex_unlock(&self -> lock);
     return true;
 }
 
 void *dequeue(queue_t *self) {
     // first check the arg
-    if (self == NULL || self -> invalid == true){
+    if (self == NULL || atomic_load(&self -> invalid) == true){
         errno = EINVAL;
         return NULL;
     }
 
-    // first try to grab an item
-    sem_wait(&self -> items);
-    // then grab the mutex
-    pthread_mutex_lock(&self -> lock);
-    // after grabbing both, check if the queue is still valid
-    if (self -> invalid == true){
-        errno = EINVAL;
-        pthread_mutex_unlock(&self -> lock);
-        return NULL;
+    // first try to grab an item. this is the only place we sleep
+    while (sem_wait(&self -> items) == -1){
+        if (errno != EINTR){
+            return NULL;
+        }
     }
 
-    // otherwise, the queue is still valid, so pop the first item off
-    void* item = self -> front -> item;
+    return claim_item(self);
+}
 
-    // grab a pointer to the next node
-    queue_node_t *next = self -> front -> next;
+void *try_dequeue(queue_t *self) {
+    if (self == NULL || atomic_load(&self -> invalid) == true){
+        errno = EINVAL;
+        return NULL;
+    }
 
-    // free the current node
-    free(self -> front);
+    // only pop if there is a count to take, otherwise the ring is empty
+    if (sem_trywait(&self -> items) == -1){
+        return NULL;
+    }
+    return claim_item(self);
+}
 
-    // set the front to the 'next' node that was obtained earlier
-    self -> front = next;
+size_t queue_depth(queue_t *self) {
+    if (self == NULL){
+        errno = EINVAL;
+        return 0;
+    }
 
-    // and now unlock and return the item
-    pthread_mutex_unlock(&self -> lock);
-    return item;
+    // read the consumer side first so a racing pop can't make this go negative
+    size_t head = atomic_load_explicit(&self -> dequeue_pos, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&self -> enqueue_pos, memory_order_relaxed);
+    return tail > head ? tail - head : 0;
 }
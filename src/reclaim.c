@@ -0,0 +1,384 @@
+#define _GNU_SOURCE
+#include "reclaim.h"
+#include "queue.h"
+#include "slab.h"
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <time.h>
+
+/*
+ * A thread that reads map memory outside the map's lock. epoch is the global
+ * epoch it saw when it entered its read section, or 0 when it's not in one.
+ * Only the thread itself writes it, and it sits on a line of its own.
+ */
+typedef struct reader_t {
+    _Alignas(CACHE_LINE) _Atomic uint64_t epoch;
+    struct reader_t *next;  // every thread's, so the reclaimer can look at them all
+} reader_t;
+
+// bumped every time something is stamped, so sections that start afterwards
+// can be told from the ones that might have seen it
+static _Atomic uint64_t globalEpoch = 1;
+// every reader, newest first. only ever pushed onto, so it can be walked without the lock
+static _Atomic(reader_t *) allReaders = NULL;
+static pthread_mutex_t readerLock = PTHREAD_MUTEX_INITIALIZER;
+// readers that couldn't get a reader_t. while there are any, nothing is safe
+static atomic_uint strays;
+static __thread reader_t *myReader = NULL;
+static __thread int readDepth = 0;
+static __thread bool stray = false;
+
+typedef struct reclaim_job_t {
+    reclaim_f func;
+    void *arg;
+    uint64_t stamp;
+    struct reclaim_job_t *next;
+} reclaim_job_t;
+
+static pthread_mutex_t reclaimLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t reclaimReady = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t reclaimDone = PTHREAD_COND_INITIALIZER;
+static reclaim_job_t *jobHead = NULL;
+static reclaim_job_t *jobTail = NULL;
+// how many jobs were handed over, and how many of those have run
+static uint64_t jobsQueued = 0;
+static uint64_t jobsRun = 0;
+
+// one retired entry, and one thread's list of them
+typedef struct retired_t {
+    destructor_f destroy;
+    map_key_t key;
+    map_val_t val;
+} retired_t;
+
+typedef struct retire_batch_t {
+    int count;
+    struct retire_batch_t *next;    // the full ones a thread holds on to, see retire_hold()
+    retired_t entries[RETIRE_BATCH];
+} retire_batch_t;
+
+static __thread retire_batch_t *retireBatch = NULL;
+static __thread retire_batch_t *heldBatches = NULL;
+static __thread bool holding = false;
+static atomic_size_t retiredOutstanding;
+
+static pthread_once_t reclaimOnce = PTHREAD_ONCE_INIT;
+// the thread couldn't be started, so whoever waits on jobs runs them
+static bool reclaimFailed = false;
+
+/*
+ * Makes the calling thread's reader_t and puts it on the list.
+ */
+static reader_t *register_reader(void){
+    reader_t *reader = aligned_alloc(CACHE_LINE, sizeof(reader_t));
+    if (reader == NULL){
+        return NULL;
+    }
+    atomic_init(&reader -> epoch, 0);
+    pthread_mutex_lock(&readerLock);
+    reader -> next = atomic_load_explicit(&allReaders, memory_order_relaxed);
+    atomic_store_explicit(&allReaders, reader, memory_order_release);
+    pthread_mutex_unlock(&readerLock);
+    myReader = reader;
+    return reader;
+}
+
+void reclaim_enter(void){
+    if (readDepth++ > 0){
+        return;
+    }
+    reader_t *reader = myReader;
+    if (reader == NULL && (reader = register_reader()) == NULL){
+        stray = true;
+        atomic_fetch_add(&strays, 1);
+        return;
+    }
+    atomic_store_explicit(&reader -> epoch, atomic_load(&globalEpoch), memory_order_relaxed);
+    // the epoch has to be out there before we look at the map. pairs with
+    // the fence in reclaim_passed()
+    atomic_thread_fence(memory_order_seq_cst);
+}
+
+void reclaim_exit(void){
+    if (--readDepth > 0){
+        return;
+    }
+    if (stray == true){
+        stray = false;
+        atomic_fetch_sub(&strays, 1);
+        return;
+    }
+    atomic_store_explicit(&myReader -> epoch, 0, memory_order_release);
+}
+
+uint64_t reclaim_stamp(void){
+    return atomic_fetch_add(&globalEpoch, 1);
+}
+
+bool reclaim_passed(uint64_t stamp){
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load(&strays) > 0){
+        return false;
+    }
+    // a reader that entered after the stamp saw the memory already gone
+    for (reader_t *reader = atomic_load_explicit(&allReaders, memory_order_acquire); reader != NULL; reader = reader -> next){
+        uint64_t epoch = atomic_load_explicit(&reader -> epoch, memory_order_acquire);
+        if (epoch != 0 && epoch <= stamp){
+            return false;
+        }
+    }
+    return true;
+}
+
+void reclaim_synchronize(void){
+    uint64_t stamp = reclaim_stamp();
+    struct timespec tick = {.tv_sec = 0, .tv_nsec = RECLAIM_TICK_NS};
+    while (reclaim_passed(stamp) == false){
+        nanosleep(&tick, NULL);
+    }
+}
+
+/*
+ * Runs the oldest job if its readers are done with it. Returns false if there
+ * wasn't one, or it has to wait.
+ */
+static bool run_ready_job(void){
+    pthread_mutex_lock(&reclaimLock);
+    reclaim_job_t *job = jobHead;
+    if (job == NULL || reclaim_passed(job -> stamp) == false){
+        pthread_mutex_unlock(&reclaimLock);
+        return false;
+    }
+    jobHead = job -> next;
+    if (jobHead == NULL){
+        jobTail = NULL;
+    }
+    pthread_mutex_unlock(&reclaimLock);
+
+    job -> func(job -> arg);
+    free(job);
+
+    pthread_mutex_lock(&reclaimLock);
+    jobsRun += 1;
+    pthread_cond_broadcast(&reclaimDone);
+    pthread_mutex_unlock(&reclaimLock);
+    return true;
+}
+
+/*
+ * Takes every job off the queue, waits out the readers of all of them at
+ * once, and runs them right here. For threads that can't leave it to the
+ * reclaimer any longer. Caller is not in a read section.
+ */
+static void run_backlog(void){
+    pthread_mutex_lock(&reclaimLock);
+    reclaim_job_t *job = jobHead;
+    jobHead = NULL;
+    jobTail = NULL;
+    pthread_mutex_unlock(&reclaimLock);
+    if (job == NULL){
+        return;
+    }
+
+    // stamped after all of them, so once it has passed so have theirs
+    reclaim_synchronize();
+    uint64_t count = 0;
+    while (job != NULL){
+        reclaim_job_t *next = job -> next;
+        job -> func(job -> arg);
+        free(job);
+        job = next;
+        count += 1;
+    }
+
+    pthread_mutex_lock(&reclaimLock);
+    jobsRun += count;
+    pthread_cond_broadcast(&reclaimDone);
+    pthread_mutex_unlock(&reclaimLock);
+}
+
+static void *reclaimer(void *vargp){
+    // only run when nothing else wants the cpu
+    struct sched_param param = {.sched_priority = 0};
+    pthread_setschedparam(pthread_self(), SCHED_IDLE, &param);
+    struct timespec tick = {.tv_sec = 0, .tv_nsec = RECLAIM_TICK_NS};
+
+    while (1){
+        pthread_mutex_lock(&reclaimLock);
+        while (jobHead == NULL){
+            pthread_cond_wait(&reclaimReady, &reclaimLock);
+        }
+        pthread_mutex_unlock(&reclaimLock);
+
+        // the oldest job still has readers in the way, they'll be gone soon
+        if (run_ready_job() == false){
+            nanosleep(&tick, NULL);
+            continue;
+        }
+        // don't sit on the chunks we just freed, the slab rebalancer may be
+        // waiting for them
+        slab_flush_cache();
+    }
+    return NULL;
+}
+
+static void start_reclaimer(void){
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, reclaimer, NULL) == 0){
+        pthread_detach(tid);
+    }
+    else{
+        reclaimFailed = true;
+    }
+}
+
+bool reclaim_later(reclaim_f func, void *arg){
+    pthread_once(&reclaimOnce, start_reclaimer);
+
+    // running it now could pull memory out from under a reader, and the
+    // caller may hold a lock a reader is waiting on, so it's let go
+    reclaim_job_t *job = malloc(sizeof(reclaim_job_t));
+    if (job == NULL){
+        return false;
+    }
+    job -> func = func;
+    job -> arg = arg;
+    job -> next = NULL;
+
+    // stamped under the lock, so the stamps go up along the queue
+    pthread_mutex_lock(&reclaimLock);
+    job -> stamp = reclaim_stamp();
+    if (jobTail == NULL){
+        jobHead = job;
+    }
+    else{
+        jobTail -> next = job;
+    }
+    jobTail = job;
+    jobsQueued += 1;
+    pthread_cond_signal(&reclaimReady);
+    pthread_mutex_unlock(&reclaimLock);
+    return true;
+}
+
+void reclaim_wait(void){
+    struct timespec tick = {.tv_sec = 0, .tv_nsec = RECLAIM_TICK_NS};
+    pthread_mutex_lock(&reclaimLock);
+    uint64_t target = jobsQueued;
+    while (jobsRun < target){
+        if (reclaimFailed == false){
+            pthread_cond_wait(&reclaimDone, &reclaimLock);
+            continue;
+        }
+        pthread_mutex_unlock(&reclaimLock);
+        if (run_ready_job() == false){
+            nanosleep(&tick, NULL);
+        }
+        pthread_mutex_lock(&reclaimLock);
+    }
+    pthread_mutex_unlock(&reclaimLock);
+}
+
+/*
+ * Reclaimer job: destroys one thread's batch of retired entries.
+ */
+static void destroy_batch(void *arg){
+    retire_batch_t *batch = arg;
+    for (int i = 0; i < batch -> count; i++){
+        batch -> entries[i].destroy(batch -> entries[i].key, batch -> entries[i].val);
+    }
+    atomic_fetch_sub(&retiredOutstanding, batch -> count);
+    free(batch);
+}
+
+/*
+ * Gives the calling thread's batch to the reclaimer, or keeps it aside if
+ * the thread is holding on to what it retires.
+ */
+static void hand_over(void){
+    retire_batch_t *batch = retireBatch;
+    if (batch == NULL || batch -> count == 0){
+        return;
+    }
+    retireBatch = NULL;
+    if (holding == true){
+        batch -> next = heldBatches;
+        heldBatches = batch;
+        return;
+    }
+    reclaim_later(destroy_batch, batch);
+}
+
+void retire(destructor_f destroy, map_key_t key, map_val_t val){
+    if (destroy == NULL || (key.key_base == NULL && val.val_base == NULL)){
+        return;
+    }
+
+    if (retireBatch == NULL){
+        retireBatch = malloc(sizeof(retire_batch_t));
+        // a reader may still have it, so the best we can do is let it go
+        if (retireBatch == NULL){
+            return;
+        }
+        retireBatch -> count = 0;
+        retireBatch -> next = NULL;
+    }
+
+    retireBatch -> entries[retireBatch -> count] = (retired_t) {.destroy = destroy, .key = key, .val = val};
+    retireBatch -> count += 1;
+    atomic_fetch_add_explicit(&retiredOutstanding, 1, memory_order_relaxed);
+    if (retireBatch -> count == RETIRE_BATCH){
+        hand_over();
+    }
+}
+
+void retire_flush(void){
+    if (holding == true){
+        return;
+    }
+    hand_over();
+
+    // the reclaimer never started, so it's up to us
+    if (reclaimFailed == true && readDepth == 0){
+        run_backlog();
+    }
+    retire_catch_up();
+}
+
+void retire_catch_up(void){
+    // the reclaimer only runs when nothing else wants the cpu, which under
+    // load is never. once too much is waiting, we stop and do it ourselves
+    if (atomic_load_explicit(&retiredOutstanding, memory_order_relaxed) < RETIRE_LIMIT || readDepth > 0 || holding == true){
+        return;
+    }
+    hand_over();
+    run_backlog();
+}
+
+void retire_hold(void){
+    holding = true;
+}
+
+void retire_sync(void){
+    hand_over();
+    retire_batch_t *batches = heldBatches;
+    heldBatches = NULL;
+    holding = false;
+    if (batches == NULL){
+        return;
+    }
+
+    reclaim_synchronize();
+    while (batches != NULL){
+        retire_batch_t *next = batches -> next;
+        destroy_batch(batches);
+        batches = next;
+    }
+}
+
+size_t retired_outstanding(void){
+    return atomic_load(&retiredOutstanding);
+}
@@ -0,0 +1,555 @@
+#include "slab.h"
+#include <errno.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+
+// a thread's private stash of free chunks for one class
+typedef struct slab_cache_t {
+    void *head;
+    unsigned count;
+} slab_cache_t;
+
+static char *regionBase;
+// pages being moved to another class. their chunks go on the drain list when freed
+static uint8_t *pageDraining;
+// bumped when every thread should hand its cached chunks back
+static _Atomic unsigned flushEpoch;
+static __thread unsigned cacheEpoch;
+static size_t maxPages;
+static _Atomic size_t nextPage;
+// which class each page belongs to, so a free only needs the pointer
+static uint8_t *pageClass;
+
+static slab_class_t classes[SLAB_MAX_CLASSES];
+static int numClasses;
+// size (in SLAB_ALIGN units) -> class, so picking a class is one load
+static uint8_t classFor[SLAB_MAX_SIZE / SLAB_ALIGN + 1];
+
+static pthread_once_t slabOnce = PTHREAD_ONCE_INIT;
+static size_t slabLimit = SLAB_DEFAULT_LIMIT;
+static atomic_bool slabReady;
+
+static __thread slab_cache_t caches[SLAB_MAX_CLASSES];
+
+static void setup_slabs(void){
+    maxPages = slabLimit / SLAB_PAGE_SIZE;
+    if (maxPages == 0){
+        maxPages = 1;
+    }
+
+    // reserve the address space now, pages get made usable as they're handed out
+    regionBase = mmap(NULL, maxPages * SLAB_PAGE_SIZE, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    pageClass = calloc(maxPages, sizeof(uint8_t));
+    pageDraining = calloc(maxPages, sizeof(uint8_t));
+    if (regionBase == MAP_FAILED || pageClass == NULL || pageDraining == NULL){
+        regionBase = NULL;
+        return;
+    }
+
+    // every class is about SLAB_GROWTH percent of the last, rounded up to the alignment
+    size_t size = SLAB_MIN_SIZE;
+    while (numClasses < SLAB_MAX_CLASSES){
+        if (size > SLAB_MAX_SIZE || numClasses == SLAB_MAX_CLASSES - 1){
+            size = SLAB_MAX_SIZE;
+        }
+        classes[numClasses].size = size;
+        classes[numClasses].per_page = SLAB_PAGE_SIZE / size;
+        pthread_mutex_init(&classes[numClasses].lock, NULL);
+        numClasses += 1;
+
+        if (size == SLAB_MAX_SIZE){
+            break;
+        }
+        size_t grown = size * SLAB_GROWTH / 100;
+        size = (grown + SLAB_ALIGN - 1) / SLAB_ALIGN * SLAB_ALIGN;
+    }
+
+    int class = 0;
+    for (size_t units = 0; units <= SLAB_MAX_SIZE / SLAB_ALIGN; units++){
+        while (classes[class].size < units * SLAB_ALIGN){
+            class += 1;
+        }
+        classFor[units] = class;
+    }
+    atomic_store(&slabReady, true);
+}
+
+bool slab_init(size_t limit){
+    // the limit can only be picked before the region is reserved
+    if (atomic_load(&slabReady) == true || limit < SLAB_PAGE_SIZE){
+        errno = EINVAL;
+        return false;
+    }
+    slabLimit = limit;
+    pthread_once(&slabOnce, setup_slabs);
+    return regionBase != NULL;
+}
+
+size_t slab_chunk_size(size_t size){
+    if (size > SLAB_MAX_SIZE){
+        return 0;
+    }
+    pthread_once(&slabOnce, setup_slabs);
+    return classes[classFor[(size + SLAB_ALIGN - 1) / SLAB_ALIGN]].size;
+}
+
+bool slab_contains(const void *ptr){
+    return regionBase != NULL && (const char *) ptr >= regionBase &&
+           (const char *) ptr < regionBase + maxPages * SLAB_PAGE_SIZE;
+}
+
+bool slab_offset(const void *ptr, uint32_t *offset){
+    if (slab_contains(ptr) == false || offset == NULL){
+        errno = EINVAL;
+        return false;
+    }
+    size_t distance = (const char *) ptr - regionBase;
+    if (distance >= SLAB_OFFSET_LIMIT || distance % SLAB_ALIGN != 0){
+        errno = EINVAL;
+        return false;
+    }
+    *offset = distance / SLAB_ALIGN;
+    return true;
+}
+
+void *slab_at(uint32_t offset){
+    return regionBase + (size_t) offset * SLAB_ALIGN;
+}
+
+static size_t page_of(const void *chunk){
+    return ((const char *) chunk - regionBase) / SLAB_PAGE_SIZE;
+}
+
+/*
+ * Cuts a page into chunks for a class and puts them all in the global pool.
+ * Called with the class lock held.
+ */
+static void carve_page(int class, size_t page){
+    char *base = regionBase + page * SLAB_PAGE_SIZE;
+    pageClass[page] = class;
+
+    // thread the chunks together back to front so they come out in address order
+    slab_class_t *slabClass = &classes[class];
+    for (int i = slabClass -> per_page - 1; i >= 0; i--){
+        void *chunk = base + i * slabClass -> size;
+        *(void **) chunk = slabClass -> free_list;
+        slabClass -> free_list = chunk;
+    }
+    slabClass -> free_count += slabClass -> per_page;
+    slabClass -> pages += 1;
+}
+
+/*
+ * Gives a class a fresh page. Called with the class lock held.
+ */
+static bool grow_class(int class){
+    size_t page = atomic_load(&nextPage);
+    while (1){
+        if (page >= maxPages){
+            // remember who got turned away, that's what the rebalancer goes by
+            classes[class].failures += 1;
+            errno = ENOMEM;
+            return false;
+        }
+
+        // other classes grow at the same time, so the page is only ours once
+        // nextPage moves past it. making it usable twice does no harm
+        char *base = regionBase + page * SLAB_PAGE_SIZE;
+        if (mprotect(base, SLAB_PAGE_SIZE, PROT_READ | PROT_WRITE) == -1){
+            return false;
+        }
+        if (atomic_compare_exchange_weak(&nextPage, &page, page + 1) == true){
+            break;
+        }
+    }
+    carve_page(class, page);
+    return true;
+}
+
+/*
+ * Moves a batch of chunks from the global pool into this thread's cache.
+ */
+static bool refill_cache(int class){
+    slab_class_t *slabClass = &classes[class];
+    slab_cache_t *cache = &caches[class];
+
+    pthread_mutex_lock(&slabClass -> lock);
+    if (slabClass -> free_count == 0 && grow_class(class) == false){
+        pthread_mutex_unlock(&slabClass -> lock);
+        return false;
+    }
+
+    while (cache -> count < SLAB_BATCH && slabClass -> free_list != NULL){
+        void *chunk = slabClass -> free_list;
+        slabClass -> free_list = *(void **) chunk;
+        slabClass -> free_count -= 1;
+
+        *(void **) chunk = cache -> head;
+        cache -> head = chunk;
+        cache -> count += 1;
+    }
+    pthread_mutex_unlock(&slabClass -> lock);
+    return true;
+}
+
+/*
+ * Moves up to count chunks from this thread's cache back to the global pool.
+ */
+static void drain_cache(int class, unsigned count){
+    slab_class_t *slabClass = &classes[class];
+    slab_cache_t *cache = &caches[class];
+
+    pthread_mutex_lock(&slabClass -> lock);
+    while (count > 0 && cache -> head != NULL){
+        void *chunk = cache -> head;
+        cache -> head = *(void **) chunk;
+        cache -> count -= 1;
+
+        // chunks of a page that is moving are held aside instead of reused
+        if (pageDraining[page_of(chunk)] != 0){
+            *(void **) chunk = slabClass -> drain_list;
+            slabClass -> drain_list = chunk;
+            slabClass -> drain_count += 1;
+        }
+        else{
+            *(void **) chunk = slabClass -> free_list;
+            slabClass -> free_list = chunk;
+            slabClass -> free_count += 1;
+        }
+        count -= 1;
+    }
+    pthread_mutex_unlock(&slabClass -> lock);
+}
+
+void *slab_alloc(size_t size){
+    if (size == 0){
+        errno = EINVAL;
+        return NULL;
+    }
+    // nothing the protocol allows is this big, but don't fail on it either
+    if (size > SLAB_MAX_SIZE){
+        return malloc(size);
+    }
+
+    pthread_once(&slabOnce, setup_slabs);
+    if (regionBase == NULL){
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    // the rebalancer wants our cached chunks back
+    if (cacheEpoch != atomic_load_explicit(&flushEpoch, memory_order_relaxed)){
+        slab_flush_cache();
+    }
+
+    int class = classFor[(size + SLAB_ALIGN - 1) / SLAB_ALIGN];
+    slab_cache_t *cache = &caches[class];
+
+    // the common case: pop from our own cache, no locks
+    if (cache -> head == NULL && refill_cache(class) == false){
+        return NULL;
+    }
+    void *chunk = cache -> head;
+    cache -> head = *(void **) chunk;
+    cache -> count -= 1;
+    return chunk;
+}
+
+void slab_free(void *ptr){
+    if (ptr == NULL){
+        return;
+    }
+    // it came from the malloc fallback
+    if (slab_contains(ptr) == false){
+        free(ptr);
+        return;
+    }
+
+    int class = pageClass[page_of(ptr)];
+    slab_cache_t *cache = &caches[class];
+
+    *(void **) ptr = cache -> head;
+    cache -> head = ptr;
+    cache -> count += 1;
+
+    // too many stashed here (or the rebalancer is waiting on them), give them back
+    if (cache -> count > SLAB_CACHE_MAX){
+        drain_cache(class, SLAB_BATCH);
+    }
+    if (cacheEpoch != atomic_load_explicit(&flushEpoch, memory_order_relaxed)){
+        slab_flush_cache();
+    }
+}
+
+void slab_flush_cache(void){
+    if (atomic_load(&slabReady) == false){
+        return;
+    }
+    cacheEpoch = atomic_load(&flushEpoch);
+    for (int class = 0; class < numClasses; class++){
+        if (caches[class].count > 0){
+            drain_cache(class, caches[class].count);
+        }
+    }
+}
+
+/*
+ * Picks the class that has been refusing the most allocations since the
+ * last round, and fills in how many each class refused. Returns -1 if nobody has.
+ */
+static int hottest_class(size_t *recent){
+    int hot = -1;
+
+    for (int class = 0; class < numClasses; class++){
+        pthread_mutex_lock(&classes[class].lock);
+        recent[class] = classes[class].failures - classes[class].last_failures;
+        classes[class].last_failures = classes[class].failures;
+        pthread_mutex_unlock(&classes[class].lock);
+
+        if (recent[class] > 0 && (hot == -1 || recent[class] > recent[hot])){
+            hot = class;
+        }
+    }
+    return hot;
+}
+
+/*
+ * Picks the class to take a page from. A class that hasn't refused anything
+ * lately and has the most free bytes sitting around is wasting the most. A
+ * class's last page stays with it, or everything stored in it would go.
+ */
+static int coldest_class(int hot, size_t *recent){
+    int cold = -1;
+    size_t mostFree = 0;
+    size_t mostPages = 0;
+
+    for (int class = 0; class < numClasses; class++){
+        if (class == hot || recent[class] > 0){
+            continue;
+        }
+
+        pthread_mutex_lock(&classes[class].lock);
+        // a free 16 byte chunk is worth a lot less than a free 4k one
+        size_t freeBytes = classes[class].free_count * classes[class].size;
+        size_t pages = classes[class].pages;
+        pthread_mutex_unlock(&classes[class].lock);
+
+        if (pages <= 1){
+            continue;
+        }
+        if (cold == -1 || freeBytes > mostFree || (freeBytes == mostFree && pages > mostPages)){
+            cold = class;
+            mostFree = freeBytes;
+            mostPages = pages;
+        }
+    }
+    return cold;
+}
+
+/*
+ * Starts moving the page of a class with the fewest chunks in use, by pulling
+ * its free chunks out of the pool. A page with more than SLAB_MOVE_MAX_LIVE
+ * percent of its chunks in use is left alone, moving it costs too many residents.
+ *
+ * @return false if no page of the class can move
+ */
+static bool start_drain(int class, size_t *out){
+    slab_class_t *slabClass = &classes[class];
+    uint32_t *freeIn = calloc(maxPages, sizeof(uint32_t));
+    if (freeIn == NULL){
+        return false;
+    }
+
+    pthread_mutex_lock(&slabClass -> lock);
+
+    // count the free chunks in each page, the emptiest page evicts the fewest residents
+    for (void *chunk = slabClass -> free_list; chunk != NULL; chunk = *(void **) chunk){
+        freeIn[page_of(chunk)] += 1;
+    }
+    size_t page = 0;
+    bool found = false;
+    for (size_t i = 0; i < atomic_load(&nextPage); i++){
+        if (pageClass[i] == class && pageDraining[i] == 0 && (found == false || freeIn[i] > freeIn[page])){
+            page = i;
+            found = true;
+        }
+    }
+    size_t live = found == true ? slabClass -> per_page - freeIn[page] : 0;
+    free(freeIn);
+    if (found == false || live * 100 > (size_t) slabClass -> per_page * SLAB_MOVE_MAX_LIVE){
+        pthread_mutex_unlock(&slabClass -> lock);
+        return false;
+    }
+    pageDraining[page] = 1;
+
+    // move the page's free chunks aside so nobody gets handed one
+    void **link = &slabClass -> free_list;
+    while (*link != NULL){
+        void *chunk = *link;
+        if (page_of(chunk) == page){
+            *link = *(void **) chunk;
+            *(void **) chunk = slabClass -> drain_list;
+            slabClass -> drain_list = chunk;
+            slabClass -> drain_count += 1;
+            slabClass -> free_count -= 1;
+        }
+        else{
+            link = (void **) chunk;
+        }
+    }
+
+    pthread_mutex_unlock(&slabClass -> lock);
+    *out = page;
+    return true;
+}
+
+/*
+ * The move fell through, so the page stays where it was.
+ */
+static void cancel_drain(int class, size_t page){
+    slab_class_t *slabClass = &classes[class];
+
+    pthread_mutex_lock(&slabClass -> lock);
+    while (slabClass -> drain_list != NULL){
+        void *chunk = slabClass -> drain_list;
+        slabClass -> drain_list = *(void **) chunk;
+        *(void **) chunk = slabClass -> free_list;
+        slabClass -> free_list = chunk;
+        slabClass -> free_count += 1;
+    }
+    slabClass -> drain_count = 0;
+    pageDraining[page] = 0;
+    pthread_mutex_unlock(&slabClass -> lock);
+}
+
+bool slab_rebalance(slab_evict_f evict, void *arg){
+    if (atomic_load(&slabReady) == false){
+        return false;
+    }
+
+    size_t recent[SLAB_MAX_CLASSES];
+    int hot = hottest_class(recent);
+    if (hot == -1){
+        return false;
+    }
+    // chunks stashed in thread caches look like they're in use. ask for them
+    // back, so if this round finds no page it can move the next one might
+    atomic_fetch_add(&flushEpoch, 1);
+    slab_flush_cache();
+    int cold = coldest_class(hot, recent);
+    if (cold == -1){
+        return false;
+    }
+
+    slab_class_t *coldClass = &classes[cold];
+    size_t page;
+    if (start_drain(cold, &page) == false){
+        return false;
+    }
+    char *base = regionBase + page * SLAB_PAGE_SIZE;
+
+    // get everything that lives in the page thrown out, then wait for its
+    // chunks to come back from the thread caches they get freed into
+    struct timespec tick = {.tv_sec = 0, .tv_nsec = 1000000L};
+    bool drained = false;
+    for (int try = 0; try < SLAB_DRAIN_TRIES && drained == false; try++){
+        // run the hook again now and then, for residents that were still on their way in
+        if (evict != NULL && try % 10 == 0){
+            int evicted = evict(base, base + SLAB_PAGE_SIZE, arg);
+            pthread_mutex_lock(&coldClass -> lock);
+            coldClass -> evicted += evicted;
+            pthread_mutex_unlock(&coldClass -> lock);
+        }
+        atomic_fetch_add(&flushEpoch, 1);
+        slab_flush_cache();
+
+        pthread_mutex_lock(&coldClass -> lock);
+        drained = coldClass -> drain_count == coldClass -> per_page;
+        pthread_mutex_unlock(&coldClass -> lock);
+        if (drained == false){
+            nanosleep(&tick, NULL);
+        }
+    }
+
+    if (drained == false){
+        cancel_drain(cold, page);
+        return false;
+    }
+
+    // every chunk is back, so the page is ours to hand over
+    pthread_mutex_lock(&coldClass -> lock);
+    coldClass -> drain_list = NULL;
+    coldClass -> drain_count = 0;
+    coldClass -> pages -= 1;
+    coldClass -> moved_out += 1;
+    pageDraining[page] = 0;
+    pthread_mutex_unlock(&coldClass -> lock);
+
+    pthread_mutex_lock(&classes[hot].lock);
+    carve_page(hot, page);
+    classes[hot].moved_in += 1;
+    pthread_mutex_unlock(&classes[hot].lock);
+    return true;
+}
+
+typedef struct rebalancer_args_t {
+    slab_evict_f evict;
+    void *arg;
+    unsigned interval_ms;
+} rebalancer_args_t;
+
+static void *rebalancer(void *vargp){
+    rebalancer_args_t args = *(rebalancer_args_t *) vargp;
+    free(vargp);
+
+    struct timespec interval = {.tv_sec = args.interval_ms / 1000, .tv_nsec = (args.interval_ms % 1000) * 1000000L};
+    while (1){
+        nanosleep(&interval, NULL);
+        slab_rebalance(args.evict, args.arg);
+    }
+    return NULL;
+}
+
+bool start_slab_rebalancer(slab_evict_f evict, void *arg, unsigned interval_ms){
+    if (evict == NULL || interval_ms == 0){
+        errno = EINVAL;
+        return false;
+    }
+
+    rebalancer_args_t *args = malloc(sizeof(rebalancer_args_t));
+    if (args == NULL){
+        return false;
+    }
+    args -> evict = evict;
+    args -> arg = arg;
+    args -> interval_ms = interval_ms;
+
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, rebalancer, args) != 0){
+        free(args);
+        return false;
+    }
+    pthread_detach(tid);
+    return true;
+}
+
+bool slab_class_stats(int class, slab_class_t *out){
+    if (atomic_load(&slabReady) == false || class < 0 || class >= numClasses || out == NULL){
+        errno = EINVAL;
+        return false;
+    }
+
+    pthread_mutex_lock(&classes[class].lock);
+    *out = classes[class];
+    pthread_mutex_unlock(&classes[class].lock);
+    return true;
+}
+
+int slab_num_classes(void){
+    pthread_once(&slabOnce, setup_slabs);
+    return numClasses;
+}
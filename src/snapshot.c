@@ -0,0 +1,601 @@
+#define _GNU_SOURCE
+#include "snapshot.h"
+#include "slab.h"
+#include "reclaim.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+// only one snapshot is written at a time, they'd share the temporary file.
+// a flag rather than a lock, since a forked snapshot is finished by a
+// different thread than the one that started it
+static atomic_bool snapshotRunning;
+// how the last one to finish went
+static atomic_bool lastSaved;
+
+// where save_snapshot() is in the file it's writing
+typedef struct snapshot_writer_t {
+    FILE *file;
+    uint64_t offset;
+    uint64_t count;
+    uint64_t *index;
+    uint64_t index_cap;
+} snapshot_writer_t;
+
+// what the loader threads share
+typedef struct snapshot_loader_t {
+    store_t *store;
+    const char *base;
+    const snapshot_header_t *header;
+    const uint64_t *index;
+    map_entry_t *entries;   // the decoded records of the blocks from first_block
+    uint64_t first_block;
+    uint64_t end_block;
+    atomic_uint_fast64_t next_block;
+    atomic_int error;
+} snapshot_loader_t;
+
+static bool write_record(map_key_t key, map_val_t val, uint64_t age_ms, void *arg){
+    snapshot_writer_t *writer = arg;
+
+    // every block starts with an entry in the index
+    if (writer -> count % SNAPSHOT_BLOCK == 0){
+        if (writer -> count / SNAPSHOT_BLOCK == writer -> index_cap){
+            uint64_t cap = writer -> index_cap == 0 ? 64 : writer -> index_cap * 2;
+            uint64_t *index = realloc(writer -> index, cap * sizeof(uint64_t));
+            if (index == NULL){
+                return false;
+            }
+            writer -> index = index;
+            writer -> index_cap = cap;
+        }
+        writer -> index[writer -> count / SNAPSHOT_BLOCK] = writer -> offset;
+    }
+
+    snapshot_record_t record = {.key_len = key.key_len, .val_len = val.val_len, .age_ms = age_ms};
+    if (fwrite(&record, sizeof(record), 1, writer -> file) != 1 ||
+        fwrite(key.key_base, 1, key.key_len, writer -> file) != key.key_len ||
+        fwrite(val.val_base, 1, val.val_len, writer -> file) != val.val_len){
+        return false;
+    }
+    writer -> offset += sizeof(record) + key.key_len + val.val_len;
+    writer -> count += 1;
+    return true;
+}
+
+/*
+ * Writes the snapshot. The caller has set snapshotRunning.
+ */
+static bool write_snapshot(store_t *store, const char *path){
+    errno = 0;
+    char *tmpPath = malloc(strlen(path) + sizeof(".tmp"));
+    char *buffer = malloc(SNAPSHOT_BUFFER);
+    snapshot_writer_t writer = {.offset = sizeof(snapshot_header_t)};
+    snapshot_header_t header = {.version = SNAPSHOT_VERSION, .block_records = SNAPSHOT_BLOCK};
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+    bool saved = false;
+
+    if (tmpPath == NULL || buffer == NULL){
+        goto done;
+    }
+    sprintf(tmpPath, "%s.tmp", path);
+    writer.file = fopen(tmpPath, "w");
+    if (writer.file == NULL){
+        goto done;
+    }
+    setvbuf(writer.file, buffer, _IOFBF, SNAPSHOT_BUFFER);
+
+    // the header is written for real once we know what goes in it
+    if (fwrite(&header, sizeof(header), 1, writer.file) != 1 || store_walk(store, write_record, &writer) == false){
+        goto done;
+    }
+    header.count = writer.count;
+    header.num_blocks = (writer.count + SNAPSHOT_BLOCK - 1) / SNAPSHOT_BLOCK;
+    // pad up to the index, so the loader can use it straight from the mapping
+    static const char padding[sizeof(uint64_t)];
+    size_t pad = (sizeof(uint64_t) - writer.offset % sizeof(uint64_t)) % sizeof(uint64_t);
+    header.index_offset = writer.offset + pad;
+    if (fwrite(padding, 1, pad, writer.file) != pad || fwrite(writer.index, sizeof(uint64_t), header.num_blocks, writer.file) != header.num_blocks ||
+        fseek(writer.file, 0, SEEK_SET) != 0 || fwrite(&header, sizeof(header), 1, writer.file) != 1 ||
+        fflush(writer.file) != 0 || fsync(fileno(writer.file)) != 0){
+        goto done;
+    }
+    saved = true;
+
+done:
+    if (writer.file != NULL){
+        saved = fclose(writer.file) == 0 && saved;
+        // swap it in, or get rid of what we wrote
+        if (saved == true){
+            saved = rename(tmpPath, path) == 0;
+        }
+        if (saved == false){
+            unlink(tmpPath);
+        }
+    }
+    if (saved == false && errno == 0){
+        errno = EIO;
+    }
+    free(writer.index);
+    free(buffer);
+    free(tmpPath);
+    return saved;
+}
+
+bool save_snapshot(store_t *store, const char *path){
+    if (store == NULL || path == NULL){
+        errno = EINVAL;
+        return false;
+    }
+    if (atomic_exchange(&snapshotRunning, true) == true){
+        errno = EBUSY;
+        return false;
+    }
+    bool saved = write_snapshot(store, path);
+    atomic_store(&lastSaved, saved);
+    atomic_store(&snapshotRunning, false);
+    return saved;
+}
+
+#ifdef PERSIST
+// what a snapshot written by a thread instead of a child needs
+typedef struct snapshot_job_t {
+    store_t *store;
+    char *path;
+} snapshot_job_t;
+
+static void *write_in_thread(void *vargp){
+    snapshot_job_t *job = vargp;
+    bool saved = write_snapshot(job -> store, job -> path);
+    if (saved == false){
+        fprintf(stderr, "snapshot of %s failed: %s\n", job -> path, strerror(errno));
+    }
+    atomic_store(&lastSaved, saved);
+    atomic_store(&snapshotRunning, false);
+    free(job -> path);
+    free(job);
+    return NULL;
+}
+#else
+/*
+ * Waits for a snapshot child to finish, and says so if it failed.
+ */
+static void *reap_snapshot(void *vargp){
+    pid_t child = (pid_t) (intptr_t) vargp;
+    int status = 0;
+    pid_t reaped;
+    while ((reaped = waitpid(child, &status, 0)) < 0 && errno == EINTR)
+        ;
+    bool saved = reaped == child && WIFEXITED(status) == true && WEXITSTATUS(status) == EXIT_SUCCESS;
+    if (saved == false){
+        fprintf(stderr, "snapshot %d failed\n", child);
+    }
+    atomic_store(&lastSaved, saved);
+    atomic_store(&snapshotRunning, false);
+    return NULL;
+}
+#endif
+
+#ifndef PERSIST
+/*
+ * Closes every socket a snapshot child inherited. Files stay open, the
+ * child reads a cold tier's values through them.
+ */
+static void close_sockets(void){
+    struct stat info;
+    DIR *fds = opendir("/proc/self/fd");
+    if (fds == NULL){
+        for (int fd = 3; fd < SNAPSHOT_MAX_FDS; fd++){
+            if (fstat(fd, &info) == 0 && S_ISSOCK(info.st_mode)){
+                close(fd);
+            }
+        }
+        return;
+    }
+    // closing while reading the directory is fine, it's only read ahead
+    struct dirent *entry;
+    while ((entry = readdir(fds)) != NULL){
+        int fd = atoi(entry -> d_name);
+        if (fd > 2 && fd != dirfd(fds) && fstat(fd, &info) == 0 && S_ISSOCK(info.st_mode)){
+            close(fd);
+        }
+    }
+    closedir(fds);
+}
+#endif
+
+bool fork_snapshot(store_t *store, const char *path){
+    if (store == NULL || path == NULL){
+        errno = EINVAL;
+        return false;
+    }
+    if (atomic_exchange(&snapshotRunning, true) == true){
+        errno = EBUSY;
+        return false;
+    }
+
+#ifdef PERSIST
+    // the persistent map is a shared mapping, so a child wouldn't get a copy
+    // of it, it would see every change we make. a thread walks it instead,
+    // holding off writers one shard at a time
+    snapshot_job_t *job = malloc(sizeof(snapshot_job_t));
+    char *jobPath = strdup(path);
+    pthread_t tid;
+    if (job == NULL || jobPath == NULL){
+        free(job);
+        free(jobPath);
+        atomic_store(&snapshotRunning, false);
+        errno = ENOMEM;
+        return false;
+    }
+    *job = (snapshot_job_t) {.store = store, .path = jobPath};
+    if (pthread_create(&tid, NULL, write_in_thread, job) != 0){
+        free(job);
+        free(jobPath);
+        atomic_store(&snapshotRunning, false);
+        return false;
+    }
+    pthread_detach(tid);
+    return true;
+#else
+
+    // nobody is in the middle of changing the map while we fork, so the child
+    // gets a consistent copy of it
+    store_freeze(store);
+    pid_t child = fork();
+    if (child == 0){
+        // we're the only thread left. start the locks over, and let go of the
+        // sockets we inherited so no client waits on us
+        store_reset_locks(store);
+        close_sockets();
+        _exit(write_snapshot(store, path) == true ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+    store_thaw(store);
+
+    if (child < 0){
+        atomic_store(&snapshotRunning, false);
+        return false;
+    }
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, reap_snapshot, (void *) (intptr_t) child) != 0){
+        // no thread to wait for it, so we wait ourselves
+        reap_snapshot((void *) (intptr_t) child);
+        return true;
+    }
+    pthread_detach(tid);
+    return true;
+#endif
+}
+
+bool snapshot_running(void){
+    return atomic_load(&snapshotRunning);
+}
+
+bool snapshot_wait(void){
+    struct timespec tick = {.tv_sec = 0, .tv_nsec = SNAPSHOT_POLL_MS * 1000000L};
+    while (atomic_load(&snapshotRunning) == true){
+        nanosleep(&tick, NULL);
+    }
+    return atomic_load(&lastSaved);
+}
+
+/*
+ * Decodes one block of records into its part of the loader's entries.
+ * Whatever it got to before failing is left there, to be freed.
+ *
+ * @return false if the block is damaged or we're out of memory
+ */
+static bool load_block(snapshot_loader_t *loader, uint64_t block){
+    const snapshot_header_t *header = loader -> header;
+    uint64_t pos = loader -> index[block];
+    uint64_t end = block + 1 < header -> num_blocks ? loader -> index[block + 1] : header -> index_offset;
+    uint64_t records = header -> count - block * header -> block_records;
+    if (records > header -> block_records){
+        records = header -> block_records;
+    }
+    if (pos < sizeof(snapshot_header_t) || pos > end || end > header -> index_offset){
+        errno = EINVAL;
+        return false;
+    }
+
+    map_entry_t *entries = loader -> entries + (block - loader -> first_block) * header -> block_records;
+    for (uint64_t i = 0; i < records; i++){
+        snapshot_record_t record;
+        if (end - pos < sizeof(record)){
+            errno = EINVAL;
+            return false;
+        }
+        // records aren't aligned, so copy the fixed part out
+        memcpy(&record, loader -> base + pos, sizeof(record));
+        pos += sizeof(record);
+        if (record.key_len == 0 || record.val_len == 0 || end - pos < (uint64_t) record.key_len + record.val_len){
+            errno = EINVAL;
+            return false;
+        }
+
+        char *key = slab_alloc(record.key_len);
+        char *val = slab_alloc(record.val_len);
+        if (key == NULL || val == NULL){
+            slab_free(key);
+            slab_free(val);
+            errno = ENOMEM;
+            return false;
+        }
+        memcpy(key, loader -> base + pos, record.key_len);
+        pos += record.key_len;
+        memcpy(val, loader -> base + pos, record.val_len);
+        pos += record.val_len;
+
+        map_key_t mapKey = MAP_KEY(key, record.key_len);
+        entries[i] = (map_entry_t) {
+            .key = mapKey,
+            .val = MAP_VAL(val, record.val_len),
+            .hash = loader -> store -> hash_function(mapKey),
+            .age_ms = record.age_ms,
+        };
+    }
+    return true;
+}
+
+static void *load_blocks(void *vargp){
+    snapshot_loader_t *loader = vargp;
+
+    // take blocks until there are none left, so a thread that got small ones
+    // just takes more
+    uint64_t block;
+    while (atomic_load_explicit(&loader -> error, memory_order_relaxed) == 0 &&
+           (block = atomic_fetch_add(&loader -> next_block, 1)) < loader -> end_block){
+        if (load_block(loader, block) == false){
+            atomic_store(&loader -> error, errno);
+        }
+    }
+
+    // this thread is about to go away, don't strand anything in its caches
+    slab_flush_cache();
+    return NULL;
+}
+
+/*
+ * Maps a snapshot and checks its header.
+ *
+ * @return The mapping, or NULL (errno EINVAL if the file isn't a snapshot)
+ */
+static char *map_snapshot(const char *path, size_t *sizeOut, snapshot_header_t *headerOut){
+    int fd = open(path, O_RDONLY);
+    if (fd < 0){
+        return NULL;
+    }
+    struct stat info;
+    if (fstat(fd, &info) != 0 || info.st_size < sizeof(snapshot_header_t)){
+        close(fd);
+        errno = EINVAL;
+        return NULL;
+    }
+    size_t size = info.st_size;
+    char *base = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED){
+        return NULL;
+    }
+
+    snapshot_header_t header;
+    memcpy(&header, base, sizeof(header));
+    if (memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic)) != 0 || header.version != SNAPSHOT_VERSION ||
+        header.block_records == 0 || header.num_blocks != (header.count + header.block_records - 1) / header.block_records ||
+        header.index_offset > size || (size - header.index_offset) / sizeof(uint64_t) < header.num_blocks ||
+        header.index_offset % sizeof(uint64_t) != 0){
+        munmap(base, size);
+        errno = EINVAL;
+        return NULL;
+    }
+    *sizeOut = size;
+    *headerOut = header;
+    return base;
+}
+
+bool load_snapshot(store_t *store, const char *path, int threads, uint64_t *loaded){
+    if (loaded != NULL){
+        *loaded = 0;
+    }
+    if (store == NULL || path == NULL || threads < 1){
+        errno = EINVAL;
+        return false;
+    }
+
+    size_t size;
+    snapshot_header_t header;
+    char *base = map_snapshot(path, &size, &header);
+    if (base == NULL){
+        return false;
+    }
+    // it'll all be read, start reading ahead now
+    madvise(base, size, MADV_WILLNEED);
+
+    // the index is aligned (checked above), so it can be used in place
+    snapshot_loader_t loader = {
+        .store = store,
+        .base = base,
+        .header = &header,
+        .index = (const uint64_t *) (base + header.index_offset),
+    };
+    atomic_init(&loader.next_block, 0);
+    atomic_init(&loader.error, 0);
+
+    uint64_t window = SNAPSHOT_LOAD_BLOCKS * header.block_records;
+    if (window > header.count){
+        window = header.count;
+    }
+    loader.entries = malloc(window * sizeof(map_entry_t) + 1);
+    int decoders = threads;
+    if (decoders > header.num_blocks){
+        decoders = header.num_blocks > 0 ? header.num_blocks : 1;
+    }
+    if (decoders > SNAPSHOT_LOAD_BLOCKS){
+        decoders = SNAPSHOT_LOAD_BLOCKS;
+    }
+    pthread_t *tids = calloc(decoders, sizeof(pthread_t));
+    bool *started = calloc(decoders, sizeof(bool));
+    if (loader.entries == NULL || tids == NULL || started == NULL){
+        atomic_store(&loader.error, ENOMEM);
+    }
+
+    uint64_t stored = 0;
+    for (uint64_t first = 0; first < header.num_blocks && atomic_load(&loader.error) == 0; first += SNAPSHOT_LOAD_BLOCKS){
+        loader.first_block = first;
+        loader.end_block = first + SNAPSHOT_LOAD_BLOCKS < header.num_blocks ? first + SNAPSHOT_LOAD_BLOCKS : header.num_blocks;
+        atomic_store(&loader.next_block, first);
+        uint64_t end = loader.end_block * header.block_records < header.count ? loader.end_block * header.block_records : header.count;
+        uint64_t count = end - first * header.block_records;
+        memset(loader.entries, 0, count * sizeof(map_entry_t));
+
+        // decode the window's blocks...
+        for (int i = 1; i < decoders; i++){
+            started[i] = pthread_create(&tids[i], NULL, load_blocks, &loader) == 0;
+        }
+        // we pitch in too, and finish the job alone if no thread could be started
+        load_blocks(&loader);
+        for (int i = 1; i < decoders; i++){
+            if (started[i] == true){
+                pthread_join(tids[i], NULL);
+            }
+        }
+
+        // ...and put them all at once, before the store takes any traffic
+        if (atomic_load(&loader.error) == 0 && store_bulk_load(store, loader.entries, count, threads, false) == false){
+            atomic_store(&loader.error, errno);
+        }
+        for (uint64_t i = 0; i < count; i++){
+            if (loader.entries[i].stored == true){
+                stored += 1;
+            }
+            else if (loader.entries[i].key.key_base != NULL){
+                slab_free(loader.entries[i].key.key_base);
+                slab_free(loader.entries[i].val.val_base);
+            }
+        }
+    }
+    // the threads the map put with are gone, but ours is still around
+    retire_flush();
+    free(loader.entries);
+    free(tids);
+    free(started);
+    munmap(base, size);
+
+    if (loaded != NULL){
+        *loaded = stored;
+    }
+    if (atomic_load(&loader.error) != 0){
+        errno = atomic_load(&loader.error);
+        return false;
+    }
+    return true;
+}
+
+static uint64_t hash_key(const char *key, size_t len){
+    uint64_t hash = 14695981039346656037ull;
+    for (size_t i = 0; i < len; i++){
+        hash = (hash ^ (uint8_t) key[i]) * 1099511628211ull;
+    }
+    return hash;
+}
+
+snapshot_source_t *open_snapshot_source(const char *path){
+    if (path == NULL){
+        errno = EINVAL;
+        return NULL;
+    }
+    snapshot_source_t *source = calloc(1, sizeof(snapshot_source_t));
+    if (source == NULL){
+        return NULL;
+    }
+    snapshot_header_t header;
+    source -> base = map_snapshot(path, &source -> size, &header);
+    if (source -> base == NULL){
+        free(source);
+        return NULL;
+    }
+
+    // at most half full, so probes stay short
+    uint64_t slots = 16;
+    while (slots < header.count * 2){
+        slots *= 2;
+    }
+    source -> slots = calloc(slots, sizeof(uint64_t));
+    source -> mask = slots - 1;
+    if (source -> slots == NULL){
+        close_snapshot_source(source);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    // index every record by its key. a damaged record ends the index, what
+    // came before it can still be fetched
+    uint64_t pos = sizeof(snapshot_header_t);
+    for (uint64_t i = 0; i < header.count; i++){
+        snapshot_record_t record;
+        if (header.index_offset - pos < sizeof(record)){
+            break;
+        }
+        memcpy(&record, source -> base + pos, sizeof(record));
+        if (record.key_len == 0 || record.val_len == 0 ||
+            header.index_offset - pos - sizeof(record) < (uint64_t) record.key_len + record.val_len){
+            break;
+        }
+        uint64_t slot = hash_key(source -> base + pos + sizeof(record), record.key_len) & source -> mask;
+        while (source -> slots[slot] != 0){
+            slot = (slot + 1) & source -> mask;
+        }
+        source -> slots[slot] = pos;
+        pos += sizeof(record) + record.key_len + record.val_len;
+    }
+    return source;
+}
+
+bool fetch_from_snapshot(map_key_t key, map_val_t *val, uint64_t *age_ms, void *arg){
+    snapshot_source_t *source = arg;
+    if (source == NULL || key.key_base == NULL || val == NULL || age_ms == NULL){
+        errno = EINVAL;
+        return false;
+    }
+    uint64_t slot = hash_key(key.key_base, key.key_len) & source -> mask;
+    for (; source -> slots[slot] != 0; slot = (slot + 1) & source -> mask){
+        snapshot_record_t record;
+        const char *found = source -> base + source -> slots[slot];
+        memcpy(&record, found, sizeof(record));
+        if (record.key_len != key.key_len || memcmp(found + sizeof(record), key.key_base, key.key_len) != 0){
+            continue;
+        }
+        char *copy = slab_alloc(record.val_len);
+        if (copy == NULL){
+            errno = ENOMEM;
+            return false;
+        }
+        memcpy(copy, found + sizeof(record) + record.key_len, record.val_len);
+        *val = MAP_VAL(copy, record.val_len);
+        *age_ms = record.age_ms;
+        return true;
+    }
+    errno = ENOENT;
+    return false;
+}
+
+void close_snapshot_source(snapshot_source_t *source){
+    if (source == NULL){
+        return;
+    }
+    if (source -> base != NULL){
+        munmap(source -> base, source -> size);
+    }
+    free(source -> slots);
+    free(source);
+}
@@ -0,0 +1,70 @@
+#include "spsc.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+spsc_t *create_spsc(void){
+    spsc_t *ring = aligned_alloc(CACHE_LINE, sizeof(spsc_t));
+    if (ring == NULL){
+        return NULL;
+    }
+    memset(ring, 0, sizeof(spsc_t));
+
+    ring -> items = calloc(SPSC_CAPACITY, sizeof(void *));
+    if (ring -> items == NULL){
+        free(ring);
+        return NULL;
+    }
+    ring -> mask = SPSC_CAPACITY - 1;
+    atomic_init(&ring -> head, 0);
+    atomic_init(&ring -> tail, 0);
+    return ring;
+}
+
+bool spsc_push(spsc_t *self, void *item){
+    if (self == NULL || item == NULL){
+        errno = EINVAL;
+        return false;
+    }
+
+    size_t tail = atomic_load_explicit(&self -> tail, memory_order_relaxed);
+    // looks full from here, see how far the consumer really got
+    if (tail - self -> cached_head > self -> mask){
+        self -> cached_head = atomic_load_explicit(&self -> head, memory_order_acquire);
+        if (tail - self -> cached_head > self -> mask){
+            errno = ENOBUFS;
+            return false;
+        }
+    }
+
+    self -> items[tail & self -> mask] = item;
+    // publishes the item along with the new tail
+    atomic_store_explicit(&self -> tail, tail + 1, memory_order_release);
+    return true;
+}
+
+void *spsc_pop(spsc_t *self){
+    if (self == NULL){
+        errno = EINVAL;
+        return NULL;
+    }
+
+    size_t head = atomic_load_explicit(&self -> head, memory_order_relaxed);
+    // looks empty from here, see whether the producer added anything
+    if (head == self -> cached_tail){
+        self -> cached_tail = atomic_load_explicit(&self -> tail, memory_order_acquire);
+        if (head == self -> cached_tail){
+            return NULL;
+        }
+    }
+
+    void *item = self -> items[head & self -> mask];
+    // hands the slot back to the producer
+    atomic_store_explicit(&self -> head, head + 1, memory_order_release);
+    return item;
+}
+
+bool spsc_empty(spsc_t *self){
+    return atomic_load_explicit(&self -> head, memory_order_relaxed) ==
+           atomic_load_explicit(&self -> tail, memory_order_acquire);
+}
@@ -0,0 +1,74 @@
+#include "stats.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const char *names[STATS_COUNTERS] = {
+    [STATS_PUT] = "put",
+    [STATS_GET] = "get",
+    [STATS_EVICT] = "evict",
+    [STATS_CLEAR] = "clear",
+    [STATS_SNAPSHOT] = "snapshot",
+    [STATS_STATS] = "stats",
+    [STATS_UNSUPPORTED] = "unsupported",
+    [STATS_BAD_REQUEST] = "bad_request",
+    [STATS_HITS] = "hits",
+    [STATS_MISSES] = "misses",
+    [STATS_EVICTED] = "evicted",
+    [STATS_EXPIRED] = "expired",
+    [STATS_REBALANCED] = "rebalance_evicted",
+    [STATS_ACCEPTED] = "accepted",
+    [STATS_CLOSED] = "closed",
+    [STATS_SHED] = "shed",
+};
+
+// every thread's counters, newest first. only ever pushed onto, so readers
+// can walk it without the lock
+static _Atomic(stats_t *) allStats = NULL;
+static pthread_mutex_t registerLock = PTHREAD_MUTEX_INITIALIZER;
+static __thread stats_t *myStats = NULL;
+
+/*
+ * Makes the calling thread's counters and puts them on the list.
+ */
+static stats_t *register_stats(void){
+    stats_t *stats = aligned_alloc(CACHE_LINE, sizeof(stats_t));
+    if (stats == NULL){
+        return NULL;
+    }
+    for (int i = 0; i < STATS_COUNTERS; i++){
+        atomic_init(&stats -> counters[i], 0);
+    }
+    pthread_mutex_lock(&registerLock);
+    stats -> next = atomic_load_explicit(&allStats, memory_order_relaxed);
+    atomic_store_explicit(&allStats, stats, memory_order_release);
+    pthread_mutex_unlock(&registerLock);
+    myStats = stats;
+    return stats;
+}
+
+void stats_add(int counter, uint64_t n){
+    stats_t *stats = myStats;
+    if (stats == NULL && (stats = register_stats()) == NULL){
+        return;
+    }
+    // we're the only writer, so there's no need for a locked add
+    uint64_t count = atomic_load_explicit(&stats -> counters[counter], memory_order_relaxed);
+    atomic_store_explicit(&stats -> counters[counter], count + n, memory_order_relaxed);
+}
+
+void stats_sum(uint64_t *totals){
+    memset(totals, 0, STATS_COUNTERS * sizeof(uint64_t));
+    for (stats_t *stats = atomic_load_explicit(&allStats, memory_order_acquire); stats != NULL; stats = stats -> next){
+        for (int i = 0; i < STATS_COUNTERS; i++){
+            totals[i] += atomic_load_explicit(&stats -> counters[i], memory_order_relaxed);
+        }
+    }
+}
+
+const char *stats_name(int counter){
+    if (counter < 0 || counter >= STATS_COUNTERS){
+        return NULL;
+    }
+    return names[counter];
+}
@@ -0,0 +1,413 @@
+#include "store.h"
+#include "reclaim.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+
+// what a shard builder thread needs
+typedef struct shard_job_t {
+    store_t *store;
+    const char *path;   // the shard's file, or NULL
+    int shard;
+    uint32_t capacity;
+    destructor_f destroy_function;
+    topology_t *topology;
+    int prefault_threads;
+    int error;          // errno, if the shard couldn't be built
+} shard_job_t;
+
+/*
+ * Builds one shard. With a topology this runs pinned to the shard's node, so
+ * the table gets first touched (and placed) there, as do the prefault
+ * threads, which inherit the pinning.
+ */
+static void *build_shard(void *vargp){
+    shard_job_t *job = vargp;
+    if (job -> topology != NULL && pin_thread_to_node(job -> topology, job -> shard) == false){
+        return NULL;
+    }
+
+    hashmap_t *shard;
+    if (job -> path == NULL){
+        shard = create_map(job -> capacity, job -> store -> hash_function, job -> destroy_function);
+    }
+    else{
+#ifdef PERSIST
+        shard = open_map(job -> path, job -> capacity, job -> store -> hash_function, job -> destroy_function);
+#else
+        // only the persistent engine keeps its map in a file
+        errno = ENOTSUP;
+        shard = NULL;
+#endif
+    }
+    if (shard == NULL){
+        job -> error = errno;
+        return NULL;
+    }
+    if (job -> prefault_threads > 0 && prefault_map(shard, job -> prefault_threads) == false){
+        invalidate_map(shard);
+        free(shard);
+        return NULL;
+    }
+    job -> store -> shards[job -> shard] = shard;
+    return NULL;
+}
+
+store_t *create_store(int num_shards, uint32_t capacity, hash_func_f hash_function,
+                      destructor_f destroy_function, topology_t *topology, int prefault_threads){
+    return open_store(NULL, num_shards, capacity, hash_function, destroy_function, topology, prefault_threads);
+}
+
+store_t *open_store(const char *path, int num_shards, uint32_t capacity, hash_func_f hash_function,
+                    destructor_f destroy_function, topology_t *topology, int prefault_threads){
+    if (topology != NULL){
+        num_shards = topology -> num_nodes;
+        // an unfaulted table gets placed wherever a worker happens to touch it first
+        if (prefault_threads < 1){
+            prefault_threads = 1;
+        }
+    }
+    if (num_shards < 1 || num_shards > STORE_MAX_SHARDS || capacity < (uint32_t) num_shards ||
+        hash_function == NULL || destroy_function == NULL){
+        errno = EINVAL;
+        return NULL;
+    }
+
+    store_t *store = calloc(1, sizeof(store_t));
+    if (store == NULL){
+        return NULL;
+    }
+    store -> num_shards = num_shards;
+    store -> hash_function = hash_function;
+    store -> destroy_function = destroy_function;
+
+    shard_job_t jobs[STORE_MAX_SHARDS];
+    pthread_t tids[STORE_MAX_SHARDS];
+    bool threaded[STORE_MAX_SHARDS];
+    // the shard count is in the name, a key's shard depends on it
+    char paths[STORE_MAX_SHARDS][STORE_PATH_MAX];
+    for (int i = 0; i < num_shards; i++){
+        if (path != NULL && snprintf(paths[i], STORE_PATH_MAX, "%s.%d-of-%d", path, i, num_shards) >= STORE_PATH_MAX){
+            free(store);
+            errno = ENAMETOOLONG;
+            return NULL;
+        }
+        jobs[i] = (shard_job_t) {
+            .store = store,
+            .path = path != NULL ? paths[i] : NULL,
+            .shard = i,
+            .capacity = (capacity + num_shards - 1) / num_shards,
+            .destroy_function = destroy_function,
+            .topology = topology,
+            .prefault_threads = prefault_threads,
+            .error = ENOMEM,
+        };
+        // a thread per shard, so every node builds its own at the same time
+        threaded[i] = topology != NULL && pthread_create(&tids[i], NULL, build_shard, &jobs[i]) == 0;
+        if (threaded[i] == false){
+            build_shard(&jobs[i]);
+        }
+    }
+
+    bool ok = true;
+    int error = ENOMEM;
+    for (int i = 0; i < num_shards; i++){
+        if (threaded[i] == true){
+            pthread_join(tids[i], NULL);
+        }
+        if (store -> shards[i] == NULL){
+            ok = false;
+            error = jobs[i].error;
+        }
+    }
+    if (ok == false){
+        for (int i = 0; i < num_shards; i++){
+            if (store -> shards[i] != NULL){
+                invalidate_map(store -> shards[i]);
+                free(store -> shards[i]);
+            }
+        }
+        free(store);
+        errno = error;
+        return NULL;
+    }
+    return store;
+}
+
+int store_shard_of(store_t *self, map_key_t key){
+    if (self -> num_shards == 1){
+        return 0;
+    }
+    // the shards index with the low bits, so pick the shard with the high ones
+    return (self -> hash_function(key) >> 16) % self -> num_shards;
+}
+
+bool store_put(store_t *self, map_key_t key, map_val_t val, bool force){
+    if (self == NULL || key.key_base == NULL){
+        errno = EINVAL;
+        return false;
+    }
+    return put(self -> shards[store_shard_of(self, key)], key, val, force);
+}
+
+bool store_put_aged(store_t *self, map_key_t key, map_val_t val, uint64_t age_ms, bool force){
+    if (self == NULL || key.key_base == NULL){
+        errno = EINVAL;
+        return false;
+    }
+    return put_aged(self -> shards[store_shard_of(self, key)], key, val, age_ms, force);
+}
+
+map_val_t store_get(store_t *self, map_key_t key){
+    if (self == NULL || key.key_base == NULL){
+        errno = EINVAL;
+        return MAP_VAL(NULL, 0);
+    }
+    return get(self -> shards[store_shard_of(self, key)], key);
+}
+
+map_node_t store_delete(store_t *self, map_key_t key){
+    if (self == NULL || key.key_base == NULL){
+        errno = EINVAL;
+        return MAP_NODE(MAP_KEY(NULL, 0), MAP_VAL(NULL, 0), false);
+    }
+    return delete(self -> shards[store_shard_of(self, key)], key);
+}
+
+bool store_evict(store_t *self, map_key_t key){
+    map_node_t node = store_delete(self, key);
+    if (node.key.key_len == 0){
+        return false;
+    }
+    retire(self -> destroy_function, node.key, node.val);
+    return true;
+}
+
+/*
+ * Puts one shard's share, a slice at a time if it's live.
+ */
+static bool bulk_load_shard(hashmap_t *shard, map_entry_t *entries, size_t count, int threads, bool live){
+    size_t slice = live == true ? STORE_BULK_SLICE : count;
+    bool stored = true;
+    int error = 0;
+    for (size_t first = 0; first < count; first += slice){
+        if (bulk_put(shard, entries + first, count - first < slice ? count - first : slice, threads) == false){
+            stored = false;
+            error = errno;
+        }
+    }
+    if (stored == false){
+        errno = error;
+    }
+    return stored;
+}
+
+bool store_bulk_load(store_t *self, map_entry_t *entries, size_t count, int threads, bool live){
+    if (self == NULL || (entries == NULL && count > 0) || threads < 1){
+        errno = EINVAL;
+        return false;
+    }
+    if (self -> num_shards == 1){
+        return bulk_load_shard(self -> shards[0], entries, count, threads, live);
+    }
+
+    // group the batch by shard, the same way store_shard_of() picks one,
+    // keeping where every entry came from so stored can be copied back
+    map_entry_t *grouped = malloc(count * sizeof(map_entry_t) + 1);
+    size_t *from = malloc(count * sizeof(size_t) + 1);
+    if (grouped == NULL || from == NULL){
+        free(grouped);
+        free(from);
+        errno = ENOMEM;
+        return false;
+    }
+    size_t first[STORE_MAX_SHARDS + 1] = {0};
+    for (size_t i = 0; i < count; i++){
+        first[(entries[i].hash >> 16) % self -> num_shards + 1] += 1;
+    }
+    for (int i = 0; i < self -> num_shards; i++){
+        first[i + 1] += first[i];
+    }
+    size_t next[STORE_MAX_SHARDS];
+    memcpy(next, first, sizeof(next));
+    for (size_t i = 0; i < count; i++){
+        size_t slot = next[(entries[i].hash >> 16) % self -> num_shards]++;
+        grouped[slot] = entries[i];
+        from[slot] = i;
+    }
+
+    bool stored = true;
+    int error = 0;
+    for (int i = 0; i < self -> num_shards; i++){
+        if (bulk_load_shard(self -> shards[i], grouped + first[i], first[i + 1] - first[i], threads, live) == false){
+            stored = false;
+            error = errno;
+        }
+    }
+    for (size_t i = 0; i < count; i++){
+        entries[from[i]].stored = grouped[i].stored;
+    }
+    free(grouped);
+    free(from);
+    if (stored == false){
+        errno = error;
+    }
+    return stored;
+}
+
+bool store_clear(store_t *self){
+    if (self == NULL){
+        errno = EINVAL;
+        return false;
+    }
+    bool cleared = true;
+    for (int i = 0; i < self -> num_shards; i++){
+        cleared = clear_map(self -> shards[i]) && cleared;
+    }
+    return cleared;
+}
+
+int store_evict_range(store_t *self, const void *lo, const void *hi){
+    if (self == NULL){
+        errno = EINVAL;
+        return 0;
+    }
+    int evicted = 0;
+    for (int i = 0; i < self -> num_shards; i++){
+        evicted += evict_range(self -> shards[i], lo, hi);
+    }
+    return evicted;
+}
+
+bool store_walk(store_t *self, map_walk_f func, void *arg){
+    if (self == NULL || func == NULL){
+        errno = EINVAL;
+        return false;
+    }
+    for (int i = 0; i < self -> num_shards; i++){
+        if (map_walk(self -> shards[i], func, arg) == false){
+            return false;
+        }
+    }
+    return true;
+}
+
+bool store_hottest(store_t *self, uint32_t count, map_walk_f func, void *arg){
+#ifdef EC
+    if (self == NULL || func == NULL){
+        errno = EINVAL;
+        return false;
+    }
+    uint32_t share = (count + self -> num_shards - 1) / self -> num_shards;
+    for (int i = 0; i < self -> num_shards; i++){
+        if (map_hottest(self -> shards[i], share, func, arg) == false){
+            return false;
+        }
+    }
+    return true;
+#else
+    errno = ENOTSUP;
+    return false;
+#endif
+}
+
+void store_freeze(store_t *self){
+    // a thread only ever holds one shard's lock at a time, so taking them all
+    // in order can't deadlock
+    for (int i = 0; i < self -> num_shards; i++){
+        pthread_mutex_lock(&self -> shards[i] -> write_lock);
+    }
+}
+
+void store_thaw(store_t *self){
+    for (int i = self -> num_shards - 1; i >= 0; i--){
+        pthread_mutex_unlock(&self -> shards[i] -> write_lock);
+    }
+}
+
+void store_reset_locks(store_t *self){
+    // a reader may have been waiting for the write lock while holding
+    // fields_lock, so that one is started over too
+    for (int i = 0; i < self -> num_shards; i++){
+        pthread_mutex_init(&self -> shards[i] -> write_lock, NULL);
+        pthread_mutex_init(&self -> shards[i] -> fields_lock, NULL);
+        self -> shards[i] -> num_readers = 0;
+    }
+}
+
+uint32_t store_size(store_t *self){
+    if (self == NULL){
+        errno = EINVAL;
+        return 0;
+    }
+    uint32_t size = 0;
+    for (int i = 0; i < self -> num_shards; i++){
+        size += self -> shards[i] -> size;
+    }
+    return size;
+}
+
+uint32_t store_capacity(store_t *self){
+    if (self == NULL){
+        errno = EINVAL;
+        return 0;
+    }
+    uint32_t capacity = 0;
+    for (int i = 0; i < self -> num_shards; i++){
+        capacity += self -> shards[i] -> capacity;
+    }
+    return capacity;
+}
+
+uint32_t store_tombstones(store_t *self){
+    if (self == NULL){
+        errno = EINVAL;
+        return 0;
+    }
+    uint32_t tombstones = 0;
+    for (int i = 0; i < self -> num_shards; i++){
+        tombstones += map_tombstones(self -> shards[i]);
+    }
+    return tombstones;
+}
+
+bool store_checkpoint(store_t *self){
+    if (self == NULL){
+        errno = EINVAL;
+        return false;
+    }
+#ifdef PERSIST
+    bool synced = true;
+    for (int i = 0; i < self -> num_shards; i++){
+        synced = checkpoint_map(self -> shards[i]) && synced;
+    }
+    return synced;
+#else
+    // nothing to write back, the map only lives in memory
+    return true;
+#endif
+}
+
+bool store_spill(store_t *self, const char *path, uint64_t hot_limit){
+    if (self == NULL || path == NULL || hot_limit < (uint64_t) self -> num_shards){
+        errno = EINVAL;
+        return false;
+    }
+#ifdef EC
+    for (int i = 0; i < self -> num_shards; i++){
+        char shardPath[STORE_PATH_MAX];
+        if (snprintf(shardPath, STORE_PATH_MAX, "%s.%d", path, i) >= STORE_PATH_MAX){
+            errno = ENAMETOOLONG;
+            return false;
+        }
+        if (spill_map(self -> shards[i], shardPath, hot_limit / self -> num_shards) == false){
+            return false;
+        }
+    }
+    return true;
+#else
+    errno = ENOTSUP;
+    return false;
+#endif
+}
@@ -0,0 +1,116 @@
+#include "table.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+// one prefault thread's share of the table
+typedef struct prefault_t {
+    char *start;
+    char *end;
+    size_t page;
+} prefault_t;
+
+static size_t table_bytes(size_t count, size_t size){
+    return (count * size + TABLE_HUGE_PAGE - 1) / TABLE_HUGE_PAGE * TABLE_HUGE_PAGE;
+}
+
+void *table_alloc(size_t count, size_t size){
+    if (count == 0 || size == 0 || count > SIZE_MAX / size){
+        errno = EINVAL;
+        return NULL;
+    }
+    if (count * size < TABLE_MMAP_MIN){
+        return calloc(count, size);
+    }
+
+    size_t bytes = table_bytes(count, size);
+    // over-map by a huge page so the table itself can start on a huge page boundary
+    char *mapping = mmap(NULL, bytes + TABLE_HUGE_PAGE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (mapping == MAP_FAILED){
+        errno = ENOMEM;
+        return NULL;
+    }
+    char *table = (char *) (((uintptr_t) mapping + TABLE_HUGE_PAGE - 1) & ~(TABLE_HUGE_PAGE - 1));
+    // give back the slack on either side
+    if (table > mapping){
+        munmap(mapping, table - mapping);
+    }
+    munmap(table + bytes, mapping + TABLE_HUGE_PAGE - table);
+
+    // only a hint. without THP we still get a working (4 KB page) table
+    madvise(table, bytes, MADV_HUGEPAGE);
+    return table;
+}
+
+void table_free(void *table, size_t count, size_t size){
+    if (table == NULL){
+        return;
+    }
+    if (count * size < TABLE_MMAP_MIN){
+        free(table);
+        return;
+    }
+    munmap(table, table_bytes(count, size));
+}
+
+static void *prefault(void *vargp){
+    prefault_t *range = vargp;
+    // an atomic no-op write, so the page is faulted in writable without
+    // racing anyone who is already using it
+    for (char *addr = range -> start; addr < range -> end; addr += range -> page){
+        __atomic_fetch_or(addr, 0, __ATOMIC_RELAXED);
+    }
+    return NULL;
+}
+
+bool table_prefault(void *table, size_t count, size_t size, int threads){
+    if (table == NULL || threads < 1){
+        errno = EINVAL;
+        return false;
+    }
+
+    size_t bytes = count * size;
+    size_t page = sysconf(_SC_PAGESIZE);
+    // small tables (and single threads) aren't worth the thread start up
+    size_t pieces = (bytes + TABLE_HUGE_PAGE - 1) / TABLE_HUGE_PAGE;
+    if ((size_t) threads > pieces){
+        threads = pieces;
+    }
+    if (threads <= 1){
+        prefault_t whole = {.start = table, .end = (char *) table + bytes, .page = page};
+        prefault(&whole);
+        return true;
+    }
+
+    pthread_t *tids = calloc(threads, sizeof(pthread_t));
+    prefault_t *ranges = calloc(threads, sizeof(prefault_t));
+    if (tids == NULL || ranges == NULL){
+        free(tids);
+        free(ranges);
+        return false;
+    }
+
+    // whole huge pages per thread, so no two threads fault the same one
+    size_t share = (pieces + threads - 1) / threads * TABLE_HUGE_PAGE;
+    int started = 0;
+    for (size_t lo = 0; lo < bytes; lo += share){
+        size_t hi = lo + share < bytes ? lo + share : bytes;
+        ranges[started] = (prefault_t) {.start = (char *) table + lo, .end = (char *) table + hi, .page = page};
+        // couldn't get a thread, do this piece ourselves
+        if (pthread_create(&tids[started], NULL, prefault, &ranges[started]) != 0){
+            prefault(&ranges[started]);
+            continue;
+        }
+        started += 1;
+    }
+    for (int i = 0; i < started; i++){
+        pthread_join(tids[i], NULL);
+    }
+
+    free(tids);
+    free(ranges);
+    return true;
+}
@@ -0,0 +1,181 @@
+#define _GNU_SOURCE
+#include "topology.h"
+#include <ctype.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+bool parse_cpulist(const char *list, int *cpus, int max, int *count){
+    if (list == NULL || cpus == NULL || count == NULL){
+        errno = EINVAL;
+        return false;
+    }
+
+    *count = 0;
+    const char *pos = list;
+    while (*pos != '\0' && *pos != '\n'){
+        char *end;
+        long lo = strtol(pos, &end, 10);
+        long hi = lo;
+        if (end == pos || lo < 0){
+            errno = EINVAL;
+            return false;
+        }
+        // a range
+        if (*end == '-'){
+            pos = end + 1;
+            hi = strtol(pos, &end, 10);
+            if (end == pos || hi < lo){
+                errno = EINVAL;
+                return false;
+            }
+        }
+        for (long cpu = lo; cpu <= hi && *count < max; cpu++){
+            cpus[(*count)++] = cpu;
+        }
+
+        if (*end == ','){
+            end += 1;
+        }
+        else if (*end != '\0' && *end != '\n'){
+            errno = EINVAL;
+            return false;
+        }
+        pos = end;
+    }
+    return true;
+}
+
+/*
+ * Adds a node made of whichever of the given CPUs we may run on.
+ */
+static void add_node(topology_t *self, int *cpus, int count, cpu_set_t *allowed){
+    if (self -> num_nodes == TOPOLOGY_MAX_NODES){
+        return;
+    }
+
+    int usable = 0;
+    for (int i = 0; i < count; i++){
+        if (cpus[i] < CPU_SETSIZE && CPU_ISSET(cpus[i], allowed)){
+            cpus[usable++] = cpus[i];
+        }
+    }
+    if (usable == 0){
+        return;
+    }
+
+    int *copy = malloc(usable * sizeof(int));
+    if (copy == NULL){
+        return;
+    }
+    memcpy(copy, cpus, usable * sizeof(int));
+    self -> cpus[self -> num_nodes] = copy;
+    self -> num_cpus[self -> num_nodes] = usable;
+    self -> num_nodes += 1;
+}
+
+bool load_topology(topology_t *self, const char *root){
+    if (self == NULL || root == NULL){
+        errno = EINVAL;
+        return false;
+    }
+    memset(self, 0, sizeof(topology_t));
+
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0){
+        return false;
+    }
+
+    int *cpus = malloc(TOPOLOGY_MAX_CPUS * sizeof(int));
+    if (cpus == NULL){
+        return false;
+    }
+
+    // node numbers can have holes in them, so ask which ones exist
+    char path[256];
+    char line[4096];
+    int nodes[TOPOLOGY_MAX_NODES];
+    int numNodes = 0;
+    snprintf(path, sizeof(path), "%s/online", root);
+    FILE *file = fopen(path, "r");
+    if (file != NULL){
+        if (fgets(line, sizeof(line), file) == NULL || parse_cpulist(line, nodes, TOPOLOGY_MAX_NODES, &numNodes) == false){
+            numNodes = 0;
+        }
+        fclose(file);
+    }
+
+    for (int i = 0; i < numNodes; i++){
+        snprintf(path, sizeof(path), "%s/node%d/cpulist", root, nodes[i]);
+        file = fopen(path, "r");
+        if (file == NULL){
+            continue;
+        }
+        int count;
+        if (fgets(line, sizeof(line), file) != NULL && parse_cpulist(line, cpus, TOPOLOGY_MAX_CPUS, &count) == true){
+            add_node(self, cpus, count, &allowed);
+        }
+        fclose(file);
+    }
+
+    // no NUMA information (or none we can use), so it's all one node
+    if (self -> num_nodes == 0){
+        int count = 0;
+        for (int cpu = 0; cpu < CPU_SETSIZE && count < TOPOLOGY_MAX_CPUS; cpu++){
+            if (CPU_ISSET(cpu, &allowed)){
+                cpus[count++] = cpu;
+            }
+        }
+        add_node(self, cpus, count, &allowed);
+    }
+
+    free(cpus);
+    return self -> num_nodes > 0;
+}
+
+void free_topology(topology_t *self){
+    if (self == NULL){
+        return;
+    }
+    for (int i = 0; i < self -> num_nodes; i++){
+        free(self -> cpus[i]);
+    }
+    memset(self, 0, sizeof(topology_t));
+}
+
+int topology_cpu(topology_t *self, int node, int n){
+    if (self == NULL || node < 0 || node >= self -> num_nodes || n < 0){
+        errno = EINVAL;
+        return -1;
+    }
+    return self -> cpus[node][n % self -> num_cpus[node]];
+}
+
+bool pin_thread_to_node(topology_t *self, int node){
+    if (self == NULL || node < 0 || node >= self -> num_nodes){
+        errno = EINVAL;
+        return false;
+    }
+
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int i = 0; i < self -> num_cpus[node]; i++){
+        CPU_SET(self -> cpus[node][i], &set);
+    }
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+}
+
+bool pin_thread_to_cpu(int cpu){
+    if (cpu < 0 || cpu >= CPU_SETSIZE){
+        errno = EINVAL;
+        return false;
+    }
+
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+}
@@ -0,0 +1,477 @@
+#include "wal.h"
+#include "slab.h"
+#include "snapshot.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * FNV-1a over the record after its checksum, then the key and the value.
+ */
+static uint32_t wal_checksum(const wal_record_t *record, const void *key, const void *val){
+    uint32_t hash = 2166136261u;
+    const uint8_t *parts[3] = {(const uint8_t *) &record -> op, key, val};
+    size_t lens[3] = {sizeof(wal_record_t) - sizeof(uint32_t), record -> key_len, record -> val_len};
+    for (int part = 0; part < 3; part++){
+        for (size_t i = 0; i < lens[part]; i++){
+            hash = (hash ^ parts[part][i]) * 16777619u;
+        }
+    }
+    return hash;
+}
+
+static char *path_with(const char *path, const char *suffix){
+    char *joined = malloc(strlen(path) + strlen(suffix) + 1);
+    if (joined != NULL){
+        sprintf(joined, "%s%s", path, suffix);
+    }
+    return joined;
+}
+
+bool parse_wal_policy(const char *policy, int *mode, int *sync_ms){
+    if (policy == NULL || mode == NULL || sync_ms == NULL){
+        errno = EINVAL;
+        return false;
+    }
+    if (strcmp(policy, "always") == 0){
+        *mode = WAL_SYNC_ALWAYS;
+        *sync_ms = 0;
+        return true;
+    }
+    if (strcmp(policy, "never") == 0){
+        *mode = WAL_SYNC_NEVER;
+        *sync_ms = WAL_NEVER_FLUSH_MS;
+        return true;
+    }
+    char *end;
+    long ms = strtol(policy, &end, 10);
+    if (end == policy || *end != '\0' || ms < 1 || ms > 60000){
+        errno = EINVAL;
+        return false;
+    }
+    *mode = WAL_SYNC_INTERVAL;
+    *sync_ms = ms;
+    return true;
+}
+
+/*
+ * Does what one record says.
+ */
+static void apply_record(store_t *store, const wal_record_t *record, const char *key, const char *val){
+    if (record -> op == WAL_CLEAR){
+        store_clear(store);
+        return;
+    }
+    if (record -> op == WAL_EVICT){
+        map_node_t node = store_delete(store, MAP_KEY((void *) key, record -> key_len));
+        slab_free(node.key.key_base);
+        slab_free(node.val.val_base);
+        return;
+    }
+
+    char *keyCopy = slab_alloc(record -> key_len);
+    char *valCopy = slab_alloc(record -> val_len);
+    if (keyCopy != NULL && valCopy != NULL){
+        memcpy(keyCopy, key, record -> key_len);
+        memcpy(valCopy, val, record -> val_len);
+        if (store_put(store, MAP_KEY(keyCopy, record -> key_len), MAP_VAL(valCopy, record -> val_len), true) == true){
+            return;
+        }
+    }
+    slab_free(keyCopy);
+    slab_free(valCopy);
+}
+
+/*
+ * Replays one of the log's files, up to its first bad record. A file that
+ * isn't there has nothing to replay.
+ *
+ * @param cut Whether to cut the file back to its last good record
+ * @return false if the file couldn't be read
+ */
+static bool replay_file(store_t *store, const char *path, bool cut, uint64_t *applied){
+    int fd = open(path, cut == true ? O_RDWR : O_RDONLY);
+    if (fd < 0){
+        return errno == ENOENT;
+    }
+    struct stat info;
+    if (fstat(fd, &info) != 0){
+        close(fd);
+        return false;
+    }
+    size_t size = info.st_size;
+    if (size == 0){
+        close(fd);
+        return true;
+    }
+    char *base = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (base == MAP_FAILED){
+        close(fd);
+        return false;
+    }
+    madvise(base, size, MADV_SEQUENTIAL);
+
+    size_t pos = 0;
+    while (size - pos >= sizeof(wal_record_t)){
+        wal_record_t record;
+        memcpy(&record, base + pos, sizeof(record));
+        const char *key = base + pos + sizeof(record);
+        const char *val = key + record.key_len;
+        if ((uint64_t) record.key_len + record.val_len > size - pos - sizeof(record) ||
+            wal_checksum(&record, key, val) != record.checksum){
+            break;
+        }
+        if (record.op == WAL_CLEAR || (record.op == WAL_EVICT && record.key_len > 0) ||
+            (record.op == WAL_PUT && record.key_len > 0 && record.val_len > 0)){
+            apply_record(store, &record, key, val);
+            *applied += 1;
+        }
+        pos += sizeof(record) + record.key_len + record.val_len;
+    }
+    munmap(base, size);
+
+    // whatever follows was being written when we went down
+    if (cut == true && pos < size && ftruncate(fd, pos) != 0){
+        close(fd);
+        return false;
+    }
+    close(fd);
+    return true;
+}
+
+bool recover_wal(store_t *store, const char *path, const char *snap_path, uint64_t *applied){
+    uint64_t count = 0;
+    if (applied != NULL){
+        *applied = 0;
+    }
+    if (store == NULL || path == NULL || snap_path == NULL){
+        errno = EINVAL;
+        return false;
+    }
+
+    char *oldPath = path_with(path, ".old");
+    if (oldPath == NULL){
+        return false;
+    }
+    long threads = sysconf(_SC_NPROCESSORS_ONLN);
+    uint64_t loaded = 0;
+    bool recovered = (load_snapshot(store, snap_path, threads > 0 ? threads : 1, &loaded) == true || errno == ENOENT) &&
+                     replay_file(store, oldPath, false, &count) == true &&
+                     replay_file(store, path, true, &count) == true;
+    free(oldPath);
+
+    if (applied != NULL){
+        *applied = count;
+    }
+    return recovered;
+}
+
+/*
+ * Writes all of a buffer, however many write() calls that takes.
+ */
+static bool write_all(int fd, const char *data, size_t len){
+    while (len > 0){
+        ssize_t written = write(fd, data, len);
+        if (written < 0 && errno == EINTR){
+            continue;
+        }
+        if (written <= 0){
+            return false;
+        }
+        data += written;
+        len -= written;
+    }
+    return true;
+}
+
+void wal_lock(wal_t *self, int shard){
+    if (self == NULL){
+        return;
+    }
+    if (shard >= 0){
+        pthread_mutex_lock(&self -> order[shard]);
+        return;
+    }
+    // always in the same order, so two of these can't deadlock
+    for (int i = 0; i < self -> store -> num_shards; i++){
+        pthread_mutex_lock(&self -> order[i]);
+    }
+}
+
+void wal_unlock(wal_t *self, int shard){
+    if (self == NULL){
+        return;
+    }
+    if (shard >= 0){
+        pthread_mutex_unlock(&self -> order[shard]);
+        return;
+    }
+    for (int i = self -> store -> num_shards - 1; i >= 0; i--){
+        pthread_mutex_unlock(&self -> order[i]);
+    }
+}
+
+/*
+ * Moves the live log to <path>.old and starts an empty one. Nothing can be
+ * between appended and put in the store while it does, so the old log has
+ * nothing the store doesn't.
+ */
+static bool rotate(wal_t *self){
+    wal_lock(self, -1);
+    pthread_mutex_lock(&self -> lock);
+    // the log thread is only ever waited for here, it never takes an order lock
+    while (self -> writing == true){
+        pthread_cond_wait(&self -> done, &self -> lock);
+    }
+
+    bool rotated = false;
+    int fd = -1;
+    if (rename(self -> path, self -> old_path) != 0 ||
+        (fd = open(self -> path, O_WRONLY | O_CREAT | O_APPEND, 0644)) < 0){
+        // we may have moved the log away. put it back so appends carry on in it
+        rename(self -> old_path, self -> path);
+    }
+    else{
+        close(self -> fd);
+        self -> fd = fd;
+        self -> file_size = 0;
+        rotated = true;
+    }
+
+    pthread_mutex_unlock(&self -> lock);
+    wal_unlock(self, -1);
+    return rotated;
+}
+
+static void *compact(void *vargp){
+    wal_t *self = vargp;
+
+    // an old log may still be waiting for a snapshot. taking one now is
+    // enough, it just doesn't get the live log any shorter this time
+    bool compacted = access(self -> old_path, F_OK) == 0 || rotate(self) == true;
+
+    // a snapshot that's already running may have started before the
+    // rotation, so it's waited out and ours goes after it
+    while (compacted == true && fork_snapshot(self -> store, self -> snap_path) == false){
+        if (errno != EBUSY){
+            compacted = false;
+            break;
+        }
+        snapshot_wait();
+    }
+
+    // everything up to the rotation is in the store, so once a snapshot
+    // started after it is safely on disk, the old log isn't needed anymore
+    compacted = compacted == true && snapshot_wait() == true;
+    if (compacted == true){
+        unlink(self -> old_path);
+    }
+    else{
+        fprintf(stderr, "%s: compaction failed: %s\n", self -> path, strerror(errno));
+    }
+
+    pthread_mutex_lock(&self -> lock);
+    // don't try again after every write, wait for the log to grow some more
+    self -> compact_at = compacted == true ? WAL_COMPACT_BYTES : self -> file_size + WAL_COMPACT_BYTES;
+    self -> compacting = false;
+    pthread_mutex_unlock(&self -> lock);
+    return NULL;
+}
+
+/*
+ * Snapshots the store and starts the log over in the background. Called by
+ * the log thread with the lock held, between writes.
+ */
+static void start_compaction(wal_t *self){
+    pthread_t tid;
+    self -> compacting = true;
+    if (pthread_create(&tid, NULL, compact, self) != 0){
+        self -> compacting = false;
+        self -> compact_at = self -> file_size + WAL_COMPACT_BYTES;
+        return;
+    }
+    pthread_detach(tid);
+}
+
+static void *log_thread(void *vargp){
+    wal_t *self = vargp;
+    wal_buffer_t writing = {0};
+
+    pthread_mutex_lock(&self -> lock);
+    while (1){
+        if (self -> policy == WAL_SYNC_ALWAYS){
+            while (self -> pending.len == 0){
+                pthread_cond_wait(&self -> work, &self -> lock);
+            }
+        }
+        // the others go out on a timer, or early if the buffer is filling up
+        else{
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_sec += self -> sync_ms / 1000;
+            deadline.tv_nsec += (self -> sync_ms % 1000) * 1000000L;
+            if (deadline.tv_nsec >= 1000000000L){
+                deadline.tv_sec += 1;
+                deadline.tv_nsec -= 1000000000L;
+            }
+            pthread_cond_timedwait(&self -> work, &self -> lock, &deadline);
+            if (self -> pending.len == 0){
+                continue;
+            }
+        }
+
+        // take everything appended so far, and let appends carry on into the
+        // other buffer while we write
+        wal_buffer_t batch = self -> pending;
+        self -> pending = writing;
+        uint64_t target = self -> appended;
+        self -> writing = true;
+        pthread_mutex_unlock(&self -> lock);
+
+        bool written = write_all(self -> fd, batch.data, batch.len);
+        if (written == true && self -> policy != WAL_SYNC_NEVER){
+            written = fdatasync(self -> fd) == 0;
+        }
+
+        pthread_mutex_lock(&self -> lock);
+        if (written == false && self -> failed == false){
+            fprintf(stderr, "%s: %s, writes are no longer logged\n", self -> path, strerror(errno));
+            self -> failed = true;
+        }
+        self -> writing = false;
+        self -> file_size += batch.len;
+        self -> synced = target;
+        batch.len = 0;
+        writing = batch;
+        pthread_cond_broadcast(&self -> done);
+
+        if (self -> file_size > self -> compact_at && self -> compacting == false && self -> failed == false){
+            start_compaction(self);
+        }
+    }
+    return NULL;
+}
+
+wal_t *open_wal(store_t *store, const char *path, const char *snap_path, int policy, int sync_ms){
+    if (store == NULL || path == NULL || snap_path == NULL || policy < WAL_SYNC_ALWAYS || policy > WAL_SYNC_NEVER ||
+        (policy != WAL_SYNC_ALWAYS && sync_ms < 1)){
+        errno = EINVAL;
+        return NULL;
+    }
+
+    wal_t *wal = calloc(1, sizeof(wal_t));
+    if (wal == NULL){
+        return NULL;
+    }
+    wal -> path = path_with(path, "");
+    wal -> old_path = path_with(path, ".old");
+    wal -> snap_path = path_with(snap_path, "");
+    wal -> fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    wal -> policy = policy;
+    wal -> sync_ms = sync_ms;
+    wal -> store = store;
+    wal -> compact_at = WAL_COMPACT_BYTES;
+    pthread_mutex_init(&wal -> lock, NULL);
+    pthread_cond_init(&wal -> work, NULL);
+    pthread_cond_init(&wal -> done, NULL);
+    for (int i = 0; i < STORE_MAX_SHARDS; i++){
+        pthread_mutex_init(&wal -> order[i], NULL);
+    }
+
+    struct stat info;
+    pthread_t tid;
+    if (wal -> path == NULL || wal -> old_path == NULL || wal -> snap_path == NULL || wal -> fd < 0 ||
+        fstat(wal -> fd, &info) != 0 || pthread_create(&tid, NULL, log_thread, wal) != 0){
+        if (wal -> fd >= 0){
+            close(wal -> fd);
+        }
+        free(wal -> path);
+        free(wal -> old_path);
+        free(wal -> snap_path);
+        free(wal);
+        return NULL;
+    }
+    wal -> file_size = info.st_size;
+    pthread_detach(tid);
+    return wal;
+}
+
+uint64_t wal_append(wal_t *self, uint32_t op, const void *key, uint32_t key_len, const void *val, uint32_t val_len){
+    if (self == NULL){
+        errno = EINVAL;
+        return 0;
+    }
+    wal_record_t record = {.op = op, .key_len = key_len, .val_len = val_len};
+    record.checksum = wal_checksum(&record, key, val);
+    size_t size = sizeof(record) + key_len + val_len;
+
+    pthread_mutex_lock(&self -> lock);
+    while (self -> failed == false && self -> pending.len > 0 && self -> pending.len + size > WAL_BUFFER_MAX){
+        pthread_cond_wait(&self -> done, &self -> lock);
+    }
+    if (self -> failed == true){
+        pthread_mutex_unlock(&self -> lock);
+        errno = EIO;
+        return 0;
+    }
+
+    wal_buffer_t *buffer = &self -> pending;
+    if (buffer -> len + size > buffer -> cap){
+        size_t cap = buffer -> cap == 0 ? 4096 : buffer -> cap;
+        while (cap < buffer -> len + size){
+            cap *= 2;
+        }
+        char *data = realloc(buffer -> data, cap);
+        if (data == NULL){
+            pthread_mutex_unlock(&self -> lock);
+            errno = ENOMEM;
+            return 0;
+        }
+        buffer -> data = data;
+        buffer -> cap = cap;
+    }
+    memcpy(buffer -> data + buffer -> len, &record, sizeof(record));
+    if (key_len > 0){
+        memcpy(buffer -> data + buffer -> len + sizeof(record), key, key_len);
+    }
+    if (val_len > 0){
+        memcpy(buffer -> data + buffer -> len + sizeof(record) + key_len, val, val_len);
+    }
+    buffer -> len += size;
+    self -> appended += size;
+    uint64_t lsn = self -> appended;
+
+    // someone is going to wait for this, or the buffer is getting full
+    if (self -> policy == WAL_SYNC_ALWAYS || buffer -> len >= WAL_BUFFER_MAX / 2){
+        pthread_cond_signal(&self -> work);
+    }
+    pthread_mutex_unlock(&self -> lock);
+    return lsn;
+}
+
+bool wal_wait(wal_t *self, uint64_t lsn){
+    if (self == NULL){
+        errno = EINVAL;
+        return false;
+    }
+    if (self -> policy != WAL_SYNC_ALWAYS){
+        return true;
+    }
+
+    pthread_mutex_lock(&self -> lock);
+    while (self -> synced < lsn && self -> failed == false){
+        pthread_cond_wait(&self -> done, &self -> lock);
+    }
+    bool durable = self -> synced >= lsn;
+    pthread_mutex_unlock(&self -> lock);
+    if (durable == false){
+        errno = EIO;
+    }
+    return durable;
+}
@@ -0,0 +1,38 @@
+#include <criterion/criterion.h>
+#include <criterion/logging.h>
+#include <errno.h>
+#include <stdint.h>
+
+#include "arena.h"
+
+Test(arena_suite, 00_aligned_and_disjoint, .timeout = 2){
+    arena_t arena;
+    cr_assert(init_arena(&arena, 256), "Arena could not be set up");
+
+    char *first = arena_alloc(&arena, 3);
+    char *second = arena_alloc(&arena, 17);
+    cr_assert_not_null(first, "First allocation failed");
+    cr_assert_not_null(second, "Second allocation failed");
+    cr_assert_eq((uintptr_t) second % ARENA_ALIGN, 0, "Second allocation is not aligned");
+    cr_assert_geq(second - first, 3, "Allocations overlap");
+    cr_assert_eq(arena.used, 32, "Used %lu bytes. Expected: %d", arena.used, 32);
+
+    destroy_arena(&arena);
+}
+
+Test(arena_suite, 01_full_then_reset, .timeout = 2){
+    arena_t arena;
+    cr_assert(init_arena(&arena, 64), "Arena could not be set up");
+
+    char *first = arena_alloc(&arena, 64);
+    cr_assert_not_null(first, "Could not take the whole arena");
+    errno = 0;
+    cr_assert_null(arena_alloc(&arena, 1), "Allocated past the end of the arena");
+    cr_assert_eq(errno, ENOMEM, "errno was %d. Expected: ENOMEM", errno);
+
+    // a reset hands out the same memory again
+    arena_reset(&arena);
+    cr_assert_eq(arena_alloc(&arena, 8), first, "Reset did not start over at the base");
+
+    destroy_arena(&arena);
+}
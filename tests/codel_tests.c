@@ -0,0 +1,45 @@
+#include <criterion/criterion.h>
+#include <criterion/logging.h>
+
+#include "codel.h"
+
+Test(codel_suite, 00_short_delays_pass, .timeout = 2){
+    codel_t codel;
+    init_codel(&codel, 5, 100);
+
+    // everything under target goes through no matter how long it keeps up
+    for (uint64_t now = 1000; now < 5000; now++){
+        cr_assert_not(codel_should_drop(&codel, now - 4, now), "Dropped an item that waited 4ms at %lu", now);
+    }
+}
+
+Test(codel_suite, 01_standing_queue_sheds, .timeout = 2){
+    codel_t codel;
+    init_codel(&codel, 5, 100);
+
+    // a 20ms standing queue is tolerated for one interval, then shedding starts
+    int drops = 0;
+    uint64_t firstDrop = 0;
+    for (uint64_t now = 1000; now < 2000; now++){
+        if (codel_should_drop(&codel, now - 20, now)){
+            if (firstDrop == 0)
+                firstDrop = now;
+            drops++;
+        }
+    }
+    cr_assert_eq(firstDrop, 1100, "First drop was at %lu. Expected: %d", firstDrop, 1100);
+    cr_assert_gt(drops, 1, "Only shed %d items from a standing queue", drops);
+
+    // and it stops as soon as the delay is back under target
+    cr_assert_not(codel_should_drop(&codel, 2000, 2001), "Kept dropping after the queue drained");
+    cr_assert_not(codel.dropping, "Still in the dropping state");
+}
+
+Test(codel_suite, 02_disabled, .timeout = 2){
+    codel_t codel;
+    init_codel(&codel, 0, 100);
+
+    for (uint64_t now = 1000; now < 2000; now++){
+        cr_assert_not(codel_should_drop(&codel, 0, now), "Dropped with shedding turned off");
+    }
+}
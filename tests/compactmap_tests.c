@@ -0,0 +1,102 @@
+#include <criterion/criterion.h>
+#include <criterion/logging.h>
+#include <errno.h>
+#include <string.h>
+
+#include "compactmap.h"
+#include "slab.h"
+#define MAP_KEY(kbase, klen) (map_key_t) {.key_base = kbase, .key_len = klen}
+#define MAP_VAL(vbase, vlen) (map_val_t) {.val_base = vbase, .val_len = vlen}
+
+hashmap_t *compact_map;
+int destroyed;
+
+/* everything the map keeps is a slab chunk */
+void compact_free_function(map_key_t key, map_val_t val) {
+    if (key.key_base != NULL && slab_contains(key.key_base))
+        slab_free(key.key_base);
+    if (val.val_base != NULL && slab_contains(val.val_base))
+        slab_free(val.val_base);
+    destroyed++;
+}
+
+/* every key lands in the same slot, so everything probes */
+uint32_t collide_hash(map_key_t map_key) {
+    return 0;
+}
+
+char *slab_copy(const char *str) {
+    char *chunk = slab_alloc(strlen(str));
+    memcpy(chunk, str, strlen(str));
+    return chunk;
+}
+
+void compact_init(void) {
+    destroyed = 0;
+    compact_map = create_map(8, collide_hash, compact_free_function);
+}
+
+void compact_fini(void) {
+    invalidate_map(compact_map);
+}
+
+Test(compact_suite, 00_slot_size, .timeout = 2) {
+    cr_assert_eq(sizeof(map_slot_t), 24, "map_slot_t is %lu bytes. Expected: %d", sizeof(map_slot_t), 24);
+}
+
+Test(compact_suite, 01_inline_and_slab_keys, .timeout = 2, .init = compact_init, .fini = compact_fini) {
+    char *longKey = slab_copy("a key much too long to keep in the slot");
+    char *val = slab_copy("value");
+
+    // a short key from the stack is copied into the slot, a long one is adopted
+    cr_assert(put(compact_map, MAP_KEY("short", 5), MAP_VAL(slab_copy("one"), 3), false), "Short key put failed");
+    cr_assert(put(compact_map, MAP_KEY(longKey, strlen(longKey)), MAP_VAL(val, 5), false), "Long key put failed");
+
+    map_val_t got = get(compact_map, MAP_KEY("short", 5));
+    cr_assert_eq(got.val_len, 3, "Short key value was %lu bytes. Expected: %d", got.val_len, 3);
+    cr_assert(memcmp(got.val_base, "one", 3) == 0, "Short key value was wrong");
+
+    got = get(compact_map, MAP_KEY("a key much too long to keep in the slot", strlen(longKey)));
+    cr_assert_eq(got.val_base, val, "Long key value was not adopted in place");
+    cr_assert_eq(compact_map -> size, 2, "Size was %u. Expected: %d", compact_map -> size, 2);
+}
+
+Test(compact_suite, 02_replace_delete_and_probe, .timeout = 2, .init = compact_init, .fini = compact_fini) {
+    put(compact_map, MAP_KEY("a", 1), MAP_VAL(slab_copy("1"), 1), false);
+    put(compact_map, MAP_KEY("b", 1), MAP_VAL(slab_copy("2"), 1), false);
+    put(compact_map, MAP_KEY("c", 1), MAP_VAL(slab_copy("3"), 1), false);
+
+    // replacing destroys the old entry and keeps the size
+    put(compact_map, MAP_KEY("b", 1), MAP_VAL(slab_copy("22"), 2), false);
+    cr_assert_eq(compact_map -> size, 3, "Size was %u. Expected: %d", compact_map -> size, 3);
+    cr_assert_eq(get(compact_map, MAP_KEY("b", 1)).val_len, 2, "Replaced value was not returned");
+
+    // a tombstone in the middle of the probe path must not hide what comes after it
+    map_node_t node = delete(compact_map, MAP_KEY("b", 1));
+    slab_free(node.val.val_base);
+    cr_assert_eq(get(compact_map, MAP_KEY("b", 1)).val_base, NULL, "Deleted key was still found");
+    cr_assert_eq(get(compact_map, MAP_KEY("c", 1)).val_len, 1, "Key after the tombstone was lost");
+    cr_assert_eq(compact_map -> size, 2, "Size was %u. Expected: %d", compact_map -> size, 2);
+
+    cr_assert(clear_map(compact_map), "Clear failed");
+    cr_assert_eq(compact_map -> size, 0, "Size was %u. Expected: %d", compact_map -> size, 0);
+    cr_assert_eq(get(compact_map, MAP_KEY("a", 1)).val_base, NULL, "Cleared key was still found");
+}
+
+Test(compact_suite, 03_full, .timeout = 2, .init = compact_init, .fini = compact_fini) {
+    char keys[8];
+    for (int i = 0; i < 8; i++) {
+        keys[i] = 'a' + i;
+        cr_assert(put(compact_map, MAP_KEY(&keys[i], 1), MAP_VAL(slab_copy("v"), 1), false), "Put %d failed", i);
+    }
+
+    char *val = slab_copy("v");
+    errno = 0;
+    cr_assert_not(put(compact_map, MAP_KEY("z", 1), MAP_VAL(val, 1), false), "Put into a full map worked");
+    cr_assert_eq(errno, ENOMEM, "errno was %d. Expected: ENOMEM", errno);
+
+    // forcing overwrites the home slot
+    cr_assert(put(compact_map, MAP_KEY("z", 1), MAP_VAL(val, 1), true), "Forced put failed");
+    cr_assert_eq(get(compact_map, MAP_KEY("a", 1)).val_base, NULL, "Home slot was not overwritten");
+    cr_assert_eq(get(compact_map, MAP_KEY("z", 1)).val_base, val, "Forced key was not found");
+}
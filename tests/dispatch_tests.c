@@ -0,0 +1,138 @@
+#include <criterion/criterion.h>
+#include <criterion/logging.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "dispatch.h"
+#define NUM_WORKERS 4
+#define NUM_ITEMS 400
+
+dispatcher_t *global_dispatcher;
+
+void dispatch_init(void) {
+    global_dispatcher = create_dispatcher(NUM_WORKERS);
+}
+
+Test(dispatch_suite, 00_creation, .timeout = 2, .init = dispatch_init){
+    cr_assert_not_null(global_dispatcher, "Dispatcher returned was null");
+    cr_assert_null(create_dispatcher(0), "Dispatcher with no workers was created");
+}
+
+Test(dispatch_suite, 01_round_robin, .timeout = 2, .init = dispatch_init){
+    static int items[NUM_ITEMS];
+
+    for (int index = 0; index < NUM_ITEMS; index++){
+        cr_assert(dispatch(global_dispatcher, &items[index]), "Dispatch %d failed", index);
+    }
+
+    // every worker should have been handed the same share
+    for (int worker = 0; worker < NUM_WORKERS; worker++){
+        int num_items;
+        sem_getvalue(&global_dispatcher->locals[worker]->items, &num_items);
+        cr_assert_eq(num_items, NUM_ITEMS / NUM_WORKERS, "Worker %d had %d items. Expected: %d", worker, num_items, NUM_ITEMS / NUM_WORKERS);
+    }
+}
+
+Test(dispatch_suite, 02_stealing, .timeout = 2, .init = dispatch_init){
+    static int items[NUM_ITEMS];
+
+    for (int index = 0; index < NUM_ITEMS; index++){
+        dispatch(global_dispatcher, &items[index]);
+    }
+
+    // a single worker has to be able to drain everyone else's queue
+    int lane;
+    for (int index = 0; index < NUM_ITEMS; index++){
+        cr_assert_not_null(dispatch_next(global_dispatcher, 0, &lane), "Worker 0 ran out of work at %d", index);
+    }
+
+    for (int worker = 0; worker < NUM_WORKERS; worker++){
+        int num_items;
+        sem_getvalue(&global_dispatcher->locals[worker]->items, &num_items);
+        cr_assert_eq(num_items, 0, "Worker %d still had %d items", worker, num_items);
+    }
+}
+
+void *thread_next(void *arg) {
+    int lane;
+    return dispatch_next(global_dispatcher, 1, &lane);
+}
+
+Test(dispatch_suite, 03_park_and_wake, .timeout = 2, .init = dispatch_init){
+    static int item;
+    pthread_t tid;
+
+    // no spinning, so the worker has to park and be woken by the dispatch
+    global_dispatcher->spin_budget = 0;
+    pthread_create(&tid, NULL, thread_next, NULL);
+    while (atomic_load(&global_dispatcher->sleepers) == 0)
+        usleep(1000);
+
+    dispatch(global_dispatcher, &item);
+
+    void *result;
+    pthread_join(tid, &result);
+    cr_assert_eq(result, &item, "Parked worker got %p. Expected: %p", result, (void *) &item);
+    cr_assert_geq(atomic_load(&global_dispatcher->counters[1].parks), 1, "Worker never parked");
+}
+
+Test(dispatch_suite, 04_weighted_lanes, .timeout = 2, .init = dispatch_init){
+    static int reads[NUM_ITEMS], writes[NUM_ITEMS];
+    int counts[DISPATCH_LANES] = {0};
+    int lane;
+
+    for (int index = 0; index < NUM_ITEMS; index++){
+        dispatch(global_dispatcher, &reads[index]);
+        dispatch_lane(global_dispatcher, DISPATCH_LANE_WRITE, &writes[index]);
+    }
+
+    // with both lanes backed up, picks are split by weight
+    int rounds = DISPATCH_READ_WEIGHT + DISPATCH_WRITE_WEIGHT;
+    for (int index = 0; index < rounds; index++){
+        dispatch_next(global_dispatcher, 0, &lane);
+        counts[lane]++;
+    }
+    cr_assert_eq(counts[DISPATCH_LANE_READ], DISPATCH_READ_WEIGHT, "Took %d reads. Expected: %d", counts[DISPATCH_LANE_READ], DISPATCH_READ_WEIGHT);
+    cr_assert_eq(counts[DISPATCH_LANE_WRITE], DISPATCH_WRITE_WEIGHT, "Took %d writes. Expected: %d", counts[DISPATCH_LANE_WRITE], DISPATCH_WRITE_WEIGHT);
+}
+
+Test(dispatch_suite, 05_bulk_limit, .timeout = 2, .init = dispatch_init){
+    static int bulk[2];
+    int lane;
+
+    dispatch_lane(global_dispatcher, DISPATCH_LANE_BULK, &bulk[0]);
+    dispatch_lane(global_dispatcher, DISPATCH_LANE_BULK, &bulk[1]);
+    global_dispatcher->spin_budget = 0;
+
+    cr_assert_eq(dispatch_next(global_dispatcher, 0, &lane), &bulk[0], "First bulk item wasn't handed out");
+    cr_assert_eq(lane, DISPATCH_LANE_BULK, "Item came from lane %d", lane);
+
+    // the second one has to wait until the first is done
+    cr_assert_eq(atomic_load(&global_dispatcher->bulk_running), DISPATCH_BULK_LIMIT, "Bulk work wasn't counted");
+    dispatch_done(global_dispatcher, DISPATCH_LANE_BULK);
+    cr_assert_eq(dispatch_next(global_dispatcher, 1, &lane), &bulk[1], "Second bulk item wasn't handed out");
+}
+
+Test(dispatch_suite, 06_groups, .timeout = 2, .init = dispatch_init){
+    static int items[8];
+    int groups[NUM_WORKERS] = {0, 1, 0, 1};
+    cr_assert(set_dispatch_groups(global_dispatcher, groups), "Setting groups failed");
+
+    // routed work only lands on the group's own workers
+    for (int index = 0; index < 8; index++){
+        cr_assert(dispatch_group(global_dispatcher, 1, &items[index]), "Dispatch %d to group 1 failed", index);
+    }
+    cr_assert_eq(queue_depth(global_dispatcher->locals[0]) + queue_depth(global_dispatcher->locals[2]), 0, "Group 0 was handed group 1's work");
+
+    // and the other group can't steal it
+    int lane;
+    cr_assert_null(try_dequeue(global_dispatcher->locals[0]), "Worker 0 had work of its own");
+    cr_assert_eq(queue_depth(global_dispatcher->locals[1]) + queue_depth(global_dispatcher->locals[3]), 8, "Group 1 lost work");
+    void *item = dispatch_next(global_dispatcher, 3, &lane);
+    cr_assert_not_null(item, "Worker 3 found nothing");
+    cr_assert_eq(lane, DISPATCH_LANE_READ, "Routed work came from lane %d", lane);
+
+    errno = 0;
+    cr_assert_not(dispatch_group(global_dispatcher, 5, &items[0]), "Dispatched to a group with no workers");
+    cr_assert_eq(errno, EINVAL, "errno was %d. Expected: EINVAL", errno);
+}
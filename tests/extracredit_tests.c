@@ -3,5 +3,133 @@
 #include <unistd.h>
 #include <errno.h>
 #include <stdio.h>
+#include <string.h>
 
 #include "extracredit.h"
+#include "reclaim.h"
+#include "slab.h"
+
+#define NUM_KEYS 500
+#define VAL_LEN 64
+// the keys take 8000 bytes of it, and can't be spilled
+#define HOT_LIMIT 16384
+#define COLD_FILE "/tmp/cream_extracredit_tests.cold"
+// a small slab region, with the hot limit the share of it -c gives
+#define SMALL_PAGES 3
+#define SMALL_HOT_PERCENT 60
+#define BIG_VAL_LEN 3000
+
+static void ec_free_function(map_key_t key, map_val_t val) {
+    slab_free(key.key_base);
+    slab_free(val.val_base);
+}
+
+static uint32_t spread_hash(map_key_t key) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < key.key_len; i++)
+        hash = (hash ^ ((uint8_t *) key.key_base)[i]) * 16777619u;
+    return hash;
+}
+
+static void put_value(hashmap_t *map, int i) {
+    char *key = malloc(16);
+    char *val = malloc(VAL_LEN);
+    int keyLen = sprintf(key, "key%d", i);
+    memset(val, 'a' + i % 26, VAL_LEN);
+    cr_assert(put(map, MAP_KEY(key, keyLen), MAP_VAL(val, VAL_LEN), false), "Put %d failed", i);
+}
+
+static int count_spilled(hashmap_t *map) {
+    int spilled = 0;
+    for (uint32_t i = 0; i < map -> capacity; i++)
+        spilled += map -> nodes[i].tombstone == false && map -> nodes[i].key.key_len != 0 && map -> nodes[i].spilled;
+    return spilled;
+}
+
+static bool key_spilled(hashmap_t *map, const char *key) {
+    for (uint32_t i = 0; i < map -> capacity; i++)
+        if (map -> nodes[i].tombstone == false && map -> nodes[i].key.key_len == strlen(key) &&
+            memcmp(map -> nodes[i].key.key_base, key, strlen(key)) == 0)
+            return map -> nodes[i].spilled;
+    return false;
+}
+
+static void wait_for_spiller(hashmap_t *map) {
+    while (atomic_load(&map -> tier -> spilling))
+        usleep(1000);
+}
+
+Test(extracredit_suite, 00_spill_and_promote, .timeout = 10) {
+    hashmap_t *map = create_map(NUM_KEYS * 2, spread_hash, ec_free_function);
+    cr_assert_not_null(map, "Map returned was NULL");
+    cr_assert(spill_map(map, COLD_FILE, HOT_LIMIT), "spill_map failed: %s", strerror(errno));
+    errno = 0;
+    cr_assert_not(spill_map(map, COLD_FILE, HOT_LIMIT), "A second tier was set up");
+    cr_assert_eq(errno, EINVAL, "errno was %d. Expected: EINVAL", errno);
+
+    // the spiller runs in the background, so wait for it before looking
+    for (int i = 0; i < NUM_KEYS; i++)
+        put_value(map, i);
+    wait_for_spiller(map);
+    put_value(map, 0);
+    wait_for_spiller(map);
+    cr_assert_leq(map -> tier -> hot_bytes, HOT_LIMIT, "%lu bytes stayed in memory", map -> tier -> hot_bytes);
+    int spilled = count_spilled(map);
+    cr_assert_gt(spilled, NUM_KEYS / 2, "Only %d values were spilled", spilled);
+
+    // every value reads back the same, and what was read is in memory again.
+    // reading them all goes over the limit, so the spiller moves the ones
+    // read first back out, but the last one stays
+    cr_assert(key_spilled(map, "key1"), "The coldest value wasn't spilled");
+    for (int i = 0; i < NUM_KEYS; i++){
+        char key[16], expected[VAL_LEN];
+        int keyLen = sprintf(key, "key%d", i);
+        memset(expected, 'a' + i % 26, VAL_LEN);
+        map_val_t val = get(map, MAP_KEY(key, keyLen));
+        cr_assert_eq(val.val_len, VAL_LEN, "Value of %s had length %zu", key, val.val_len);
+        cr_assert(memcmp(val.val_base, expected, VAL_LEN) == 0, "Value of %s was wrong", key);
+    }
+    wait_for_spiller(map);
+    char last[16];
+    sprintf(last, "key%d", NUM_KEYS - 1);
+    cr_assert_not(key_spilled(map, last), "The value read last wasn't promoted");
+
+    // a clear empties the file with the map
+    cr_assert(clear_map(map), "Clear failed");
+    cr_assert_eq(map -> tier -> file_size, 0, "Cold file was %lu bytes after a clear", map -> tier -> file_size);
+    cr_assert_null(get(map, MAP_KEY("key7", 4)).val_base, "Cleared key was still found");
+    reclaim_wait();
+    unlink(COLD_FILE);
+}
+
+Test(extracredit_suite, 01_spill_before_slabs_run_out, .timeout = 10) {
+    cr_assert(slab_init(SMALL_PAGES * SLAB_PAGE_SIZE), "slab_init failed");
+    hashmap_t *map = create_map(4096, spread_hash, ec_free_function);
+    cr_assert_not_null(map, "Map returned was NULL");
+    uint64_t hotLimit = (uint64_t) SMALL_PAGES * SLAB_PAGE_SIZE / 100 * SMALL_HOT_PERCENT;
+    cr_assert(spill_map(map, COLD_FILE, hotLimit), "spill_map failed: %s", strerror(errno));
+
+    // values take up more than their length in chunks, and the keys a page of
+    // their own. far more than fits, so the spiller has to keep making room
+    for (int i = 0; i < 2000; i++){
+        char *key = slab_alloc(16);
+        char *val = slab_alloc(BIG_VAL_LEN);
+        for (int try = 0; (key == NULL || val == NULL) && try < 100; try++){
+            wait_for_spiller(map);
+            usleep(1000);
+            if (key == NULL)
+                key = slab_alloc(16);
+            if (val == NULL)
+                val = slab_alloc(BIG_VAL_LEN);
+        }
+        cr_assert(key != NULL && val != NULL, "Slabs ran out at put %d, %lu bytes counted in memory", i, map -> tier -> hot_bytes);
+        int keyLen = sprintf(key, "key%d", i);
+        memset(val, 'a' + i % 26, BIG_VAL_LEN);
+        cr_assert(put(map, MAP_KEY(key, keyLen), MAP_VAL(val, BIG_VAL_LEN), false), "Put %d failed", i);
+    }
+    wait_for_spiller(map);
+    cr_assert_gt(map -> tier -> file_size, 0, "Nothing reached the cold file");
+    cr_assert_gt(count_spilled(map), 1000, "Only %d values were spilled", count_spilled(map));
+    reclaim_wait();
+    unlink(COLD_FILE);
+}
@@ -94,3 +94,36 @@ Test(map_suite, 02_multithreaded, .timeout = 3, .init = map_init, .fini = map_fi
     int num_items = global_map->size;
     cr_assert_eq(num_items, NUM_THREADS, "Had %d items in map. Expected %d", num_items, NUM_THREADS);
 }
+
+uint32_t same_hash(map_key_t map_key) {
+    return 7;
+}
+
+Test(map_suite, 03_probe_past_tombstone, .timeout = 2) {
+    hashmap_t *map = create_map(4, same_hash, map_free_function);
+    int *keys[3];
+    for (int i = 0; i < 3; i++) {
+        keys[i] = malloc(sizeof(int));
+        *keys[i] = i;
+        int *val = malloc(sizeof(int));
+        *val = i * 2;
+        put(map, MAP_KEY(keys[i], sizeof(int)), MAP_VAL(val, sizeof(int)), false);
+    }
+
+    // every key collides, so the last one is only found by probing past the tombstone
+    map_node_t node = delete(map, MAP_KEY(keys[1], sizeof(int)));
+    map_free_function(node.key, node.val);
+    int last = 2;
+    cr_assert_not_null(get(map, MAP_KEY(&last, sizeof(int))).val_base, "Key behind the tombstone was lost");
+
+    // putting it again replaces it instead of adding it to the dead slot
+    int *val = malloc(sizeof(int));
+    *val = 40;
+    int *key = malloc(sizeof(int));
+    *key = 2;
+    put(map, MAP_KEY(key, sizeof(int)), MAP_VAL(val, sizeof(int)), false);
+    cr_assert_eq(map -> size, 2, "Had %d items in map. Expected %d", map -> size, 2);
+    cr_assert_eq(*(int *) get(map, MAP_KEY(&last, sizeof(int))).val_base, 40, "Value was not replaced");
+
+    invalidate_map(map);
+}
@@ -0,0 +1,142 @@
+#include <criterion/criterion.h>
+#include <criterion/logging.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "hotkeys.h"
+#include "snapshot.h"
+#include "slab.h"
+
+#define NUM_KEYS 10000
+#define NUM_HOT 1000
+#define HOTKEYS_FILE "/tmp/cream_hotkeys_tests.keys"
+#define HOTKEYS_SNAPSHOT "/tmp/cream_hotkeys_tests.snap"
+
+static void hotkeys_free_function(map_key_t key, map_val_t val) {
+    slab_free(key.key_base);
+    slab_free(val.val_base);
+}
+
+static uint32_t spread_hash(map_key_t key) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < key.key_len; i++)
+        hash = (hash ^ ((uint8_t *) key.key_base)[i]) * 16777619u;
+    return hash;
+}
+
+static void fill(store_t *store) {
+    for (int i = 0; i < NUM_KEYS; i++){
+        char *key = slab_alloc(16);
+        char *val = slab_alloc(32);
+        int keyLen = sprintf(key, "key%d", i);
+        int valLen = sprintf(val, "value of %d", i);
+        cr_assert(store_put(store, MAP_KEY(key, keyLen), MAP_VAL(val, valLen), false), "Put %d failed", i);
+    }
+}
+
+static void check(store_t *store, int i) {
+    char key[16], expected[32];
+    int keyLen = sprintf(key, "key%d", i);
+    int valLen = sprintf(expected, "value of %d", i);
+    map_val_t val = store_get(store, MAP_KEY(key, keyLen));
+    cr_assert_eq(val.val_len, valLen, "Value of %s had length %zu", key, val.val_len);
+    cr_assert(memcmp(val.val_base, expected, valLen) == 0, "Value of %s was wrong", key);
+}
+
+// the origin stand-in: every key's value can be made up from the key
+static bool fetch_from_origin(map_key_t key, map_val_t *val, uint64_t *age_ms, void *arg) {
+    int i;
+    if (sscanf(key.key_base, "key%d", &i) != 1)
+        return false;
+    char *copy = slab_alloc(32);
+    *val = MAP_VAL(copy, sprintf(copy, "value of %d", i));
+    *age_ms = 0;
+    return true;
+}
+
+// writes the keys of every step'th entry, from first, the way save_hot_keys() would
+static void write_keys(int first, int step) {
+    FILE *file = fopen(HOTKEYS_FILE, "w");
+    cr_assert_not_null(file, "Could not create the hot keys file");
+    hotkeys_header_t header = {.version = HOTKEYS_VERSION, .count = 0};
+    memcpy(header.magic, HOTKEYS_MAGIC, sizeof(header.magic));
+    for (int i = first; i < NUM_KEYS * 2; i += step)
+        header.count += 1;
+    fwrite(&header, sizeof(header), 1, file);
+    for (int i = first; i < NUM_KEYS * 2; i += step){
+        char key[16];
+        uint32_t keyLen = sprintf(key, "key%d", i);
+        fwrite(&keyLen, sizeof(keyLen), 1, file);
+        fwrite(key, 1, keyLen, file);
+    }
+    fclose(file);
+}
+
+Test(hotkeys_suite, 00_save_hottest, .timeout = 10){
+    // one shard, since every shard only gives its share of the keys
+    store_t *store = create_store(1, NUM_KEYS * 2, spread_hash, hotkeys_free_function, NULL, 0);
+    fill(store);
+#ifdef EC
+    // the last keys read are the hot ones
+    for (int i = NUM_KEYS - NUM_HOT; i < NUM_KEYS; i++)
+        check(store, i);
+    cr_assert(save_hot_keys(store, HOTKEYS_FILE, NUM_HOT), "Save failed: %s", strerror(errno));
+
+    store_t *restored = create_store(3, NUM_KEYS * 2, spread_hash, hotkeys_free_function, NULL, 0);
+    uint64_t loaded;
+    cr_assert(load_hot_keys(restored, HOTKEYS_FILE, fetch_from_origin, NULL, 4, &loaded), "Load failed: %s", strerror(errno));
+    cr_assert_eq(loaded, NUM_HOT, "Loaded %lu entries. Expected: %d", loaded, NUM_HOT);
+    for (int i = NUM_KEYS - NUM_HOT; i < NUM_KEYS; i++)
+        check(restored, i);
+#else
+    // nothing but the extra credit map knows which keys are hot
+    errno = 0;
+    cr_assert_not(save_hot_keys(store, HOTKEYS_FILE, NUM_HOT), "Saved without knowing what's hot");
+    cr_assert_eq(errno, ENOTSUP, "errno was %d. Expected: ENOTSUP", errno);
+    cr_assert_neq(access(HOTKEYS_FILE, F_OK), 0, "A file was left behind");
+#endif
+    unlink(HOTKEYS_FILE);
+}
+
+Test(hotkeys_suite, 01_load_from_snapshot, .timeout = 10){
+    store_t *store = create_store(2, NUM_KEYS * 2, spread_hash, hotkeys_free_function, NULL, 0);
+    fill(store);
+    cr_assert(save_snapshot(store, HOTKEYS_SNAPSHOT), "Save failed: %s", strerror(errno));
+
+    // half the keys asked for were never in the snapshot, and are skipped
+    write_keys(0, 10);
+    snapshot_source_t *source = open_snapshot_source(HOTKEYS_SNAPSHOT);
+    cr_assert_not_null(source, "open_snapshot_source failed: %s", strerror(errno));
+    store_t *restored = create_store(2, NUM_KEYS * 2, spread_hash, hotkeys_free_function, NULL, 0);
+    uint64_t loaded;
+    cr_assert(load_hot_keys(restored, HOTKEYS_FILE, fetch_from_snapshot, source, 4, &loaded), "Load failed: %s", strerror(errno));
+    close_snapshot_source(source);
+
+    cr_assert_eq(loaded, NUM_KEYS / 10, "Loaded %lu entries. Expected: %d", loaded, NUM_KEYS / 10);
+    cr_assert_eq(store_size(restored), NUM_KEYS / 10, "Store had %u entries", store_size(restored));
+    for (int i = 0; i < NUM_KEYS; i += 10)
+        check(restored, i);
+    unlink(HOTKEYS_FILE);
+    unlink(HOTKEYS_SNAPSHOT);
+}
+
+Test(hotkeys_suite, 02_damaged_file, .timeout = 5){
+    write_keys(0, 1);
+
+    // cut it off in the middle of a key
+    FILE *file = fopen(HOTKEYS_FILE, "r+");
+    cr_assert_not_null(file, "Could not open the hot keys file");
+    fseek(file, 0, SEEK_END);
+    cr_assert_eq(ftruncate(fileno(file), ftell(file) - 2), 0, "Could not truncate the file");
+    fclose(file);
+
+    store_t *store = create_store(1, NUM_KEYS * 2, spread_hash, hotkeys_free_function, NULL, 0);
+    errno = 0;
+    cr_assert_not(load_hot_keys(store, HOTKEYS_FILE, fetch_from_origin, NULL, 2, NULL), "Loaded a damaged file");
+    cr_assert_eq(errno, EINVAL, "errno was %d. Expected: EINVAL", errno);
+    cr_assert_eq(store_size(store), 0, "Store had %u entries", store_size(store));
+    unlink(HOTKEYS_FILE);
+}
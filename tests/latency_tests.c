@@ -0,0 +1,56 @@
+#include <criterion/criterion.h>
+#include <criterion/logging.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "latency.h"
+
+#define NUM_THREADS 4
+#define NUM_VALUES 10000
+
+// 1us to 10ms, so the top percentiles land in the higher powers of two
+static void *record_values(void *arg){
+    for (uint64_t i = 1; i <= NUM_VALUES; i++)
+        latency_record(LATENCY_MAP, i * 1000);
+    return NULL;
+}
+
+static void assert_close(uint64_t got, uint64_t expected){
+    // a bucket's top is at most 1 / 32 above anything in it
+    cr_assert(got >= expected && got <= expected + expected / 32, "Got %lu. Expected about %lu", got, expected);
+}
+
+Test(latency_suite, 00_percentiles, .timeout = 5){
+    pthread_t tids[NUM_THREADS];
+    for (int i = 0; i < NUM_THREADS; i++)
+        cr_assert_eq(pthread_create(&tids[i], NULL, record_values, NULL), 0, "Could not start thread %d", i);
+    for (int i = 0; i < NUM_THREADS; i++)
+        pthread_join(tids[i], NULL);
+
+    latency_hist_t hist;
+    latency_merge(LATENCY_MAP, &hist);
+    cr_assert_eq(hist.total, NUM_THREADS * NUM_VALUES, "Merged %lu values. Expected: %d", hist.total, NUM_THREADS * NUM_VALUES);
+    assert_close(latency_percentile(&hist, 50), 5000 * 1000);
+    assert_close(latency_percentile(&hist, 99), 9900 * 1000);
+    assert_close(latency_percentile(&hist, 99.9), 9990 * 1000);
+    assert_close(latency_percentile(&hist, 100), NUM_VALUES * 1000);
+}
+
+Test(latency_suite, 01_small_and_huge, .timeout = 2){
+    latency_hist_t hist;
+    latency_merge(LATENCY_WRITE, &hist);
+    cr_assert_eq(latency_percentile(&hist, 50), 0, "An empty histogram had a median");
+
+    // small values are exact, and nothing is too big for a bucket
+    latency_record(LATENCY_WRITE, 3);
+    latency_record(LATENCY_WRITE, 3);
+    latency_record(LATENCY_WRITE, UINT64_MAX);
+    latency_merge(LATENCY_WRITE, &hist);
+    cr_assert_eq(latency_percentile(&hist, 50), 3, "Median was %lu. Expected: 3", latency_percentile(&hist, 50));
+    cr_assert_eq(latency_percentile(&hist, 100), UINT64_MAX, "Max was %lu", latency_percentile(&hist, 100));
+
+    cr_assert(strcmp(latency_name(LATENCY_QUEUE), "queue") == 0, "Name was %s", latency_name(LATENCY_QUEUE));
+    cr_assert(strcmp(latency_name(STATS_GET), "get") == 0, "Name was %s", latency_name(STATS_GET));
+    cr_assert_null(latency_name(LATENCY_HISTOGRAMS), "A histogram past the end had a name");
+}
@@ -0,0 +1,172 @@
+#include <criterion/criterion.h>
+#include <criterion/logging.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "persistmap.h"
+#include "reclaim.h"
+
+#define NUM_KEYS 1000
+#define MAP_FILE "/tmp/cream_persistmap_tests.map"
+
+int handed_back;
+
+/* the map copies everything, so all the destructor sees is our own buffers */
+void persist_free_function(map_key_t key, map_val_t val) {
+    handed_back++;
+}
+
+uint32_t spread_hash(map_key_t map_key) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < map_key.key_len; i++)
+        hash = (hash ^ ((uint8_t *) map_key.key_base)[i]) * 16777619u;
+    return hash;
+}
+
+void fill(hashmap_t *map, int from, int to) {
+    for (int i = from; i < to; i++){
+        char key[16], val[32];
+        int keyLen = sprintf(key, "key%d", i);
+        int valLen = sprintf(val, "value of %d", i);
+        cr_assert(put(map, MAP_KEY(key, keyLen), MAP_VAL(val, valLen), false), "Put %d failed: %s", i, strerror(errno));
+    }
+}
+
+void check(hashmap_t *map, int from, int to) {
+    for (int i = from; i < to; i++){
+        char key[16], expected[32];
+        int keyLen = sprintf(key, "key%d", i);
+        int valLen = sprintf(expected, "value of %d", i);
+        map_val_t val = get(map, MAP_KEY(key, keyLen));
+        cr_assert_eq(val.val_len, valLen, "Value of %s had length %zu", key, val.val_len);
+        cr_assert(memcmp(val.val_base, expected, valLen) == 0, "Value of %s was wrong", key);
+    }
+}
+
+void remove_file(void) {
+    unlink(MAP_FILE);
+    handed_back = 0;
+}
+
+Test(persist_suite, 00_slot_size, .timeout = 2) {
+    cr_assert_eq(sizeof(map_slot_t), 32, "map_slot_t is %lu bytes. Expected: %d", sizeof(map_slot_t), 32);
+}
+
+Test(persist_suite, 01_copies_and_hands_back, .timeout = 5, .init = remove_file) {
+    hashmap_t *map = create_map(NUM_KEYS * 2, spread_hash, persist_free_function);
+    cr_assert_not_null(map, "Map returned was NULL");
+    fill(map, 0, NUM_KEYS);
+    cr_assert_eq(handed_back, NUM_KEYS, "%d buffers were handed back. Expected: %d", handed_back, NUM_KEYS);
+    check(map, 0, NUM_KEYS);
+
+    // replaced and deleted entries are the map's own, nothing more comes back
+    fill(map, 0, NUM_KEYS / 2);
+    map_node_t node = delete(map, MAP_KEY("key7", 4));
+    cr_assert(node.tombstone, "Delete missed key7");
+    cr_assert_null(node.key.key_base, "Delete handed back the map's key");
+    cr_assert_null(get(map, MAP_KEY("key7", 4)).val_base, "Deleted key was still found");
+    cr_assert_eq(map -> size, NUM_KEYS - 1, "Size was %u. Expected: %d", map -> size, NUM_KEYS - 1);
+    cr_assert_eq(handed_back, NUM_KEYS + NUM_KEYS / 2, "%d buffers were handed back", handed_back);
+    invalidate_map(map);
+}
+
+Test(persist_suite, 02_reopen, .timeout = 10, .init = remove_file) {
+    hashmap_t *map = open_map(MAP_FILE, NUM_KEYS * 2, spread_hash, persist_free_function);
+    cr_assert_not_null(map, "open_map failed: %s", strerror(errno));
+    fill(map, 0, NUM_KEYS);
+    delete(map, MAP_KEY("key7", 4));
+    cr_assert(checkpoint_map(map), "Checkpoint failed: %s", strerror(errno));
+    invalidate_map(map);
+
+    // everything is back without loading anything, and the freed space is reused
+    hashmap_t *reopened = open_map(MAP_FILE, NUM_KEYS * 2, spread_hash, persist_free_function);
+    cr_assert_not_null(reopened, "Reopen failed: %s", strerror(errno));
+    cr_assert_eq(reopened -> size, NUM_KEYS - 1, "Size was %u. Expected: %d", reopened -> size, NUM_KEYS - 1);
+    check(reopened, 0, 7);
+    check(reopened, 8, NUM_KEYS);
+    uint64_t bump = reopened -> bump;
+    fill(reopened, NUM_KEYS, NUM_KEYS + 1);
+    cr_assert_eq(reopened -> bump, bump, "The freed chunks were not reused");
+
+    // a different capacity isn't the same map
+    errno = 0;
+    cr_assert_null(open_map(MAP_FILE, NUM_KEYS, spread_hash, persist_free_function), "Opened with the wrong capacity");
+    cr_assert_eq(errno, EINVAL, "errno was %d. Expected: EINVAL", errno);
+    invalidate_map(reopened);
+    remove_file();
+}
+
+Test(persist_suite, 03_torn_slot, .timeout = 10, .init = remove_file) {
+    hashmap_t *map = open_map(MAP_FILE, NUM_KEYS * 2, spread_hash, persist_free_function);
+    cr_assert_not_null(map, "open_map failed: %s", strerror(errno));
+    fill(map, 0, NUM_KEYS);
+
+    // we went down in the middle of writing key7's slot
+    map_slot_t *slot = NULL;
+    for (uint32_t i = 0; i < map -> capacity && slot == NULL; i++){
+        if (map -> slots[i].key_len == 4 && memcmp(map -> base + map -> slots[i].key_off, "key7", 4) == 0)
+            slot = &map -> slots[i];
+    }
+    cr_assert_not_null(slot, "key7 was not in the table");
+    slot -> val_off += 4096;
+    invalidate_map(map);
+
+    hashmap_t *reopened = open_map(MAP_FILE, NUM_KEYS * 2, spread_hash, persist_free_function);
+    cr_assert_not_null(reopened, "Reopen failed: %s", strerror(errno));
+    cr_assert_eq(reopened -> size, NUM_KEYS - 1, "Size was %u. Expected: %d", reopened -> size, NUM_KEYS - 1);
+    cr_assert_null(get(reopened, MAP_KEY("key7", 4)).val_base, "The torn slot was still found");
+    check(reopened, 8, NUM_KEYS);
+    invalidate_map(reopened);
+    remove_file();
+}
+
+Test(persist_suite, 04_clear, .timeout = 5, .init = remove_file) {
+    hashmap_t *map = open_map(MAP_FILE, NUM_KEYS * 2, spread_hash, persist_free_function);
+    cr_assert_not_null(map, "open_map failed: %s", strerror(errno));
+    fill(map, 0, NUM_KEYS);
+    cr_assert(clear_map(map), "Clear failed");
+    cr_assert_eq(map -> size, 0, "Size was %u. Expected: 0", map -> size);
+    cr_assert_null(get(map, MAP_KEY("key7", 4)).val_base, "Cleared key was still found");
+    fill(map, 0, 10);
+    check(map, 0, 10);
+    invalidate_map(map);
+
+    hashmap_t *reopened = open_map(MAP_FILE, NUM_KEYS * 2, spread_hash, persist_free_function);
+    cr_assert_not_null(reopened, "Reopen failed: %s", strerror(errno));
+    cr_assert_eq(reopened -> size, 10, "Size was %u. Expected: 10", reopened -> size);
+    invalidate_map(reopened);
+    remove_file();
+}
+
+Test(persist_suite, 05_readers_keep_old_values, .timeout = 5, .init = remove_file) {
+    hashmap_t *map = create_map(NUM_KEYS * 2, spread_hash, persist_free_function);
+    cr_assert_not_null(map, "Map returned was NULL");
+    fill(map, 0, NUM_KEYS);
+
+    reclaim_enter();
+    map_val_t old = get(map, MAP_KEY("key7", 4));
+    cr_assert_not_null(old.val_base, "key7 wasn't found");
+    // replace everything twice over, then clear and fill again: none of it
+    // may land where key7's value was while we're reading it
+    for (int round = 0; round < 2; round++){
+        for (int i = 0; i < NUM_KEYS; i++){
+            char key[16];
+            int keyLen = sprintf(key, "key%d", i);
+            cr_assert(put(map, MAP_KEY(key, keyLen), MAP_VAL("something else", 14), false), "Put %d failed", i);
+        }
+    }
+    cr_assert(clear_map(map), "Clear failed");
+    fill(map, NUM_KEYS, NUM_KEYS * 2);
+    cr_assert(memcmp(old.val_base, "value of 7", old.val_len) == 0, "key7's value was overwritten under a reader");
+    reclaim_exit();
+
+    // once the reader is gone the arena is handed out again
+    uint64_t bump = map -> bump;
+    cr_assert(clear_map(map), "Clear failed");
+    fill(map, 0, NUM_KEYS);
+    check(map, 0, NUM_KEYS);
+    cr_assert_eq(map -> bump, bump, "The file grew past the cleared arena");
+    invalidate_map(map);
+}
@@ -90,4 +90,68 @@ Test(queue_suite, 02_popping, .timeout = 2, .init = queue_init, .fini = queue_fi
         exit(EXIT_FAILURE);
 
     cr_assert_eq(num_items, 0, "Had %d items. Expected: %d", num_items, 0);
-}
\ No newline at end of file
+}
+Test(queue_suite, 03_fifo_wraparound, .timeout = 2, .init = queue_init, .fini = queue_fini){
+    // push and pop more than a ring's worth so the positions lap the cells
+    for (int index = 0; index < QUEUE_CAPACITY * 3; index++){
+        int *ptr = malloc(sizeof(int));
+        *ptr = index;
+        cr_assert(enqueue(global_queue, ptr), "Enqueue %d failed", index);
+
+        int *item = dequeue(global_queue);
+        cr_assert_not_null(item, "Dequeue returned NULL");
+        cr_assert_eq(*item, index, "Dequeued %d. Expected: %d", *item, index);
+        free(item);
+    }
+}
+
+Test(queue_suite, 04_full, .timeout = 2, .init = queue_init, .fini = queue_fini){
+    static int items[QUEUE_CAPACITY + 1];
+
+    for (int index = 0; index < QUEUE_CAPACITY; index++){
+        cr_assert(enqueue(global_queue, &items[index]), "Enqueue %d failed", index);
+    }
+
+    // one more than the capacity has to be refused
+    cr_assert_not(enqueue(global_queue, &items[QUEUE_CAPACITY]), "Enqueue into a full queue succeeded");
+    cr_assert_eq(errno, ENOBUFS, "errno was %d. Expected: %d", errno, ENOBUFS);
+
+    // drain it so the fini doesn't try to free static storage
+    for (int index = 0; index < QUEUE_CAPACITY; index++){
+        cr_assert_eq(dequeue(global_queue), &items[index], "Items came out of order");
+    }
+}
+
+#define PER_PRODUCER 20000
+static atomic_long consumed_sum;
+
+void *thread_produce(void *arg) {
+    for (long index = 1; index <= PER_PRODUCER; index++){
+        // the ring is bounded, so back off while the consumers catch up
+        while (enqueue(global_queue, (void *) index) == false);
+    }
+    return NULL;
+}
+
+void *thread_consume(void *arg) {
+    for (long index = 0; index < PER_PRODUCER; index++){
+        atomic_fetch_add(&consumed_sum, (long) dequeue(global_queue));
+    }
+    return NULL;
+}
+
+Test(queue_suite, 05_producers_consumers, .timeout = 5, .init = queue_init){
+    pthread_t producers[4], consumers[4];
+
+    for (int index = 0; index < 4; index++){
+        pthread_create(&producers[index], NULL, thread_produce, NULL);
+        pthread_create(&consumers[index], NULL, thread_consume, NULL);
+    }
+    for (int index = 0; index < 4; index++){
+        pthread_join(producers[index], NULL);
+        pthread_join(consumers[index], NULL);
+    }
+
+    long expected = 4L * PER_PRODUCER * (PER_PRODUCER + 1) / 2;
+    cr_assert_eq(atomic_load(&consumed_sum), expected, "Consumed %ld. Expected: %ld", atomic_load(&consumed_sum), expected);
+}
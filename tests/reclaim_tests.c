@@ -0,0 +1,229 @@
+#include <criterion/criterion.h>
+#include <criterion/logging.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "reclaim.h"
+#include "slab.h"
+#include "utils.h"
+
+#define NUM_JOBS 1000
+#define NUM_KEYS 100
+
+static int ran[NUM_JOBS];
+static atomic_int next_job;
+static atomic_int destroyed;
+
+static void record_job(void *arg) {
+    ran[atomic_fetch_add(&next_job, 1)] = (int) (intptr_t) arg;
+}
+
+static void counting_free_function(map_key_t key, map_val_t val) {
+    atomic_fetch_add(&destroyed, 1);
+    slab_free(key.key_base);
+    slab_free(val.val_base);
+}
+
+static uint32_t int_hash(map_key_t key) {
+    return *(uint32_t *) key.key_base * 2654435761u;
+}
+
+Test(reclaim_suite, 00_jobs_run_in_order, .timeout = 5){
+    atomic_init(&next_job, 0);
+    for (int i = 0; i < NUM_JOBS; i++)
+        reclaim_later(record_job, (void *) (intptr_t) i);
+    reclaim_wait();
+
+    cr_assert_eq(atomic_load(&next_job), NUM_JOBS, "%d jobs ran. Expected: %d", atomic_load(&next_job), NUM_JOBS);
+    for (int i = 0; i < NUM_JOBS; i++)
+        cr_assert_eq(ran[i], i, "Job %d ran in position %d", ran[i], i);
+}
+
+Test(reclaim_suite, 01_clear_destroys_in_background, .timeout = 5){
+    hashmap_t *map = create_map(NUM_KEYS * 2, int_hash, counting_free_function);
+    cr_assert_not_null(map, "Map returned was NULL");
+    for (int i = 0; i < NUM_KEYS; i++){
+        int *key = malloc(sizeof(int));
+        int *val = malloc(sizeof(int));
+        *key = i;
+        *val = i;
+        cr_assert(put(map, MAP_KEY(key, sizeof(int)), MAP_VAL(val, sizeof(int)), false), "Put %d failed", i);
+    }
+    // some engines copy what they're given and destroy the originals right away
+    int before = atomic_load(&destroyed);
+
+    cr_assert(clear_map(map), "Clear failed");
+    cr_assert_eq(map->size, 0, "Size was %u. Expected: %d", map->size, 0);
+    int key = 7;
+    cr_assert_null(get(map, MAP_KEY(&key, sizeof(int))).val_base, "Cleared key was still found");
+
+    reclaim_wait();
+#ifdef PERSIST
+    // the persistent map keeps its own copies, the destructor only ever gets the originals
+    int expected = 0;
+#else
+    int expected = NUM_KEYS;
+#endif
+    cr_assert_eq(atomic_load(&destroyed) - before, expected, "%d entries were destroyed. Expected: %d",
+                 atomic_load(&destroyed) - before, expected);
+
+    // the new table works like the old one
+    int *k = malloc(sizeof(int));
+    int *v = malloc(sizeof(int));
+    *k = 7;
+    *v = 70;
+    cr_assert(put(map, MAP_KEY(k, sizeof(int)), MAP_VAL(v, sizeof(int)), false), "Put after clear failed");
+    cr_assert_eq(*(int *) get(map, MAP_KEY(&key, sizeof(int))).val_base, 70, "Got the wrong value after clear");
+    invalidate_map(map);
+}
+
+Test(reclaim_suite, 02_retire_in_batches, .timeout = 5){
+    retire_flush();
+    reclaim_wait();
+    int before = atomic_load(&destroyed);
+
+    // a partial batch stays with the thread that retired it
+    for (int i = 0; i < RETIRE_BATCH - 1; i++)
+        retire(counting_free_function, MAP_KEY(malloc(1), 1), MAP_VAL(malloc(1), 1));
+    reclaim_wait();
+    cr_assert_eq(atomic_load(&destroyed), before, "Entries were destroyed before the batch was handed over");
+    cr_assert_eq(retired_outstanding(), RETIRE_BATCH - 1, "%zu entries outstanding. Expected: %d",
+                 retired_outstanding(), RETIRE_BATCH - 1);
+
+    // the one that fills it sends it to the reclaimer
+    retire(counting_free_function, MAP_KEY(malloc(1), 1), MAP_VAL(malloc(1), 1));
+    reclaim_wait();
+    cr_assert_eq(atomic_load(&destroyed) - before, RETIRE_BATCH, "%d entries were destroyed. Expected: %d",
+                 atomic_load(&destroyed) - before, RETIRE_BATCH);
+    cr_assert_eq(retired_outstanding(), 0, "%zu entries outstanding. Expected: 0", retired_outstanding());
+}
+
+Test(reclaim_suite, 03_replaced_entries_are_retired, .timeout = 5){
+    hashmap_t *map = create_map(16, int_hash, counting_free_function);
+    cr_assert_not_null(map, "Map returned was NULL");
+    int *key = malloc(sizeof(int));
+    *key = 1;
+    cr_assert(put(map, MAP_KEY(key, sizeof(int)), MAP_VAL(malloc(sizeof(int)), sizeof(int)), false), "First put failed");
+    int *again = malloc(sizeof(int));
+    *again = 1;
+    retire_flush();
+    reclaim_wait();
+    int before = atomic_load(&destroyed);
+
+    cr_assert(put(map, MAP_KEY(again, sizeof(int)), MAP_VAL(malloc(sizeof(int)), sizeof(int)), false), "Second put failed");
+    retire_flush();
+    reclaim_wait();
+    cr_assert_gt(atomic_load(&destroyed), before, "The replaced entry was never destroyed");
+    cr_assert_eq(retired_outstanding(), 0, "%zu entries outstanding. Expected: 0", retired_outstanding());
+    invalidate_map(map);
+}
+
+Test(reclaim_suite, 04_readers_hold_off_reclaim, .timeout = 5){
+    retire_flush();
+    reclaim_wait();
+    int before = atomic_load(&destroyed);
+
+    // a full batch goes to the reclaimer, which has to wait for us
+    reclaim_enter();
+    for (int i = 0; i < RETIRE_BATCH; i++)
+        retire(counting_free_function, MAP_KEY(malloc(1), 1), MAP_VAL(malloc(1), 1));
+    usleep(50000);
+    cr_assert_eq(atomic_load(&destroyed), before, "Entries were destroyed while a reader was in its section");
+    reclaim_exit();
+
+    reclaim_wait();
+    cr_assert_eq(atomic_load(&destroyed) - before, RETIRE_BATCH, "%d entries were destroyed. Expected: %d",
+                 atomic_load(&destroyed) - before, RETIRE_BATCH);
+}
+
+Test(reclaim_suite, 05_held_entries_are_destroyed_in_place, .timeout = 5){
+    retire_flush();
+    reclaim_wait();
+    int before = atomic_load(&destroyed);
+
+    // more than a batch, and none of it goes to the reclaimer
+    retire_hold();
+    for (int i = 0; i < RETIRE_BATCH * 2 + 1; i++)
+        retire(counting_free_function, MAP_KEY(malloc(1), 1), MAP_VAL(malloc(1), 1));
+    retire_flush();
+    reclaim_wait();
+    cr_assert_eq(atomic_load(&destroyed), before, "Held entries were handed to the reclaimer");
+
+    retire_sync();
+    cr_assert_eq(atomic_load(&destroyed) - before, RETIRE_BATCH * 2 + 1, "%d entries were destroyed. Expected: %d",
+                 atomic_load(&destroyed) - before, RETIRE_BATCH * 2 + 1);
+    cr_assert_eq(retired_outstanding(), 0, "%zu entries outstanding. Expected: 0", retired_outstanding());
+}
+
+// the compact and persistent maps copy values, so theirs never live in the block
+#if !defined(COMPACT) && !defined(PERSIST)
+#define EVICT_KEYS (MAP_EVICT_CHUNK * 2 + 100)
+static int block[EVICT_KEYS];
+
+static void block_free_function(map_key_t key, map_val_t val) {
+    atomic_fetch_add(&destroyed, 1);
+    free(key.key_base);
+    if ((int *) val.val_base < block || (int *) val.val_base >= block + EVICT_KEYS)
+        free(val.val_base);
+}
+
+Test(reclaim_suite, 06_evict_range_spans_chunks, .timeout = 10){
+    hashmap_t *map = create_map(EVICT_KEYS * 2, int_hash, block_free_function);
+    cr_assert_not_null(map, "Map returned was NULL");
+    // every other value lives in the block
+    for (int i = 0; i < EVICT_KEYS; i++){
+        int *key = malloc(sizeof(int));
+        *key = i;
+        int *val = i % 2 == 0 ? &block[i] : malloc(sizeof(int));
+        cr_assert(put(map, MAP_KEY(key, sizeof(int)), MAP_VAL(val, sizeof(int)), false), "Put %d failed", i);
+    }
+    int before = atomic_load(&destroyed);
+
+    int evicted = evict_range(map, block, block + EVICT_KEYS);
+    cr_assert_eq(evicted, (EVICT_KEYS + 1) / 2, "%d entries were evicted. Expected: %d", evicted, (EVICT_KEYS + 1) / 2);
+    // they're destroyed by the time it returns, without the reclaimer
+    cr_assert_eq(atomic_load(&destroyed) - before, evicted, "%d entries were destroyed. Expected: %d",
+                 atomic_load(&destroyed) - before, evicted);
+    cr_assert_eq(map->size, EVICT_KEYS - evicted, "Size was %u. Expected: %d", map->size, EVICT_KEYS - evicted);
+    invalidate_map(map);
+}
+#endif
+
+static atomic_bool reading;
+
+static void *hold_reader(void *arg) {
+    reclaim_enter();
+    atomic_store(&reading, true);
+    usleep(50000);
+    reclaim_exit();
+    return NULL;
+}
+
+Test(reclaim_suite, 07_catch_up_past_the_limit, .timeout = 10){
+    retire_flush();
+    reclaim_wait();
+    int before = atomic_load(&destroyed);
+
+    // a reader holds the reclaimer up while the limit is passed
+    pthread_t tid;
+    pthread_create(&tid, NULL, hold_reader, NULL);
+    while (atomic_load(&reading) == false)
+        usleep(100);
+    for (int i = 0; i < RETIRE_LIMIT; i++)
+        retire(counting_free_function, MAP_KEY(malloc(1), 1), MAP_VAL(malloc(1), 1));
+    cr_assert_geq(retired_outstanding(), RETIRE_LIMIT, "Entries were destroyed while a reader was in its section");
+
+    // so we wait the reader out and destroy them ourselves
+    retire_catch_up();
+    cr_assert_lt(retired_outstanding(), RETIRE_LIMIT, "%zu entries still outstanding", retired_outstanding());
+    cr_assert_geq(atomic_load(&destroyed) - before, RETIRE_LIMIT, "%d entries were destroyed. Expected: %d",
+                  atomic_load(&destroyed) - before, RETIRE_LIMIT);
+    pthread_join(tid, NULL);
+
+    // and below it, nothing happens
+    retire(counting_free_function, MAP_KEY(malloc(1), 1), MAP_VAL(malloc(1), 1));
+    retire_catch_up();
+    cr_assert_eq(retired_outstanding(), 1, "%zu entries outstanding. Expected: 1", retired_outstanding());
+}
@@ -0,0 +1,111 @@
+#include <criterion/criterion.h>
+#include <criterion/logging.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+
+#include "slab.h"
+#define NUM_THREADS 8
+#define NUM_CHUNKS 5000
+
+Test(slab_suite, 00_size_classes, .timeout = 2){
+    // every size the protocol allows has a class that fits it
+    for (size_t size = 1; size <= SLAB_MAX_SIZE; size++){
+        size_t chunk = slab_chunk_size(size);
+        cr_assert_geq(chunk, size, "Size %lu went to a %lu byte class", size, chunk);
+        cr_assert_eq(chunk % SLAB_ALIGN, 0, "Class %lu isn't aligned", chunk);
+    }
+    cr_assert_eq(slab_chunk_size(SLAB_MAX_SIZE + 1), 0, "Oversized request got a class");
+}
+
+Test(slab_suite, 01_alloc_free_reuse, .timeout = 2){
+    char *first = slab_alloc(100);
+    cr_assert_not_null(first, "slab_alloc returned NULL");
+    cr_assert(slab_contains(first), "Chunk isn't inside the slab region");
+    memset(first, 'a', 100);
+
+    // a freed chunk goes to this thread's cache and comes right back out
+    slab_free(first);
+    char *second = slab_alloc(100);
+    cr_assert_eq(first, second, "Freed chunk wasn't reused");
+    slab_free(second);
+
+    // big requests fall back to malloc and free just the same
+    char *big = slab_alloc(SLAB_MAX_SIZE * 2);
+    cr_assert_not_null(big, "Oversized slab_alloc returned NULL");
+    cr_assert_not(slab_contains(big), "Oversized chunk came from the slabs");
+    slab_free(big);
+}
+
+void *thread_churn(void *arg) {
+    char *chunks[NUM_CHUNKS];
+    size_t seed = (size_t) arg;
+
+    for (int index = 0; index < NUM_CHUNKS; index++){
+        size_t size = 1 + (seed * 7919 + index * 104729) % SLAB_MAX_SIZE;
+        chunks[index] = slab_alloc(size);
+        if (chunks[index] == NULL)
+            return (void *) 1;
+        // stamp the chunk so overlapping handouts would show up
+        memset(chunks[index], (int) seed, size);
+    }
+    for (int index = 0; index < NUM_CHUNKS; index++){
+        if (chunks[index][0] != (char) seed)
+            return (void *) 1;
+        slab_free(chunks[index]);
+    }
+    slab_flush_cache();
+    return NULL;
+}
+
+Test(slab_suite, 02_multithreaded, .timeout = 5){
+    pthread_t thread_ids[NUM_THREADS];
+
+    for (size_t index = 0; index < NUM_THREADS; index++){
+        if (pthread_create(&thread_ids[index], NULL, thread_churn, (void *) (index + 1)) != 0)
+            exit(EXIT_FAILURE);
+    }
+
+    for (int index = 0; index < NUM_THREADS; index++){
+        void *result;
+        pthread_join(thread_ids[index], &result);
+        cr_assert_null(result, "Thread %d saw a bad chunk", index);
+    }
+}
+
+int count_evictions(const void *lo, const void *hi, void *arg) {
+    *(int *) arg += 1;
+    return 0;
+}
+
+Test(slab_suite, 03_rebalance, .timeout = 5){
+    // two pages total, so the second class has to get its memory from the first
+    cr_assert(slab_init(2 * SLAB_PAGE_SIZE), "slab_init failed");
+
+    size_t small = slab_chunk_size(64);
+    int perPage = SLAB_PAGE_SIZE / small;
+    void **chunks = malloc(2 * perPage * sizeof(void *));
+    for (int index = 0; index < 2 * perPage; index++){
+        chunks[index] = slab_alloc(64);
+        cr_assert_not_null(chunks[index], "Ran out at %d of %d", index, 2 * perPage);
+    }
+    cr_assert_null(slab_alloc(2048), "Got a chunk with every page taken");
+
+    // empty the small class out again. its pages stay with it until they're moved
+    for (int index = 0; index < 2 * perPage; index++){
+        slab_free(chunks[index]);
+    }
+    slab_flush_cache();
+    cr_assert_null(slab_alloc(2048), "Got a chunk with every page taken");
+
+    int hookCalls = 0;
+    cr_assert(slab_rebalance(count_evictions, &hookCalls), "No page was moved");
+    cr_assert_gt(hookCalls, 0, "The eviction hook was never run");
+
+    void *big = slab_alloc(2048);
+    cr_assert_not_null(big, "Still no chunk after the move");
+
+    // nothing else is short, so the next round leaves things alone
+    cr_assert_not(slab_rebalance(count_evictions, &hookCalls), "A page moved without any pressure");
+    free(chunks);
+}
@@ -0,0 +1,116 @@
+#include <criterion/criterion.h>
+#include <criterion/logging.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "snapshot.h"
+#include "slab.h"
+
+#define NUM_KEYS 10000
+#define SNAPSHOT_FILE "/tmp/cream_snapshot_tests.snap"
+
+static void snapshot_free_function(map_key_t key, map_val_t val) {
+    slab_free(key.key_base);
+    slab_free(val.val_base);
+}
+
+static uint32_t spread_hash(map_key_t key) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < key.key_len; i++)
+        hash = (hash ^ ((uint8_t *) key.key_base)[i]) * 16777619u;
+    return hash;
+}
+
+static void fill(store_t *store) {
+    for (int i = 0; i < NUM_KEYS; i++){
+        char *key = slab_alloc(16);
+        char *val = slab_alloc(32);
+        int keyLen = sprintf(key, "key%d", i);
+        int valLen = sprintf(val, "value of %d", i);
+        cr_assert(store_put(store, MAP_KEY(key, keyLen), MAP_VAL(val, valLen), false), "Put %d failed", i);
+    }
+}
+
+static bool count_entry(map_key_t key, map_val_t val, uint64_t age_ms, void *arg) {
+    *(int *) arg += 1;
+    return true;
+}
+
+Test(snapshot_suite, 00_walk, .timeout = 5){
+    store_t *store = create_store(2, NUM_KEYS * 2, spread_hash, snapshot_free_function, NULL, 0);
+    fill(store);
+    int count = 0;
+    cr_assert(store_walk(store, count_entry, &count), "Walk failed");
+    cr_assert_eq(count, NUM_KEYS, "Walk saw %d entries. Expected: %d", count, NUM_KEYS);
+}
+
+Test(snapshot_suite, 01_save_and_load, .timeout = 10){
+    store_t *store = create_store(2, NUM_KEYS * 2, spread_hash, snapshot_free_function, NULL, 0);
+    fill(store);
+    cr_assert(save_snapshot(store, SNAPSHOT_FILE), "Save failed: %s", strerror(errno));
+
+    // a different shard count doesn't matter, entries go wherever they belong now
+    store_t *restored = create_store(3, NUM_KEYS * 2, spread_hash, snapshot_free_function, NULL, 0);
+    uint64_t loaded;
+    cr_assert(load_snapshot(restored, SNAPSHOT_FILE, 4, &loaded), "Load failed: %s", strerror(errno));
+    cr_assert_eq(loaded, NUM_KEYS, "Loaded %lu entries. Expected: %d", loaded, NUM_KEYS);
+    cr_assert_eq(store_size(restored), NUM_KEYS, "Store had %u entries. Expected: %d", store_size(restored), NUM_KEYS);
+
+    for (int i = 0; i < NUM_KEYS; i++){
+        char key[16], expected[32];
+        int keyLen = sprintf(key, "key%d", i);
+        int valLen = sprintf(expected, "value of %d", i);
+        map_val_t val = store_get(restored, MAP_KEY(key, keyLen));
+        cr_assert_eq(val.val_len, valLen, "Value of %s had length %zu", key, val.val_len);
+        cr_assert(memcmp(val.val_base, expected, valLen) == 0, "Value of %s was wrong", key);
+    }
+    unlink(SNAPSHOT_FILE);
+}
+
+Test(snapshot_suite, 02_damaged_file, .timeout = 5){
+    store_t *store = create_store(1, NUM_KEYS * 2, spread_hash, snapshot_free_function, NULL, 0);
+    fill(store);
+    cr_assert(save_snapshot(store, SNAPSHOT_FILE), "Save failed: %s", strerror(errno));
+
+    // cut it off in the middle of the records
+    FILE *file = fopen(SNAPSHOT_FILE, "r+");
+    cr_assert_not_null(file, "Could not open the snapshot");
+    cr_assert_eq(ftruncate(fileno(file), sizeof(snapshot_header_t) + 100), 0, "Could not truncate the snapshot");
+    fclose(file);
+
+    store_t *restored = create_store(1, NUM_KEYS * 2, spread_hash, snapshot_free_function, NULL, 0);
+    errno = 0;
+    cr_assert_not(load_snapshot(restored, SNAPSHOT_FILE, 2, NULL), "Loaded a damaged snapshot");
+    cr_assert_eq(errno, EINVAL, "errno was %d. Expected: EINVAL", errno);
+
+    errno = 0;
+    cr_assert_not(load_snapshot(restored, "/tmp/cream_snapshot_tests.missing", 2, NULL), "Loaded a missing snapshot");
+    cr_assert_eq(errno, ENOENT, "errno was %d. Expected: ENOENT", errno);
+    unlink(SNAPSHOT_FILE);
+}
+
+Test(snapshot_suite, 03_forked, .timeout = 10){
+    store_t *store = create_store(2, NUM_KEYS * 2, spread_hash, snapshot_free_function, NULL, 0);
+    fill(store);
+    cr_assert(fork_snapshot(store, SNAPSHOT_FILE), "Fork failed: %s", strerror(errno));
+#ifdef PERSIST
+    // a shared mapping isn't copied for a child, a thread walks the live map
+    // instead, so what we change before it's done may or may not make it in
+    while (snapshot_running())
+        usleep(1000);
+#endif
+
+    // we're free to change the map while the child writes its copy
+    cr_assert(store_clear(store), "Clear failed");
+    while (snapshot_running())
+        usleep(1000);
+
+    store_t *restored = create_store(2, NUM_KEYS * 2, spread_hash, snapshot_free_function, NULL, 0);
+    uint64_t loaded;
+    cr_assert(load_snapshot(restored, SNAPSHOT_FILE, 2, &loaded), "Load failed: %s", strerror(errno));
+    cr_assert_eq(loaded, NUM_KEYS, "Loaded %lu entries. Expected: %d", loaded, NUM_KEYS);
+    unlink(SNAPSHOT_FILE);
+}
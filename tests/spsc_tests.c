@@ -0,0 +1,49 @@
+#include <criterion/criterion.h>
+#include <criterion/logging.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+
+#include "spsc.h"
+#define NUM_ITEMS 100000
+
+Test(spsc_suite, 00_fifo_and_full, .timeout = 2){
+    spsc_t *ring = create_spsc();
+    cr_assert_not_null(ring, "Ring returned was NULL");
+    cr_assert(spsc_empty(ring), "New ring was not empty");
+
+    for (uintptr_t i = 1; i <= SPSC_CAPACITY; i++)
+        cr_assert(spsc_push(ring, (void *) i), "Push %lu failed", i);
+    errno = 0;
+    cr_assert_not(spsc_push(ring, (void *) 1), "Pushed into a full ring");
+    cr_assert_eq(errno, ENOBUFS, "errno was %d. Expected: ENOBUFS", errno);
+
+    for (uintptr_t i = 1; i <= SPSC_CAPACITY; i++)
+        cr_assert_eq((uintptr_t) spsc_pop(ring), i, "Items came out of order");
+    cr_assert_null(spsc_pop(ring), "Popped from an empty ring");
+}
+
+static void *producer(void *arg){
+    spsc_t *ring = arg;
+    for (uintptr_t i = 1; i <= NUM_ITEMS; i++){
+        while (spsc_push(ring, (void *) i) == false)
+            ;
+    }
+    return NULL;
+}
+
+Test(spsc_suite, 01_two_threads, .timeout = 5){
+    spsc_t *ring = create_spsc();
+    pthread_t tid;
+    pthread_create(&tid, NULL, producer, ring);
+
+    // everything arrives, once, in order
+    for (uintptr_t expected = 1; expected <= NUM_ITEMS; ){
+        void *item = spsc_pop(ring);
+        if (item == NULL)
+            continue;
+        cr_assert_eq((uintptr_t) item, expected, "Got %lu. Expected: %lu", (uintptr_t) item, expected);
+        expected++;
+    }
+    pthread_join(tid, NULL);
+}
@@ -0,0 +1,76 @@
+#include <criterion/criterion.h>
+#include <criterion/logging.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "stats.h"
+#include "store.h"
+#include "slab.h"
+
+#define NUM_THREADS 8
+#define NUM_COUNTS 100000
+#define NUM_KEYS 100
+
+static void *count_hits(void *arg){
+    for (int i = 0; i < NUM_COUNTS; i++)
+        stats_add(STATS_HITS, 1);
+    stats_add(STATS_MISSES, 2);
+    return NULL;
+}
+
+Test(stats_suite, 00_threads_add_up, .timeout = 5){
+    uint64_t before[STATS_COUNTERS], after[STATS_COUNTERS];
+    stats_sum(before);
+
+    pthread_t tids[NUM_THREADS];
+    for (int i = 0; i < NUM_THREADS; i++)
+        cr_assert_eq(pthread_create(&tids[i], NULL, count_hits, NULL), 0, "Could not start thread %d", i);
+    // what exited threads counted is still there
+    for (int i = 0; i < NUM_THREADS; i++)
+        pthread_join(tids[i], NULL);
+    stats_sum(after);
+
+    cr_assert_eq(after[STATS_HITS] - before[STATS_HITS], (uint64_t) NUM_THREADS * NUM_COUNTS,
+                 "Counted %lu hits. Expected: %d", after[STATS_HITS] - before[STATS_HITS], NUM_THREADS * NUM_COUNTS);
+    cr_assert_eq(after[STATS_MISSES] - before[STATS_MISSES], NUM_THREADS * 2, "Counted %lu misses", after[STATS_MISSES] - before[STATS_MISSES]);
+    cr_assert(strcmp(stats_name(STATS_HITS), "hits") == 0, "Name was %s", stats_name(STATS_HITS));
+    for (int i = 0; i < STATS_COUNTERS; i++)
+        cr_assert_not_null(stats_name(i), "Counter %d had no name", i);
+    cr_assert_null(stats_name(STATS_COUNTERS), "A counter past the end had a name");
+}
+
+static void store_free_function(map_key_t key, map_val_t val) {
+    slab_free(key.key_base);
+    slab_free(val.val_base);
+}
+
+static uint32_t spread_hash(map_key_t key) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < key.key_len; i++)
+        hash = (hash ^ ((uint8_t *) key.key_base)[i]) * 16777619u;
+    return hash;
+}
+
+Test(stats_suite, 01_store_counts, .timeout = 5){
+    store_t *store = create_store(2, NUM_KEYS * 2, spread_hash, store_free_function, NULL, 0);
+    cr_assert_eq(store_capacity(store), NUM_KEYS * 2, "Capacity was %u. Expected: %d", store_capacity(store), NUM_KEYS * 2);
+    for (int i = 0; i < NUM_KEYS; i++){
+        char *key = slab_alloc(16);
+        char *val = slab_alloc(16);
+        int keyLen = sprintf(key, "key%d", i);
+        cr_assert(store_put(store, MAP_KEY(key, keyLen), MAP_VAL(val, sprintf(val, "%d", i)), false), "Put %d failed", i);
+    }
+    cr_assert_eq(store_tombstones(store), 0, "A new store had %u tombstones", store_tombstones(store));
+
+    // a deleted entry leaves a tombstone behind
+    for (int i = 0; i < NUM_KEYS; i += 10){
+        char key[16];
+        int keyLen = sprintf(key, "key%d", i);
+        map_node_t node = store_delete(store, MAP_KEY(key, keyLen));
+        cr_assert(node.tombstone, "Delete missed %s", key);
+        store_free_function(node.key, node.val);
+    }
+    cr_assert_eq(store_tombstones(store), NUM_KEYS / 10, "Store had %u tombstones. Expected: %d", store_tombstones(store), NUM_KEYS / 10);
+}
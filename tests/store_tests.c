@@ -0,0 +1,192 @@
+#include <criterion/criterion.h>
+#include <criterion/logging.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "store.h"
+#include "slab.h"
+#include "reclaim.h"
+
+#define NUM_KEYS 200
+
+/* slab_free() also takes heap pointers, so this works for every engine */
+static void store_free_function(map_key_t key, map_val_t val) {
+    slab_free(key.key_base);
+    slab_free(val.val_base);
+}
+
+static uint32_t spread_hash(map_key_t key) {
+    // every byte matters, and the high bits pick the shard
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < key.key_len; i++)
+        hash = (hash ^ ((uint8_t *) key.key_base)[i]) * 16777619u;
+    return hash;
+}
+
+Test(store_suite, 00_shards, .timeout = 5){
+    store_t *store = create_store(4, NUM_KEYS * 2, spread_hash, store_free_function, NULL, 0);
+    cr_assert_not_null(store, "Store returned was NULL");
+    cr_assert_eq(store->num_shards, 4, "Store had %d shards. Expected: %d", store->num_shards, 4);
+
+    int perShard[4] = {0};
+    for (int i = 0; i < NUM_KEYS; i++){
+        int *key = malloc(sizeof(int));
+        int *val = malloc(sizeof(int));
+        *key = i;
+        *val = i * 3;
+        perShard[store_shard_of(store, (map_key_t) {.key_base = key, .key_len = sizeof(int)})] += 1;
+        cr_assert(store_put(store, (map_key_t) {.key_base = key, .key_len = sizeof(int)}, (map_val_t) {.val_base = val, .val_len = sizeof(int)}, false), "Put %d failed", i);
+    }
+    cr_assert_eq(store_size(store), NUM_KEYS, "Store had %u entries. Expected: %d", store_size(store), NUM_KEYS);
+    for (int shard = 0; shard < 4; shard++)
+        cr_assert_gt(perShard[shard], 0, "Shard %d got no keys", shard);
+
+    for (int i = 0; i < NUM_KEYS; i++){
+        map_val_t val = store_get(store, (map_key_t) {.key_base = &i, .key_len = sizeof(int)});
+        cr_assert_not_null(val.val_base, "Key %d was not found", i);
+        cr_assert_eq(*(int *) val.val_base, i * 3, "Key %d had the wrong value", i);
+    }
+
+    cr_assert(store_clear(store), "Clear failed");
+    cr_assert_eq(store_size(store), 0, "Store had %u entries after clear", store_size(store));
+}
+
+Test(store_suite, 01_one_shard_per_node, .timeout = 5){
+    topology_t topology;
+    cr_assert(load_topology(&topology, TOPOLOGY_ROOT), "Could not load the topology");
+
+    store_t *store = create_store(1, 1000, spread_hash, store_free_function, &topology, 0);
+    cr_assert_not_null(store, "Store returned was NULL");
+    cr_assert_eq(store->num_shards, topology.num_nodes, "Store had %d shards for %d nodes", store->num_shards, topology.num_nodes);
+    free_topology(&topology);
+}
+
+#define NUM_BULK 20000
+
+static map_entry_t bulk_entry(store_t *store, int i, int val) {
+    int *key = malloc(sizeof(int));
+    int *copy = malloc(sizeof(int));
+    *key = i;
+    *copy = val;
+    map_key_t mapKey = {.key_base = key, .key_len = sizeof(int)};
+    return (map_entry_t) {.key = mapKey, .val = {.val_base = copy, .val_len = sizeof(int)}, .hash = spread_hash(mapKey)};
+}
+
+Test(store_suite, 02_bulk_load, .timeout = 10){
+    // a fifth empty, so probes run across the threads' regions
+    store_t *store = create_store(2, NUM_BULK * 5 / 4, spread_hash, store_free_function, NULL, 0);
+    cr_assert_not_null(store, "Store returned was NULL");
+
+    map_entry_t *entries = calloc(NUM_BULK + 1, sizeof(map_entry_t));
+    for (int i = 0; i < NUM_BULK; i++)
+        entries[i] = bulk_entry(store, i, i * 3);
+    cr_assert(store_bulk_load(store, entries, NUM_BULK, 4, false), "Bulk load failed");
+    for (int i = 0; i < NUM_BULK; i++)
+        cr_assert(entries[i].stored, "Entry %d was not stored", i);
+    cr_assert_eq(store_size(store), NUM_BULK, "Store had %u entries. Expected: %d", store_size(store), NUM_BULK);
+#ifdef EC
+    // a lookup here walks the whole map, so look at some before they expire
+    int step = 50;
+#else
+    int step = 1;
+#endif
+    for (int i = 0; i < NUM_BULK; i += step){
+        map_val_t val = store_get(store, (map_key_t) {.key_base = &i, .key_len = sizeof(int)});
+        cr_assert_not_null(val.val_base, "Key %d was not found", i);
+        cr_assert_eq(*(int *) val.val_base, i * 3, "Key %d had the wrong value", i);
+    }
+
+#ifndef EC
+    // live, a slice at a time, the same keys again. the last two entries are
+    // a key twice, and the later one wins. the extra credit map only spots a
+    // key that's already there in its home slot, so it's left out of this
+    for (int i = 0; i < NUM_BULK; i++)
+        entries[i] = bulk_entry(store, i, i * 5);
+    entries[NUM_BULK] = bulk_entry(store, NUM_BULK - 1, 42);
+    cr_assert(store_bulk_load(store, entries, NUM_BULK + 1, 4, true), "Live bulk load failed");
+    cr_assert_eq(store_size(store), NUM_BULK, "Store had %u entries. Expected: %d", store_size(store), NUM_BULK);
+    for (int i = 0; i < NUM_BULK; i++){
+        map_val_t val = store_get(store, (map_key_t) {.key_base = &i, .key_len = sizeof(int)});
+        cr_assert_not_null(val.val_base, "Key %d was not found", i);
+        cr_assert_eq(*(int *) val.val_base, i == NUM_BULK - 1 ? 42 : i * 5, "Key %d had the wrong value", i);
+    }
+
+    // the rest don't fit, and are still ours. the extra credit map would evict
+    for (int i = 0; i < NUM_BULK; i++)
+        entries[i] = bulk_entry(store, NUM_BULK + i, i);
+    errno = 0;
+    cr_assert_not(store_bulk_load(store, entries, NUM_BULK, 4, false), "Bulk load into a full store worked");
+    cr_assert_eq(errno, ENOMEM, "errno was %d. Expected: ENOMEM", errno);
+    int stored = 0;
+    for (int i = 0; i < NUM_BULK; i++){
+        if (entries[i].stored == true)
+            stored += 1;
+        else
+            store_free_function(entries[i].key, entries[i].val);
+    }
+    cr_assert_eq(store_size(store), NUM_BULK + stored, "Store had %u entries, %d were stored", store_size(store), stored);
+    cr_assert_lt(stored, NUM_BULK, "Every entry was stored");
+#endif
+    free(entries);
+}
+
+Test(store_suite, 03_evict_frees_entries, .timeout = 10){
+    // room for a few hundred big values, put and evicted many times over
+    cr_assert(slab_init(2 * SLAB_PAGE_SIZE), "slab_init failed");
+    store_t *store = create_store(1, 100, spread_hash, store_free_function, NULL, 0);
+    cr_assert_not_null(store, "Store returned was NULL");
+
+    for (int i = 0; i < 4000; i++){
+        char *key = slab_alloc(16);
+        char *val = slab_alloc(4000);
+        cr_assert(key != NULL && val != NULL, "Ran out of slab at round %d", i);
+        // some engines copy the key and free ours, so evict with a copy of it
+        char name[16];
+        int keyLen = sprintf(name, "key%d", i % 10);
+        memcpy(key, name, keyLen);
+        cr_assert(store_put(store, MAP_KEY(key, keyLen), MAP_VAL(val, 4000), true), "Put %d failed", i);
+        cr_assert(store_evict(store, MAP_KEY(name, keyLen)), "Key %d was not there to evict", i);
+        // what a worker does before it goes idle
+        retire_flush();
+        reclaim_wait();
+    }
+    cr_assert_eq(store_size(store), 0, "Store had %u entries. Expected: 0", store_size(store));
+    cr_assert_not(store_evict(store, MAP_KEY("key0", 4)), "An evicted key was evicted again");
+}
+
+#ifndef PERSIST
+// the persistent map copies everything into its own file, so it never fills the slabs
+static int evict_from_store(const void *lo, const void *hi, void *arg) {
+    return store_evict_range(arg, lo, hi);
+}
+
+Test(store_suite, 04_rebalance_keeps_entries, .timeout = 10){
+    // small keys and big values share four pages
+    cr_assert(slab_init(4 * SLAB_PAGE_SIZE), "slab_init failed");
+    store_t *store = create_store(1, 4096, spread_hash, store_free_function, NULL, 0);
+    cr_assert_not_null(store, "Store returned was NULL");
+
+    for (int i = 0; i < 4096; i++){
+        char *key = slab_alloc(16);
+        char *val = slab_alloc(3000);
+        if (key == NULL || val == NULL){
+            slab_free(key);
+            slab_free(val);
+            break;
+        }
+        int keyLen = sprintf(key, "key%d", i);
+        cr_assert(store_put(store, MAP_KEY(key, keyLen), MAP_VAL(val, 3000), false), "Put %d failed", i);
+    }
+    uint32_t size = store_size(store);
+    cr_assert_gt(size, 0, "Nothing was stored");
+
+    // now another class is short. the keys' only page must not be the one that goes
+    cr_assert_null(slab_alloc(2048), "Got a chunk with every page taken");
+    slab_flush_cache();
+    slab_rebalance(evict_from_store, store);
+    cr_assert_gt(store_size(store), 0, "One rebalance emptied the store of %u entries", size);
+    cr_assert_geq(store_size(store), size / 2, "One rebalance took %u of %u entries", size - store_size(store), size);
+}
+#endif
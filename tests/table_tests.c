@@ -0,0 +1,33 @@
+#include <criterion/criterion.h>
+#include <criterion/logging.h>
+#include <stdint.h>
+
+#include "table.h"
+
+Test(table_suite, 00_small_and_big, .timeout = 2){
+    // small tables come from the heap, big ones are mapped on a huge page boundary
+    uint64_t *small = table_alloc(16, sizeof(uint64_t));
+    cr_assert_not_null(small, "Small table was NULL");
+    cr_assert_eq(small[15], 0, "Small table was not zeroed");
+    table_free(small, 16, sizeof(uint64_t));
+
+    size_t count = 3 * TABLE_HUGE_PAGE / sizeof(uint64_t) + 5;
+    uint64_t *big = table_alloc(count, sizeof(uint64_t));
+    cr_assert_not_null(big, "Big table was NULL");
+    cr_assert_eq((uintptr_t) big % TABLE_HUGE_PAGE, 0, "Big table is not huge page aligned");
+    cr_assert_eq(big[count - 1], 0, "Big table was not zeroed");
+    table_free(big, count, sizeof(uint64_t));
+}
+
+Test(table_suite, 01_prefault_keeps_contents, .timeout = 5){
+    size_t count = 4 * TABLE_HUGE_PAGE / sizeof(uint64_t);
+    uint64_t *table = table_alloc(count, sizeof(uint64_t));
+    cr_assert_not_null(table, "Table was NULL");
+    for (size_t i = 0; i < count; i += 4096)
+        table[i] = i;
+
+    cr_assert(table_prefault(table, count, sizeof(uint64_t), 3), "Prefault failed");
+    for (size_t i = 0; i < count; i += 4096)
+        cr_assert_eq(table[i], i, "Prefault changed entry %lu", i);
+    table_free(table, count, sizeof(uint64_t));
+}
@@ -0,0 +1,61 @@
+#include <criterion/criterion.h>
+#include <criterion/logging.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+
+#include "topology.h"
+
+Test(topology_suite, 00_parse_cpulist, .timeout = 2){
+    int cpus[16];
+    int count;
+
+    cr_assert(parse_cpulist("0-3,8,10-11\n", cpus, 16, &count), "Valid list was rejected");
+    cr_assert_eq(count, 7, "Found %d cpus. Expected: %d", count, 7);
+    int expected[] = {0, 1, 2, 3, 8, 10, 11};
+    for (int i = 0; i < 7; i++)
+        cr_assert_eq(cpus[i], expected[i], "cpu %d was %d. Expected: %d", i, cpus[i], expected[i]);
+
+    // only as many as fit
+    cr_assert(parse_cpulist("0-31", cpus, 16, &count), "Long list was rejected");
+    cr_assert_eq(count, 16, "Found %d cpus. Expected: %d", count, 16);
+
+    errno = 0;
+    cr_assert_not(parse_cpulist("3-1", cpus, 16, &count), "Backwards range was accepted");
+    cr_assert_eq(errno, EINVAL, "errno was %d. Expected: EINVAL", errno);
+    cr_assert_not(parse_cpulist("0,x", cpus, 16, &count), "Garbage was accepted");
+}
+
+static void write_file(const char *path, const char *contents){
+    FILE *file = fopen(path, "w");
+    fputs(contents, file);
+    fclose(file);
+}
+
+Test(topology_suite, 01_load_fake_sysfs, .timeout = 2){
+    char root[] = "/tmp/topologyXXXXXX";
+    cr_assert_not_null(mkdtemp(root), "Could not make a fake sysfs");
+    char path[256];
+
+    // node numbers with a hole in them, and a node without cpus
+    snprintf(path, sizeof(path), "%s/online", root);
+    write_file(path, "0,2-3\n");
+    for (int node = 0; node <= 3; node += 1){
+        snprintf(path, sizeof(path), "%s/node%d", root, node);
+        mkdir(path, 0700);
+        snprintf(path, sizeof(path), "%s/node%d/cpulist", root, node);
+        write_file(path, node == 3 ? "\n" : "0\n");
+    }
+
+    topology_t topology;
+    cr_assert(load_topology(&topology, root), "Loading the fake topology failed");
+    cr_assert_eq(topology.num_nodes, 2, "Found %d nodes. Expected: %d", topology.num_nodes, 2);
+    cr_assert_eq(topology_cpu(&topology, 1, 5), 0, "Node 1 cpu 5 did not wrap to cpu 0");
+    free_topology(&topology);
+
+    // nothing there at all is one node of everything we may run on
+    cr_assert(load_topology(&topology, "/nonexistent"), "Fallback topology failed");
+    cr_assert_eq(topology.num_nodes, 1, "Found %d nodes. Expected: %d", topology.num_nodes, 1);
+    free_topology(&topology);
+}
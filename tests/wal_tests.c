@@ -0,0 +1,197 @@
+#include <criterion/criterion.h>
+#include <criterion/logging.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "wal.h"
+#include "slab.h"
+
+#define NUM_KEYS 1000
+#define NUM_THREADS 8
+#define WAL_FILE "/tmp/cream_wal_tests.log"
+#define WAL_SNAPSHOT "/tmp/cream_wal_tests.snap"
+
+static void wal_free_function(map_key_t key, map_val_t val) {
+    slab_free(key.key_base);
+    slab_free(val.val_base);
+}
+
+static uint32_t spread_hash(map_key_t key) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < key.key_len; i++)
+        hash = (hash ^ ((uint8_t *) key.key_base)[i]) * 16777619u;
+    return hash;
+}
+
+static void remove_files(void) {
+    unlink(WAL_FILE);
+    unlink(WAL_FILE ".old");
+    unlink(WAL_SNAPSHOT);
+}
+
+static void log_put(wal_t *wal, int i) {
+    char key[16], val[32];
+    int keyLen = sprintf(key, "key%d", i);
+    int valLen = sprintf(val, "value of %d", i);
+    uint64_t lsn = wal_append(wal, WAL_PUT, key, keyLen, val, valLen);
+    cr_assert_neq(lsn, 0, "Append of %d failed: %s", i, strerror(errno));
+    cr_assert(wal_wait(wal, lsn), "Wait for %d failed: %s", i, strerror(errno));
+}
+
+static store_t *recover(uint64_t *applied) {
+    store_t *store = create_store(2, NUM_KEYS * 2, spread_hash, wal_free_function, NULL, 0);
+    cr_assert(recover_wal(store, WAL_FILE, WAL_SNAPSHOT, applied), "Recovery failed: %s", strerror(errno));
+    return store;
+}
+
+Test(wal_suite, 00_policies, .timeout = 2){
+    int mode, syncMs;
+    cr_assert(parse_wal_policy("always", &mode, &syncMs) && mode == WAL_SYNC_ALWAYS, "always was not parsed");
+    cr_assert(parse_wal_policy("never", &mode, &syncMs) && mode == WAL_SYNC_NEVER, "never was not parsed");
+    cr_assert(parse_wal_policy("10", &mode, &syncMs) && mode == WAL_SYNC_INTERVAL && syncMs == 10, "10 was not parsed");
+    cr_assert_not(parse_wal_policy("sometimes", &mode, &syncMs), "sometimes was parsed");
+    cr_assert_not(parse_wal_policy("0", &mode, &syncMs), "0 was parsed");
+}
+
+Test(wal_suite, 01_replay, .timeout = 10){
+    remove_files();
+    store_t *store = create_store(2, NUM_KEYS * 2, spread_hash, wal_free_function, NULL, 0);
+    wal_t *wal = open_wal(store, WAL_FILE, WAL_SNAPSHOT, WAL_SYNC_ALWAYS, 0);
+    cr_assert_not_null(wal, "open_wal failed: %s", strerror(errno));
+
+    // everything, then half of it taken back out, then a clear and a fresh start
+    for (int i = 0; i < NUM_KEYS; i++)
+        log_put(wal, i);
+    cr_assert(wal_wait(wal, wal_append(wal, WAL_CLEAR, NULL, 0, NULL, 0)), "Clear was not logged");
+    for (int i = 0; i < NUM_KEYS; i++)
+        log_put(wal, i);
+    for (int i = 0; i < NUM_KEYS; i += 2){
+        char key[16];
+        int keyLen = sprintf(key, "key%d", i);
+        cr_assert(wal_wait(wal, wal_append(wal, WAL_EVICT, key, keyLen, NULL, 0)), "Evict of %d was not logged", i);
+    }
+
+    uint64_t applied;
+    store_t *restored = recover(&applied);
+    cr_assert_eq(applied, NUM_KEYS * 2 + 1 + NUM_KEYS / 2, "Replayed %lu records", applied);
+    cr_assert_eq(store_size(restored), NUM_KEYS / 2, "Store had %u entries. Expected: %d", store_size(restored), NUM_KEYS / 2);
+    for (int i = 1; i < NUM_KEYS; i += 2){
+        char key[16], expected[32];
+        int keyLen = sprintf(key, "key%d", i);
+        int valLen = sprintf(expected, "value of %d", i);
+        map_val_t val = store_get(restored, MAP_KEY(key, keyLen));
+        cr_assert_eq(val.val_len, valLen, "Value of %s had length %zu", key, val.val_len);
+        cr_assert(memcmp(val.val_base, expected, valLen) == 0, "Value of %s was wrong", key);
+    }
+    remove_files();
+}
+
+Test(wal_suite, 02_torn_tail, .timeout = 10){
+    remove_files();
+    store_t *store = create_store(2, NUM_KEYS * 2, spread_hash, wal_free_function, NULL, 0);
+    wal_t *wal = open_wal(store, WAL_FILE, WAL_SNAPSHOT, WAL_SYNC_ALWAYS, 0);
+    cr_assert_not_null(wal, "open_wal failed: %s", strerror(errno));
+    for (int i = 0; i < NUM_KEYS; i++)
+        log_put(wal, i);
+
+    // we went down halfway through writing the last record
+    struct stat info;
+    cr_assert_eq(stat(WAL_FILE, &info), 0, "Could not stat the log");
+    cr_assert_eq(truncate(WAL_FILE, info.st_size - 3), 0, "Could not truncate the log");
+
+    uint64_t applied;
+    store_t *restored = recover(&applied);
+    cr_assert_eq(applied, NUM_KEYS - 1, "Replayed %lu records. Expected: %d", applied, NUM_KEYS - 1);
+    cr_assert_eq(store_size(restored), NUM_KEYS - 1, "Store had %u entries", store_size(restored));
+
+    // and the piece of it is gone, so what's logged next follows good records
+    cr_assert_eq(stat(WAL_FILE, &info), 0, "Could not stat the log");
+    size_t expected = 0;
+    for (int i = 0; i < NUM_KEYS - 1; i++){
+        char key[16], val[32];
+        expected += sizeof(wal_record_t) + sprintf(key, "key%d", i) + sprintf(val, "value of %d", i);
+    }
+    cr_assert_eq(info.st_size, expected, "Log was %ld bytes. Expected: %zu", info.st_size, expected);
+    remove_files();
+}
+
+typedef struct {
+    wal_t *wal;
+    int first;
+} appender_args_t;
+
+static void *appender(void *vargp) {
+    appender_args_t *args = vargp;
+    for (int i = args -> first; i < NUM_KEYS; i += NUM_THREADS)
+        log_put(args -> wal, i);
+    return NULL;
+}
+
+Test(wal_suite, 03_group_commit, .timeout = 20){
+    remove_files();
+    store_t *store = create_store(2, NUM_KEYS * 2, spread_hash, wal_free_function, NULL, 0);
+    wal_t *wal = open_wal(store, WAL_FILE, WAL_SNAPSHOT, WAL_SYNC_ALWAYS, 0);
+    cr_assert_not_null(wal, "open_wal failed: %s", strerror(errno));
+
+    // every appender waits for its own record, and they all share the syncs
+    pthread_t tids[NUM_THREADS];
+    appender_args_t args[NUM_THREADS];
+    for (int i = 0; i < NUM_THREADS; i++){
+        args[i] = (appender_args_t) {.wal = wal, .first = i};
+        pthread_create(&tids[i], NULL, appender, &args[i]);
+    }
+    for (int i = 0; i < NUM_THREADS; i++)
+        pthread_join(tids[i], NULL);
+    cr_assert_eq(wal -> synced, wal -> appended, "Synced %lu of %lu bytes", wal -> synced, wal -> appended);
+
+    uint64_t applied;
+    store_t *restored = recover(&applied);
+    cr_assert_eq(applied, NUM_KEYS, "Replayed %lu records. Expected: %d", applied, NUM_KEYS);
+    cr_assert_eq(store_size(restored), NUM_KEYS, "Store had %u entries", store_size(restored));
+    remove_files();
+}
+
+Test(wal_suite, 04_compaction, .timeout = 20){
+    remove_files();
+    store_t *store = create_store(2, NUM_KEYS * 2, spread_hash, wal_free_function, NULL, 0);
+    wal_t *wal = open_wal(store, WAL_FILE, WAL_SNAPSHOT, WAL_SYNC_ALWAYS, 0);
+    cr_assert_not_null(wal, "open_wal failed: %s", strerror(errno));
+    pthread_mutex_lock(&wal -> lock);
+    wal -> compact_at = 4096;
+    pthread_mutex_unlock(&wal -> lock);
+
+    // changes go into the store and the log together, like the server's
+    for (int i = 0; i < NUM_KEYS; i++){
+        char *key = slab_alloc(16), *val = slab_alloc(32);
+        int keyLen = sprintf(key, "key%d", i);
+        int valLen = sprintf(val, "value of %d", i);
+        int shard = store_shard_of(store, MAP_KEY(key, keyLen));
+        wal_lock(wal, shard);
+        uint64_t lsn = wal_append(wal, WAL_PUT, key, keyLen, val, valLen);
+        cr_assert(store_put(store, MAP_KEY(key, keyLen), MAP_VAL(val, valLen), true), "Put of %d failed", i);
+        wal_unlock(wal, shard);
+        cr_assert(wal_wait(wal, lsn), "Wait for %d failed: %s", i, strerror(errno));
+    }
+
+    // the log was rotated and snapshotted at least once, and is done with it
+    bool compacting = true;
+    while (compacting == true || access(WAL_FILE ".old", F_OK) == 0){
+        usleep(1000);
+        pthread_mutex_lock(&wal -> lock);
+        compacting = wal -> compacting;
+        pthread_mutex_unlock(&wal -> lock);
+    }
+    cr_assert_eq(access(WAL_SNAPSHOT, F_OK), 0, "No snapshot was written");
+    struct stat info;
+    cr_assert_eq(stat(WAL_FILE, &info), 0, "Could not stat the log");
+    cr_assert_lt(info.st_size, wal -> appended, "The log was never rotated");
+
+    store_t *restored = recover(NULL);
+    cr_assert_eq(store_size(restored), NUM_KEYS, "Store had %u entries", store_size(restored));
+    remove_files();
+}